@@ -0,0 +1,376 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <string.h>
+#include <iso646.h>
+
+#include <popsift/popsift.h>
+
+#ifdef USE_DEVIL
+#include <devil_cpp_wrapper.hpp>
+#endif
+#include "pgmread.h"
+#include "jpegread.h"
+#include "decode_pool.h"
+
+#ifdef USE_NVTX
+#include <nvToolsExtCuda.h>
+#else
+#define nvtxRangePushA(a)
+#define nvtxRangePop()
+#endif
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+static inline long long elapsed_us( const Clock::time_point& since )
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - since ).count();
+}
+
+/*************************************************************
+ * DecodedImage
+ *************************************************************/
+
+DecodedImage::DecodedImage( const std::string& name )
+    : filename( name )
+    , w( 0 )
+    , h( 0 )
+    , full_w( 0 )
+    , full_h( 0 )
+    , byte_data( 0 )
+    , short_data( 0 )
+    , float_data( 0 )
+{ }
+
+DecodedImage::~DecodedImage( )
+{
+    delete [] byte_data;
+    delete [] short_data;
+    delete [] float_data;
+}
+
+SiftJob* DecodedImage::enqueue( PopSift& popsift ) const
+{
+    if( short_data ) return popsift.enqueue( w, h, short_data );
+    if( float_data ) return popsift.enqueue( w, h, float_data );
+    return popsift.enqueue( w, h, byte_data );
+}
+
+/*************************************************************
+ * DecodePool
+ *************************************************************/
+
+DecodePool::DecodePool( int num_threads, int prefetch, PixelType type, bool use_devil )
+    : _num_threads( max( num_threads, 1 ) )
+    , _type( type )
+    , _use_devil( use_devil )
+    , _downscale( 1 )
+    , _input( max( prefetch, 1 ) + _num_threads )
+    , _output( max( prefetch, 1 ) )
+    , _finished_threads( 0 )
+    , _decoded( 0 )
+    , _dct_decoded( 0 )
+    , _decode_stall_us( 0 )
+    , _compute_stall_us( 0 )
+{
+#ifdef USE_DEVIL
+    if( _use_devil ) {
+        ilInit();
+    }
+#endif
+
+    for( int i=0; i<_num_threads; i++ ) {
+        _threads.push_back( new boost::thread( &DecodePool::decodeLoop, this ) );
+    }
+}
+
+DecodePool::~DecodePool( )
+{
+    for( auto t : _threads ) {
+        t->join();
+        delete t;
+    }
+}
+
+void DecodePool::setDownscale( int scale )
+{
+    if( scale != 1 && scale != 2 && scale != 4 && scale != 8 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " downscale factor must be 1, 2, 4 or 8" << endl;
+        exit( -1 );
+    }
+    if( scale > 1 && _type == Shorts ) {
+        cerr << __FILE__ << ":" << __LINE__ << " downscaled decoding is not available for 16-bit images" << endl;
+        exit( -1 );
+    }
+    _downscale = scale;
+}
+
+void DecodePool::push( const std::string& filename )
+{
+    _input.push( new string( filename ) );
+}
+
+void DecodePool::close( )
+{
+    /* one termination token for every decoder thread */
+    for( int i=0; i<_num_threads; i++ ) {
+        _input.push( 0 );
+    }
+}
+
+DecodedImage* DecodePool::pull( )
+{
+    while( _finished_threads < _num_threads ) {
+        Clock::time_point start = Clock::now();
+        DecodedImage* img = _output.pull();
+        _decode_stall_us += elapsed_us( start );
+
+        if( img != 0 ) {
+            /* printed here rather than by the decoders, so that the
+             * lines of several threads do not interleave */
+            cout << "Loading " << img->w << " x " << img->h << " image " << img->filename << endl;
+            _decoded++;
+            return img;
+        }
+        /* a decoder thread has terminated */
+        _finished_threads++;
+    }
+    return 0;
+}
+
+void DecodePool::decodeLoop( )
+{
+    string* filename;
+    while( ( filename = _input.pull() ) != 0 ) {
+        DecodedImage* img = decode( *filename );
+        delete filename;
+
+        if( img == 0 ) continue;
+
+        Clock::time_point start = Clock::now();
+        _output.push( img );
+        _compute_stall_us += elapsed_us( start );
+    }
+    _output.push( 0 );
+}
+
+DecodedImage* DecodePool::decode( const std::string& filename )
+{
+    DecodedImage* img = new DecodedImage( filename );
+
+    bool success = false;
+    if( _downscale > 1 ) {
+        success = decodeJPEGScaled( img );
+    }
+
+    if( not success ) {
+#ifdef USE_DEVIL
+        if( _use_devil )
+            success = decodeDevIL( img );
+        else
+#endif
+            success = decodePGM( img );
+
+        if( not success ) {
+            delete img;
+            return 0;
+        }
+        img->full_w = img->w;
+        img->full_h = img->h;
+        if( _downscale > 1 ) {
+            downscale( img );
+        }
+    }
+    return img;
+}
+
+bool DecodePool::decodePGM( DecodedImage* img )
+{
+    nvtxRangePushA( "load and convert image - pgmread" );
+
+    if( _type == Shorts ) {
+        img->short_data = readPGMfile16( img->filename, img->w, img->h );
+        nvtxRangePop( );
+        return ( img->short_data != 0 );
+    }
+
+    unsigned char* image_data = readPGMfile( img->filename, img->w, img->h );
+    if( image_data == 0 ) {
+        nvtxRangePop( );
+        return false;
+    }
+
+    if( _type == Floats ) {
+        const int sz = img->w * img->h;
+        img->float_data = new float[sz];
+        for( int i=0; i<sz; i++ ) {
+            img->float_data[i] = float( image_data[i] ) / 256.0f;
+        }
+        delete [] image_data;
+    } else {
+        img->byte_data = image_data;
+    }
+
+    nvtxRangePop( ); // "load and convert image - pgmread"
+    return true;
+}
+
+bool DecodePool::decodeJPEGScaled( DecodedImage* img )
+{
+    if( not isJPEGfile( img->filename ) ) return false;
+
+    nvtxRangePushA( "load and convert image - jpeg dct scaling" );
+
+    unsigned char* image_data = readJPEGfile( img->filename, _downscale, img->w, img->h,
+                                              &img->full_w, &img->full_h );
+    if( image_data == 0 ) {
+        /* not a baseline JPEG, the general loader takes over */
+        nvtxRangePop( );
+        return false;
+    }
+
+    if( _type == Floats ) {
+        const int sz = img->w * img->h;
+        img->float_data = new float[sz];
+        for( int i=0; i<sz; i++ ) {
+            img->float_data[i] = float( image_data[i] ) / 256.0f;
+        }
+        delete [] image_data;
+    } else {
+        img->byte_data = image_data;
+    }
+    _dct_decoded++;
+
+    nvtxRangePop( ); // "load and convert image - jpeg dct scaling"
+    return true;
+}
+
+void DecodePool::downscale( DecodedImage* img )
+{
+    int w;
+    int h;
+    if( img->float_data ) {
+        float* small = downscaleBox( img->float_data, img->w, img->h, _downscale, w, h );
+        delete [] img->float_data;
+        img->float_data = small;
+    } else {
+        unsigned char* small = downscaleBox( img->byte_data, img->w, img->h, _downscale, w, h );
+        delete [] img->byte_data;
+        img->byte_data = small;
+    }
+    img->w = w;
+    img->h = h;
+}
+
+#ifdef USE_DEVIL
+bool DecodePool::decodeDevIL( DecodedImage* img )
+{
+    nvtxRangePushA( "load and convert image - devil" );
+
+    /* Read the compressed file without holding the DevIL lock, this is
+     * where network-mounted storage spends its time.
+     */
+    ifstream file( img->filename.c_str(), ios::binary | ios::ate );
+    if( not file.is_open() ) {
+        cerr << "Could not open image " << img->filename << endl;
+        nvtxRangePop( );
+        return false;
+    }
+    const streamsize file_size = file.tellg();
+    file.seekg( 0, ios::beg );
+    vector<char> buffer( file_size );
+    if( not file.read( buffer.data(), file_size ) ) {
+        cerr << "Could not read image " << img->filename << endl;
+        nvtxRangePop( );
+        return false;
+    }
+
+    boost::mutex::scoped_lock lock( _devil_mutex );
+
+    ILuint id;
+    ilGenImages( 1, &id );
+    ilBindImage( id );
+
+    if( ilLoadL( IL_TYPE_UNKNOWN, buffer.data(), (ILuint)file_size ) == false ) {
+        cerr << "Could not load image " << img->filename << endl;
+        ilDeleteImages( 1, &id );
+        nvtxRangePop( );
+        return false;
+    }
+
+    const ILenum il_type = ( _type == Shorts ) ? IL_UNSIGNED_SHORT : IL_UNSIGNED_BYTE;
+    if( ilConvertImage( IL_LUMINANCE, il_type ) == false ) {
+        /* skip the image, the pool and the writers keep running */
+        cerr << "Failed converting image " << img->filename << " to unsigned greyscale image" << endl;
+        ilDeleteImages( 1, &id );
+        nvtxRangePop( );
+        return false;
+    }
+
+    img->w = ilGetInteger( IL_IMAGE_WIDTH );
+    img->h = ilGetInteger( IL_IMAGE_HEIGHT );
+    const int sz = img->w * img->h;
+
+    switch( _type )
+    {
+    case Shorts :
+        img->short_data = new unsigned short[sz];
+        memcpy( img->short_data, ilGetData(), sz * sizeof(unsigned short) );
+        break;
+    case Floats :
+        {
+            const ILubyte* src = ilGetData();
+            img->float_data = new float[sz];
+            for( int i=0; i<sz; i++ ) {
+                img->float_data[i] = float( src[i] ) / 256.0f;
+            }
+        }
+        break;
+    default :
+        img->byte_data = new unsigned char[sz];
+        memcpy( img->byte_data, ilGetData(), sz );
+        break;
+    }
+
+    ilDeleteImages( 1, &id );
+
+    nvtxRangePop( ); // "load and convert image - devil"
+    return true;
+}
+#endif
+
+double DecodePool::getDecodeStallSeconds( ) const
+{
+    return _decode_stall_us / 1000000.0;
+}
+
+double DecodePool::getComputeStallSeconds( ) const
+{
+    return _compute_stall_us / 1000000.0;
+}
+
+void DecodePool::printStats( std::ostream& ostr ) const
+{
+    ostr << "Decoded " << _decoded << " images with " << _num_threads << " decoder thread(s)" << endl
+         << "    decode stall  (extraction waited for images): "
+         << fixed << setprecision(3) << getDecodeStallSeconds() << " s" << endl
+         << "    compute stall (decoders waited for extraction): "
+         << getComputeStallSeconds() << " s" << endl;
+    if( _downscale > 1 ) {
+        ostr << "    " << _dct_decoded << " JPEG images decoded at 1/" << _downscale
+             << " size in the DCT domain" << endl;
+    }
+    ostr.unsetf( ios::floatfield );
+    ostr << setprecision(6);
+}
+
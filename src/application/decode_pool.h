@@ -0,0 +1,121 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/sync_bounded_queue.hpp>
+
+class PopSift;
+class SiftJob;
+
+/* A decoded greyscale image waiting to be enqueued in PopSift.
+ * Exactly one of the data pointers is set, depending on the pixel
+ * type that the DecodePool was created for.
+ */
+struct DecodedImage
+{
+    std::string     filename;
+    int             w;
+    int             h;
+    int             full_w;  // size of the input file, before any
+    int             full_h;  // downscaling while decoding
+    unsigned char*  byte_data;
+    unsigned short* short_data;
+    float*          float_data;
+
+    DecodedImage( const std::string& name );
+    ~DecodedImage( );
+
+    /** Hand the image to PopSift, matching the pipeline's image mode */
+    SiftJob* enqueue( PopSift& popsift ) const;
+};
+
+/* A pool of decoder threads that run ahead of the PopSift queue.
+ * Filenames are pushed by the caller, decoded images are pulled in the
+ * order in which decoding finishes. At most prefetch decoded images are
+ * kept in memory; decoders block when that window is full.
+ *
+ * The pool measures two kinds of stall:
+ * - decode stall:  time the consumer waited in pull() for a decoded
+ *                  image, i.e. the pipeline was starved by I/O or decoding
+ * - compute stall: time the decoders waited for room in the prefetch
+ *                  window, i.e. decoding was faster than extraction
+ */
+class DecodePool
+{
+public:
+    enum PixelType
+    {
+        Bytes,
+        Shorts,
+        Floats
+    };
+
+    DecodePool( int num_threads, int prefetch, PixelType type, bool use_devil );
+    ~DecodePool( );
+
+    /** Deliver all images reduced by scale (1, 2, 4 or 8). Baseline
+     *  JPEG files are decoded directly at the reduced size in the DCT
+     *  domain, other files are decoded at full size and box-filtered.
+     *  Not available for 16-bit images. Call before the first push(). */
+    void setDownscale( int scale );
+
+    /** Queue a file for decoding. Blocks when the decoders are far
+     *  enough ahead, so that a lazy producer of filenames is not
+     *  drained faster than images are consumed. */
+    void push( const std::string& filename );
+
+    /** No more files will be pushed */
+    void close( );
+
+    /** Blocks until a decoded image is available. Returns 0 when all
+     *  pushed files have been handed out. Images that failed to decode
+     *  are skipped. The caller must delete the returned image. */
+    DecodedImage* pull( );
+
+    double getDecodeStallSeconds( ) const;
+    double getComputeStallSeconds( ) const;
+
+    void printStats( std::ostream& ostr ) const;
+
+private:
+    void decodeLoop( );
+
+    DecodedImage* decode( const std::string& filename );
+    bool          decodePGM( DecodedImage* img );
+    bool          decodeJPEGScaled( DecodedImage* img );
+    void          downscale( DecodedImage* img );
+#ifdef USE_DEVIL
+    bool          decodeDevIL( DecodedImage* img );
+#endif
+
+private:
+    const int       _num_threads;
+    const PixelType _type;
+    const bool      _use_devil;
+    int             _downscale;
+
+    std::vector<boost::thread*>              _threads;
+    boost::sync_bounded_queue<std::string*>  _input;
+    boost::sync_bounded_queue<DecodedImage*> _output;
+    int                                     _finished_threads;
+
+    /* DevIL keeps global state, only one thread may use it at a time.
+     * Reading the file from disk is done outside of this lock. */
+    boost::mutex                            _devil_mutex;
+
+    int                                     _decoded;
+    std::atomic<int>                        _dct_decoded;
+    std::atomic<long long>                  _decode_stall_us;
+    std::atomic<long long>                  _compute_stall_us;
+};
+
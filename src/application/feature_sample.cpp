@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <random>
+
+#include <cuda_runtime.h>
+
+#include <popsift/features_file.h>
+
+#include "feature_sample.h"
+
+using namespace std;
+
+bool sampleDescriptors( const std::vector<std::string>& files,
+                        size_t                          max_samples,
+                        unsigned                        seed,
+                        std::vector<float>&             sample,
+                        int&                            dim,
+                        size_t&                         seen )
+{
+    std::mt19937_64 rng( seed );
+
+    dim  = 0;
+    seen = 0;
+    sample.clear();
+
+    /* reservoir sampling, every descriptor of every file has the
+     * same chance to be in the sample */
+    for( const string& name : files ) {
+        popsift::FeaturesFile file;
+        if( not file.open( name ) ) {
+            return false;
+        }
+        if( file.getDescCodec() != popsift::FF_CodecNone ) {
+            cerr << "File " << name << " holds encoded descriptors" << endl;
+            return false;
+        }
+        if( dim == 0 ) {
+            dim = file.getDescDim();
+            sample.reserve( max_samples * dim );
+        } else if( file.getDescDim() != dim ) {
+            cerr << "File " << name << " has " << file.getDescDim()
+                 << "-dimensional descriptors, expected " << dim << endl;
+            return false;
+        }
+
+        const int num_desc = file.getDescriptorCount();
+        for( int i=0; i<num_desc; i++, seen++ ) {
+            if( seen < max_samples ) {
+                sample.resize( ( seen + 1 ) * dim );
+                file.getDescriptorAsFloat( i, &sample[seen * dim] );
+            } else {
+                std::uniform_int_distribution<size_t> pick( 0, seen );
+                const size_t slot = pick( rng );
+                if( slot < max_samples ) {
+                    file.getDescriptorAsFloat( i, &sample[slot * dim] );
+                }
+            }
+        }
+        cerr << name << ": " << num_desc << " descriptors" << endl;
+    }
+    return true;
+}
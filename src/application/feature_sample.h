@@ -0,0 +1,24 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+
+/* Draw a uniform random sample of at most max_samples descriptors from
+ * binary feature files (.psf), for the training tools. The sample is
+ * stored as float rows of dim values. seen is the number of descriptors
+ * in all files.
+ * Returns false and explains why on cerr if a file cannot be used.
+ */
+bool sampleDescriptors( const std::vector<std::string>& files,
+                        size_t                          max_samples,
+                        unsigned                        seed,
+                        std::vector<float>&             sample,
+                        int&                            dim,
+                        size_t&                         seen );
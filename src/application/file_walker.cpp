@@ -0,0 +1,244 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <algorithm>
+#include <iso646.h>
+#include <boost/algorithm/string.hpp>
+
+#include "file_walker.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+FileWalker::FileWalker( )
+    : _source( Manifest )
+    , _sorted( false )
+    , _started( false )
+    , _done( false )
+    , _count( 0 )
+{ }
+
+FileWalker::FileWalker( const std::string& root )
+    : _source( SingleFile )
+    , _root( root )
+    , _sorted( false )
+    , _started( false )
+    , _done( false )
+    , _count( 0 )
+{
+    if( fs::is_directory( _root ) ) {
+        _source = Directory;
+    }
+}
+
+FileWalker* FileWalker::fromManifest( const std::string& manifest )
+{
+    FileWalker* walker = new FileWalker( );
+    walker->_root = fs::path( manifest ).parent_path();
+    walker->_manifest.open( manifest.c_str() );
+    if( not walker->_manifest.is_open() ) {
+        cerr << "Manifest file " << manifest << " could not be opened for reading" << endl;
+        walker->_done = true;
+    }
+    return walker;
+}
+
+FileWalker::~FileWalker( )
+{ }
+
+void FileWalker::setExtensions( const std::string& comma_separated )
+{
+    _extensions.clear();
+
+    vector<string> parts;
+    boost::algorithm::split( parts, comma_separated, boost::algorithm::is_any_of(",") );
+    for( auto& ext : parts ) {
+        boost::algorithm::trim( ext );
+        if( ext.empty() ) continue;
+        if( ext[0] != '.' ) ext = "." + ext;
+        _extensions.push_back( boost::algorithm::to_lower_copy( ext ) );
+    }
+}
+
+void FileWalker::setSorted( bool on )
+{
+    _sorted = on;
+}
+
+fs::path FileWalker::relativeName( const std::string& filename ) const
+{
+    const fs::path p( filename );
+    if( _source == SingleFile ) {
+        return p.filename();
+    }
+
+    /* strip the root if it is a prefix of p, component by component */
+    fs::path::const_iterator pi = p.begin();
+    bool below_root = not _root.empty();
+    for( const fs::path& part : _root ) {
+        if( part == "." ) continue;
+        if( pi == p.end() || *pi != part ) {
+            below_root = false;
+            break;
+        }
+        ++pi;
+    }
+
+    const fs::path rest = p.relative_path();
+    fs::path rel;
+    if( below_root ) {
+        for( ; pi != p.end(); ++pi ) {
+            if( *pi == ".." || *pi == "." ) continue;
+            rel /= *pi;
+        }
+    } else {
+        for( const fs::path& part : rest ) {
+            if( part == ".." || part == "." ) continue;
+            rel /= part;
+        }
+    }
+    if( rel.empty() ) rel = p.filename();
+    return rel;
+}
+
+bool FileWalker::accept( const fs::path& p ) const
+{
+    if( _extensions.empty() ) return true;
+
+    const string ext = boost::algorithm::to_lower_copy( p.extension().string() );
+    return std::find( _extensions.begin(), _extensions.end(), ext ) != _extensions.end();
+}
+
+bool FileWalker::next( std::string& filename )
+{
+    if( _done ) return false;
+
+    fs::path p;
+    bool     found = false;
+
+    switch( _source )
+    {
+    case SingleFile :
+        /* a file named explicitly on the command line is not filtered */
+        found = not _started;
+        p     = _root;
+        break;
+    case Directory :
+        found = _sorted ? nextSorted( p ) : nextUnsorted( p );
+        break;
+    case Manifest :
+        found = nextManifest( p );
+        break;
+    }
+    _started = true;
+
+    if( not found ) {
+        _done = true;
+        return false;
+    }
+
+    filename = p.string();
+    _count++;
+    return true;
+}
+
+bool FileWalker::nextUnsorted( fs::path& p )
+{
+    boost::system::error_code ec;
+
+    if( not _started ) {
+        _it = fs::recursive_directory_iterator( _root, ec );
+        if( ec ) {
+            cerr << "Cannot read directory " << _root << ": " << ec.message() << endl;
+            return false;
+        }
+    } else {
+        _it.increment( ec );
+    }
+
+    for( ; _it != fs::recursive_directory_iterator(); _it.increment( ec ) ) {
+        if( ec ) {
+            cerr << "Skipping unreadable entry in " << _root << ": " << ec.message() << endl;
+            ec.clear();
+            continue;
+        }
+        const fs::path& curr = _it->path();
+        if( fs::is_regular_file( curr ) && accept( curr ) ) {
+            p = curr;
+            return true;
+        }
+    }
+    return false;
+}
+
+void FileWalker::pushSortedDirectory( const fs::path& dir )
+{
+    boost::system::error_code ec;
+
+    SortedDir level;
+    level.index = 0;
+
+    fs::directory_iterator it( dir, ec );
+    if( ec ) {
+        cerr << "Cannot read directory " << dir << ": " << ec.message() << endl;
+        return;
+    }
+    for( ; it != fs::directory_iterator(); it.increment( ec ) ) {
+        if( ec ) break;
+        level.entries.push_back( it->path() );
+    }
+    std::sort( level.entries.begin(), level.entries.end() );
+
+    _stack.push_back( level );
+}
+
+bool FileWalker::nextSorted( fs::path& p )
+{
+    if( not _started ) {
+        pushSortedDirectory( _root );
+    }
+
+    while( not _stack.empty() ) {
+        SortedDir& level = _stack.back();
+        if( level.index == level.entries.size() ) {
+            _stack.pop_back();
+            continue;
+        }
+
+        const fs::path curr = level.entries[level.index++];
+        if( fs::is_symlink( curr ) && fs::is_directory( curr ) ) {
+            continue; // like recursive_directory_iterator in nextUnsorted
+        } else if( fs::is_directory( curr ) ) {
+            pushSortedDirectory( curr ); // invalidates level
+        } else if( fs::is_regular_file( curr ) && accept( curr ) ) {
+            p = curr;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FileWalker::nextManifest( fs::path& p )
+{
+    string line;
+    while( getline( _manifest, line ) ) {
+        boost::algorithm::trim( line );
+        if( line.empty() || line[0] == '#' ) continue;
+
+        fs::path curr( line );
+        if( curr.is_relative() && not _root.empty() ) {
+            curr = _root / curr;
+        }
+        if( not accept( curr ) ) continue;
+
+        p = curr;
+        return true;
+    }
+    return false;
+}
+
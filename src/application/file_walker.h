@@ -0,0 +1,98 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <boost/filesystem.hpp>
+
+/* Produces input filenames one at a time, without collecting the whole
+ * tree first. The source is either a single file, a directory that is
+ * walked recursively, or a manifest file listing one path per line.
+ *
+ * By default, directories are visited in the order in which the file
+ * system returns them. With setSorted(true), every directory is read and
+ * sorted before its entries are returned; only the directories on the
+ * current path are held in memory, not the whole tree. Both orders
+ * follow symbolic links to files but not to directories, so they
+ * return the same files and cannot loop.
+ */
+class FileWalker
+{
+public:
+    /** Walk a file or a directory */
+    explicit FileWalker( const std::string& root );
+
+    /** Read the filenames from a manifest, one per line. Empty lines and
+     *  lines starting with '#' are skipped. Relative paths are relative
+     *  to the directory containing the manifest. */
+    static FileWalker* fromManifest( const std::string& manifest );
+
+    ~FileWalker( );
+
+    /** Only return files with one of these extensions, compared without
+     *  case, e.g. "jpg,png,pgm". An empty string accepts all files. */
+    void setExtensions( const std::string& comma_separated );
+
+    /** Return directory entries in lexicographic order. Must be called
+     *  before the first call to next(). */
+    void setSorted( bool on );
+
+    /** Get the next filename. Returns false when there are no more. */
+    bool next( std::string& filename );
+
+    /** Number of filenames returned so far */
+    inline size_t count() const { return _count; }
+
+    /** The part of a filename returned by next() that lies below the
+     *  walked directory or the manifest's directory, e.g. to mirror the
+     *  input tree in an output directory. A single input file yields
+     *  its name. Paths outside of the root lose their root and any
+     *  ".." components. */
+    boost::filesystem::path relativeName( const std::string& filename ) const;
+
+private:
+    FileWalker( );
+
+    bool accept( const boost::filesystem::path& p ) const;
+
+    bool nextUnsorted( boost::filesystem::path& p );
+    bool nextSorted( boost::filesystem::path& p );
+    bool nextManifest( boost::filesystem::path& p );
+
+    void pushSortedDirectory( const boost::filesystem::path& dir );
+
+private:
+    enum Source
+    {
+        SingleFile,
+        Directory,
+        Manifest
+    };
+
+    struct SortedDir
+    {
+        std::vector<boost::filesystem::path> entries;
+        size_t                               index;
+    };
+
+    Source                                        _source;
+    boost::filesystem::path                       _root;
+    bool                                          _sorted;
+    bool                                          _started;
+    bool                                          _done;
+    size_t                                        _count;
+    std::vector<std::string>                      _extensions;
+
+    boost::filesystem::recursive_directory_iterator _it;
+    std::vector<SortedDir>                        _stack;
+
+    std::ifstream                                 _manifest;
+};
+
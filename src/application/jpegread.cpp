@@ -0,0 +1,672 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <iso646.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+#include "jpegread.h"
+
+using namespace std;
+
+namespace {
+
+/* position k in the zigzag sequence holds the coefficient at natural index zigzag[k] */
+const int zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+#define HUFF_LOOKAHEAD 9
+
+struct HuffTable
+{
+    bool    defined;
+    uint8_t lookup_len[1<<HUFF_LOOKAHEAD]; // 0: code longer than lookahead
+    uint8_t lookup_val[1<<HUFF_LOOKAHEAD];
+    int32_t mincode[17];
+    int32_t maxcode[18];
+    int32_t valptr[17];
+    uint8_t vals[256];
+
+    HuffTable( ) : defined( false ) { }
+
+    bool build( const uint8_t* bits, const uint8_t* values, int num_values )
+    {
+        defined = false;
+        int total = 0;
+        for( int len=1; len<=16; len++ ) total += bits[len-1];
+        if( num_values < 0 || num_values > 256 || total > num_values ) return false;
+
+        memcpy( vals, values, num_values );
+        memset( lookup_len, 0, sizeof(lookup_len) );
+
+        int code = 0;
+        int k    = 0;
+        for( int len=1; len<=16; len++ ) {
+            /* over-subscribed table, checked before the lookup is filled */
+            if( code + bits[len-1] > (1<<len) ) return false;
+            valptr[len]  = k;
+            mincode[len] = code;
+            for( int i=0; i<bits[len-1]; i++ ) {
+                if( len <= HUFF_LOOKAHEAD ) {
+                    const int shift = HUFF_LOOKAHEAD - len;
+                    for( int fill=0; fill<(1<<shift); fill++ ) {
+                        lookup_len[(code << shift) | fill] = len;
+                        lookup_val[(code << shift) | fill] = vals[k];
+                    }
+                }
+                code++;
+                k++;
+            }
+            maxcode[len] = bits[len-1] ? code-1 : -1;
+            code <<= 1;
+        }
+        maxcode[17] = 0x7fffffff;
+        defined     = true;
+        return true;
+    }
+};
+
+/* Reads the entropy-coded segment MSB first, removes stuffed zero bytes
+ * and stops in front of markers. Past a marker, zero bits are returned.
+ */
+struct BitReader
+{
+    const uint8_t* p;
+    const uint8_t* end;
+    uint32_t       acc;
+    int            nbits;
+    bool           at_marker;
+
+    BitReader( const uint8_t* start, const uint8_t* stop )
+        : p( start ), end( stop ), acc( 0 ), nbits( 0 ), at_marker( false )
+    { }
+
+    inline void fill( )
+    {
+        while( nbits <= 24 ) {
+            uint32_t byte = 0;
+            if( not at_marker && p < end ) {
+                byte = *p;
+                if( byte == 0xFF ) {
+                    const uint8_t next = ( p+1 < end ) ? p[1] : 0xD9;
+                    if( next == 0x00 ) {
+                        p += 2;
+                    } else {
+                        at_marker = true;
+                        byte      = 0;
+                    }
+                } else {
+                    p++;
+                }
+            }
+            acc   |= byte << ( 24 - nbits );
+            nbits += 8;
+        }
+    }
+
+    inline int get( int n )
+    {
+        if( n == 0 ) return 0;
+        fill( );
+        const int v = acc >> ( 32 - n );
+        acc   <<= n;
+        nbits  -= n;
+        return v;
+    }
+
+    /* Skip to the marker that follows the entropy-coded data,
+     * p points to its 0xFF afterwards.
+     */
+    void seekMarker( )
+    {
+        acc   = 0;
+        nbits = 0;
+        while( not at_marker && p < end ) {
+            if( p[0] == 0xFF && p+1 < end && p[1] != 0x00 && p[1] != 0xFF ) {
+                at_marker = true;
+            } else {
+                p++;
+            }
+        }
+    }
+
+    /* Consume an RSTn marker, returns false if there is none */
+    bool restart( )
+    {
+        seekMarker( );
+        if( p+1 < end && p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7 ) {
+            p += 2;
+            at_marker = false;
+            return true;
+        }
+        return false;
+    }
+};
+
+inline int decodeHuffman( BitReader& br, const HuffTable& t )
+{
+    br.fill( );
+    const uint32_t look = br.acc >> ( 32 - HUFF_LOOKAHEAD );
+    const int      len  = t.lookup_len[look];
+    if( len ) {
+        br.acc   <<= len;
+        br.nbits  -= len;
+        return t.lookup_val[look];
+    }
+    for( int l=HUFF_LOOKAHEAD+1; l<=16; l++ ) {
+        const int32_t code = br.acc >> ( 32 - l );
+        if( code <= t.maxcode[l] ) {
+            br.acc   <<= l;
+            br.nbits  -= l;
+            return t.vals[ t.valptr[l] + code - t.mincode[l] ];
+        }
+    }
+    return -1;
+}
+
+inline int extend( int v, int n )
+{
+    return ( v < ( 1 << (n-1) ) ) ? v - ( 1 << n ) + 1 : v;
+}
+
+struct Component
+{
+    int id;
+    int hs;
+    int vs;
+    int tq;
+    int td;
+    int ta;
+    int pred;
+};
+
+/* Reduced-size IDCT. For an N-point output, only the N lowest
+ * frequencies of the 8-point DCT are used:
+ *     f(x) = sum_{u<N} C(u)/2 * F(u) * cos( (2x+1) u pi / 2N )
+ * which is the 8-point IDCT followed by an NxN box filter, up to
+ * aliasing of the discarded frequencies.
+ */
+struct ScaledIDCT
+{
+    int   n;
+    float table[8][8]; // [x][u]
+
+    explicit ScaledIDCT( int points ) : n( points )
+    {
+        for( int x=0; x<n; x++ ) {
+            for( int u=0; u<n; u++ ) {
+                const float cu = ( u == 0 ) ? 1.0f / sqrtf( 2.0f ) : 1.0f;
+                table[x][u] = cu / 2.0f * cosf( ( 2*x+1 ) * u * float(M_PI) / ( 2*n ) );
+            }
+        }
+    }
+
+    /* coef is n x n, row-major, dequantized */
+    void run( const float* coef, unsigned char* dst, int dst_step ) const
+    {
+        if( n == 1 ) {
+            dst[0] = clampPixel( coef[0] / 8.0f );
+            return;
+        }
+        float tmp[8*8];
+        for( int v=0; v<n; v++ ) {
+            for( int x=0; x<n; x++ ) {
+                float sum = 0.0f;
+                for( int u=0; u<n; u++ ) sum += table[x][u] * coef[v*n+u];
+                tmp[v*n+x] = sum;
+            }
+        }
+        for( int y=0; y<n; y++ ) {
+            for( int x=0; x<n; x++ ) {
+                float sum = 0.0f;
+                for( int v=0; v<n; v++ ) sum += table[y][v] * tmp[v*n+x];
+                dst[y*dst_step+x] = clampPixel( sum );
+            }
+        }
+    }
+
+    static inline unsigned char clampPixel( float v )
+    {
+        const int i = (int)lrintf( v + 128.0f );
+        return (unsigned char)( i < 0 ? 0 : ( i > 255 ? 255 : i ) );
+    }
+};
+
+class JpegDecoder
+{
+public:
+    JpegDecoder( const vector<uint8_t>& data, int scale )
+        : _data( data )
+        , _n( 8 / scale )
+        , _scale( scale )
+        , _idct( 8 / scale )
+        , _width( 0 )
+        , _height( 0 )
+        , _restart_interval( 0 )
+        , _adobe_transform( -1 )
+        , _luma_done( false )
+    {
+        for( int i=0; i<4; i++ ) memset( _qt[i], 0, sizeof(_qt[i]) );
+    }
+
+    bool decode( );
+
+    inline int getWidth( ) const  { return _width; }
+    inline int getHeight( ) const { return _height; }
+
+    int            _out_w;
+    int            _out_h;
+    vector<uint8_t> _plane; // padded to whole blocks
+    int            _plane_step;
+
+private:
+    inline int u16( size_t pos ) const { return ( _data[pos] << 8 ) | _data[pos+1]; }
+
+    bool parseSOF( size_t pos, int len );
+    bool parseDHT( size_t pos, int len );
+    bool parseDQT( size_t pos, int len );
+    bool parseSOS( size_t pos, int len, size_t& entropy_start );
+    bool decodeScan( size_t& pos );
+
+    bool decodeBlock( BitReader& br, Component& c, bool keep, int bx, int by );
+
+private:
+    const vector<uint8_t>& _data;
+    const int              _n;
+    const int              _scale;
+    const ScaledIDCT       _idct;
+
+    int                    _width;
+    int                    _height;
+    int                    _hmax;
+    int                    _vmax;
+    int                    _mcus_x;
+    int                    _mcus_y;
+    int                    _restart_interval;
+    int                    _adobe_transform;
+    bool                   _luma_done;
+
+    uint16_t               _qt[4][64]; // natural order
+    HuffTable              _dc[4];
+    HuffTable              _ac[4];
+    vector<Component>      _comps;
+    vector<int>            _scan_comps;
+};
+
+bool JpegDecoder::parseSOF( size_t pos, int len )
+{
+    if( len < 8 ) return false;
+    const int precision = _data[pos];
+    _height = u16( pos+1 );
+    _width  = u16( pos+3 );
+    const int nf = _data[pos+5];
+
+    if( precision != 8 ) return false;
+    if( _width == 0 || _height == 0 ) return false; // DNL marker not supported
+    if( nf != 1 && nf != 3 ) return false;          // no CMYK / YCCK
+    if( len < 6 + 3*nf ) return false;
+
+    _hmax = _vmax = 1;
+    for( int i=0; i<nf; i++ ) {
+        Component c;
+        c.id   = _data[pos+6+3*i];
+        c.hs   = _data[pos+7+3*i] >> 4;
+        c.vs   = _data[pos+7+3*i] & 15;
+        c.tq   = _data[pos+8+3*i] & 3;
+        c.td   = c.ta = 0;
+        c.pred = 0;
+        if( c.hs < 1 || c.hs > 4 || c.vs < 1 || c.vs > 4 ) return false;
+        _hmax = max( _hmax, c.hs );
+        _vmax = max( _vmax, c.vs );
+        _comps.push_back( c );
+    }
+    /* luminance must be sampled at full resolution */
+    if( _comps[0].hs != _hmax || _comps[0].vs != _vmax ) return false;
+
+    _mcus_x = ( _width  + 8*_hmax - 1 ) / ( 8*_hmax );
+    _mcus_y = ( _height + 8*_vmax - 1 ) / ( 8*_vmax );
+
+    const int blocks_x = _mcus_x * _hmax;
+    const int blocks_y = _mcus_y * _vmax;
+    _plane_step = blocks_x * _n;
+    _plane.assign( (size_t)_plane_step * blocks_y * _n, 0 );
+
+    _out_w = ( _width  + _scale - 1 ) / _scale;
+    _out_h = ( _height + _scale - 1 ) / _scale;
+    return true;
+}
+
+bool JpegDecoder::parseDHT( size_t pos, int len )
+{
+    const size_t end = pos + len;
+    while( pos < end ) {
+        const int tc = _data[pos] >> 4;
+        const int th = _data[pos] & 15;
+        if( tc > 1 || th > 3 || pos + 17 > end ) return false;
+        const uint8_t* bits = &_data[pos+1];
+        int count = 0;
+        for( int i=0; i<16; i++ ) count += bits[i];
+        if( count > 256 || pos + 17 + count > end ) return false;
+        HuffTable& t = ( tc == 0 ) ? _dc[th] : _ac[th];
+        if( not t.build( bits, &_data[pos+17], count ) ) return false;
+        pos += 17 + count;
+    }
+    return true;
+}
+
+bool JpegDecoder::parseDQT( size_t pos, int len )
+{
+    const size_t end = pos + len;
+    while( pos < end ) {
+        const int pq = _data[pos] >> 4;
+        const int tq = _data[pos] & 15;
+        if( tq > 3 ) return false;
+        pos++;
+        if( pos + 64 * ( pq + 1 ) > end ) return false;
+        for( int k=0; k<64; k++ ) {
+            _qt[tq][zigzag[k]] = pq ? u16( pos + 2*k ) : _data[pos+k];
+        }
+        pos += 64 * ( pq + 1 );
+    }
+    return true;
+}
+
+bool JpegDecoder::parseSOS( size_t pos, int len, size_t& entropy_start )
+{
+    if( len < 1 ) return false;
+    const int ns = _data[pos];
+    if( ns < 1 || ns > 4 || len < 4 + 2*ns ) return false;
+    _scan_comps.clear();
+    for( int i=0; i<ns; i++ ) {
+        const int id = _data[pos+1+2*i];
+        const int tables = _data[pos+2+2*i];
+        int found = -1;
+        for( size_t c=0; c<_comps.size(); c++ ) {
+            if( _comps[c].id == id ) found = c;
+        }
+        if( found < 0 ) return false;
+        _comps[found].td   = ( tables >> 4 ) & 3;
+        _comps[found].ta   = tables & 3;
+        _comps[found].pred = 0;
+        if( not _dc[_comps[found].td].defined || not _ac[_comps[found].ta].defined ) return false;
+        _scan_comps.push_back( found );
+    }
+    const int ss = _data[pos+1+2*ns];
+    const int se = _data[pos+2+2*ns];
+    if( ss != 0 || se != 63 ) return false; // not sequential
+    entropy_start = pos + len;
+    return true;
+}
+
+bool JpegDecoder::decodeBlock( BitReader& br, Component& c, bool keep, int bx, int by )
+{
+    float coef[64];
+
+    const int s = decodeHuffman( br, _dc[c.td] );
+    if( s < 0 || s > 11 ) return false;
+    if( s ) c.pred += extend( br.get( s ), s );
+
+    const uint16_t* q = _qt[c.tq];
+    if( keep ) {
+        memset( coef, 0, _n * _n * sizeof(float) );
+        coef[0] = float( c.pred * q[0] );
+    }
+
+    const HuffTable& ac = _ac[c.ta];
+    for( int k=1; k<64; ) {
+        const int rs = decodeHuffman( br, ac );
+        if( rs < 0 ) return false;
+        const int r  = rs >> 4;
+        const int sz = rs & 15;
+        if( sz == 0 ) {
+            if( r != 15 ) break; // EOB
+            k += 16;
+            continue;
+        }
+        k += r;
+        if( k > 63 ) return false;
+        const int v = extend( br.get( sz ), sz );
+        if( keep ) {
+            const int z   = zigzag[k];
+            const int row = z >> 3;
+            const int col = z & 7;
+            if( row < _n && col < _n ) coef[row*_n+col] = float( v * q[z] );
+        }
+        k++;
+    }
+
+    if( keep ) {
+        _idct.run( coef, &_plane[ (size_t)by * _n * _plane_step + bx * _n ], _plane_step );
+    }
+    return true;
+}
+
+bool JpegDecoder::decodeScan( size_t& pos )
+{
+    BitReader br( &_data[pos], &_data[0] + _data.size() );
+
+    const bool has_luma = std::find( _scan_comps.begin(), _scan_comps.end(), 0 ) != _scan_comps.end();
+
+    int units_x;
+    int units_y;
+    if( _scan_comps.size() == 1 ) {
+        /* non-interleaved: the MCU is a single block of the component */
+        const Component& c = _comps[_scan_comps[0]];
+        const int cw = ( _width  * c.hs + _hmax - 1 ) / _hmax;
+        const int ch = ( _height * c.vs + _vmax - 1 ) / _vmax;
+        units_x = ( cw + 7 ) / 8;
+        units_y = ( ch + 7 ) / 8;
+    } else {
+        units_x = _mcus_x;
+        units_y = _mcus_y;
+    }
+
+    int todo = _restart_interval;
+    for( int my=0; my<units_y; my++ ) {
+        for( int mx=0; mx<units_x; mx++ ) {
+            if( _restart_interval ) {
+                if( todo == 0 ) {
+                    if( not br.restart() ) return false;
+                    for( auto& c : _comps ) c.pred = 0;
+                    todo = _restart_interval;
+                }
+                todo--;
+            }
+
+            if( _scan_comps.size() == 1 ) {
+                Component& c = _comps[_scan_comps[0]];
+                if( not decodeBlock( br, c, _scan_comps[0] == 0, mx, my ) ) return false;
+                continue;
+            }
+            for( size_t i=0; i<_scan_comps.size(); i++ ) {
+                Component& c    = _comps[_scan_comps[i]];
+                const bool luma = ( _scan_comps[i] == 0 );
+                for( int v=0; v<c.vs; v++ ) {
+                    for( int h=0; h<c.hs; h++ ) {
+                        if( not decodeBlock( br, c, luma, mx*c.hs+h, my*c.vs+v ) ) return false;
+                    }
+                }
+            }
+        }
+    }
+
+    br.seekMarker( );
+    pos = br.p - &_data[0];
+    if( has_luma ) _luma_done = true;
+    return true;
+}
+
+bool JpegDecoder::decode( )
+{
+    const size_t size = _data.size();
+    if( size < 4 || _data[0] != 0xFF || _data[1] != 0xD8 ) return false;
+
+    size_t pos = 2;
+    while( pos + 4 <= size ) {
+        if( _data[pos] != 0xFF ) { pos++; continue; }
+        const int marker = _data[pos+1];
+        if( marker == 0xFF ) { pos++; continue; } // fill byte
+        pos += 2;
+
+        if( marker == 0xD9 ) break;                    // EOI
+        if( marker >= 0xD0 && marker <= 0xD7 ) continue; // stray RST
+
+        const int len = u16( pos );
+        if( len < 2 || pos + len > size ) return false;
+        const size_t body = pos + 2;
+        const int    blen = len - 2;
+
+        switch( marker )
+        {
+        case 0xC0 : // baseline
+        case 0xC1 : // extended sequential, Huffman
+            if( not _comps.empty() ) return false;
+            if( not parseSOF( body, blen ) ) return false;
+            if( _adobe_transform == 0 && _comps.size() == 3 ) return false; // RGB, no luminance plane
+            break;
+        case 0xC4 :
+            if( not parseDHT( body, blen ) ) return false;
+            break;
+        case 0xDB :
+            if( not parseDQT( body, blen ) ) return false;
+            break;
+        case 0xDD :
+            if( blen < 2 ) return false;
+            _restart_interval = u16( body );
+            break;
+        case 0xEE : // APP14, Adobe colour transform flag
+            if( blen >= 12 && memcmp( &_data[body], "Adobe", 5 ) == 0 ) {
+                _adobe_transform = _data[body+11];
+            }
+            break;
+        case 0xDA :
+            {
+                if( _comps.empty() ) return false;
+                size_t entropy;
+                if( not parseSOS( body, blen, entropy ) ) return false;
+                pos = entropy;
+                if( not decodeScan( pos ) ) return false;
+                if( _luma_done ) return true; // chroma-only scans may follow
+            }
+            continue;
+        default :
+            /* SOF2/3/5-7/9-11/13-15 and DAC: progressive, lossless,
+             * hierarchical or arithmetic coding are not supported */
+            if( ( marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 ) ) return false;
+            break; // APPn, COM and others are skipped
+        }
+        pos += len;
+    }
+    return _luma_done;
+}
+
+} // anonymous namespace
+
+bool isJPEGfile( const std::string& filename )
+{
+    ifstream file( filename.c_str(), ios::binary );
+    unsigned char magic[3] = { 0, 0, 0 };
+    file.read( (char*)magic, 3 );
+    return file.good() && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF;
+}
+
+unsigned char* readJPEGfile( const std::string& filename, int scale, int& w, int& h, int* full_w, int* full_h )
+{
+    if( scale != 1 && scale != 2 && scale != 4 && scale != 8 ) {
+        cerr << "JPEG scale must be 1, 2, 4 or 8, not " << scale << endl;
+        return 0;
+    }
+
+    ifstream file( filename.c_str(), ios::binary | ios::ate );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return 0;
+    }
+    const streamsize size = file.tellg();
+    file.seekg( 0, ios::beg );
+    vector<uint8_t> data( size );
+    if( not file.read( (char*)data.data(), size ) ) {
+        cerr << "File " << filename << " could not be read" << endl;
+        return 0;
+    }
+
+    JpegDecoder decoder( data, scale );
+    if( not decoder.decode() ) {
+        return 0;
+    }
+
+    w = decoder._out_w;
+    h = decoder._out_h;
+    if( full_w ) *full_w = decoder.getWidth();
+    if( full_h ) *full_h = decoder.getHeight();
+    unsigned char* image = new unsigned char[ w * h ];
+    for( int y=0; y<h; y++ ) {
+        memcpy( &image[y*w], &decoder._plane[ (size_t)y * decoder._plane_step ], w );
+    }
+    return image;
+}
+
+static inline void storeMean( unsigned char& dst, unsigned int sum, int count )
+{
+    dst = (unsigned char)( ( sum + count/2 ) / count );
+}
+
+static inline void storeMean( float& dst, float sum, int count )
+{
+    dst = sum / count;
+}
+
+template<typename T, typename Acc>
+static T* downscaleBoxT( const T* src, int w, int h, int scale, int& out_w, int& out_h )
+{
+    out_w = ( w + scale - 1 ) / scale;
+    out_h = ( h + scale - 1 ) / scale;
+
+    T* dst = new T[ out_w * out_h ];
+    for( int y=0; y<out_h; y++ ) {
+        const int y0 = y * scale;
+        const int y1 = min( y0 + scale, h );
+        for( int x=0; x<out_w; x++ ) {
+            const int x0 = x * scale;
+            const int x1 = min( x0 + scale, w );
+            Acc sum = 0;
+            for( int yy=y0; yy<y1; yy++ ) {
+                for( int xx=x0; xx<x1; xx++ ) {
+                    sum += src[yy*w+xx];
+                }
+            }
+            const int count = ( y1 - y0 ) * ( x1 - x0 );
+            storeMean( dst[y*out_w+x], sum, count );
+        }
+    }
+    return dst;
+}
+
+unsigned char* downscaleBox( const unsigned char* src, int w, int h, int scale, int& out_w, int& out_h )
+{
+    return downscaleBoxT<unsigned char,unsigned int>( src, w, h, scale, out_w, out_h );
+}
+
+float* downscaleBox( const float* src, int w, int h, int scale, int& out_w, int& out_h )
+{
+    return downscaleBoxT<float,float>( src, w, h, scale, out_w, out_h );
+}
+
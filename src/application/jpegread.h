@@ -0,0 +1,38 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <string>
+
+/* Decode the luminance of a baseline (sequential Huffman, 8-bit) JPEG
+ * file at 1/scale of its size, where scale is 1, 2, 4 or 8. Downscaling
+ * happens in the DCT domain: only the top-left 8/scale x 8/scale
+ * coefficients of every block are dequantized and passed through a
+ * reduced-size IDCT, and chroma blocks are entropy-decoded only to skip
+ * over them.
+ *
+ * The resulting image is ceil(width/scale) x ceil(height/scale); with
+ * full_w and full_h, the width and height of the frame header are
+ * returned there as well. Returns 0 for files that are not baseline JPEG (progressive,
+ * arithmetic-coded, 12-bit, CMYK, ...), so the caller can fall back
+ * to a general-purpose loader. The caller must delete [] the buffer.
+ */
+unsigned char* readJPEGfile( const std::string& filename, int scale, int& w, int& h,
+                             int* full_w = 0, int* full_h = 0 );
+
+/* Cheap test for the JPEG SOI marker at the start of the file */
+bool isJPEGfile( const std::string& filename );
+
+/* Reduce a greyscale image by an integer factor with a box filter.
+ * Used for non-JPEG input when the JPEG path decodes at reduced size,
+ * so that all images reach PopSift at the same scale.
+ * The caller must delete [] the buffer.
+ */
+unsigned char* downscaleBox( const unsigned char* src, int w, int h, int scale, int& out_w, int& out_h );
+float*         downscaleBox( const float*         src, int w, int h, int scale, int& out_w, int& out_h );
+
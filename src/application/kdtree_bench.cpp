@@ -0,0 +1,158 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <stdlib.h>
+
+#include <boost/program_options.hpp>
+
+#include <cuda_runtime.h>
+
+#include <popsift/features_file.h>
+#include <popsift/desc_match.h>
+#include <popsift/desc_kdtree.h>
+
+using namespace std;
+
+static string      query_file;
+static string      train_file;
+static int         num_trees   = 4;
+static vector<int> checks      = { 32, 64, 128, 256, 512, 1024 };
+static float       match_ratio = 0.8f;
+static int         num_threads = 0;
+static unsigned    seed        = 1;
+
+static void parseargs( int argc, char** argv )
+{
+    using namespace boost::program_options;
+
+    options_description options("Options");
+    {
+        options.add_options()
+            ("help,h", "Print usage")
+            ("query,q", value<std::string>(&query_file)->required(), "Binary feature file (.psf) with the query descriptors")
+            ("train,t", value<std::string>(&train_file)->required(), "Binary feature file (.psf) with the descriptors to index")
+            ("trees", value<int>(&num_trees)->default_value(num_trees), "Number of randomized k-d trees")
+            ("checks", value<std::vector<int>>(&checks)->multitoken(),
+             "Check budgets to measure, default 32 64 128 256 512 1024")
+            ("ratio", value<float>(&match_ratio)->default_value(match_ratio), "Ratio of Lowe's ratio test")
+            ("threads", value<int>(&num_threads)->default_value(num_threads), "Threads for matching, 0 for all cores")
+            ("seed", value<unsigned>(&seed)->default_value(seed), "Seed for the random splits of the trees");
+    }
+
+    variables_map vm;
+    try
+    {
+        store( parse_command_line(argc, argv, options), vm );
+
+        if( vm.count("help") ) {
+            std::cout << "Usage: popsift-kdtree-bench -q query.psf -t train.psf [--checks 64 256 ...]\n\n"
+                      << options << '\n';
+            exit(1);
+        }
+
+        notify(vm);
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        std::cerr << "Usage:\n\n" << options << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+static bool loadDescriptors( const string& name, popsift::DescriptorMatrix& matrix )
+{
+    popsift::FeaturesFile file;
+    if( not file.open( name ) ) {
+        return false;
+    }
+    if( file.getDescCodec() != popsift::FF_CodecNone ) {
+        cerr << "File " << name << " holds encoded descriptors" << endl;
+        return false;
+    }
+    matrix.assign( file.getDescriptorData(), file.getDescType(), file.getDescriptorCount(),
+                   file.getDescStride(), file.getDescDim() );
+    cerr << name << ": " << matrix.size() << " descriptors" << endl;
+    return true;
+}
+
+static double seconds_since( const std::chrono::steady_clock::time_point& start )
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main( int argc, char** argv )
+{
+    parseargs( argc, argv );
+
+    popsift::DescriptorMatrix query;
+    popsift::DescriptorMatrix train;
+    if( not loadDescriptors( query_file, query ) || not loadDescriptors( train_file, train ) ) {
+        exit( EXIT_FAILURE );
+    }
+    if( query.getDim() != train.getDim() ) {
+        cerr << "The descriptors of " << query_file << " and " << train_file << " differ in dimension" << endl;
+        exit( EXIT_FAILURE );
+    }
+    const size_t n = query.size();
+    if( n == 0 || train.size() == 0 ) {
+        cerr << "Nothing to match" << endl;
+        exit( EXIT_FAILURE );
+    }
+
+    /* the exact result is the reference */
+    vector<int>   nn( 2 * n );
+    vector<float> dist( 2 * n );
+    vector<char>  accept( n );
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    popsift::matchNearest2( query, train, nn.data(), dist.data(), num_threads );
+    const double exact_time = seconds_since( start );
+    const size_t exact_accepted = popsift::ratioTest( nn.data(), dist.data(), n, match_ratio, accept.data() );
+
+    start = std::chrono::steady_clock::now();
+    popsift::KdForest forest;
+    forest.build( train, num_trees, seed, num_threads );
+    const double build_time = seconds_since( start );
+
+    cout << fixed << setprecision(3)
+         << "exact:  " << exact_time * 1000.0 << " ms, " << exact_accepted << " matches pass the ratio test" << endl
+         << "build:  " << build_time * 1000.0 << " ms for " << num_trees << " trees" << endl
+         << "checks    time ms   speedup  recall@1  matches  match recall" << endl;
+
+    vector<int>   ann( 2 * n );
+    vector<float> adist( 2 * n );
+    vector<char>  aaccept( n );
+    for( int c : checks ) {
+        start = std::chrono::steady_clock::now();
+        forest.matchNearest2( query, c, ann.data(), adist.data(), num_threads );
+        const double t = seconds_since( start );
+        const size_t accepted = popsift::ratioTest( ann.data(), adist.data(), n, match_ratio, aaccept.data() );
+
+        /* recall@1: the nearest neighbour was found; match recall: an
+         * exact match that passes the ratio test is found and passes */
+        size_t found = 0;
+        size_t kept  = 0;
+        for( size_t q=0; q<n; q++ ) {
+            found += ( ann[2*q] == nn[2*q] );
+            kept  += ( accept[q] && aaccept[q] && ann[2*q] == nn[2*q] );
+        }
+
+        cout << setw(6) << c
+             << setw(12) << t * 1000.0
+             << setw(10) << setprecision(1) << ( t > 0.0 ? exact_time / t : 0.0 ) << setprecision(3)
+             << setw(10) << (double)found / n
+             << setw(9)  << accepted
+             << setw(14) << ( exact_accepted > 0 ? (double)kept / exact_accepted : 1.0 ) << endl;
+    }
+    return 0;
+}
@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <stdexcept>
 #include <list>
+#include <queue>
 #include <string>
 
 #include <boost/program_options.hpp>
@@ -21,13 +22,18 @@
 
 #include <popsift/popsift.h>
 #include <popsift/features.h>
+#include <popsift/features_file.h>
+#include <popsift/features_soa.h>
+#include <popsift/features_text.h>
+#include <popsift/features_db.h>
+#include <popsift/desc_pca.h>
+#include <popsift/desc_pq.h>
 #include <popsift/sift_conf.h>
 #include <popsift/common/device_prop.h>
 
-#ifdef USE_DEVIL
-#include <devil_cpp_wrapper.hpp>
-#endif
-#include "pgmread.h"
+#include "decode_pool.h"
+#include "file_walker.h"
+#include "writer_pool.h"
 
 #ifdef USE_NVTX
 #include <nvToolsExtCuda.h>
@@ -42,8 +48,26 @@ static bool print_dev_info  = false;
 static bool print_time_info = false;
 static bool write_as_uchar  = false;
 static bool dont_write      = false;
+static bool write_binary    = false;
 static bool pgmread_loading = false;
 static bool float_mode      = false;
+static bool short_mode      = false;
+static int  decode_threads  = 2;
+static int  prefetch_images = 4;
+static bool sorted_walk     = false;
+static string extensions;
+static string manifest;
+static bool no_dct_scaling  = false;
+static int  dct_scale       = 1;
+static string pca_file;
+static int  pca_dim         = 64;
+static popsift::PcaBasis pca_basis;
+static string pq_file;
+static popsift::PqCodebook pq_codebook;
+static string output_dir;
+static int  write_threads   = 2;
+static string db_file;
+static popsift::FeaturesDbWriter db_writer;
 
 static void parseargs(int argc, char** argv, popsift::Config& config, string& inputFile) {
     using namespace boost::program_options;
@@ -55,7 +79,10 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& in
             ("verbose,v", bool_switch()->notifier([&](bool i) {if(i) config.setVerbose(); }), "")
             ("log,l", bool_switch()->notifier([&](bool i) {if(i) config.setLogMode(popsift::Config::All); }), "Write debugging files")
 
-            ("input-file,i", value<std::string>(&inputFile)->required(), "Input file");
+            ("input-file,i", value<std::string>(&inputFile), "Input file or directory")
+            ("manifest", value<std::string>(&manifest), "Text file listing the input files, one per line, instead of --input-file")
+            ("ext", value<std::string>(&extensions), "Only process files with these extensions, comma-separated, e.g. jpg,png,pgm")
+            ("sorted", bool_switch(&sorted_walk)->default_value(false), "Process directory entries in sorted order (deterministic but slower to start)");
     
     }
     options_description parameters("Parameters");
@@ -69,6 +96,8 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& in
             ("edge-threshold", value<float>()->notifier([&](float f) { config.setEdgeLimit(f); }), "On-edge threshold")
             ("edge-limit", value<float>()->notifier([&](float f) { config.setEdgeLimit(f); }), "On-edge threshold")
             ("downsampling", value<float>()->notifier([&](float f) { config.setDownsampling(f); }), "Downscale width and height of input by 2^N")
+            ("no-dct-scaling", bool_switch(&no_dct_scaling)->default_value(false), "With downsampling >= 1, do not decode baseline JPEG files "
+             "at 1/2, 1/4 or 1/8 size in the DCT domain, downscale on the GPU instead")
             ("initial-blur", value<float>()->notifier([&](float f) {config.setInitialBlur(f); }), "Assume initial blur, subtract when blurring first time");
     }
     options_description modes("Modes");
@@ -104,6 +133,8 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& in
           popsift::Config::getNormModeUsage() )
         ( "root-sift", bool_switch()->notifier([&](bool b) { if(b) config.setNormMode(popsift::Config::RootSift); }),
           popsift::Config::getNormModeUsage() )
+        ( "desc-type", value<std::string>()->notifier([&](const std::string& s) { config.setDescType(s); }),
+          popsift::Config::getDescTypeUsage() )
         ("filter-max-extrema", value<int>()->notifier([&](int f) {config.setFilterMaxExtrema(f); }), "Approximate max number of extrema.")
         ("filter-grid", value<int>()->notifier([&](int f) {config.setFilterGridSize(f); }), "Grid edge length for extrema filtering (ie. value 4 leads to a 4x4 grid)")
         ("filter-sort", value<std::string>()->notifier([&](const std::string& s) {config.setFilterSorting(s); }), "Sort extrema in each cell by scale, either random (default), up or down");
@@ -118,8 +149,27 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& in
         ("write-as-uchar", bool_switch(&write_as_uchar)->default_value(false), "Output descriptors rounded to int.\n"
          "Scaling to sensible ranges is not automatic, should be combined with --norm-multi=9 or similar")
         ("dont-write", bool_switch(&dont_write)->default_value(false), "Suppress descriptor output")
+        ("write-binary", bool_switch(&write_binary)->default_value(false), "Write the binary PopSift feature format (.psf) "
+         "instead of text. Descriptors are stored in the type chosen with --desc-type, or as uint8 with --write-as-uchar")
+        ("output-dir", value<std::string>(&output_dir), "Write one feature file per image into this directory, mirroring the "
+         "input tree: <output-dir>/<path below the input>.txt or .psf. Without it, every image overwrites output-features.txt or .psf, "
+         "and a single writer thread is used so that images are written one after the other")
+        ("write-threads", value<int>(&write_threads)->default_value(2), "Number of threads that post-process and write features "
+         "while extraction continues")
+        ("write-db", value<std::string>(&db_file), "Append the features of all images to this feature database (and its .idx index) "
+         "in the binary format, instead of writing one file per image. Images are named by their path below the input")
+        ("pca-basis", value<std::string>(&pca_file), "Project the descriptors to --pca-dim dimensions with this PCA basis, "
+         "trained with popsift-pca-train. Projected descriptors are written as float")
+        ("pca-dim", value<int>(&pca_dim)->default_value(64), "Output dimension of --pca-basis, e.g. 32, 64 or 96")
+        ("pq-codebook", value<std::string>(&pq_file), "Encode the descriptors, after --pca-basis if given, as product quantization "
+         "codes with this codebook, trained with popsift-pq-train. Requires --write-binary or --write-db")
         ("pgmread-loading", bool_switch(&pgmread_loading)->default_value(false), "Use the old image loader instead of LibDevIL")
         ("float-mode", bool_switch(&float_mode)->default_value(false), "Upload image to GPU as float instead of byte")
+        ("16bit-mode", bool_switch(&short_mode)->default_value(false), "Upload image to GPU as unsigned 16-bit instead of byte. "
+         "Keeps the precision of 16-bit PGM/PPM files, conversion to float happens on the GPU")
+        ("decode-threads", value<int>(&decode_threads)->default_value(2), "Number of threads that load and decode images ahead of extraction")
+        ("prefetch", value<int>(&prefetch_images)->default_value(4), "Maximum number of decoded images waiting for extraction. "
+         "Also limits the number of images in flight inside PopSift.")
         ;
         
         //("test-direct-scaling")
@@ -139,6 +189,10 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& in
        }
 
         notify(vm); // Notify does processing (e.g., raise exceptions if required args are missing)
+
+        if( vm.count("input-file") == vm.count("manifest") ) {
+            throw boost::program_options::error( "exactly one of --input-file and --manifest is required" );
+        }
     }
     catch(boost::program_options::error& e)
     {
@@ -149,118 +203,145 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& in
 }
 
 
-static void collectFilenames( list<string>& inputFiles, const boost::filesystem::path& inputFile )
+/* The output file of an input image: with --output-dir, the input's
+ * path below the walked directory or manifest with ext appended,
+ * otherwise the same file in the working directory for every image,
+ * which main() then writes from a single writer thread. */
+static string output_name( const FileWalker& walker, const string& input, const char* ext )
 {
-    vector<boost::filesystem::path> vec;
-    std::copy( boost::filesystem::directory_iterator( inputFile ),
-               boost::filesystem::directory_iterator(),
-               std::back_inserter(vec) );
-    for (const auto& currPath : vec)
-    {
-        if( boost::filesystem::is_regular_file(currPath) )
-        {
-            inputFiles.push_back( currPath.string() );
-        }
-        else if( boost::filesystem::is_directory(currPath) )
-        {
-            collectFilenames( inputFiles, currPath);
-        }
+    if( output_dir.empty() ) {
+        return string( "output-features" ) + ext;
     }
+    boost::filesystem::path out = boost::filesystem::path( output_dir ) / walker.relativeName( input );
+    out += ext;
+    return out.string();
 }
 
-SiftJob* process_image( const string& inputFile, PopSift& PopSift )
+/* Post-process and write the features of one image, on a writer
+ * thread. Takes ownership of feature_list. */
+static void write_job( popsift::Features*      feature_list,
+                       const string&           out_name,
+                       const string&           image_name,
+                       int                     width,
+                       int                     height,
+                       const popsift::Config&  config,
+                       bool                    really_write,
+                       int                     text_threads )
 {
-    int w;
-    int h;
-    SiftJob* job;
-    unsigned char* image_data;
-
-#ifdef USE_DEVIL
-    if( not pgmread_loading )
-    {
-        if( float_mode )
-        {
-            cerr << "Cannot combine float-mode test with DevIL image reader" << endl;
-            exit( -1 );
-        }
-
-        nvtxRangePushA( "load and convert image - devil" );
-
-        ilImage img;
-        if( img.Load( inputFile.c_str() ) == false ) {
-            cerr << "Could not load image " << inputFile << endl;
-            return 0;
+    if( dct_scale > 1 ) {
+        /* the image was decoded at reduced size, return to input
+         * coordinates: reduced pixel i covers input pixels
+         * dct_scale * i .. dct_scale * i + dct_scale - 1 */
+        const float offset = ( dct_scale - 1 ) * 0.5f;
+        for( popsift::Feature& f : *feature_list ) {
+            f.xpos   = f.xpos * dct_scale + offset;
+            f.ypos   = f.ypos * dct_scale + offset;
+            f.sigma *= dct_scale;
         }
-        if( img.Convert( IL_LUMINANCE ) == false ) {
-            cerr << "Failed converting image " << inputFile << " to unsigned greyscale image" << endl;
-            exit( -1 );
-        }
-        w = img.Width();
-        h = img.Height();
-        cout << "Loading " << w << " x " << h << " image " << inputFile << endl;
-
-        image_data = img.GetData();
-
-        nvtxRangePop( ); // "load and convert image - devil"
-
-        job = PopSift.enqueue( w, h, image_data );
+    }
 
-        img.Clear();
+    popsift::FeaturesSoA* reduced = 0;
+    if( pca_basis.isValid() ) {
+        nvtxRangePushA( "PCA projection" );
+        popsift::FeaturesSoA soa( *feature_list );
+        reduced = pca_basis.project( soa, pca_dim );
+        nvtxRangePop( );
     }
-    else
-#endif
-    {
-        nvtxRangePushA( "load and convert image - pgmread" );
 
-        image_data = readPGMfile( inputFile, w, h );
-        if( image_data == 0 ) {
-            exit( -1 );
+    popsift::FeaturesSoA* encoded = 0;
+    if( pq_codebook.isValid() ) {
+        nvtxRangePushA( "PQ encoding" );
+        if( reduced ) {
+            encoded = pq_codebook.encode( *reduced );
+        } else {
+            popsift::FeaturesSoA soa( *feature_list );
+            encoded = pq_codebook.encode( soa );
         }
+        nvtxRangePop( );
+    }
 
-        nvtxRangePop( ); // "load and convert image - pgmread"
-
-        if( not float_mode )
-        {
-            // PopSift.init( w, h );
-            job = PopSift.enqueue( w, h, image_data );
+    if( really_write ) {
+        nvtxRangePushA( "Writing features to disk" );
 
-            delete [] image_data;
-        }
-        else
-        {
-            float* f_image_data = new float [w * h];
-            for( int i=0; i<w*h; i++ )
-            {
-                f_image_data[i] = float( image_data[i] ) / 256.0f;
+        if( db_writer.isOpen() ) {
+            if( encoded ) {
+                db_writer.append( image_name, *encoded, config, width, height,
+                                  popsift::FF_CodecPQ, pq_codebook.getFingerprint() );
+            } else if( reduced ) {
+                db_writer.append( image_name, *reduced, config, width, height );
+            } else {
+                db_writer.append( image_name, *feature_list, config, width, height,
+                                  write_as_uchar ? popsift::Config::UInt8Desc
+                                                 : feature_list->getDescType() );
+            }
+        } else {
+            const boost::filesystem::path dir = boost::filesystem::path( out_name ).parent_path();
+            if( not dir.empty() ) {
+                boost::system::error_code ec;
+                boost::filesystem::create_directories( dir, ec );
+                if( ec ) {
+                    cerr << "Directory " << dir.string() << " could not be created: " << ec.message() << endl;
+                }
             }
-            job = PopSift.enqueue( w, h, f_image_data );
 
-            delete [] image_data;
-            delete [] f_image_data;
+            if( encoded ) {
+                popsift::writeFeaturesFile( out_name, *encoded, config, width, height,
+                                            popsift::FF_CodecPQ, pq_codebook.getFingerprint() );
+            } else if( reduced ) {
+                if( write_binary ) {
+                    popsift::writeFeaturesFile( out_name, *reduced, config, width, height );
+                } else {
+                    std::ofstream of( out_name.c_str() );
+                    reduced->print( of, write_as_uchar );
+                }
+            } else if( write_binary ) {
+                popsift::writeFeaturesFile( out_name, *feature_list, config, width, height,
+                                            write_as_uchar ? popsift::Config::UInt8Desc
+                                                           : feature_list->getDescType() );
+            } else {
+                popsift::writeFeaturesText( out_name, *feature_list, write_as_uchar, text_threads );
+            }
         }
-    }
 
-    return job;
+        nvtxRangePop( ); // Writing features to disk
+    }
+    delete encoded;
+    delete reduced;
+    delete feature_list;
 }
 
-void read_job( SiftJob* job, bool really_write )
+/* An image inside PopSift, with the size of its input file */
+struct PendingJob
 {
-    popsift::Features* feature_list = job->get();
+    SiftJob* job;
+    string   input;
+    int      width;
+    int      height;
+};
+
+/* Wait for the features of one image and hand them to the writers */
+static void read_job( const PendingJob&       pending,
+                      const FileWalker&       walker,
+                      const popsift::Config&  config,
+                      bool                    really_write,
+                      WriterPool&             writer )
+{
+    popsift::Features* feature_list = pending.job->get();
     cerr << "Number of feature points: " << feature_list->getFeatureCount()
          << " number of feature descriptors: " << feature_list->getDescriptorCount()
          << endl;
 
-    if( really_write ) {
-        nvtxRangePushA( "Writing features to disk" );
+    const string out_name   = output_name( walker, pending.input, write_binary ? ".psf" : ".txt" );
+    const string image_name = walker.relativeName( pending.input ).generic_string();
+    const int    width      = pending.width;
+    const int    height     = pending.height;
 
-        std::ofstream of( "output-features.txt" );
-        feature_list->print( of, write_as_uchar );
-    }
-    delete feature_list;
+    /* with several writers, every image is formatted by one thread */
+    const int text_threads = writer.getThreadCount() > 1 ? 1 : 0;
 
-    if( really_write ) {
-        nvtxRangePop( ); // Writing features to disk
-    }
+    writer.push( [=, &config]() {
+        write_job( feature_list, out_name, image_name, width, height, config, really_write, text_threads );
+    } );
 }
 
 int main(int argc, char **argv)
@@ -268,7 +349,6 @@ int main(int argc, char **argv)
     cudaDeviceReset();
 
     popsift::Config config;
-    list<string>   inputFiles;
     string         inputFile = "";
     const char*    appName   = argv[0];
 
@@ -281,48 +361,154 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    if( boost::filesystem::exists( inputFile ) ) {
-        if( boost::filesystem::is_directory( inputFile ) ) {
-            cout << "BOOST " << inputFile << " is directory" << endl;
-            collectFilenames( inputFiles, inputFile );
-            if( inputFiles.empty() ) {
-                cerr << "No files in directory, nothing to do" << endl;
-                exit( 0 );
-            }
-        } else if( boost::filesystem::is_regular_file( inputFile ) ) {
-            inputFiles.push_back( inputFile );
-        } else {
-            cout << "Input file is neither regular file nor directory, nothing to do" << endl;
+    if( not pca_file.empty() ) {
+        if( not pca_basis.load( pca_file ) ) {
+            exit( -1 );
+        }
+        if( pca_dim <= 0 || pca_dim > pca_basis.getComponentCount() ) {
+            cerr << "The PCA basis " << pca_file << " has " << pca_basis.getComponentCount()
+                 << " components, --pca-dim " << pca_dim << " is not possible" << endl;
             exit( -1 );
         }
     }
 
+    if( not pq_file.empty() ) {
+        if( not write_binary && db_file.empty() ) {
+            cerr << "--pq-codebook writes codes to the binary feature file, it requires --write-binary or --write-db" << endl;
+            exit( -1 );
+        }
+        if( not pq_codebook.load( pq_file ) ) {
+            exit( -1 );
+        }
+        const int dim = pca_basis.isValid() ? pca_dim : 128;
+        if( pq_codebook.getDim() != dim ) {
+            cerr << "The PQ codebook " << pq_file << " encodes " << pq_codebook.getDim()
+                 << "-dimensional descriptors, but the descriptors have " << dim << " dimensions" << endl;
+            exit( -1 );
+        }
+    }
+
+    if( not db_file.empty() && not dont_write ) {
+        if( not db_writer.open( db_file ) ) {
+            exit( -1 );
+        }
+    }
+
+    FileWalker* walker;
+    if( not manifest.empty() ) {
+        walker = FileWalker::fromManifest( manifest );
+    } else if( boost::filesystem::is_directory( inputFile ) ) {
+        cout << "BOOST " << inputFile << " is directory" << endl;
+        walker = new FileWalker( inputFile );
+    } else if( boost::filesystem::is_regular_file( inputFile ) ) {
+        walker = new FileWalker( inputFile );
+    } else {
+        cout << "Input file is neither regular file nor directory, nothing to do" << endl;
+        exit( -1 );
+    }
+    walker->setExtensions( extensions );
+    walker->setSorted( sorted_walk );
+
     popsift::cuda::device_prop_t deviceInfo;
     deviceInfo.set( 0, print_dev_info );
     if( print_dev_info ) deviceInfo.print( );
 
-    PopSift PopSift( config,
+    if( float_mode && short_mode ) {
+        cerr << "Cannot combine float-mode and 16bit-mode" << endl;
+        exit( -1 );
+    }
+
+    /* The integer part of the downsampling, up to 2^3, is done while
+     * decoding: baseline JPEGs are decoded from the low DCT frequencies
+     * only, PopSift does the rest. Only PopSift sees the reduced
+     * downsampling; files are written and fingerprinted with config. */
+    popsift::Config extract_config = config;
+    if( not no_dct_scaling && not short_mode ) {
+        const float down  = -config.getUpscaleFactor();
+        const int   steps = min( (int)floorf( down ), 3 );
+        if( steps > 0 ) {
+            dct_scale = 1 << steps;
+            extract_config.setDownsampling( down - steps );
+        }
+    }
+
+    PopSift PopSift( extract_config,
                      popsift::Config::ExtractingMode,
-                     float_mode ? PopSift::FloatImages : PopSift::ByteImages );
+                     float_mode ? PopSift::FloatImages
+                                : short_mode ? PopSift::ShortImages
+                                             : PopSift::ByteImages );
 
-    std::queue<SiftJob*> jobs;
-    for( auto it = inputFiles.begin(); it!=inputFiles.end(); it++ ) {
-        inputFile = it->c_str();
+    DecodePool::PixelType pixel_type = float_mode ? DecodePool::Floats
+                                     : short_mode ? DecodePool::Shorts
+                                                  : DecodePool::Bytes;
+#ifdef USE_DEVIL
+    const bool use_devil = not pgmread_loading;
+#else
+    const bool use_devil = false;
+#endif
+
+    DecodePool decoder( decode_threads, prefetch_images, pixel_type, use_devil );
+    decoder.setDownscale( dct_scale );
 
-        SiftJob* job = process_image( inputFile, PopSift );
-        jobs.push( job );
+    /* Walk the input lazily in its own thread, decoding starts
+     * as soon as the first file is found. */
+    boost::thread feeder( [&]() {
+        string filename;
+        while( walker->next( filename ) ) {
+            decoder.push( filename );
+        }
+        decoder.close( );
+    } );
+
+    /* Post-processing and writing overlap extraction, at most
+     * write_queue finished images wait for a writer. */
+    if( output_dir.empty() && not db_writer.isOpen() && not dont_write && write_threads > 1 ) {
+        /* every image is written to the same file, two writers would
+         * truncate and write it at the same time */
+        write_threads = 1;
+    }
+    const int  write_queue = max( write_threads, 1 ) * 2;
+    WriterPool writer( write_threads, write_queue );
+
+    std::queue<PendingJob> jobs;
+    DecodedImage* image;
+    while( ( image = decoder.pull() ) != 0 ) {
+        const PendingJob pending = { image->enqueue( PopSift ), image->filename, image->full_w, image->full_h };
+        jobs.push( pending );
+        delete image;
+
+        /* Keep the number of images in flight inside PopSift bounded,
+         * otherwise the decoders never wait and every image is copied
+         * into host memory up front. */
+        while( jobs.size() > (size_t)max( prefetch_images, 1 ) ) {
+            const PendingJob done = jobs.front();
+            jobs.pop();
+            read_job( done, *walker, config, not dont_write, writer );
+            delete done.job;
+        }
     }
 
     while( !jobs.empty() )
     {
-        SiftJob* job = jobs.front();
+        const PendingJob job = jobs.front();
         jobs.pop();
-        if( job ) {
-            read_job( job, not dont_write );
-            delete job;
+        if( job.job ) {
+            read_job( job, *walker, config, not dont_write, writer );
+            delete job.job;
         }
     }
 
+    writer.close( );
+    db_writer.close( );
+    feeder.join( );
+    if( walker->count() == 0 ) {
+        cerr << "No input files found, nothing to do" << endl;
+    }
+    delete walker;
+
+    decoder.printStats( cout );
+    writer.printStats( cout );
+
     PopSift.uninit( );
 }
 
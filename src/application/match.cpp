@@ -15,12 +15,15 @@
 #include <stdexcept>
 #include <list>
 #include <string>
+#include <chrono>
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 
 #include <popsift/popsift.h>
 #include <popsift/features.h>
+#include <popsift/desc_match.h>
+#include <popsift/match_list.h>
 #include <popsift/sift_conf.h>
 #include <popsift/common/device_prop.h>
 
@@ -43,6 +46,10 @@ static bool print_time_info = false;
 static bool write_as_uchar  = false;
 static bool dont_write      = false;
 static bool pgmread_loading = false;
+static bool host_match      = false;
+static bool mutual_match    = false;
+static int  match_threads   = 0;
+static string match_file;
 
 static void parseargs(int argc, char** argv, popsift::Config& config, string& lFile, string& rFile) {
     using namespace boost::program_options;
@@ -116,6 +123,10 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& lF
         ("write-as-uchar", bool_switch(&write_as_uchar)->default_value(false), "Output descriptors rounded to int Scaling to sensible ranges is not automatic, should be combined with --norm-multi=9 or similar")
         ("dont-write", bool_switch(&dont_write)->default_value(false), "Suppress descriptor output")
         ("pgmread-loading", bool_switch(&pgmread_loading)->default_value(false), "Use the old image loader instead of LibDevIL")
+        ("host-match", bool_switch(&host_match)->default_value(false), "Download the features and match them on the CPU instead of the GPU")
+        ("mutual", bool_switch(&mutual_match)->default_value(false), "Accept only matches that pass the ratio test in both directions and are mutual nearest neighbours")
+        ("match-threads", value<int>(&match_threads), "Threads for --host-match, default is the number of cores")
+        ("write-matches", value<std::string>(&match_file), "Write the matches to this binary match file instead of printing them")
         ;
         
         //("test-direct-scaling")
@@ -145,26 +156,6 @@ static void parseargs(int argc, char** argv, popsift::Config& config, string& lF
 }
 
 
-static void collectFilenames( list<string>& inputFiles, const boost::filesystem::path& inputFile )
-{
-    vector<boost::filesystem::path> vec;
-    std::copy( boost::filesystem::directory_iterator( inputFile ),
-               boost::filesystem::directory_iterator(),
-               std::back_inserter(vec) );
-    for (const auto& currPath : vec)
-    {
-        if( boost::filesystem::is_regular_file(currPath) )
-        {
-            inputFiles.push_back( currPath.string() );
-
-        }
-        else if( boost::filesystem::is_directory(currPath) )
-        {
-            collectFilenames( inputFiles, currPath);
-        }
-    }
-}
-
 SiftJob* process_image( const string& inputFile, PopSift& PopSift )
 {
     int w;
@@ -252,23 +243,58 @@ int main(int argc, char **argv)
     deviceInfo.set( 0, print_dev_info );
     if( print_dev_info ) deviceInfo.print( );
 
-    PopSift PopSift( config, popsift::Config::MatchingMode );
+    PopSift PopSift( config, host_match ? popsift::Config::ExtractingMode : popsift::Config::MatchingMode );
 
     SiftJob* lJob = process_image( lFile, PopSift );
     SiftJob* rJob = process_image( rFile, PopSift );
 
-    popsift::FeaturesDev* lFeatures = lJob->getDev();
-    cout << "Number of features:    " << lFeatures->getFeatureCount() << endl;
-    cout << "Number of descriptors: " << lFeatures->getDescriptorCount() << endl;
+    popsift::MatchList matches;
 
-    popsift::FeaturesDev* rFeatures = rJob->getDev();
-    cout << "Number of features:    " << rFeatures->getFeatureCount() << endl;
-    cout << "Number of descriptors: " << rFeatures->getDescriptorCount() << endl;
+    if( host_match ) {
+        popsift::FeaturesHost* lFeatures = lJob->getHost();
+        popsift::FeaturesHost* rFeatures = rJob->getHost();
+        cout << "Number of features:    " << lFeatures->getFeatureCount() << " <-> " << rFeatures->getFeatureCount() << endl;
+        cout << "Number of descriptors: " << lFeatures->getDescriptorCount() << " <-> " << rFeatures->getDescriptorCount() << endl;
 
-    lFeatures->match( rFeatures );
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if( mutual_match ) {
+            popsift::matchFeaturesMutual( *lFeatures, *rFeatures, matches, 0.8f, match_threads );
+        } else {
+            popsift::matchFeatures( *lFeatures, *rFeatures, matches, 0.8f, match_threads );
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if( print_time_info ) {
+            cout << "Matching took " << elapsed.count() * 1000.0 << " ms" << endl;
+        }
+
+        delete lFeatures;
+        delete rFeatures;
+    } else {
+        popsift::FeaturesDev* lFeatures = lJob->getDev();
+        cout << "Number of features:    " << lFeatures->getFeatureCount() << endl;
+        cout << "Number of descriptors: " << lFeatures->getDescriptorCount() << endl;
+
+        popsift::FeaturesDev* rFeatures = rJob->getDev();
+        cout << "Number of features:    " << rFeatures->getFeatureCount() << endl;
+        cout << "Number of descriptors: " << rFeatures->getDescriptorCount() << endl;
+
+        lFeatures->match( rFeatures, matches );
+        if( mutual_match ) {
+            popsift::MatchList reverse;
+            rFeatures->match( lFeatures, reverse );
+            matches.keepMutual( reverse );
+        }
 
-    delete lFeatures;
-    delete rFeatures;
+        delete lFeatures;
+        delete rFeatures;
+    }
+
+    cout << "Accepted " << matches.getAcceptedCount() << " of " << matches.size() << " matches" << endl;
+    if( not match_file.empty() ) {
+        matches.save( match_file );
+    } else if( not dont_write ) {
+        matches.print( cout );
+    }
 
     PopSift.uninit( );
 }
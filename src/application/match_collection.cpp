@@ -0,0 +1,120 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <stdlib.h>
+
+#include <boost/program_options.hpp>
+
+#include <cuda_runtime.h>
+
+#include <popsift/features_db.h>
+#include <popsift/match_db.h>
+#include <popsift/collection_match.h>
+
+using namespace std;
+
+static string db_path;
+static string output_path;
+static string pairs_file;
+static bool   all_pairs     = false;
+static size_t window        = 0;
+static size_t block_size    = 64;
+static float  match_ratio   = 0.8f;
+static bool   mutual        = false;
+static bool   keep_rejected = false;
+static int    num_threads   = 0;
+
+static void parseargs( int argc, char** argv )
+{
+    using namespace boost::program_options;
+
+    options_description options("Options");
+    {
+        options.add_options()
+            ("help,h", "Print usage")
+            ("db,d", value<std::string>(&db_path)->required(), "Feature database written by popsift-demo --write-db")
+            ("output,o", value<std::string>(&output_path)->required(),
+             "Match database (and its .idx index) to append to. An existing database is continued: "
+             "the pairs it holds are not matched again")
+            ("all", bool_switch(&all_pairs)->default_value(false), "Match all pairs of images")
+            ("window", value<size_t>(&window), "Match every image with this many images that follow it, for image sequences")
+            ("pairs", value<std::string>(&pairs_file),
+             "Match the pairs of this file, one pair of image ids per line, e.g. from popsift-vocab-query --pairs")
+            ("block", value<size_t>(&block_size)->default_value(block_size),
+             "Images per block of the pair matrix; the descriptors of two blocks are kept in memory")
+            ("ratio", value<float>(&match_ratio)->default_value(match_ratio), "Ratio of Lowe's ratio test")
+            ("mutual", bool_switch(&mutual)->default_value(false),
+             "Keep only matches that pass the ratio test in both directions and are mutual nearest neighbours")
+            ("keep-rejected", bool_switch(&keep_rejected)->default_value(false),
+             "Store the matches that fail the ratio test as well")
+            ("threads", value<int>(&num_threads)->default_value(num_threads), "Threads for matching, 0 for all cores");
+    }
+
+    variables_map vm;
+    try
+    {
+        store( parse_command_line(argc, argv, options), vm );
+
+        if( vm.count("help") ) {
+            std::cout << "Usage: popsift-match-collection -d features.db -o matches.db [--all | --window 10 | --pairs pairs.txt]\n\n"
+                      << options << '\n';
+            exit(1);
+        }
+
+        notify(vm);
+
+        if( (int)all_pairs + (int)vm.count("window") + (int)vm.count("pairs") != 1 ) {
+            throw error( "exactly one of --all, --window and --pairs is required" );
+        }
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        std::cerr << "Usage:\n\n" << options << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main( int argc, char** argv )
+{
+    parseargs( argc, argv );
+
+    popsift::FeaturesDb db;
+    if( not db.open( db_path ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    vector<popsift::ImagePair> pairs;
+    if( all_pairs ) {
+        popsift::makeAllPairs( db.getImageCount(), pairs );
+    } else if( window > 0 ) {
+        popsift::makeWindowPairs( db.getImageCount(), window, pairs );
+    } else if( not pairs_file.empty() && not popsift::readPairList( pairs_file, pairs ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    popsift::MatchDbWriter output;
+    if( not output.open( output_path, db.getDbId() ) ) {
+        exit( EXIT_FAILURE );
+    }
+    if( output.getPairCount() > 0 ) {
+        cerr << "Continuing " << output_path << ", which holds " << output.getPairCount() << " pairs" << endl;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    popsift::CollectionMatcher matcher( db, block_size, num_threads );
+    const size_t stored = matcher.run( pairs, output, match_ratio, mutual, keep_rejected, &cerr );
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    cerr << "Matched " << stored << " pairs of " << db.getImageCount() << " images in "
+         << elapsed.count() << " s, " << matcher.getLoadCount() << " images loaded" << endl;
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include <boost/program_options.hpp>
+
+#include <cuda_runtime.h>
+
+#include <popsift/desc_pca.h>
+
+#include "feature_sample.h"
+
+using namespace std;
+
+static string         output_file;
+static vector<string> input_files;
+static size_t         max_samples    = 200000;
+static int            num_components = 0;
+static unsigned       seed           = 1;
+
+static void parseargs( int argc, char** argv )
+{
+    using namespace boost::program_options;
+
+    options_description options("Options");
+    {
+        options.add_options()
+            ("help,h", "Print usage")
+            ("output,o", value<std::string>(&output_file)->required(), "PCA basis file to write")
+            ("input-file,i", value<std::vector<std::string>>(&input_files)->required(),
+             "Binary feature files (.psf) written by popsift-demo --write-binary")
+            ("samples", value<size_t>(&max_samples)->default_value(max_samples),
+             "Number of descriptors drawn at random from all input files")
+            ("components", value<int>(&num_components)->default_value(0),
+             "Number of components kept in the file, 0 keeps all. "
+             "Projection can use any number up to this, e.g. 32, 64 or 96")
+            ("seed", value<unsigned>(&seed)->default_value(seed), "Seed for drawing the sample");
+    }
+
+    positional_options_description positional;
+    positional.add( "input-file", -1 );
+
+    variables_map vm;
+    try
+    {
+        store( command_line_parser(argc, argv).options(options).positional(positional).run(), vm );
+
+        if( vm.count("help") ) {
+            std::cout << "Usage: popsift-pca-train -o basis.pca features1.psf [features2.psf ...]\n\n"
+                      << options << '\n';
+            exit(1);
+        }
+
+        notify(vm);
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        std::cerr << "Usage:\n\n" << options << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main( int argc, char** argv )
+{
+    parseargs( argc, argv );
+
+    int           dim  = 0;
+    size_t        seen = 0;
+    vector<float> sample;
+    if( not sampleDescriptors( input_files, max_samples, seed, sample, dim, seen ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    const size_t count = sample.size() / ( dim > 0 ? dim : 1 );
+    cerr << "Training on " << count << " of " << seen << " descriptors" << endl;
+
+    popsift::PcaBasis basis;
+    if( not basis.train( sample.data(), count, dim * sizeof(float), dim, num_components ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    /* how much of the variance the usual output sizes keep */
+    double total = 0.0;
+    for( int c=0; c<basis.getComponentCount(); c++ ) total += basis.getEigenvalues()[c];
+    double sum = 0.0;
+    for( int c=0; c<basis.getComponentCount(); c++ ) {
+        sum += basis.getEigenvalues()[c];
+        if( ( c + 1 ) % 32 == 0 ) {
+            cerr << "    " << setw(3) << c + 1 << " components: "
+                 << fixed << setprecision(1) << 100.0 * sum / total << "% of the variance kept in the file" << endl;
+        }
+    }
+
+    if( not basis.save( output_file ) ) {
+        exit( EXIT_FAILURE );
+    }
+    return 0;
+}
@@ -35,51 +35,36 @@
 
 using namespace std;
 
-unsigned char* readPGMfile( const string& filename, int& w, int& h )
+static bool readPGMheader( ifstream& pgmfile, const boost::filesystem::path& input_file, int& type, int& w, int& h, int& maxval )
 {
-    boost::filesystem::path input_file( filename );
-
-    if( not boost::filesystem::exists( input_file ) ) {
-        cerr << "File " << input_file << " does not exist" << endl;
-        return 0;
-    }
-
-    ifstream pgmfile( filename.c_str(), ios::binary );
-    if( not pgmfile.is_open() ) {
-        cerr << "File " << input_file << " could not be opened for reading" << endl;
-        return 0;
-    }
-
     string pgmtype;
     do {
         getline( pgmfile, pgmtype ); // this is the string version of getline()
         if( pgmfile.fail() ) {
             cerr << "File " << input_file << " is too short" << endl;
-            return 0;
+            return false;
         }
         boost::algorithm::trim_left( pgmtype ); // nice because of trim
     } while( pgmtype.at(0) == '#' );
 
-    int type;
     if( pgmtype.substr(0,2) == "P2" ) type = 2;
     else if( pgmtype.substr(0,2) == "P3" ) type = 3;
     else if( pgmtype.substr(0,2) == "P5" ) type = 5;
     else if( pgmtype.substr(0,2) == "P6" ) type = 6;
     else {
         cerr << "File " << input_file << " can only contain P2, P3, P5 or P6 PGM images" << endl;
-        return 0;
+        return false;
     }
 
     char  line[1000];
     char* parse;
-    int   maxval;
 
     do {
         pgmfile.getline( line, 1000 );
 
         if( pgmfile.fail() ) {
             cerr << "File " << input_file << " is too short" << endl;
-            return 0;
+            return false;
         }
         int num = pgmfile.gcount();
         parse = line;
@@ -92,20 +77,20 @@ unsigned char* readPGMfile( const string& filename, int& w, int& h )
             cerr << "Error in " << __FILE__ << ":" << __LINE__ << endl
                  << "File " << input_file << " PGM type header (" << type << ") must be followed by comments and WxH info" << endl
                  << "but line contains " << parse << endl;
-            return 0;
+            return false;
         }
     } while( *parse == '#' );
 
     if( w <= 0 || h <= 0 ) {
         cerr << "File " << input_file << " has meaningless image size" << endl;
-        return 0;
+        return false;
     }
 
     do {
         pgmfile.getline( line, 1000 );
         if( pgmfile.fail() ) {
             cerr << "File " << input_file << " is too short" << endl;
-            return 0;
+            return false;
         }
         int num = pgmfile.gcount();
         parse = line;
@@ -116,10 +101,40 @@ unsigned char* readPGMfile( const string& filename, int& w, int& h )
         int ct = sscanf( parse, "%d", &maxval );
         if( ct != 1 ) {
             cerr << "File " << input_file << " PGM dimensions must be followed by comments and max value info" << endl;
-            return 0;
+            return false;
         }
     } while( *parse == '#' );
 
+    if( maxval <= 0 || maxval > 65535 ) {
+        cerr << "File " << input_file << " has meaningless max value " << maxval << endl;
+        return false;
+    }
+
+    return true;
+}
+
+unsigned char* readPGMfile( const string& filename, int& w, int& h )
+{
+    boost::filesystem::path input_file( filename );
+
+    if( not boost::filesystem::exists( input_file ) ) {
+        cerr << "File " << input_file << " does not exist" << endl;
+        return 0;
+    }
+
+    ifstream pgmfile( filename.c_str(), ios::binary );
+    if( not pgmfile.is_open() ) {
+        cerr << "File " << input_file << " could not be opened for reading" << endl;
+        return 0;
+    }
+
+    int type;
+    int maxval;
+
+    if( not readPGMheader( pgmfile, input_file, type, w, h, maxval ) ) {
+        return 0;
+    }
+
     unsigned char* input_data = new unsigned char[ w * h ];
 
     switch( type )
@@ -252,3 +267,116 @@ unsigned char* readPGMfile( const string& filename, int& w, int& h )
     return input_data;
 }
 
+
+/* Binary PGM/PPM files with maxval > 255 store 2 bytes per sample,
+ * most significant byte first.
+ */
+static inline unsigned int readBigEndian16( const unsigned char* src )
+{
+    return ( (unsigned int)src[0] << 8 ) | (unsigned int)src[1];
+}
+
+/* Stretch a sample from [0..maxval] to [0..65535]. Integer arithmetic,
+ * exact for maxval 255 (factor 257) and 65535 (identity).
+ */
+static inline unsigned short stretch16( unsigned int value, unsigned int maxval )
+{
+    if( value >= maxval ) return 65535;
+    return (unsigned short)( ( value * 65535u + maxval / 2 ) / maxval );
+}
+
+static inline unsigned short rgb2gray16( unsigned int r, unsigned int g, unsigned int b )
+{
+#ifdef RGB2GRAY_IN_INT
+    return (unsigned short)( ( R_RATE*r+G_RATE*g+B_RATE*b ) >> RATE_SHIFT );
+#else // RGB2GRAY_IN_INT
+    return (unsigned short)( R_RATE*r+G_RATE*g+B_RATE*b );
+#endif // RGB2GRAY_IN_INT
+}
+
+unsigned short* readPGMfile16( const string& filename, int& w, int& h )
+{
+    boost::filesystem::path input_file( filename );
+
+    if( not boost::filesystem::exists( input_file ) ) {
+        cerr << "File " << input_file << " does not exist" << endl;
+        return 0;
+    }
+
+    ifstream pgmfile( filename.c_str(), ios::binary );
+    if( not pgmfile.is_open() ) {
+        cerr << "File " << input_file << " could not be opened for reading" << endl;
+        return 0;
+    }
+
+    int type;
+    int maxval;
+
+    if( not readPGMheader( pgmfile, input_file, type, w, h, maxval ) ) {
+        return 0;
+    }
+
+    const int channels = ( type == 3 || type == 6 ) ? 3 : 1;
+    const int samples  = w * h * channels;
+
+    unsigned short* input_data = new unsigned short[ w * h ];
+    unsigned short* i2         = ( channels == 1 ) ? input_data
+                                                   : new unsigned short[ samples ];
+
+    switch( type )
+    {
+    case 2 :
+    case 3 :
+        for( int i=0; i<samples; i++ ) {
+            int input;
+            pgmfile >> input;
+            if( pgmfile.fail() ) {
+                cerr << "File " << input_file << " file too short" << endl;
+                if( i2 != input_data ) delete [] i2;
+                delete [] input_data;
+                return 0;
+            }
+            i2[i] = stretch16( input, maxval );
+        }
+        break;
+    case 5 :
+    case 6 :
+        {
+            const int      bytes = ( maxval < 256 ) ? 1 : 2;
+            unsigned char* raw   = new unsigned char[ samples * bytes ];
+            pgmfile.read( (char*)raw, samples * bytes );
+            if( pgmfile.fail() ) {
+                cerr << "File " << input_file << " file too short" << endl;
+                delete [] raw;
+                if( i2 != input_data ) delete [] i2;
+                delete [] input_data;
+                return 0;
+            }
+            if( bytes == 1 ) {
+                for( int i=0; i<samples; i++ ) {
+                    i2[i] = stretch16( raw[i], maxval );
+                }
+            } else {
+                for( int i=0; i<samples; i++ ) {
+                    i2[i] = stretch16( readBigEndian16( &raw[2*i] ), maxval );
+                }
+            }
+            delete [] raw;
+        }
+        break;
+    }
+
+    if( channels == 3 ) {
+        const unsigned short* src = i2;
+        for( int i=0; i<w*h; i++ ) {
+            unsigned int r = *src; src++;
+            unsigned int g = *src; src++;
+            unsigned int b = *src; src++;
+            input_data[i] = rgb2gray16( r, g, b );
+        }
+        delete [] i2;
+    }
+
+    return input_data;
+}
+
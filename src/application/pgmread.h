@@ -11,3 +11,9 @@
 
 unsigned char* readPGMfile( const std::string& filename, int& w, int& h );
 
+/* Read a PGM or PPM file into 16-bit greyscale. Samples are stretched
+ * from [0..maxval] to [0..65535], so 12-bit or 14-bit sensor data keeps
+ * its full precision. The caller must delete [] the returned buffer.
+ */
+unsigned short* readPGMfile16( const std::string& filename, int& w, int& h );
+
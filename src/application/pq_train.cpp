@@ -0,0 +1,115 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include <boost/program_options.hpp>
+
+#include <cuda_runtime.h>
+
+#include <popsift/desc_pq.h>
+
+#include "feature_sample.h"
+
+using namespace std;
+
+static string         output_file;
+static vector<string> input_files;
+static size_t         max_samples   = 100000;
+static int            num_subspaces = 16;
+static int            iterations    = 25;
+static unsigned       seed          = 1;
+
+static void parseargs( int argc, char** argv )
+{
+    using namespace boost::program_options;
+
+    options_description options("Options");
+    {
+        options.add_options()
+            ("help,h", "Print usage")
+            ("output,o", value<std::string>(&output_file)->required(), "PQ codebook file to write")
+            ("input-file,i", value<std::vector<std::string>>(&input_files)->required(),
+             "Binary feature files (.psf) written by popsift-demo --write-binary, "
+             "with PCA-projected descriptors if the codebook is used after --pca-basis")
+            ("samples", value<size_t>(&max_samples)->default_value(max_samples),
+             "Number of descriptors drawn at random from all input files")
+            ("subspaces", value<int>(&num_subspaces)->default_value(num_subspaces),
+             "Number of subspaces, which is the code size in bytes. Must divide the descriptor dimension")
+            ("iterations", value<int>(&iterations)->default_value(iterations), "Maximum number of k-means iterations")
+            ("seed", value<unsigned>(&seed)->default_value(seed), "Seed for drawing the sample and the initial centroids");
+    }
+
+    positional_options_description positional;
+    positional.add( "input-file", -1 );
+
+    variables_map vm;
+    try
+    {
+        store( command_line_parser(argc, argv).options(options).positional(positional).run(), vm );
+
+        if( vm.count("help") ) {
+            std::cout << "Usage: popsift-pq-train -o codebook.pq features1.psf [features2.psf ...]\n\n"
+                      << options << '\n';
+            exit(1);
+        }
+
+        notify(vm);
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        std::cerr << "Usage:\n\n" << options << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main( int argc, char** argv )
+{
+    parseargs( argc, argv );
+
+    int           dim  = 0;
+    size_t        seen = 0;
+    vector<float> sample;
+    if( not sampleDescriptors( input_files, max_samples, seed, sample, dim, seen ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    const size_t count = sample.size() / ( dim > 0 ? dim : 1 );
+    cerr << "Training on " << count << " of " << seen << " descriptors" << endl;
+
+    popsift::PqCodebook codebook;
+    if( not codebook.train( sample.data(), count, dim * sizeof(float), dim, num_subspaces, iterations, seed ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    /* quantization error on the training sample */
+    vector<uint8_t> code( codebook.getCodeSize() );
+    vector<float>   rec( dim );
+    double err  = 0.0;
+    double norm = 0.0;
+    for( size_t i=0; i<count; i++ ) {
+        const float* x = &sample[i * dim];
+        codebook.encode( x, 1, 0, code.data(), 0 );
+        codebook.decode( code.data(), rec.data() );
+        for( int j=0; j<dim; j++ ) {
+            err  += ( x[j] - rec[j] ) * ( x[j] - rec[j] );
+            norm += x[j] * x[j];
+        }
+    }
+    cerr << "    " << codebook.getCodeSize() << " bytes per code, relative squared error "
+         << fixed << setprecision(4) << ( norm > 0.0 ? err / norm : 0.0 ) << endl;
+
+    if( not codebook.save( output_file ) ) {
+        exit( EXIT_FAILURE );
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include <boost/program_options.hpp>
+
+#include <cuda_runtime.h>
+
+#include <popsift/features_db.h>
+#include <popsift/desc_match.h>
+#include <popsift/vocab_tree.h>
+#include <popsift/bow_index.h>
+
+using namespace std;
+
+static string vocab_file;
+static string db_path;
+static string output_file;
+static int    num_threads = 0;
+
+static void parseargs( int argc, char** argv )
+{
+    using namespace boost::program_options;
+
+    options_description options("Options");
+    {
+        options.add_options()
+            ("help,h", "Print usage")
+            ("vocab,v", value<std::string>(&vocab_file)->required(), "Vocabulary tree written by popsift-vocab-train")
+            ("db,d", value<std::string>(&db_path)->required(), "Feature database written by popsift-demo --write-db")
+            ("output,o", value<std::string>(&output_file)->required(), "BoW index file to write")
+            ("threads", value<int>(&num_threads)->default_value(num_threads), "Threads for quantizing, 0 for all cores");
+    }
+
+    variables_map vm;
+    try
+    {
+        store( parse_command_line(argc, argv, options), vm );
+
+        if( vm.count("help") ) {
+            std::cout << "Usage: popsift-vocab-index -v vocab.psvt -d features.db -o index.psbw\n\n"
+                      << options << '\n';
+            exit(1);
+        }
+
+        notify(vm);
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        std::cerr << "Usage:\n\n" << options << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main( int argc, char** argv )
+{
+    parseargs( argc, argv );
+
+    popsift::VocabTree tree;
+    popsift::FeaturesDb db;
+    if( not tree.load( vocab_file ) || not db.open( db_path ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    popsift::BowIndex index;
+    index.create( tree.getWordCount(), tree.getFingerprint() );
+
+    popsift::FeaturesFile     view;
+    popsift::DescriptorMatrix desc;
+    vector<int>               words;
+    size_t                    skipped = 0;
+    for( size_t id=0; id<db.getImageCount(); id++ ) {
+        if( not db.getFeatures( id, view ) ) {
+            skipped++;
+            continue;
+        }
+        if( view.getDescCodec() != popsift::FF_CodecNone || view.getDescDim() != tree.getDim() ) {
+            cerr << "Image " << db.getImageName( id ) << " has encoded or " << view.getDescDim()
+                 << "-dimensional descriptors, the vocabulary expects " << tree.getDim() << endl;
+            skipped++;
+            continue;
+        }
+
+        desc.assign( view.getDescriptorData(), view.getDescType(), view.getDescriptorCount(),
+                     view.getDescStride(), view.getDescDim() );
+        words.resize( desc.size() );
+        tree.quantize( desc, words.data(), num_threads );
+        index.add( (uint32_t)id, words.data(), words.size() );
+    }
+    cerr << "Indexed " << index.getImageCount() << " images with " << tree.getWordCount() << " words";
+    if( skipped > 0 ) cerr << ", skipped " << skipped;
+    cerr << endl;
+
+    if( not index.save( output_file ) ) {
+        exit( EXIT_FAILURE );
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <set>
+#include <stdlib.h>
+
+#include <boost/program_options.hpp>
+
+#include <cuda_runtime.h>
+
+#include <popsift/features_db.h>
+#include <popsift/desc_match.h>
+#include <popsift/vocab_tree.h>
+#include <popsift/bow_index.h>
+
+using namespace std;
+
+static string         vocab_file;
+static string         index_file;
+static string         db_path;
+static vector<string> query_images;
+static vector<string> query_files;
+static bool           query_all   = false;
+static size_t         top         = 10;
+static float          min_score   = 0.0f;
+static string         pairs_file;
+static int            num_threads = 0;
+
+static void parseargs( int argc, char** argv )
+{
+    using namespace boost::program_options;
+
+    options_description options("Options");
+    {
+        options.add_options()
+            ("help,h", "Print usage")
+            ("vocab,v", value<std::string>(&vocab_file)->required(), "Vocabulary tree written by popsift-vocab-train")
+            ("index,x", value<std::string>(&index_file)->required(), "BoW index written by popsift-vocab-index")
+            ("db,d", value<std::string>(&db_path)->required(), "Feature database of the index")
+            ("image", value<std::vector<std::string>>(&query_images)->multitoken(), "Query with these images of the database")
+            ("all", bool_switch(&query_all)->default_value(false), "Query with every image of the database")
+            ("input-file,i", value<std::vector<std::string>>(&query_files),
+             "Query with binary feature files (.psf) written by popsift-demo --write-binary")
+            ("top,n", value<size_t>(&top)->default_value(top), "Number of similar images per query")
+            ("min-score", value<float>(&min_score)->default_value(min_score), "Ignore images with a lower score, between 0 and 1")
+            ("pairs", value<std::string>(&pairs_file),
+             "Write the image pairs found by the database queries to this file, one pair of image ids per line")
+            ("threads", value<int>(&num_threads)->default_value(num_threads), "Threads for quantizing, 0 for all cores");
+    }
+
+    positional_options_description positional;
+    positional.add( "input-file", -1 );
+
+    variables_map vm;
+    try
+    {
+        store( command_line_parser(argc, argv).options(options).positional(positional).run(), vm );
+
+        if( vm.count("help") ) {
+            std::cout << "Usage: popsift-vocab-query -v vocab.psvt -x index.psbw -d features.db [--all | --image name ... | query.psf ...]\n\n"
+                      << options << '\n';
+            exit(1);
+        }
+
+        notify(vm);
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        std::cerr << "Usage:\n\n" << options << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* The words of the descriptors of a feature file or database block */
+static bool quantize( const popsift::VocabTree& tree, const popsift::FeaturesFile& file,
+                      const string& name, vector<int>& words )
+{
+    if( file.getDescCodec() != popsift::FF_CodecNone || file.getDescDim() != tree.getDim() ) {
+        cerr << "Image " << name << " has encoded or " << file.getDescDim()
+             << "-dimensional descriptors, the vocabulary expects " << tree.getDim() << endl;
+        return false;
+    }
+    popsift::DescriptorMatrix desc;
+    desc.assign( file.getDescriptorData(), file.getDescType(), file.getDescriptorCount(),
+                 file.getDescStride(), file.getDescDim() );
+    words.resize( desc.size() );
+    tree.quantize( desc, words.data(), num_threads );
+    return true;
+}
+
+int main( int argc, char** argv )
+{
+    parseargs( argc, argv );
+
+    popsift::VocabTree tree;
+    popsift::BowIndex  index;
+    popsift::FeaturesDb db;
+    if( not tree.load( vocab_file ) || not index.load( index_file ) || not db.open( db_path ) ) {
+        exit( EXIT_FAILURE );
+    }
+    if( index.getVocabFingerprint() != tree.getFingerprint() ) {
+        cerr << "Index " << index_file << " was not built with vocabulary " << vocab_file << endl;
+        exit( EXIT_FAILURE );
+    }
+
+    vector<size_t> db_queries;
+    if( query_all ) {
+        for( size_t id=0; id<db.getImageCount(); id++ ) db_queries.push_back( id );
+    }
+    for( const string& name : query_images ) {
+        const long long id = db.findImage( name );
+        if( id < 0 ) {
+            cerr << "Image " << name << " is not in feature database " << db_path << endl;
+            exit( EXIT_FAILURE );
+        }
+        db_queries.push_back( (size_t)id );
+    }
+    if( db_queries.empty() && query_files.empty() ) {
+        cerr << "Nothing to query, use --all, --image or feature files" << endl;
+        exit( EXIT_FAILURE );
+    }
+
+    set<pair<size_t,size_t>>      pairs;
+    vector<int>                   words;
+    vector<popsift::ImageScore>   similar;
+    popsift::FeaturesFile         file;
+    cout << fixed << setprecision(4);
+
+    /* a database image finds itself first, so one more is asked for */
+    for( size_t id : db_queries ) {
+        const string name = db.getImageName( id );
+        if( not db.getFeatures( id, file ) || not quantize( tree, file, name, words ) ) continue;
+
+        index.query( words.data(), words.size(), top + 1, similar );
+        size_t found = 0;
+        for( const popsift::ImageScore& s : similar ) {
+            if( s.image == id ) continue;
+            if( found++ == top || s.score < min_score ) break;
+            cout << name << " " << db.getImageName( s.image ) << " " << s.score << endl;
+            pairs.insert( make_pair( std::min( id, (size_t)s.image ), std::max( id, (size_t)s.image ) ) );
+        }
+    }
+
+    for( const string& name : query_files ) {
+        if( not file.open( name ) || not quantize( tree, file, name, words ) ) continue;
+
+        index.query( words.data(), words.size(), top, similar );
+        for( const popsift::ImageScore& s : similar ) {
+            if( s.score < min_score ) break;
+            cout << name << " " << db.getImageName( s.image ) << " " << s.score << endl;
+        }
+    }
+
+    if( not pairs_file.empty() ) {
+        ofstream of( pairs_file.c_str() );
+        if( not of.is_open() ) {
+            cerr << "File " << pairs_file << " could not be opened for writing" << endl;
+            exit( EXIT_FAILURE );
+        }
+        for( const pair<size_t,size_t>& p : pairs ) {
+            of << p.first << " " << p.second << endl;
+        }
+        cerr << "Wrote " << pairs.size() << " image pairs to " << pairs_file << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include <boost/program_options.hpp>
+
+#include <cuda_runtime.h>
+
+#include <popsift/desc_match.h>
+#include <popsift/vocab_tree.h>
+
+#include "feature_sample.h"
+
+using namespace std;
+
+static string         output_file;
+static vector<string> input_files;
+static size_t         max_samples = 200000;
+static int            branching   = 10;
+static int            depth       = 6;
+static int            iterations  = 100;
+static size_t         batch_size  = 10000;
+static int            num_threads = 0;
+static unsigned       seed        = 1;
+
+static void parseargs( int argc, char** argv )
+{
+    using namespace boost::program_options;
+
+    options_description options("Options");
+    {
+        options.add_options()
+            ("help,h", "Print usage")
+            ("output,o", value<std::string>(&output_file)->required(), "Vocabulary tree file to write")
+            ("input-file,i", value<std::vector<std::string>>(&input_files)->required(),
+             "Binary feature files (.psf) written by popsift-demo --write-binary")
+            ("samples", value<size_t>(&max_samples)->default_value(max_samples),
+             "Number of descriptors drawn at random from all input files")
+            ("branching", value<int>(&branching)->default_value(branching), "Children of every node")
+            ("depth", value<int>(&depth)->default_value(depth), "Levels below the root, at most branching^depth words")
+            ("iterations", value<int>(&iterations)->default_value(iterations), "Maximum number of k-means batches per node")
+            ("batch", value<size_t>(&batch_size)->default_value(batch_size), "Descriptors per k-means batch")
+            ("threads", value<int>(&num_threads)->default_value(num_threads), "Threads for training, 0 for all cores")
+            ("seed", value<unsigned>(&seed)->default_value(seed), "Seed for drawing the sample and the initial centroids");
+    }
+
+    positional_options_description positional;
+    positional.add( "input-file", -1 );
+
+    variables_map vm;
+    try
+    {
+        store( command_line_parser(argc, argv).options(options).positional(positional).run(), vm );
+
+        if( vm.count("help") ) {
+            std::cout << "Usage: popsift-vocab-train -o vocab.psvt features1.psf [features2.psf ...]\n\n"
+                      << options << '\n';
+            exit(1);
+        }
+
+        notify(vm);
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl << std::endl;
+        std::cerr << "Usage:\n\n" << options << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main( int argc, char** argv )
+{
+    parseargs( argc, argv );
+
+    int           dim  = 0;
+    size_t        seen = 0;
+    vector<float> sample;
+    if( not sampleDescriptors( input_files, max_samples, seed, sample, dim, seen ) ) {
+        exit( EXIT_FAILURE );
+    }
+
+    const size_t count = sample.size() / ( dim > 0 ? dim : 1 );
+    cerr << "Training on " << count << " of " << seen << " descriptors" << endl;
+
+    popsift::DescriptorMatrix matrix;
+    matrix.assign( sample.data(), popsift::Config::FloatDesc, count, dim * sizeof(float), dim );
+    sample.clear();
+    sample.shrink_to_fit();
+
+    popsift::VocabTree tree;
+    if( not tree.train( matrix, branching, depth, iterations, batch_size, seed, num_threads ) ) {
+        exit( EXIT_FAILURE );
+    }
+    cerr << "    " << tree.getNodeCount() << " nodes, " << tree.getWordCount() << " words" << endl;
+
+    if( not tree.save( output_file ) ) {
+        exit( EXIT_FAILURE );
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <iso646.h>
+
+#include "writer_pool.h"
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+static inline long long elapsed_us( const Clock::time_point& since )
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - since ).count();
+}
+
+WriterPool::WriterPool( int num_threads, int queue_size )
+    : _num_threads( max( num_threads, 1 ) )
+    , _input( max( queue_size, 1 ) )
+    , _closed( false )
+    , _written( 0 )
+    , _write_stall_us( 0 )
+    , _write_us( 0 )
+{
+    for( int i=0; i<_num_threads; i++ ) {
+        _threads.push_back( new boost::thread( &WriterPool::writeLoop, this ) );
+    }
+}
+
+WriterPool::~WriterPool( )
+{
+    close( );
+}
+
+void WriterPool::push( const Task& task )
+{
+    Clock::time_point start = Clock::now();
+    _input.push( new Task( task ) );
+    _write_stall_us += elapsed_us( start );
+}
+
+void WriterPool::close( )
+{
+    if( _closed ) return;
+    _closed = true;
+
+    /* one termination token for every writer thread */
+    for( int i=0; i<_num_threads; i++ ) {
+        _input.push( 0 );
+    }
+    for( auto t : _threads ) {
+        t->join();
+        delete t;
+    }
+    _threads.clear();
+}
+
+void WriterPool::writeLoop( )
+{
+    Task* task;
+    while( ( task = _input.pull() ) != 0 ) {
+        Clock::time_point start = Clock::now();
+        (*task)();
+        delete task;
+        _write_us += elapsed_us( start );
+        _written++;
+    }
+}
+
+double WriterPool::getWriteStallSeconds( ) const
+{
+    return _write_stall_us / 1000000.0;
+}
+
+double WriterPool::getWriteSeconds( ) const
+{
+    return _write_us / 1000000.0;
+}
+
+void WriterPool::printStats( std::ostream& ostr ) const
+{
+    ostr << "Wrote " << _written << " images with " << _num_threads << " writer thread(s)" << endl
+         << "    write stall (extraction waited for writers): "
+         << fixed << setprecision(3) << getWriteStallSeconds() << " s" << endl
+         << "    write time  (summed over writer threads): "
+         << getWriteSeconds() << " s" << endl;
+    ostr.unsetf( ios::floatfield );
+    ostr << setprecision(6);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/sync_bounded_queue.hpp>
+
+/* A pool of writer threads that take the post-processing and writing
+ * of extracted features off the thread that consumes PopSift's results.
+ * A task is pushed for every finished image; it owns the features and
+ * runs to completion on one writer thread. At most queue_size tasks
+ * wait for a writer, push() blocks when that window is full, so that
+ * the memory held by unwritten features stays bounded.
+ *
+ * The pool measures:
+ * - write stall: time the consumer waited in push() for room in the
+ *                queue, i.e. extraction was faster than writing
+ * - write time:  time the writers spent in tasks, summed over threads
+ */
+class WriterPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    WriterPool( int num_threads, int queue_size );
+
+    /** Runs the remaining tasks and joins the threads */
+    ~WriterPool( );
+
+    void push( const Task& task );
+
+    /** Wait until all pushed tasks are done. No task may be pushed
+     *  afterwards. */
+    void close( );
+
+    inline int getThreadCount( ) const { return _num_threads; }
+
+    double getWriteStallSeconds( ) const;
+    double getWriteSeconds( ) const;
+
+    void printStats( std::ostream& ostr ) const;
+
+private:
+    void writeLoop( );
+
+private:
+    const int                         _num_threads;
+    std::vector<boost::thread*>       _threads;
+    boost::sync_bounded_queue<Task*>  _input;
+    bool                              _closed;
+
+    std::atomic<int>                  _written;
+    std::atomic<long long>            _write_stall_us;
+    std::atomic<long long>            _write_us;
+};
@@ -0,0 +1,249 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <iso646.h>
+
+#include "bow_index.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(BowFileHeader) == 64, "BowFileHeader must be 64 bytes" );
+
+/* The distinct valid words of a list and their number of occurrences */
+static void histogram( const int* words, size_t count, int num_words,
+                       vector<std::pair<uint32_t,uint32_t>>& hist )
+{
+    vector<int> sorted( words, words + count );
+    std::sort( sorted.begin(), sorted.end() );
+
+    hist.clear();
+    for( int w : sorted ) {
+        if( w < 0 || w >= num_words ) continue;
+        if( not hist.empty() && hist.back().first == (uint32_t)w ) {
+            hist.back().second++;
+        } else {
+            hist.push_back( std::make_pair( (uint32_t)w, 1u ) );
+        }
+    }
+}
+
+BowIndex::BowIndex( )
+    : _vocab_fingerprint( 0 )
+    , _weighted( false )
+{ }
+
+void BowIndex::create( int num_words, unsigned long long vocab_fingerprint )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    _postings.clear();
+    _postings.resize( num_words > 0 ? num_words : 0 );
+    _images.clear();
+    _vocab_fingerprint = vocab_fingerprint;
+    _weighted          = false;
+}
+
+size_t BowIndex::add( uint32_t image_id, const int* words, size_t count )
+{
+    vector<std::pair<uint32_t,uint32_t>> hist;
+    histogram( words, count, getWordCount(), hist );
+
+    std::lock_guard<std::mutex> lock( _mutex );
+    const size_t n = _images.size();
+    _images.push_back( image_id );
+    for( const std::pair<uint32_t,uint32_t>& h : hist ) {
+        const Posting p = { (uint32_t)n, h.second };
+        _postings[h.first].push_back( p );
+    }
+    _weighted = false;
+    return n;
+}
+
+void BowIndex::prepare( ) const
+{
+    std::lock_guard<std::mutex> lock( _weight_mutex );
+    if( _weighted ) return;
+
+    const double num_images = (double)_images.size();
+    _idf.resize( _postings.size() );
+    _norms.assign( _images.size(), 0.0f );
+    for( size_t w=0; w<_postings.size(); w++ ) {
+        const vector<Posting>& list = _postings[w];
+        _idf[w] = list.empty() ? 0.0f : (float)std::log( num_images / list.size() );
+        for( const Posting& p : list ) {
+            _norms[p.image] += p.count * _idf[w];
+        }
+    }
+    _weighted = true;
+}
+
+void BowIndex::makeVector( const int* words, size_t count, BowVector& bow ) const
+{
+    prepare( );
+
+    vector<std::pair<uint32_t,uint32_t>> hist;
+    histogram( words, count, getWordCount(), hist );
+
+    bow.clear();
+    float sum = 0.0f;
+    for( const std::pair<uint32_t,uint32_t>& h : hist ) {
+        const float weight = h.second * _idf[h.first];
+        if( weight <= 0.0f ) continue;
+        bow.push_back( std::make_pair( h.first, weight ) );
+        sum += weight;
+    }
+    for( std::pair<uint32_t,float>& b : bow ) b.second /= sum;
+}
+
+void BowIndex::query( const int* words, size_t count, size_t max_images,
+                      vector<ImageScore>& images ) const
+{
+    images.clear();
+
+    BowVector bow;
+    makeVector( words, count, bow );
+    if( bow.empty() ) return;
+
+    /* 1 - |q - d|_1 / 2 is the sum of min( q_w, d_w ) over the words
+     * of both vectors */
+    vector<float>    score( _images.size(), 0.0f );
+    vector<uint32_t> touched;
+    for( const std::pair<uint32_t,float>& b : bow ) {
+        const float idf = _idf[b.first];
+        for( const Posting& p : _postings[b.first] ) {
+            const float d = p.count * idf / _norms[p.image];
+            if( score[p.image] == 0.0f ) touched.push_back( p.image );
+            score[p.image] += std::min( b.second, d );
+        }
+    }
+
+    for( uint32_t n : touched ) {
+        ImageScore s = { _images[n], score[n] };
+        images.push_back( s );
+    }
+    const size_t n = std::min( max_images, images.size() );
+    std::partial_sort( images.begin(), images.begin() + n, images.end(),
+                       []( const ImageScore& a, const ImageScore& b ) {
+                           return a.score > b.score || ( a.score == b.score && a.image < b.image );
+                       } );
+    images.resize( n );
+}
+
+bool BowIndex::save( const std::string& filename ) const
+{
+    vector<uint64_t> offset( _postings.size() + 1, 0 );
+    for( size_t w=0; w<_postings.size(); w++ ) {
+        offset[w+1] = offset[w] + _postings[w].size();
+    }
+
+    BowFileHeader hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_BOW_FILE_MAGIC, sizeof(hdr.magic) );
+    hdr.version           = POPSIFT_BOW_FILE_VERSION;
+    hdr.header_size       = sizeof(BowFileHeader);
+    hdr.byte_order_mark   = 0x01020304;
+    hdr.num_words         = (uint32_t)_postings.size();
+    hdr.num_images        = _images.size();
+    hdr.num_postings      = offset.back();
+    hdr.vocab_fingerprint = _vocab_fingerprint;
+
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+    of.write( (const char*)&hdr, sizeof(hdr) );
+    of.write( (const char*)_images.data(), _images.size() * sizeof(uint32_t) );
+    of.write( (const char*)offset.data(), offset.size() * sizeof(uint64_t) );
+    for( const vector<Posting>& list : _postings ) {
+        of.write( (const char*)list.data(), list.size() * sizeof(Posting) );
+    }
+    if( not of.good() ) {
+        cerr << "Failed to write BoW index to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool BowIndex::load( const std::string& filename )
+{
+    ifstream file( filename.c_str(), ios::binary );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return false;
+    }
+
+    BowFileHeader hdr;
+    if( not file.read( (char*)&hdr, sizeof(hdr) ) ||
+        memcmp( hdr.magic, POPSIFT_BOW_FILE_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << filename << " is not a PopSift BoW index file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << filename << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_BOW_FILE_VERSION ) {
+        cerr << "File " << filename << " has BoW index version " << hdr.version
+             << ", this reader supports version " << POPSIFT_BOW_FILE_VERSION << endl;
+        return false;
+    }
+    if( hdr.header_size < sizeof(BowFileHeader) || hdr.num_words == 0 || hdr.num_images > 0xffffffffULL ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+
+    vector<uint32_t> images( hdr.num_images );
+    vector<uint64_t> offset( (size_t)hdr.num_words + 1 );
+    file.seekg( hdr.header_size, ios::beg );
+    file.read( (char*)images.data(), images.size() * sizeof(uint32_t) );
+    file.read( (char*)offset.data(), offset.size() * sizeof(uint64_t) );
+    if( not file.good() ) {
+        cerr << "File " << filename << " is truncated" << endl;
+        return false;
+    }
+    if( offset[0] != 0 || offset.back() != hdr.num_postings ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+
+    vector<vector<Posting>> postings( hdr.num_words );
+    for( uint32_t w=0; w<hdr.num_words; w++ ) {
+        if( offset[w+1] < offset[w] ) {
+            cerr << "File " << filename << " has an invalid posting list " << w << endl;
+            return false;
+        }
+        vector<Posting>& list = postings[w];
+        list.resize( offset[w+1] - offset[w] );
+        file.read( (char*)list.data(), list.size() * sizeof(Posting) );
+        if( not file.good() ) {
+            cerr << "File " << filename << " is truncated" << endl;
+            return false;
+        }
+        for( const Posting& p : list ) {
+            if( p.image >= hdr.num_images || p.count == 0 ) {
+                cerr << "File " << filename << " has an invalid posting list " << w << endl;
+                return false;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock( _mutex );
+    _postings.swap( postings );
+    _images.swap( images );
+    _vocab_fingerprint = hdr.vocab_fingerprint;
+    _weighted          = false;
+    return true;
+}
+
+} // namespace popsift
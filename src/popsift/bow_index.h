@@ -0,0 +1,115 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "desc_ivf.h"
+
+namespace popsift {
+
+#define POPSIFT_BOW_FILE_MAGIC   "PSBW\r\n\0"
+#define POPSIFT_BOW_FILE_VERSION 1
+
+/* Header of a BoW index file (host byte order, checked with
+ * byte_order_mark). It is followed by the ids of the num_images images,
+ * num_words + 1 uint64 offsets of the posting lists of the words, and
+ * num_postings postings: the number of an image and how often the word
+ * occurs in it.
+ */
+struct BowFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark;   // 0x01020304
+    uint32_t num_words;
+    uint64_t num_images;
+    uint64_t num_postings;
+    uint64_t vocab_fingerprint; // VocabTree::getFingerprint
+    uint8_t  reserved[16];
+};
+
+/* A bag-of-visual-words vector: words in increasing order with their
+ * weights */
+typedef std::vector<std::pair<uint32_t,float>> BowVector;
+
+/* An inverted index of images by the visual words of their descriptors,
+ * see VocabTree. Every word has a posting list of the images in which it
+ * occurs, with the number of occurrences.
+ *
+ * Images are compared as TF-IDF weighted BoW vectors: the weight of a
+ * word is its number of occurrences times log( images / images with the
+ * word ), and the vectors are normalized to an L1 norm of 1. The score
+ * of two images is 1 - |q - d|_1 / 2, which is 1 for equal vectors and
+ * 0 for vectors without a common word, and depends only on the words
+ * that occur in both images, so a query only visits the posting lists
+ * of its own words.
+ *
+ * The weights change with every added image; they are computed when the
+ * index is first queried after an add.
+ */
+class BowIndex
+{
+public:
+    BowIndex( );
+
+    /** An empty index for a vocabulary of num_words words */
+    void create( int num_words, unsigned long long vocab_fingerprint = 0 );
+
+    inline bool   isValid( ) const       { return not _postings.empty(); }
+    inline int    getWordCount( ) const  { return (int)_postings.size(); }
+    inline size_t getImageCount( ) const { return _images.size(); }
+    inline uint32_t getImage( size_t n ) const { return _images[n]; }
+    inline unsigned long long getVocabFingerprint( ) const { return _vocab_fingerprint; }
+
+    /** Add an image with the words of its descriptors, from
+     *  VocabTree::quantize. May be called from several threads, but not
+     *  while querying. Returns the number of the image in the index. */
+    size_t add( uint32_t image_id, const int* words, size_t count );
+
+    /** The normalized TF-IDF vector of a list of words, with the
+     *  weights of the images added so far */
+    void makeVector( const int* words, size_t count, BowVector& bow ) const;
+
+    /** The images with the highest scores for a list of words, best
+     *  first, at most max_images. ImageScore::image is the id given to
+     *  add(). Images without a common word are not returned. */
+    void query( const int* words, size_t count, size_t max_images,
+                std::vector<ImageScore>& images ) const;
+
+    /** Returns false and explains why on cerr */
+    bool save( const std::string& filename ) const;
+    bool load( const std::string& filename );
+
+private:
+    struct Posting
+    {
+        uint32_t image; // number in the index
+        uint32_t count;
+    };
+
+    void prepare( ) const;
+
+    std::vector<std::vector<Posting>> _postings; // per word
+    std::vector<uint32_t>             _images;   // image ids
+    unsigned long long                _vocab_fingerprint;
+    std::mutex                        _mutex;    // guards add
+
+    mutable std::mutex         _weight_mutex;
+    mutable bool               _weighted;
+    mutable std::vector<float> _idf;             // per word
+    mutable std::vector<float> _norms;           // L1 norm of the weighted words of every image
+};
+
+} // namespace popsift
@@ -0,0 +1,326 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "collection_match.h"
+#include "desc_match.h"
+#include "features_db.h"
+#include "match_db.h"
+#include "match_list.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* The descriptors of a cached image. rev points into the mapped
+ * feature database. */
+struct CollectionMatcher::Image
+{
+    DescriptorMatrix desc;
+    const int*       rev;
+    uint64_t         last_use;
+};
+
+/* The pairs of one tile and the images that must be loaded for them */
+struct CollectionMatcher::Tile
+{
+    vector<ImagePair>   pairs;
+    vector<uint32_t>    missing;
+    std::atomic<size_t> next;
+    MatchDbWriter*      output;
+    float               ratio;
+    bool                mutual;
+    bool                keep_rejected;
+    int                 threads_per_pair;
+    std::atomic<size_t> stored;
+};
+
+void makeAllPairs( size_t num_images, std::vector<ImagePair>& pairs )
+{
+    pairs.clear();
+    for( size_t i=0; i<num_images; i++ ) {
+        for( size_t j=i+1; j<num_images; j++ ) {
+            const ImagePair p = { (uint32_t)i, (uint32_t)j };
+            pairs.push_back( p );
+        }
+    }
+}
+
+void makeWindowPairs( size_t num_images, size_t window, std::vector<ImagePair>& pairs )
+{
+    pairs.clear();
+    for( size_t i=0; i<num_images; i++ ) {
+        for( size_t j=i+1; j<num_images && j<=i+window; j++ ) {
+            const ImagePair p = { (uint32_t)i, (uint32_t)j };
+            pairs.push_back( p );
+        }
+    }
+}
+
+static inline bool pair_less( const ImagePair& a, const ImagePair& b )
+{
+    return a.query < b.query || ( a.query == b.query && a.train < b.train );
+}
+
+bool readPairList( const std::string& filename, std::vector<ImagePair>& pairs )
+{
+    pairs.clear();
+
+    ifstream file( filename.c_str() );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return false;
+    }
+
+    string line;
+    size_t line_number = 0;
+    while( std::getline( file, line ) ) {
+        line_number++;
+        const size_t first = line.find_first_not_of( " \t\r" );
+        if( first == string::npos || line[first] == '#' ) continue;
+
+        istringstream values( line );
+        long long a = -1;
+        long long b = -1;
+        if( not ( values >> a >> b ) || a < 0 || b < 0 || a > 0xffffffffLL || b > 0xffffffffLL ) {
+            cerr << "File " << filename << " line " << line_number << " is not a pair of image ids" << endl;
+            return false;
+        }
+        if( a == b ) continue;
+
+        const ImagePair p = { (uint32_t)std::min( a, b ), (uint32_t)std::max( a, b ) };
+        pairs.push_back( p );
+    }
+
+    std::sort( pairs.begin(), pairs.end(), pair_less );
+    pairs.erase( std::unique( pairs.begin(), pairs.end(),
+                              []( const ImagePair& a, const ImagePair& b ) {
+                                  return a.query == b.query && a.train == b.train;
+                              } ),
+                 pairs.end() );
+    return true;
+}
+
+/* Row and column of the tile of a pair; the pair matrix is symmetric,
+ * only the tiles on and above the diagonal are used */
+static inline void tile_of( const ImagePair& p, size_t block_size, size_t& row, size_t& col )
+{
+    row = std::min( p.query, p.train ) / block_size;
+    col = std::max( p.query, p.train ) / block_size;
+}
+
+void schedulePairs( std::vector<ImagePair>& pairs, size_t block_size )
+{
+    if( block_size == 0 ) block_size = 1;
+
+    std::sort( pairs.begin(), pairs.end(), [block_size]( const ImagePair& a, const ImagePair& b ) {
+        size_t ar, ac, br, bc;
+        tile_of( a, block_size, ar, ac );
+        tile_of( b, block_size, br, bc );
+        if( ar != br ) return ar < br;
+        if( ac != bc ) return ( ar % 2 == 0 ) ? ac < bc : ac > bc;
+        return pair_less( a, b );
+    } );
+}
+
+CollectionMatcher::CollectionMatcher( const FeaturesDb& db, size_t block_size, int num_threads )
+    : _db( db )
+    , _block_size( block_size > 0 ? block_size : 1 )
+    , _num_threads( num_threads )
+    , _cache( db.getImageCount(), 0 )
+    , _failed( db.getImageCount(), 0 )
+    , _clock( 0 )
+    , _loads( 0 )
+{
+    if( _num_threads <= 0 ) {
+        _num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+}
+
+CollectionMatcher::~CollectionMatcher( )
+{
+    for( Image* image : _cache ) delete image;
+}
+
+void CollectionMatcher::loadImages( Tile* tile )
+{
+    FeaturesFile view;
+    for( size_t i=tile->next++; i<tile->missing.size(); i=tile->next++ ) {
+        const uint32_t id = tile->missing[i];
+        if( not _db.getFeatures( id, view ) ) {
+            _failed[id] = 1;
+            continue;
+        }
+        if( view.getDescCodec() != FF_CodecNone ) {
+            cerr << "Image " << _db.getImageName( id ) << " has encoded descriptors and is not matched" << endl;
+            _failed[id] = 1;
+            continue;
+        }
+
+        Image* image = new Image;
+        image->desc.assign( view.getDescriptorData(), view.getDescType(), view.getDescriptorCount(),
+                            view.getDescStride(), view.getDescDim() );
+        image->rev      = view.getFeatureIndex();
+        image->last_use = _clock;
+        _cache[id] = image;
+        _loads++;
+    }
+}
+
+void CollectionMatcher::matchPairs( Tile* tile )
+{
+    MatchList matches;
+    for( size_t i=tile->next++; i<tile->pairs.size(); i=tile->next++ ) {
+        const ImagePair& p     = tile->pairs[i];
+        const Image*     query = _cache[p.query];
+        const Image*     train = _cache[p.train];
+        if( query == 0 || train == 0 ) continue;
+        if( query->desc.getDim() != train->desc.getDim() ) {
+            cerr << "Images " << _db.getImageName( p.query ) << " and " << _db.getImageName( p.train )
+                 << " have descriptors of different dimension" << endl;
+            continue;
+        }
+
+        matchDescriptors( query->desc, train->desc, query->rev, train->rev, matches,
+                          tile->ratio, tile->mutual, tile->threads_per_pair );
+        if( not tile->keep_rejected ) {
+            matches.removeRejected( );
+        }
+        if( tile->output->append( p.query, p.train, matches ) ) {
+            tile->stored++;
+        }
+    }
+}
+
+void CollectionMatcher::makeRoom( size_t count, uint64_t keep_since )
+{
+    /* two blocks, the least recently used images go first */
+    const size_t capacity = 2 * _block_size;
+    while( not _loaded.empty() && _loaded.size() + count > capacity ) {
+        size_t oldest = _loaded.size();
+        for( size_t i=0; i<_loaded.size(); i++ ) {
+            const uint64_t use = _cache[_loaded[i]]->last_use;
+            if( use < keep_since && ( oldest == _loaded.size() || use < _cache[_loaded[oldest]]->last_use ) ) {
+                oldest = i;
+            }
+        }
+        if( oldest == _loaded.size() ) break;
+
+        delete _cache[_loaded[oldest]];
+        _cache[_loaded[oldest]] = 0;
+        _loaded[oldest] = _loaded.back();
+        _loaded.pop_back();
+    }
+}
+
+size_t CollectionMatcher::run( const std::vector<ImagePair>& pairs,
+                               MatchDbWriter&                output,
+                               float                         ratio,
+                               bool                          mutual,
+                               bool                          keep_rejected,
+                               std::ostream*                 progress )
+{
+    const size_t num_images = _db.getImageCount();
+
+    vector<ImagePair> todo;
+    for( const ImagePair& p : pairs ) {
+        if( p.query >= num_images || p.train >= num_images ) {
+            cerr << "Pair " << p.query << " " << p.train << " is not in the feature database with "
+                 << num_images << " images" << endl;
+            continue;
+        }
+        if( p.query == p.train || output.contains( p.query, p.train ) ) continue;
+        todo.push_back( p );
+    }
+    schedulePairs( todo, _block_size );
+
+    size_t stored   = 0;
+    size_t reported = 0;
+    size_t end;
+    for( size_t begin=0; begin<todo.size(); begin=end ) {
+        size_t row, col, r, c;
+        tile_of( todo[begin], _block_size, row, col );
+        for( end=begin+1; end<todo.size(); end++ ) {
+            tile_of( todo[end], _block_size, r, c );
+            if( r != row || c != col ) break;
+        }
+
+        Tile tile;
+        tile.pairs.assign( todo.begin() + begin, todo.begin() + end );
+        tile.output        = &output;
+        tile.ratio         = ratio;
+        tile.mutual        = mutual;
+        tile.keep_rejected = keep_rejected;
+        tile.stored        = 0;
+        _clock++;
+
+        /* the images of the tile that are not cached yet */
+        vector<uint32_t> ids;
+        for( const ImagePair& p : tile.pairs ) {
+            ids.push_back( p.query );
+            ids.push_back( p.train );
+        }
+        std::sort( ids.begin(), ids.end() );
+        ids.erase( std::unique( ids.begin(), ids.end() ), ids.end() );
+        for( uint32_t id : ids ) {
+            if( _cache[id] ) {
+                _cache[id]->last_use = _clock;
+            } else if( not _failed[id] ) {
+                tile.missing.push_back( id );
+            }
+        }
+        makeRoom( tile.missing.size(), _clock );
+
+        vector<boost::thread*> threads;
+        const int load_threads = (int)std::min( (size_t)_num_threads, tile.missing.size() );
+        tile.next = 0;
+        for( int t=1; t<load_threads; t++ ) {
+            threads.push_back( new boost::thread( &CollectionMatcher::loadImages, this, &tile ) );
+        }
+        loadImages( &tile );
+        for( boost::thread* th : threads ) {
+            th->join();
+            delete th;
+        }
+        threads.clear();
+        for( uint32_t id : tile.missing ) {
+            if( _cache[id] ) _loaded.push_back( id );
+        }
+
+        /* one pair per thread, several threads per pair for small tiles */
+        const int match_threads = (int)std::min( (size_t)_num_threads, tile.pairs.size() );
+        tile.threads_per_pair = std::max( 1, _num_threads / match_threads );
+        tile.next = 0;
+        for( int t=1; t<match_threads; t++ ) {
+            threads.push_back( new boost::thread( &CollectionMatcher::matchPairs, this, &tile ) );
+        }
+        matchPairs( &tile );
+        for( boost::thread* th : threads ) {
+            th->join();
+            delete th;
+        }
+        stored += tile.stored;
+
+        if( progress && ( end * 100 / todo.size() > reported || end == todo.size() ) ) {
+            reported = end * 100 / todo.size();
+            *progress << "Matched " << end << " of " << todo.size() << " pairs, "
+                      << _loads << " images loaded" << endl;
+        }
+    }
+    return stored;
+}
+
+} // namespace popsift
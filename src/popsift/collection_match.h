@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace popsift {
+
+class FeaturesDb;
+class MatchDbWriter;
+
+/* Two images of a feature database, by id. The descriptors of query are
+ * matched against those of train. */
+struct ImagePair
+{
+    uint32_t query;
+    uint32_t train;
+};
+
+/* All pairs i < j of num_images images */
+void makeAllPairs( size_t num_images, std::vector<ImagePair>& pairs );
+
+/* The pairs of every image i with the images i+1 .. i+window, for
+ * images that were taken in sequence, like the frames of a video */
+void makeWindowPairs( size_t num_images, size_t window, std::vector<ImagePair>& pairs );
+
+/* Read a pair list, one pair of image ids per line as written by
+ * popsift-vocab-query --pairs. Further values on a line are ignored,
+ * as are empty lines and lines that start with #. Every pair is stored
+ * with the smaller id first, once. Returns false and explains why on
+ * cerr if the file cannot be read. */
+bool readPairList( const std::string& filename, std::vector<ImagePair>& pairs );
+
+/* Sort pairs into the order in which CollectionMatcher visits them:
+ * the images are cut into blocks of block_size consecutive ids, which
+ * cuts the pair matrix into tiles of block_size x block_size pairs. The
+ * tiles of a row of the matrix are visited one after the other, every
+ * other row backwards, so that consecutive tiles share a block. */
+void schedulePairs( std::vector<ImagePair>& pairs, size_t block_size );
+
+/* Matches many image pairs of a feature database and appends the
+ * results to a match database.
+ *
+ * The pairs are visited in the order of schedulePairs. Descriptors are
+ * converted to DescriptorMatrix once per visit to a block and kept in a
+ * cache for two blocks, so that an image is loaded once for the tiles
+ * of a row of the pair matrix instead of once per pair; all pairs of n
+ * images load every image about n / ( 2 * block_size ) times. The
+ * images of a tile are loaded and its pairs are matched by num_threads
+ * threads, one pair per thread, or several threads per pair if a tile
+ * has fewer pairs than threads.
+ *
+ * Pairs that the match database already holds are skipped, so a run
+ * that was interrupted continues where it stopped when it is started
+ * again with the same pairs.
+ */
+class CollectionMatcher
+{
+public:
+    CollectionMatcher( const FeaturesDb& db, size_t block_size = 64, int num_threads = 0 );
+    ~CollectionMatcher( );
+
+    /** Match pairs that output does not hold yet, with the ratio test,
+     *  and with matchFeaturesMutual if mutual is true. Unless
+     *  keep_rejected is true, only the accepted matches are stored. With
+     *  progress, a line is written there about every percent. Returns
+     *  the number of pairs that were matched and stored. */
+    size_t run( const std::vector<ImagePair>& pairs,
+                MatchDbWriter&                output,
+                float                         ratio         = 0.8f,
+                bool                          mutual        = false,
+                bool                          keep_rejected = false,
+                std::ostream*                 progress      = 0 );
+
+    /** Images converted to DescriptorMatrix in all runs so far */
+    inline size_t getLoadCount( ) const { return _loads; }
+
+private:
+    struct Image;
+    struct Tile;
+
+    void loadImages( Tile* tile );
+    void matchPairs( Tile* tile );
+    void makeRoom( size_t count, uint64_t keep_since );
+
+    const FeaturesDb&     _db;
+    size_t                _block_size;
+    int                   _num_threads;
+    std::vector<Image*>   _cache;  // per image id, 0 if not loaded
+    std::vector<char>     _failed; // per image id, could not be loaded
+    std::vector<uint32_t> _loaded; // ids of the cached images
+    uint64_t              _clock;  // tiles visited, for the LRU order
+    std::atomic<size_t>   _loads;
+};
+
+} // namespace popsift
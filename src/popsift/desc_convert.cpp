@@ -0,0 +1,238 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <string.h>
+#include <math.h>
+#include <iso646.h>
+
+#include "desc_convert.h"
+
+/* F16C converts 8 values per instruction. It is compiled in with a
+ * target attribute and chosen at runtime, so the library still runs
+ * on CPUs without it.
+ */
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define POPSIFT_F16C_PATH 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace popsift {
+
+uint16_t float_to_half( float f )
+{
+    uint32_t x;
+    memcpy( &x, &f, sizeof(x) );
+
+    const uint16_t sign = ( x >> 16 ) & 0x8000;
+    const uint32_t absx = x & 0x7fffffff;
+
+    if( absx >= 0x7f800000 ) {
+        /* Inf stays Inf, NaN stays quiet NaN */
+        return sign | 0x7c00 | ( absx > 0x7f800000 ? 0x200 : 0 );
+    }
+    if( absx >= 0x477ff000 ) {
+        /* rounds to a value beyond 65504 */
+        return sign | 0x7c00;
+    }
+    if( absx < 0x38800000 ) {
+        /* below 2^-14: subnormal half or zero */
+        if( absx < 0x33000000 ) return sign;
+        const uint32_t mant  = ( absx & 0x7fffff ) | 0x800000;
+        const int      shift = 126 - ( absx >> 23 );
+        uint32_t       h     = mant >> shift;
+        const uint32_t rem   = mant & ( ( 1u << shift ) - 1 );
+        const uint32_t half  = 1u << ( shift - 1 );
+        if( rem > half || ( rem == half && ( h & 1 ) ) ) h++;
+        return sign | (uint16_t)h;
+    }
+
+    uint32_t       h   = ( absx - 0x38000000 ) >> 13;
+    const uint32_t rem = absx & 0x1fff;
+    if( rem > 0x1000 || ( rem == 0x1000 && ( h & 1 ) ) ) h++;
+    return sign | (uint16_t)h;
+}
+
+float half_to_float( uint16_t h )
+{
+    const uint32_t sign = (uint32_t)( h & 0x8000 ) << 16;
+    const uint32_t exp  = ( h >> 10 ) & 0x1f;
+    uint32_t       mant = h & 0x3ff;
+    uint32_t       x;
+
+    if( exp == 0x1f ) {
+        x = sign | 0x7f800000 | ( mant << 13 );
+    } else if( exp != 0 ) {
+        x = sign | ( ( exp + 112 ) << 23 ) | ( mant << 13 );
+    } else if( mant == 0 ) {
+        x = sign;
+    } else {
+        /* subnormal half, normal float */
+        uint32_t e = 113;
+        while( not ( mant & 0x400 ) ) {
+            mant <<= 1;
+            e--;
+        }
+        x = sign | ( e << 23 ) | ( ( mant & 0x3ff ) << 13 );
+    }
+
+    float f;
+    memcpy( &f, &x, sizeof(f) );
+    return f;
+}
+
+uint8_t float_to_uint8( float f )
+{
+    const float r = roundf( f );
+    if( not ( r > 0.0f ) ) return 0; // also NaN
+    if( r >= 255.0f ) return 255;
+    return (uint8_t)r;
+}
+
+#ifdef POPSIFT_F16C_PATH
+static bool detect_f16c( )
+{
+    unsigned int a, b, c, d;
+    if( not __get_cpuid( 1, &a, &b, &c, &d ) ) return false;
+
+    const unsigned int need = bit_OSXSAVE | bit_AVX | bit_F16C;
+    if( ( c & need ) != need ) return false;
+
+    /* the OS must save the YMM registers */
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__( "xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0) );
+    return ( xcr0_lo & 6 ) == 6;
+}
+
+static bool have_f16c( )
+{
+    static const bool f16c = detect_f16c( );
+    return f16c;
+}
+
+__attribute__((target("avx,f16c")))
+static void float_to_half_f16c( const float* src, size_t count, uint16_t* dst )
+{
+    size_t i = 0;
+    for( ; i+8<=count; i+=8 ) {
+        const __m256  v = _mm256_loadu_ps( src + i );
+        const __m128i h = _mm256_cvtps_ph( v, _MM_FROUND_TO_NEAREST_INT );
+        _mm_storeu_si128( (__m128i*)( dst + i ), h );
+    }
+    for( ; i<count; i++ ) dst[i] = float_to_half( src[i] );
+}
+
+__attribute__((target("avx,f16c")))
+static void half_to_float_f16c( const uint16_t* src, size_t count, float* dst )
+{
+    size_t i = 0;
+    for( ; i+8<=count; i+=8 ) {
+        const __m128i h = _mm_loadu_si128( (const __m128i*)( src + i ) );
+        _mm256_storeu_ps( dst + i, _mm256_cvtph_ps( h ) );
+    }
+    for( ; i<count; i++ ) dst[i] = half_to_float( src[i] );
+}
+#endif
+
+size_t descTypeSize( Config::DescType type )
+{
+    switch( type )
+    {
+    case Config::HalfDesc :  return sizeof(uint16_t);
+    case Config::UInt8Desc : return sizeof(uint8_t);
+    default :                return sizeof(float);
+    }
+}
+
+const char* descTypeName( Config::DescType type )
+{
+    switch( type )
+    {
+    case Config::HalfDesc :  return "half";
+    case Config::UInt8Desc : return "uint8";
+    default :                return "float";
+    }
+}
+
+void convertFromFloat( const float* src, size_t count, Config::DescType type, void* dst )
+{
+    switch( type )
+    {
+    case Config::HalfDesc :
+        {
+            uint16_t* d = (uint16_t*)dst;
+#ifdef POPSIFT_F16C_PATH
+            if( have_f16c() ) {
+                float_to_half_f16c( src, count, d );
+                break;
+            }
+#endif
+            for( size_t i=0; i<count; i++ ) d[i] = float_to_half( src[i] );
+        }
+        break;
+    case Config::UInt8Desc :
+        {
+            uint8_t* d = (uint8_t*)dst;
+            for( size_t i=0; i<count; i++ ) d[i] = float_to_uint8( src[i] );
+        }
+        break;
+    default :
+        memcpy( dst, src, count * sizeof(float) );
+        break;
+    }
+}
+
+void convertToFloat( const void* src, size_t count, Config::DescType type, float* dst )
+{
+    switch( type )
+    {
+    case Config::HalfDesc :
+        {
+            const uint16_t* s = (const uint16_t*)src;
+#ifdef POPSIFT_F16C_PATH
+            if( have_f16c() ) {
+                half_to_float_f16c( s, count, dst );
+                break;
+            }
+#endif
+            for( size_t i=0; i<count; i++ ) dst[i] = half_to_float( s[i] );
+        }
+        break;
+    case Config::UInt8Desc :
+        {
+            const uint8_t* s = (const uint8_t*)src;
+            for( size_t i=0; i<count; i++ ) dst[i] = float( s[i] );
+        }
+        break;
+    default :
+        memcpy( dst, src, count * sizeof(float) );
+        break;
+    }
+}
+
+void convertDescriptor( const void* src, Config::DescType src_type,
+                        void*       dst, Config::DescType dst_type,
+                        size_t      count )
+{
+    if( src_type == dst_type ) {
+        memcpy( dst, src, count * descTypeSize( src_type ) );
+    } else if( src_type == Config::FloatDesc ) {
+        convertFromFloat( (const float*)src, count, dst_type, dst );
+    } else if( dst_type == Config::FloatDesc ) {
+        convertToFloat( src, count, src_type, (float*)dst );
+    } else {
+        float tmp[256];
+        for( size_t i=0; i<count; i+=256 ) {
+            const size_t n = ( count - i < 256 ) ? count - i : 256;
+            convertToFloat( (const char*)src + i * descTypeSize( src_type ), n, src_type, tmp );
+            convertFromFloat( tmp, n, dst_type, (char*)dst + i * descTypeSize( dst_type ) );
+        }
+    }
+}
+
+} // namespace popsift
+
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sift_conf.h"
+
+namespace popsift {
+
+/* Host-side conversion of descriptor values between float and the
+ * compact storage types of Config::DescType.
+ *
+ * Half conversion rounds to nearest even, like the GPU's __float2half_rn.
+ * The array functions use F16C on x86 CPUs that have it; the results
+ * are identical to the scalar functions except for NaN payloads.
+ * UInt8 conversion rounds and saturates to 0..255; the descriptor must
+ * have been scaled to a sensible range before, see setNormalizationMultiplier.
+ */
+uint16_t float_to_half( float f );
+float    half_to_float( uint16_t h );
+uint8_t  float_to_uint8( float f );
+
+/* Bytes per descriptor value */
+size_t   descTypeSize( Config::DescType type );
+
+/* Name used in usage strings and file dumps: float, half, uint8 */
+const char* descTypeName( Config::DescType type );
+
+/* Convert count values from float to type, dst has room for
+ * count * descTypeSize(type) bytes */
+void convertFromFloat( const float* src, size_t count, Config::DescType type, void* dst );
+
+/* Convert count values of type to float */
+void convertToFloat( const void* src, size_t count, Config::DescType type, float* dst );
+
+/* Convert count values between any two types, copies if they are equal */
+void convertDescriptor( const void* src, Config::DescType src_type,
+                        void*       dst, Config::DescType dst_type,
+                        size_t      count );
+
+} // namespace popsift
+
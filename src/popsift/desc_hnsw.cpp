@@ -0,0 +1,849 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <string.h>
+#include <math.h>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "desc_hnsw.h"
+#include "desc_match.h"
+#include "desc_convert.h"
+#include "features.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(HnswFileHeader) == 128, "HnswFileHeader must be 128 bytes" );
+
+/* Link lists are guarded by HNSW_LOCKS locks, node n by lock n % HNSW_LOCKS */
+#define HNSW_LOCKS 65536
+
+/* Levels above this are not drawn */
+#define HNSW_MAX_LEVEL 16
+
+/* Node records and the sections of the file start at multiples of
+ * HNSW_ALIGN bytes */
+#define HNSW_ALIGN 64
+
+/* Threads of a batch search get at least this many queries */
+#define HNSW_MIN_QUERIES_PER_THREAD 64
+
+/* The start of a node record. The link list of level 0, a count and 2M
+ * node numbers, follows; the descriptor starts at the next multiple of
+ * 16 bytes. upper is only set in files, in uint32 values from the
+ * start of the upper link lists. */
+struct HnswNode
+{
+    uint64_t label;
+    uint64_t upper;
+    uint32_t level;
+    uint32_t count;
+};
+
+static inline size_t align_up( size_t v, size_t a )
+{
+    return ( v + a - 1 ) / a * a;
+}
+
+static inline float l2_float( const void* a_, const void* b_, int dim )
+{
+    const float* __restrict__ a = (const float*)a_;
+    const float* __restrict__ b = (const float*)b_;
+    float acc[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    int k = 0;
+    for( ; k+8<=dim; k+=8 ) {
+        for( int j=0; j<8; j++ ) {
+            const float e = a[k+j] - b[k+j];
+            acc[j] += e * e;
+        }
+    }
+    for( ; k<dim; k++ ) {
+        const float e = a[k] - b[k];
+        acc[0] += e * e;
+    }
+    return ( ( acc[0] + acc[1] ) + ( acc[2] + acc[3] ) ) + ( ( acc[4] + acc[5] ) + ( acc[6] + acc[7] ) );
+}
+
+/* Integer arithmetic is exact, so the compiler may vectorize the sum */
+static inline float l2_uint8( const void* a_, const void* b_, int dim )
+{
+    const uint8_t* __restrict__ a = (const uint8_t*)a_;
+    const uint8_t* __restrict__ b = (const uint8_t*)b_;
+    int32_t sum = 0;
+    for( int k=0; k<dim; k++ ) {
+        const int32_t e = (int32_t)a[k] - (int32_t)b[k];
+        sum += e * e;
+    }
+    return (float)sum;
+}
+
+static inline uint64_t splitmix64( uint64_t x )
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+    return x ^ ( x >> 31 );
+}
+
+/* The nodes that one search has seen, marked with the number of the
+ * search so that the marks need not be cleared, and the search's
+ * buffers. Searches take one from a pool. */
+class HnswIndex::Visited
+{
+public:
+    explicit Visited( size_t n )
+        : _mark( n, 0 )
+        , _current( 0 )
+    { }
+
+    inline size_t size( ) const { return _mark.size(); }
+
+    inline void next( ) {
+        if( ++_current == 0 ) {
+            std::fill( _mark.begin(), _mark.end(), 0 );
+            _current = 1;
+        }
+    }
+
+    /* true if node was seen before */
+    inline bool testAndSet( uint32_t node ) {
+        if( _mark[node] == _current ) return true;
+        _mark[node] = _current;
+        return false;
+    }
+
+    vector<Candidate> candidates;
+    vector<Candidate> best;
+    vector<uint32_t>  links;
+
+private:
+    vector<uint16_t> _mark;
+    uint16_t         _current;
+};
+
+HnswIndex::HnswIndex( )
+    : _dim( 0 )
+    , _type( Config::FloatDesc )
+    , _desc_size( 0 )
+    , _M( 0 )
+    , _ef_construction( 0 )
+    , _seed( 0 )
+    , _node_size( 0 )
+    , _desc_offset( 0 )
+    , _capacity( 0 )
+    , _count( 0 )
+    , _mapped( 0 )
+    , _mapped_length( 0 )
+    , _mapped_upper( 0 )
+    , _entry( -1 )
+    , _max_level( -1 )
+    , _locks( HNSW_LOCKS )
+{ }
+
+HnswIndex::~HnswIndex( )
+{
+    close( );
+}
+
+void HnswIndex::close( )
+{
+    unmapFile( _mapped, _mapped_length );
+    _mapped        = 0;
+    _mapped_length = 0;
+    _mapped_upper  = 0;
+
+    _nodes.clear();
+    _nodes.shrink_to_fit();
+    _upper.clear();
+    _upper.shrink_to_fit();
+    _dim       = 0;
+    _capacity  = 0;
+    _count     = 0;
+    _entry     = -1;
+    _max_level = -1;
+
+    for( Visited* v : _visited ) delete v;
+    _visited.clear();
+}
+
+bool HnswIndex::create( int dim, Config::DescType type, size_t capacity, int M, int ef_construction, unsigned seed )
+{
+    close( );
+
+    if( dim <= 0 || ( type != Config::UInt8Desc && type != Config::FloatDesc ) ) {
+        cerr << "An HNSW index holds uint8 or float descriptors of at least one value" << endl;
+        return false;
+    }
+    if( M < 2 || M > 256 || ef_construction < 1 ) {
+        cerr << "An HNSW index needs 2 to 256 links per node and ef_construction of at least 1" << endl;
+        return false;
+    }
+
+    _dim             = dim;
+    _type            = type;
+    _desc_size       = dim * descTypeSize( type );
+    _M               = M;
+    _ef_construction = ef_construction;
+    _seed            = seed;
+    _desc_offset     = align_up( sizeof(HnswNode) + 2 * M * sizeof(uint32_t), 16 );
+    _node_size       = align_up( _desc_offset + _desc_size, 16 );
+
+    return reserve( capacity );
+}
+
+bool HnswIndex::reserve( size_t capacity )
+{
+    if( not isValid() || _mapped ) return false;
+    if( capacity <= _capacity ) return true;
+    if( capacity > (size_t)std::numeric_limits<int32_t>::max() ) {
+        cerr << "An HNSW index holds at most " << std::numeric_limits<int32_t>::max() << " nodes" << endl;
+        return false;
+    }
+
+    _nodes.resize( capacity * _node_size );
+    _upper.resize( capacity );
+    _capacity = capacity;
+
+    /* marks of the old capacity are too short */
+    for( Visited* v : _visited ) delete v;
+    _visited.clear();
+    return true;
+}
+
+/*************************************************************
+ * Nodes and links
+ *************************************************************/
+
+inline char* HnswIndex::record( uint32_t node ) const
+{
+    const char* base = _mapped ? _mapped + ( (const HnswFileHeader*)_mapped )->node_offset : _nodes.data();
+    return (char*)base + (size_t)node * _node_size;
+}
+
+inline const void* HnswIndex::descriptor( uint32_t node ) const
+{
+    return record( node ) + _desc_offset;
+}
+
+/* A count followed by the links of node on level */
+inline uint32_t* HnswIndex::linkList( uint32_t node, int level ) const
+{
+    HnswNode* n = (HnswNode*)record( node );
+    if( level == 0 ) return &n->count;
+    if( _mapped ) return (uint32_t*)_mapped_upper + n->upper + ( level - 1 ) * ( _M + 1 );
+    return (uint32_t*)_upper[node].data() + ( level - 1 ) * ( _M + 1 );
+}
+
+/* Copy the links of node on level; under the node's lock while inserts
+ * may change them. open() does not check the nodes of a file, so a
+ * mapped list is only read if it lies in the file, at most M or 2M of
+ * its links are copied and links past the last node are dropped. */
+inline int HnswIndex::copyLinks( uint32_t node, int level, uint32_t* links ) const
+{
+    if( _mapped ) {
+        const HnswNode* n          = (const HnswNode*)record( node );
+        const uint64_t  upper_size = ( (const HnswFileHeader*)_mapped )->upper_size;
+        if( level > 0 && ( (uint32_t)level > n->level || n->upper > upper_size ||
+                           (uint64_t)level * ( _M + 1 ) > upper_size - n->upper ) ) {
+            return 0;
+        }
+        const uint32_t* list = linkList( node, level );
+        const uint32_t  len  = std::min( list[0], (uint32_t)( level == 0 ? 2 * _M : _M ) );
+        int             k    = 0;
+        for( uint32_t i=0; i<len; i++ ) {
+            if( list[1+i] < _capacity ) links[k++] = list[1+i];
+        }
+        return k;
+    }
+    std::lock_guard<std::mutex> lock( _locks[node % HNSW_LOCKS] );
+    const uint32_t* list = linkList( node, level );
+    memcpy( links, list + 1, list[0] * sizeof(uint32_t) );
+    return list[0];
+}
+
+inline float HnswIndex::distance( const void* query, uint32_t node ) const
+{
+    return _type == Config::UInt8Desc ? l2_uint8( query, descriptor( node ), _dim )
+                                      : l2_float( query, descriptor( node ), _dim );
+}
+
+/* Level with probability M^-level (1 - 1/M), from a hash of the node
+ * number so that inserts need not share a generator */
+int HnswIndex::randomLevel( uint32_t node ) const
+{
+    const uint64_t h = splitmix64( ( (uint64_t)_seed << 32 ) ^ node );
+    const double   u = ( ( h >> 11 ) + 1 ) * ( 1.0 / 9007199254740992.0 ); // (0,1]
+    const int      l = (int)( -log( u ) / log( (double)_M ) );
+    return std::min( l, HNSW_MAX_LEVEL );
+}
+
+HnswIndex::Visited* HnswIndex::getVisited( ) const
+{
+    {
+        std::lock_guard<std::mutex> lock( _visited_mutex );
+        if( not _visited.empty() ) {
+            Visited* v = _visited.back();
+            _visited.pop_back();
+            return v;
+        }
+    }
+    Visited* v = new Visited( _capacity );
+    v->links.resize( 2 * _M );
+    return v;
+}
+
+void HnswIndex::putVisited( Visited* visited ) const
+{
+    std::lock_guard<std::mutex> lock( _visited_mutex );
+    _visited.push_back( visited );
+}
+
+uint64_t HnswIndex::getLabel( size_t node ) const
+{
+    return ( (const HnswNode*)record( (uint32_t)node ) )->label;
+}
+
+/*************************************************************
+ * Search
+ *************************************************************/
+
+/* Greedy descent from node through the levels from_level .. to_level+1,
+ * returns the node nearest to query on level to_level + 1 */
+uint32_t HnswIndex::greedy( const void* query, uint32_t node, int from_level, int to_level ) const
+{
+    uint32_t links[256];
+    float    d = distance( query, node );
+    for( int level=from_level; level>to_level; level-- ) {
+        bool changed = true;
+        while( changed ) {
+            changed = false;
+            const int n = copyLinks( node, level, links );
+            for( int i=0; i<n; i++ ) {
+                const float dn = distance( query, links[i] );
+                if( dn < d ) {
+                    d       = dn;
+                    node    = links[i];
+                    changed = true;
+                }
+            }
+        }
+    }
+    return node;
+}
+
+/* Best-first search on one level: best receives the ef nearest nodes
+ * found, nearest first */
+void HnswIndex::searchLevel( const void* query, uint32_t entry, int ef, int level,
+                             Visited& visited, vector<Candidate>& best ) const
+{
+    vector<Candidate>& candidates = visited.candidates; // min-heap
+    vector<uint32_t>&  links      = visited.links;
+    std::greater<Candidate> nearer;
+
+    candidates.clear();
+    best.clear();                                       // max-heap
+
+    const float d = distance( query, entry );
+    visited.testAndSet( entry );
+    candidates.push_back( Candidate( d, entry ) );
+    best.push_back( Candidate( d, entry ) );
+
+    while( not candidates.empty() ) {
+        const Candidate c = candidates.front();
+        if( c.first > best.front().first && (int)best.size() >= ef ) break;
+        std::pop_heap( candidates.begin(), candidates.end(), nearer );
+        candidates.pop_back();
+
+        const int n = copyLinks( c.second, level, links.data() );
+#ifdef __GNUC__
+        for( int i=0; i<n; i++ ) __builtin_prefetch( descriptor( links[i] ) );
+#endif
+        for( int i=0; i<n; i++ ) {
+            const uint32_t nb = links[i];
+            if( visited.testAndSet( nb ) ) continue;
+
+            const float dn = distance( query, nb );
+            if( (int)best.size() < ef || dn < best.front().first ) {
+                candidates.push_back( Candidate( dn, nb ) );
+                std::push_heap( candidates.begin(), candidates.end(), nearer );
+                best.push_back( Candidate( dn, nb ) );
+                std::push_heap( best.begin(), best.end() );
+                if( (int)best.size() > ef ) {
+                    std::pop_heap( best.begin(), best.end() );
+                    best.pop_back();
+                }
+            }
+        }
+    }
+    std::sort_heap( best.begin(), best.end() );
+}
+
+int HnswIndex::search( const void* query, int k, int ef, int* node, float* dist ) const
+{
+    if( not isValid() || k <= 0 ) return 0;
+
+    int64_t entry;
+    int     max_level;
+    {
+        std::lock_guard<std::mutex> lock( _entry_mutex );
+        entry     = _entry;
+        max_level = _max_level;
+    }
+    if( entry < 0 ) return 0;
+
+    const uint32_t start = greedy( query, (uint32_t)entry, max_level, 0 );
+
+    Visited* visited = getVisited( );
+    visited->next();
+    searchLevel( query, start, std::max( ef, k ), 0, *visited, visited->best );
+
+    const int n = std::min( k, (int)visited->best.size() );
+    for( int i=0; i<n; i++ ) {
+        node[i] = (int)visited->best[i].second;
+        dist[i] = visited->best[i].first;
+    }
+    putVisited( visited );
+    return n;
+}
+
+void HnswIndex::searchRange( const DescriptorMatrix* query, int k, int ef,
+                             size_t q_begin, size_t q_end, int* node, float* dist, int* count ) const
+{
+    vector<char> q( _desc_size );
+    for( size_t i=q_begin; i<q_end; i++ ) {
+        convertFromFloat( query->getRow( i ), _dim, _type, q.data() );
+        count[i] = search( q.data(), k, ef, &node[i * k], &dist[i * k] );
+    }
+}
+
+void HnswIndex::search( const DescriptorMatrix& query, int k, int ef,
+                        NeighbourList& result, int num_threads ) const
+{
+    const size_t num_queries = query.size();
+    k = std::max( k, 0 );
+
+    result.offset.assign( num_queries + 1, 0 );
+    result.index.resize( num_queries * k );
+    result.dist.resize( num_queries * k );
+    if( num_queries == 0 || k == 0 || not isValid() ) {
+        result.index.clear();
+        result.dist.clear();
+        return;
+    }
+    if( query.getDim() != _dim ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot search " << query.getDim()
+             << "-dimensional descriptors in an index of " << _dim << "-dimensional descriptors" << endl;
+        exit( -1 );
+    }
+
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = (int)std::max( (size_t)1, std::min( (size_t)num_threads, num_queries / HNSW_MIN_QUERIES_PER_THREAD ) );
+
+    vector<int> count( num_queries );
+    int*   node = result.index.data();
+    float* dist = result.dist.data();
+
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( &HnswIndex::searchRange, this, &query, k, ef,
+                                              num_queries * t / num_threads,
+                                              num_queries * ( t + 1 ) / num_threads,
+                                              node, dist, count.data() ) );
+    }
+    searchRange( &query, k, ef, 0, num_queries / num_threads, node, dist, count.data() );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+
+    /* compact the rows of k slots, offset[q] <= q * k */
+    for( size_t q=0; q<num_queries; q++ ) {
+        const size_t o = result.offset[q];
+        for( int i=0; i<count[q]; i++ ) {
+            result.index[o+i] = result.index[q*k+i];
+            result.dist[o+i]  = result.dist[q*k+i];
+        }
+        result.offset[q+1] = o + count[q];
+    }
+    result.index.resize( result.offset[num_queries] );
+    result.dist.resize( result.offset[num_queries] );
+}
+
+/*************************************************************
+ * Insert
+ *************************************************************/
+
+/* The heuristic of the HNSW paper: going through the candidates
+ * nearest first, keep one only if it is nearer to the query than to
+ * all candidates kept so far, up to max_links. This keeps links in
+ * different directions instead of many into one cluster. */
+void HnswIndex::selectNeighbours( vector<Candidate>& candidates, int max_links ) const
+{
+    if( (int)candidates.size() <= max_links ) return;
+
+    vector<Candidate> kept;
+    kept.reserve( max_links );
+    for( const Candidate& c : candidates ) {
+        bool keep = true;
+        for( const Candidate& k : kept ) {
+            if( distance( descriptor( k.second ), c.second ) < c.first ) {
+                keep = false;
+                break;
+            }
+        }
+        if( keep ) {
+            kept.push_back( c );
+            if( (int)kept.size() == max_links ) break;
+        }
+    }
+    candidates.swap( kept );
+}
+
+void HnswIndex::connect( uint32_t node, int level, const vector<Candidate>& neighbours )
+{
+    const int max_links = level == 0 ? 2 * _M : _M;
+    vector<Candidate> shrink;
+    {
+        /* concurrent inserts may have linked to node since its search,
+         * keep those links unless the list overflows */
+        std::lock_guard<std::mutex> lock( _locks[node % HNSW_LOCKS] );
+        uint32_t* list = linkList( node, level );
+        shrink = neighbours;
+        const void* node_desc = descriptor( node );
+        for( uint32_t i=0; i<list[0]; i++ ) {
+            const uint32_t other = list[1+i];
+            bool known = false;
+            for( const Candidate& nb : neighbours ) known = known || nb.second == other;
+            if( not known ) shrink.push_back( Candidate( distance( node_desc, other ), other ) );
+        }
+        if( shrink.size() > neighbours.size() ) {
+            std::sort( shrink.begin(), shrink.end() );
+            selectNeighbours( shrink, max_links );
+        }
+        list[0] = (uint32_t)shrink.size();
+        for( size_t i=0; i<shrink.size(); i++ ) list[1+i] = shrink[i].second;
+    }
+
+    for( const Candidate& nb : neighbours ) {
+        std::lock_guard<std::mutex> lock( _locks[nb.second % HNSW_LOCKS] );
+        uint32_t* list = linkList( nb.second, level );
+        if( (int)list[0] < max_links ) {
+            list[1 + list[0]] = node;
+            list[0]++;
+            continue;
+        }
+
+        /* full: choose again among the old links and the new node */
+        const void* nb_desc = descriptor( nb.second );
+        shrink.clear();
+        shrink.push_back( Candidate( distance( nb_desc, node ), node ) );
+        for( uint32_t i=0; i<list[0]; i++ ) {
+            shrink.push_back( Candidate( distance( nb_desc, list[1+i] ), list[1+i] ) );
+        }
+        std::sort( shrink.begin(), shrink.end() );
+        selectNeighbours( shrink, max_links );
+        list[0] = (uint32_t)shrink.size();
+        for( size_t i=0; i<shrink.size(); i++ ) list[1+i] = shrink[i].second;
+    }
+}
+
+long long HnswIndex::insert( const void* desc, uint64_t label )
+{
+    if( not isValid() || _mapped ) return -1;
+
+    size_t n = _count.load();
+    do {
+        if( n >= _capacity ) return -1;
+    } while( not _count.compare_exchange_weak( n, n + 1 ) );
+
+    const uint32_t node  = (uint32_t)n;
+    const int      level = randomLevel( node );
+
+    HnswNode* rec = (HnswNode*)record( node );
+    rec->label = label;
+    rec->upper = 0;
+    rec->level = level;
+    rec->count = 0;
+    memcpy( (char*)rec + _desc_offset, desc, _desc_size );
+    if( level > 0 ) _upper[node].assign( level * ( _M + 1 ), 0 );
+
+    /* a node that becomes the new top holds the entry lock until it
+     * is linked, so that no search starts from an unlinked node */
+    std::unique_lock<std::mutex> entry_lock( _entry_mutex );
+    const int64_t entry     = _entry;
+    const int     max_level = _max_level;
+    if( entry < 0 ) {
+        _entry     = node;
+        _max_level = level;
+        return node;
+    }
+    if( level <= max_level ) entry_lock.unlock();
+
+    const void* q   = (const char*)rec + _desc_offset;
+    uint32_t    cur = greedy( q, (uint32_t)entry, max_level, level );
+
+    Visited* visited = getVisited( );
+    for( int l=std::min( level, max_level ); l>=0; l-- ) {
+        visited->next();
+        vector<Candidate>& best = visited->best;
+        searchLevel( q, cur, _ef_construction, l, *visited, best );
+
+        /* a concurrent insert may have linked this node already */
+        best.erase( std::remove_if( best.begin(), best.end(),
+                                    [node]( const Candidate& c ) { return c.second == node; } ),
+                    best.end() );
+        if( best.empty() ) continue;
+
+        cur = best[0].second;
+        selectNeighbours( best, _M );
+        connect( node, l, best );
+    }
+    putVisited( visited );
+
+    if( level > max_level ) {
+        _entry     = node;
+        _max_level = level;
+    }
+    return node;
+}
+
+size_t HnswIndex::insert( const FeaturesHost& features, uint32_t image_id )
+{
+    if( _dim != 128 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot insert 128-dimensional descriptors into an index of "
+             << _dim << "-dimensional descriptors" << endl;
+        exit( -1 );
+    }
+
+    const char*  src    = (const char*)features.getDescriptorData();
+    const size_t stride = features.getDescriptorStride();
+    const int    count  = features.getDescriptorCount();
+
+    vector<char> desc( _desc_size );
+    size_t inserted = 0;
+    for( int i=0; i<count; i++ ) {
+        convertDescriptor( src + i * stride, features.getDescType(), desc.data(), _type, _dim );
+        if( insert( desc.data(), makeLabel( image_id, i ) ) < 0 ) break;
+        inserted++;
+    }
+    return inserted;
+}
+
+/*************************************************************
+ * Files
+ *************************************************************/
+
+bool HnswIndex::save( const std::string& filename ) const
+{
+    if( not isValid() ) return false;
+
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+
+    const size_t count = size();
+    uint64_t     upper = 0;
+    for( size_t i=0; i<count; i++ ) {
+        upper += ( (const HnswNode*)record( (uint32_t)i ) )->level * ( _M + 1 );
+    }
+
+    HnswFileHeader hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_HNSW_FILE_MAGIC, sizeof(hdr.magic) );
+    hdr.version         = POPSIFT_HNSW_FILE_VERSION;
+    hdr.header_size     = sizeof(HnswFileHeader);
+    hdr.byte_order_mark = 0x01020304;
+    hdr.dim             = _dim;
+    hdr.desc_type       = _type;
+    hdr.links           = _M;
+    hdr.ef_construction = _ef_construction;
+    hdr.max_level       = _max_level;
+    hdr.entry_point     = _entry < 0 ? 0 : (uint32_t)_entry;
+    hdr.node_size       = (uint32_t)_node_size;
+    hdr.count           = count;
+    hdr.node_offset     = align_up( sizeof(HnswFileHeader), HNSW_ALIGN );
+    hdr.upper_offset    = align_up( hdr.node_offset + count * _node_size, HNSW_ALIGN );
+    hdr.upper_size      = upper;
+    hdr.seed            = _seed;
+
+    const vector<char> pad( HNSW_ALIGN, 0 );
+    of.write( (const char*)&hdr, sizeof(hdr) );
+    of.write( pad.data(), hdr.node_offset - sizeof(hdr) );
+
+    /* records with the positions of their upper link lists */
+    vector<char> rec( _node_size );
+    upper = 0;
+    for( size_t i=0; i<count; i++ ) {
+        memcpy( rec.data(), record( (uint32_t)i ), _node_size );
+        HnswNode* n = (HnswNode*)rec.data();
+        n->upper = n->level > 0 ? upper : 0;
+        upper   += n->level * ( _M + 1 );
+        of.write( rec.data(), _node_size );
+    }
+    of.write( pad.data(), hdr.upper_offset - ( hdr.node_offset + count * _node_size ) );
+
+    for( size_t i=0; i<count; i++ ) {
+        const int level = ( (const HnswNode*)record( (uint32_t)i ) )->level;
+        if( level > 0 ) {
+            of.write( (const char*)linkList( (uint32_t)i, 1 ), level * ( _M + 1 ) * sizeof(uint32_t) );
+        }
+    }
+
+    if( not of.good() ) {
+        cerr << "Failed to write HNSW index to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool HnswIndex::validate( const HnswFileHeader& hdr, size_t length, const std::string& name ) const
+{
+    if( memcmp( hdr.magic, POPSIFT_HNSW_FILE_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << name << " is not a PopSift HNSW index file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << name << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_HNSW_FILE_VERSION ) {
+        cerr << "File " << name << " has HNSW index version " << hdr.version
+             << ", this reader supports version " << POPSIFT_HNSW_FILE_VERSION << endl;
+        return false;
+    }
+
+    const size_t desc_offset = align_up( sizeof(HnswNode) + 2 * hdr.links * sizeof(uint32_t), 16 );
+    const bool   type_ok     = hdr.desc_type == Config::UInt8Desc || hdr.desc_type == Config::FloatDesc;
+    if( hdr.header_size < sizeof(HnswFileHeader) || hdr.dim == 0 || not type_ok ||
+        hdr.links < 2 || hdr.links > 256 ||
+        hdr.node_size != align_up( desc_offset + hdr.dim * descTypeSize( (Config::DescType)hdr.desc_type ), 16 ) ||
+        hdr.count > (uint64_t)std::numeric_limits<int32_t>::max() ||
+        ( hdr.count > 0 && ( hdr.entry_point >= hdr.count || hdr.max_level < 0 || hdr.max_level > HNSW_MAX_LEVEL ) ) ||
+        hdr.node_offset < hdr.header_size || hdr.node_offset % HNSW_ALIGN != 0 ||
+        hdr.upper_offset % 4 != 0 ) {
+        cerr << "File " << name << " has an invalid header" << endl;
+        return false;
+    }
+    /* term by term, so that crafted offsets and sizes cannot wrap */
+    if( hdr.node_offset > length ||
+        hdr.count > ( length - hdr.node_offset ) / hdr.node_size ||
+        hdr.upper_offset < hdr.node_offset + hdr.count * hdr.node_size ||
+        hdr.upper_offset > length ||
+        hdr.upper_size > ( length - hdr.upper_offset ) / sizeof(uint32_t) ) {
+        cerr << "File " << name << " is truncated" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool HnswIndex::open( const std::string& filename )
+{
+    close( );
+
+    size_t      length;
+    const char* base = mapFile( filename, length, sizeof(HnswFileHeader), "PopSift HNSW index file" );
+    if( base == 0 ) return false;
+    _mapped        = base;
+    _mapped_length = length;
+
+    const HnswFileHeader& hdr = *(const HnswFileHeader*)base;
+    if( length < sizeof(HnswFileHeader) || not validate( hdr, length, filename ) ) {
+        close( );
+        return false;
+    }
+
+    _dim             = hdr.dim;
+    _type            = (Config::DescType)hdr.desc_type;
+    _desc_size       = _dim * descTypeSize( _type );
+    _M               = hdr.links;
+    _ef_construction = hdr.ef_construction;
+    _seed            = hdr.seed;
+    _desc_offset     = align_up( sizeof(HnswNode) + 2 * _M * sizeof(uint32_t), 16 );
+    _node_size       = hdr.node_size;
+    _capacity        = hdr.count;
+    _count           = hdr.count;
+    _mapped_upper    = (const uint32_t*)( base + hdr.upper_offset );
+    _entry           = hdr.count > 0 ? (int64_t)hdr.entry_point : -1;
+    _max_level       = hdr.count > 0 ? hdr.max_level : -1;
+    return true;
+}
+
+bool HnswIndex::load( const std::string& filename, size_t capacity )
+{
+    HnswIndex file;
+    if( not file.open( filename ) ) {
+        close( );
+        return false;
+    }
+
+    const HnswFileHeader& hdr   = *(const HnswFileHeader*)file._mapped;
+    const size_t          count = file.size();
+    if( not create( file._dim, file._type, std::max( count, capacity ),
+                    file._M, file._ef_construction, file._seed ) ) {
+        return false;
+    }
+
+    const size_t per_level = _M + 1;
+    for( size_t i=0; i<count; i++ ) {
+        memcpy( record( (uint32_t)i ), file.record( (uint32_t)i ), _node_size );
+        HnswNode* n = (HnswNode*)record( (uint32_t)i );
+        if( n->level > HNSW_MAX_LEVEL || n->level > (uint32_t)hdr.max_level ||
+            n->count > (uint32_t)( 2 * _M ) ||
+            ( n->level > 0 && ( n->upper > hdr.upper_size ||
+                                n->level * per_level > hdr.upper_size - n->upper ) ) ) {
+            cerr << "File " << filename << " has an invalid node " << i << endl;
+            close( );
+            return false;
+        }
+        if( n->level > 0 ) {
+            const uint32_t* src = file._mapped_upper + n->upper;
+            _upper[i].assign( src, src + n->level * per_level );
+        }
+        n->upper = 0;
+
+        bool links_ok = true;
+        for( uint32_t l=0; l<=n->level && links_ok; l++ ) {
+            const uint32_t* list = linkList( (uint32_t)i, l );
+            links_ok = list[0] <= (uint32_t)( l == 0 ? 2 * _M : _M );
+            for( uint32_t j=0; j<list[0] && links_ok; j++ ) {
+                /* a link on level l leads to a node that is on level l */
+                links_ok = list[1+j] < count && ( (const HnswNode*)file.record( list[1+j] ) )->level >= l;
+            }
+        }
+        if( not links_ok ) {
+            cerr << "File " << filename << " has invalid links at node " << i << endl;
+            close( );
+            return false;
+        }
+    }
+    if( count > 0 && ( (const HnswNode*)record( (uint32_t)file._entry ) )->level != (uint32_t)file._max_level ) {
+        cerr << "File " << filename << " has an entry point below the top level" << endl;
+        close( );
+        return false;
+    }
+    _count     = count;
+    _entry     = file._entry;
+    _max_level = file._max_level;
+    return true;
+}
+
+} // namespace popsift
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sift_conf.h"
+
+namespace popsift {
+
+class DescriptorMatrix;
+class FeaturesHost;
+struct NeighbourList;
+
+#define POPSIFT_HNSW_FILE_MAGIC   "PSHN\r\n\0"
+#define POPSIFT_HNSW_FILE_VERSION 1
+
+/* Header of an HNSW index file (host byte order, checked with
+ * byte_order_mark). The file is laid out so that it can be searched
+ * where it is mapped:
+ *
+ *   0              HnswFileHeader, 128 bytes
+ *   node_offset    count node records of node_size bytes: label, level,
+ *                  the links of level 0 and the descriptor
+ *   upper_offset   upper_size uint32 values: the link lists of the
+ *                  levels above 0, M + 1 values per node and level
+ */
+struct HnswFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark; // 0x01020304
+    uint32_t dim;
+    uint32_t desc_type;       // Config::DescType, UInt8Desc or FloatDesc
+    uint32_t links;           // M, links per node above level 0, 2M on level 0
+    uint32_t ef_construction;
+    int32_t  max_level;
+    uint32_t entry_point;
+    uint32_t node_size;
+    uint64_t count;
+    uint64_t node_offset;
+    uint64_t upper_offset;
+    uint64_t upper_size;
+    uint32_t seed;            // of the levels of new nodes
+    uint8_t  reserved[44];
+};
+
+/* A hierarchical navigable small world graph (Malkov and Yashunin) over
+ * uint8 or float descriptors, for approximate nearest-neighbour search
+ * in a collection that keeps growing.
+ *
+ * Every descriptor is a node with links to about M near nodes, 2M on
+ * level 0. A node is also on the levels 1 .. level above, with
+ * exponentially fewer nodes per level. A search descends greedily from
+ * the top level and explores level 0 with a list of the ef best nodes
+ * found so far; ef >= k trades speed for recall.
+ *
+ * insert() may be called from several threads, also while other
+ * threads search: nodes are numbered in the order in which their
+ * inserts begin, and link lists are guarded by a pool of locks. The
+ * descriptors are copied into the index, so it needs no other storage.
+ * An index that was opened from a file is mapped read-only and can be
+ * searched but not extended; load() reads it to extend it.
+ */
+class HnswIndex
+{
+public:
+    HnswIndex( );
+    ~HnswIndex( );
+
+    /** An empty index for descriptors of dim values of type UInt8Desc
+     *  or FloatDesc with room for capacity nodes. Returns false if the
+     *  parameters are not usable. */
+    bool create( int              dim,
+                 Config::DescType type,
+                 size_t           capacity,
+                 int              M               = 16,
+                 int              ef_construction = 200,
+                 unsigned         seed            = 1 );
+
+    /** Grow the room for nodes. Must not run concurrently with inserts
+     *  or searches. */
+    bool reserve( size_t capacity );
+
+    void close( );
+
+    inline bool             isValid( ) const     { return _dim > 0; }
+    inline bool             isMapped( ) const    { return _mapped != 0; }
+    inline size_t           size( ) const        { return _count.load(); }
+    inline size_t           getCapacity( ) const { return _capacity; }
+    inline int              getDim( ) const      { return _dim; }
+    inline Config::DescType getDescType( ) const { return _type; }
+
+    /** Insert one descriptor of getDim() values of getDescType() with a
+     *  label of the caller's choice. Returns the node number, or -1 if
+     *  the index is full or mapped. */
+    long long insert( const void* desc, uint64_t label );
+
+    /** Insert all descriptors of an image, converted to getDescType(),
+     *  with labels makeLabel( image_id, descriptor index ). Returns the
+     *  number of inserted descriptors. */
+    size_t insert( const FeaturesHost& features, uint32_t image_id );
+
+    static inline uint64_t makeLabel( uint32_t image_id, uint32_t desc ) {
+        return ( (uint64_t)image_id << 32 ) | desc;
+    }
+
+    uint64_t getLabel( size_t node ) const;
+
+    /** The k nearest nodes of a query of getDim() values of
+     *  getDescType(), exploring ef >= k candidates. Writes node numbers
+     *  and squared L2 distances, nearest first, and returns their
+     *  number. */
+    int search( const void* query, int k, int ef, int* node, float* dist ) const;
+
+    /** search for every row of query, converted to getDescType(), split
+     *  between num_threads threads, 0 picks the number of cores. The
+     *  indices of the result are node numbers, see getLabel. */
+    void search( const DescriptorMatrix& query, int k, int ef,
+                 NeighbourList& result, int num_threads = 0 ) const;
+
+    /** Write the index to a file; not while inserts are running.
+     *  Returns false and explains why on cerr. */
+    bool save( const std::string& filename ) const;
+
+    /** Map an index file read-only for searching. Returns false and
+     *  explains why on cerr if the file is not an index file. The
+     *  header is checked, the nodes are not, so that opening does not
+     *  read the whole file; searches only follow the links that lie
+     *  in the file and load() checks all nodes. */
+    bool open( const std::string& filename );
+
+    /** Read an index file into memory, with room for at least capacity
+     *  nodes, to insert more. */
+    bool load( const std::string& filename, size_t capacity = 0 );
+
+private:
+    class Visited;
+    typedef std::pair<float,uint32_t> Candidate;
+
+    char*           record( uint32_t node ) const;
+    const void*     descriptor( uint32_t node ) const;
+    uint32_t*       linkList( uint32_t node, int level ) const;
+    int             copyLinks( uint32_t node, int level, uint32_t* links ) const;
+    float           distance( const void* query, uint32_t node ) const;
+    int             randomLevel( uint32_t node ) const;
+
+    Visited*        getVisited( ) const;
+    void            putVisited( Visited* visited ) const;
+
+    uint32_t        greedy( const void* query, uint32_t node, int from_level, int to_level ) const;
+    void            searchLevel( const void* query, uint32_t entry, int ef, int level,
+                                 Visited& visited, std::vector<Candidate>& best ) const;
+    void            selectNeighbours( std::vector<Candidate>& candidates, int max_links ) const;
+    void            connect( uint32_t node, int level, const std::vector<Candidate>& neighbours );
+
+    void            searchRange( const DescriptorMatrix* query, int k, int ef,
+                                 size_t q_begin, size_t q_end, int* node, float* dist, int* count ) const;
+    bool            validate( const HnswFileHeader& hdr, size_t length, const std::string& name ) const;
+
+    int                   _dim;
+    Config::DescType      _type;
+    size_t                _desc_size;   // bytes per descriptor
+    int                   _M;
+    int                   _ef_construction;
+    unsigned              _seed;
+    size_t                _node_size;
+    size_t                _desc_offset; // of the descriptor in a node record
+
+    size_t                _capacity;
+    std::atomic<size_t>   _count;       // inserts begun
+    std::vector<char>     _nodes;       // [capacity][node_size] unless mapped
+    std::vector<std::vector<uint32_t>> _upper; // per node unless mapped
+
+    const char*           _mapped;      // the file of open()
+    size_t                _mapped_length;
+    const uint32_t*       _mapped_upper;
+
+    mutable std::mutex    _entry_mutex; // guards _entry and _max_level
+    int64_t               _entry;
+    int                   _max_level;
+
+    mutable std::vector<std::mutex> _locks;  // link list of node n: _locks[n % size]
+
+    mutable std::mutex             _visited_mutex;
+    mutable std::vector<Visited*>  _visited;
+};
+
+} // namespace popsift
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "desc_ivf.h"
+#include "desc_kernel.h"
+#include "desc_kmeans.h"
+#include "features.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Lists to scan per thread before another thread is worth it */
+#define IVF_MIN_LISTS_PER_THREAD 16
+
+/* The lists probed by the queries of one search, inverted: the queries
+ * that probe list l are query[offset[l]] .. query[offset[l+1]-1], and
+ * l is their slot-th nearest list */
+struct IvfIndex::Probe
+{
+    int              nprobe;
+    vector<size_t>   offset;
+    vector<uint32_t> query;
+    vector<uint32_t> slot;
+};
+
+IvfIndex::IvfIndex( )
+{ }
+
+void IvfIndex::create( const DescriptorMatrix& centroids )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    _centroids = centroids;
+    _lists.clear();
+    _lists.resize( centroids.size() );
+    _images.clear();
+    _descs.clear();
+}
+
+bool IvfIndex::train( const DescriptorMatrix& sample, int num_lists, int iterations,
+                      size_t batch_size, unsigned seed, int num_threads )
+{
+    DescriptorMatrix centroids;
+    if( not trainKMeans( sample, num_lists, centroids, iterations, batch_size, seed, num_threads ) ) {
+        return false;
+    }
+    create( centroids );
+    return true;
+}
+
+size_t IvfIndex::add( const DescriptorMatrix& desc, uint32_t image_id, int num_threads )
+{
+    const int dim = getDim();
+    if( desc.size() > 0 && desc.getDim() != dim ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot add " << desc.getDim()
+             << "-dimensional descriptors to an index of " << dim << "-dimensional descriptors" << endl;
+        exit( -1 );
+    }
+
+    vector<int> cluster( desc.size() );
+    assignClusters( desc, _centroids, cluster.data(), 0, num_threads );
+
+    std::lock_guard<std::mutex> lock( _mutex );
+    const size_t first = _images.size();
+    for( size_t i=0; i<desc.size(); i++ ) {
+        List&        list = _lists[cluster[i]];
+        const size_t r    = list.ids.size();
+        if( r % MATCH_PANEL == 0 ) {
+            list.panels.resize( list.panels.size() + dim * MATCH_PANEL, 0.0f );
+            list.norms.resize( list.norms.size() + MATCH_PANEL, std::numeric_limits<float>::infinity() );
+        }
+
+        float*       panel = &list.panels[( r / MATCH_PANEL ) * dim * MATCH_PANEL];
+        const float* row   = desc.getRow( i );
+        const int    c     = r % MATCH_PANEL;
+        for( int k=0; k<dim; k++ ) panel[k * MATCH_PANEL + c] = row[k];
+        list.norms[r] = desc.getNorm( i );
+        list.ids.push_back( (uint32_t)( first + i ) );
+
+        _images.push_back( image_id );
+        _descs.push_back( (uint32_t)i );
+    }
+    return first;
+}
+
+size_t IvfIndex::add( const FeaturesHost& features, uint32_t image_id, int num_threads )
+{
+    return add( DescriptorMatrix( features ), image_id, num_threads );
+}
+
+/* Scan lists first, first + step, ... for the queries that probe them.
+ * The k best scores of query q in its slot-th list go to the k values
+ * at ( q * nprobe + slot ) * k of index and score, sorted. */
+void IvfIndex::scanLists( const DescriptorMatrix* query, const Probe* probe, int k,
+                          int first, int step, int* index, float* score ) const
+{
+    const int         dim    = getDim();
+    const PanelKernel kernel = choosePanelKernel( );
+    float             s[MATCH_QUERIES * MATCH_PANEL];
+
+    for( int l=first; l<(int)_lists.size(); l+=step ) {
+        const List&  list       = _lists[l];
+        const size_t b          = probe->offset[l];
+        const size_t e          = probe->offset[l+1];
+        const int    num_panels = (int)( list.norms.size() / MATCH_PANEL );
+        if( b == e || num_panels == 0 ) continue;
+
+        for( size_t qb=b; qb<e; qb+=MATCH_QUERIES ) {
+            const int    rows = (int)std::min( (size_t)MATCH_QUERIES, e - qb );
+            const float* q[MATCH_QUERIES];
+            int*         best_i[MATCH_QUERIES];
+            float*       best_s[MATCH_QUERIES];
+            for( int r=0; r<MATCH_QUERIES; r++ ) {
+                const size_t p   = qb + std::min( r, rows - 1 );
+                const size_t out = ( (size_t)probe->query[p] * probe->nprobe + probe->slot[p] ) * k;
+                q[r]      = query->getRow( probe->query[p] );
+                best_i[r] = &index[out];
+                best_s[r] = &score[out];
+            }
+
+            for( int p=0; p<num_panels; p++ ) {
+                kernel( q, &list.panels[(size_t)p * dim * MATCH_PANEL], &list.norms[(size_t)p * MATCH_PANEL], dim, s );
+
+                for( int r=0; r<rows; r++ ) {
+                    const float* sr = &s[r * MATCH_PANEL];
+                    float*       bs = best_s[r];
+                    int*         bi = best_i[r];
+
+                    float m = sr[0];
+                    for( int c=1; c<MATCH_PANEL; c++ ) m = sr[c] < m ? sr[c] : m;
+                    if( not ( m < bs[k-1] ) ) continue;
+
+                    for( int c=0; c<MATCH_PANEL; c++ ) {
+                        if( not ( sr[c] < bs[k-1] ) ) continue;
+                        int j = k - 1;
+                        while( j > 0 && bs[j-1] > sr[c] ) {
+                            bs[j] = bs[j-1];
+                            bi[j] = bi[j-1];
+                            j--;
+                        }
+                        bs[j] = sr[c];
+                        bi[j] = (int)list.ids[p * MATCH_PANEL + c];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void IvfIndex::search( const DescriptorMatrix& query, int k, int nprobe,
+                       NeighbourList& result, int num_threads ) const
+{
+    const size_t num_queries = query.size();
+    result.offset.assign( num_queries + 1, 0 );
+    result.index.clear();
+    result.dist.clear();
+    if( num_queries == 0 || k <= 0 || not isValid() ) return;
+
+    if( query.getDim() != getDim() ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot search " << query.getDim()
+             << "-dimensional descriptors in an index of " << getDim() << "-dimensional descriptors" << endl;
+        exit( -1 );
+    }
+
+    /* the nearest lists of all queries, then the queries of every list */
+    Probe         probe;
+    NeighbourList nearest;
+    matchKnn( query, _centroids, std::max( nprobe, 1 ), nearest, num_threads );
+    probe.nprobe = (int)std::min( (size_t)std::max( nprobe, 1 ), _centroids.size() );
+
+    probe.offset.assign( _lists.size() + 1, 0 );
+    for( int l : nearest.index ) probe.offset[l+1]++;
+    for( size_t l=0; l<_lists.size(); l++ ) probe.offset[l+1] += probe.offset[l];
+    probe.query.resize( nearest.index.size() );
+    probe.slot.resize( nearest.index.size() );
+    {
+        vector<size_t> fill( probe.offset.begin(), probe.offset.end() - 1 );
+        for( size_t q=0; q<num_queries; q++ ) {
+            for( size_t p=0; p<nearest.count( q ); p++ ) {
+                const size_t o = fill[nearest.getIndices( q )[p]]++;
+                probe.query[o] = (uint32_t)q;
+                probe.slot[o]  = (uint32_t)p;
+            }
+        }
+    }
+
+    const size_t  slots = num_queries * probe.nprobe * k;
+    vector<int>   index( slots, -1 );
+    vector<float> score( slots, std::numeric_limits<float>::infinity() );
+
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = (int)std::max( (size_t)1, std::min( (size_t)num_threads, _lists.size() / IVF_MIN_LISTS_PER_THREAD ) );
+
+    /* thread t scans lists t, t + num_threads, ... */
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( &IvfIndex::scanLists, this, &query, &probe, k,
+                                              t, num_threads, index.data(), score.data() ) );
+    }
+    scanLists( &query, &probe, k, 0, num_threads, index.data(), score.data() );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+
+    /* the k best of the nprobe * k candidates of every query */
+    vector<std::pair<float,int>> cand;
+    for( size_t q=0; q<num_queries; q++ ) {
+        cand.clear();
+        for( size_t i=q*probe.nprobe*k; i<(q+1)*probe.nprobe*k; i++ ) {
+            if( index[i] >= 0 ) cand.push_back( std::make_pair( score[i], index[i] ) );
+        }
+        const size_t n = std::min( cand.size(), (size_t)k );
+        std::partial_sort( cand.begin(), cand.begin() + n, cand.end() );
+        for( size_t i=0; i<n; i++ ) {
+            result.index.push_back( cand[i].second );
+            result.dist.push_back( std::max( 0.0f, cand[i].first + query.getNorm( q ) ) );
+        }
+        result.offset[q+1] = result.offset[q] + n;
+    }
+}
+
+void IvfIndex::rankImages( const DescriptorMatrix& query, int k, int nprobe, size_t max_images,
+                           vector<ImageScore>& images, int num_threads ) const
+{
+    NeighbourList nearest;
+    search( query, k, nprobe, nearest, num_threads );
+
+    unordered_map<uint32_t, float> votes;
+    vector<uint32_t>               voted;
+    for( size_t q=0; q<nearest.size(); q++ ) {
+        voted.clear();
+        for( size_t i=0; i<nearest.count( q ); i++ ) {
+            const uint32_t image = _images[nearest.getIndices( q )[i]];
+            if( std::find( voted.begin(), voted.end(), image ) != voted.end() ) continue;
+            voted.push_back( image );
+            votes[image] += 1.0f;
+        }
+    }
+
+    images.clear();
+    for( const std::pair<const uint32_t, float>& v : votes ) {
+        ImageScore s = { v.first, v.second };
+        images.push_back( s );
+    }
+    const size_t n = std::min( max_images, images.size() );
+    std::partial_sort( images.begin(), images.begin() + n, images.end(),
+                       []( const ImageScore& a, const ImageScore& b ) {
+                           return a.score > b.score || ( a.score == b.score && a.image < b.image );
+                       } );
+    images.resize( n );
+}
+
+} // namespace popsift
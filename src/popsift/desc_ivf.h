@@ -0,0 +1,112 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+#include "desc_match.h"
+
+namespace popsift {
+
+class FeaturesHost;
+
+/* An image and its score for a query: for IvfIndex the number of query
+ * descriptors that found one of its descriptors among their nearest
+ * neighbours, for BowIndex the similarity of the BoW vectors */
+struct ImageScore
+{
+    uint32_t image;
+    float    score;
+};
+
+/* An inverted-file index: a coarse quantizer of k-means centroids
+ * splits the descriptors of many images into one list per centroid,
+ * and a query is only compared with the descriptors of the nprobe
+ * lists whose centroids are nearest to it.
+ *
+ * Every entry of a list is a descriptor with the id of its image and
+ * its position in the image's descriptors; entries are numbered in the
+ * order in which they were added. The lists keep their rows packed
+ * like the train rows of matchNearest2, and a search compares blocks
+ * of the queries that probe a list with its rows using the same
+ * kernels.
+ */
+class IvfIndex
+{
+public:
+    IvfIndex( );
+
+    /** Use centroids as coarse quantizer, one list per centroid.
+     *  Removes all entries. */
+    void create( const DescriptorMatrix& centroids );
+
+    /** create() with num_lists centroids from trainKMeans over sample.
+     *  Returns false if sample has fewer than num_lists rows. */
+    bool train( const DescriptorMatrix& sample,
+                int                     num_lists,
+                int                     iterations  = 100,
+                size_t                  batch_size  = 10000,
+                unsigned                seed        = 1,
+                int                     num_threads = 0 );
+
+    inline bool   isValid( ) const      { return _centroids.size() > 0; }
+    inline int    getDim( ) const       { return _centroids.getDim(); }
+    inline int    getListCount( ) const { return (int)_lists.size(); }
+    inline size_t getListSize( int l ) const { return _lists[l].ids.size(); }
+    inline size_t size( ) const         { return _images.size(); }
+
+    inline const DescriptorMatrix& getCentroids( ) const { return _centroids; }
+
+    /** Add the rows of desc as the descriptors of image image_id, their
+     *  lists are found with num_threads threads. May be called from
+     *  several threads, but not while searching. Returns the number of
+     *  the first new entry. */
+    size_t add( const DescriptorMatrix& desc, uint32_t image_id, int num_threads = 0 );
+    size_t add( const FeaturesHost& features, uint32_t image_id, int num_threads = 0 );
+
+    inline uint32_t getImage( size_t entry ) const      { return _images[entry]; }
+    inline uint32_t getDescriptor( size_t entry ) const { return _descs[entry]; }
+
+    /** The k nearest entries of every query row among the entries of
+     *  the nprobe lists nearest to it, with squared L2 distances. The
+     *  indices of the result are entry numbers. Lists are split between
+     *  num_threads threads. */
+    void search( const DescriptorMatrix& query, int k, int nprobe,
+                 NeighbourList& result, int num_threads = 0 ) const;
+
+    /** The images of the entries that search() finds for the
+     *  descriptors of one image, most votes first: every query
+     *  descriptor votes once for every image among its k neighbours.
+     *  At most max_images results. */
+    void rankImages( const DescriptorMatrix& query, int k, int nprobe, size_t max_images,
+                     std::vector<ImageScore>& images, int num_threads = 0 ) const;
+
+private:
+    struct List
+    {
+        std::vector<float>    panels; // [panel][dim][MATCH_PANEL]
+        std::vector<float>    norms;  // [panel][MATCH_PANEL], inf where unused
+        std::vector<uint32_t> ids;    // entry numbers
+    };
+
+    struct Probe;
+
+    void scanLists( const DescriptorMatrix* query, const Probe* probe, int k,
+                    int first, int step, int* index, float* score ) const;
+
+    DescriptorMatrix      _centroids;
+    std::vector<List>     _lists;
+    std::vector<uint32_t> _images;
+    std::vector<uint32_t> _descs;
+    std::mutex            _mutex;
+};
+
+} // namespace popsift
@@ -0,0 +1,448 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <limits>
+#include <float.h>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "desc_kdtree.h"
+#include "desc_match.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* A node with at most KD_LEAF_SIZE rows becomes a leaf */
+#define KD_LEAF_SIZE 8
+
+/* The mean and variance of a node are estimated from KD_SAMPLE_SIZE
+ * of its rows, and the split dimension is drawn from the KD_TOP_DIMS
+ * dimensions of highest variance (the values of FLANN) */
+#define KD_SAMPLE_SIZE 100
+#define KD_TOP_DIMS    5
+
+/* Threads of a batch search get at least this many queries */
+#define KD_MIN_QUERIES_PER_THREAD 64
+
+/* Squared L2 distance with 8 partial sums, which the compiler turns
+ * into vector code without reordering a single sum */
+static inline float l2sq( const float* __restrict__ a, const float* __restrict__ b, int dim )
+{
+    float acc[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    int k = 0;
+    for( ; k+8<=dim; k+=8 ) {
+        for( int j=0; j<8; j++ ) {
+            const float e = a[k+j] - b[k+j];
+            acc[j] += e * e;
+        }
+    }
+    for( ; k<dim; k++ ) {
+        const float e = a[k] - b[k];
+        acc[0] += e * e;
+    }
+    return ( ( acc[0] + acc[1] ) + ( acc[2] + acc[3] ) ) + ( ( acc[4] + acc[5] ) + ( acc[6] + acc[7] ) );
+}
+
+KdForest::KdForest( )
+    : _data( 0 )
+    , _size( 0 )
+{ }
+
+KdForest::~KdForest( )
+{
+    clearSearchers( );
+}
+
+/*************************************************************
+ * build
+ *************************************************************/
+
+/* The state of building one tree */
+class KdForest::Builder
+{
+public:
+    const DescriptorMatrix& data;
+    std::mt19937_64         rng;
+    vector<double>          mean;
+    vector<double>          var;
+    vector<int>             dims;
+
+    Builder( const DescriptorMatrix& data_, unsigned seed )
+        : data( data_ )
+        , rng( seed )
+        , mean( data_.getDim() )
+        , var( data_.getDim() )
+        , dims( data_.getDim() )
+    { }
+
+    /* Choose the split of rows order[b] .. order[e-1] */
+    void chooseSplit( const int32_t* order, int b, int e, int& dim, float& value )
+    {
+        const int d = data.getDim();
+        const int m = std::min( e - b, KD_SAMPLE_SIZE );
+
+        std::fill( mean.begin(), mean.end(), 0.0 );
+        std::fill( var.begin(), var.end(), 0.0 );
+        for( int i=0; i<m; i++ ) {
+            const float* row = data.getRow( order[b+i] );
+            for( int k=0; k<d; k++ ) mean[k] += row[k];
+        }
+        for( int k=0; k<d; k++ ) mean[k] /= m;
+        for( int i=0; i<m; i++ ) {
+            const float* row = data.getRow( order[b+i] );
+            for( int k=0; k<d; k++ ) var[k] += ( row[k] - mean[k] ) * ( row[k] - mean[k] );
+        }
+
+        const int top = std::min( d, KD_TOP_DIMS );
+        std::iota( dims.begin(), dims.end(), 0 );
+        std::partial_sort( dims.begin(), dims.begin() + top, dims.end(),
+                           [this]( int x, int y ) { return var[x] > var[y]; } );
+        std::uniform_int_distribution<int> pick( 0, top - 1 );
+        dim   = dims[pick( rng )];
+        value = (float)mean[dim];
+    }
+
+    int build( vector<Node>& nodes, int32_t* order, int b, int e );
+};
+
+int KdForest::Builder::build( vector<Node>& nodes, int32_t* order, int b, int e )
+{
+    const int idx = (int)nodes.size();
+    nodes.push_back( Node() );
+
+    if( e - b <= KD_LEAF_SIZE ) {
+        nodes[idx].dim    = -1;
+        nodes[idx].value  = 0.0f;
+        nodes[idx].first  = b;
+        nodes[idx].second = e;
+        return idx;
+    }
+
+    int   dim;
+    float value;
+    chooseSplit( order, b, e, dim, value );
+
+    int32_t* mid = std::partition( order + b, order + e,
+                                   [&]( int32_t r ) { return data.getRow( r )[dim] < value; } );
+    if( mid == order + b || mid == order + e ) {
+        /* the sample mean did not divide the rows, split at the median */
+        mid = order + ( b + e ) / 2;
+        std::nth_element( order + b, mid, order + e,
+                          [&]( int32_t x, int32_t y ) { return data.getRow( x )[dim] < data.getRow( y )[dim]; } );
+        value = data.getRow( *mid )[dim];
+    }
+
+    const int m     = (int)( mid - order );
+    const int left  = build( nodes, order, b, m );
+    const int right = build( nodes, order, m, e );
+    nodes[idx].dim    = dim;
+    nodes[idx].value  = value;
+    nodes[idx].first  = left;
+    nodes[idx].second = right;
+    return idx;
+}
+
+void KdForest::buildTree( Tree& tree, unsigned seed ) const
+{
+    Builder builder( *_data, seed );
+
+    tree.order.resize( _size );
+    std::iota( tree.order.begin(), tree.order.end(), 0 );
+    std::shuffle( tree.order.begin(), tree.order.end(), builder.rng );
+
+    tree.nodes.clear();
+    tree.nodes.reserve( 2 * _size / ( KD_LEAF_SIZE / 2 ) + 1 );
+    builder.build( tree.nodes, tree.order.data(), 0, (int)_size );
+}
+
+void KdForest::build( const DescriptorMatrix& data, int num_trees, unsigned seed, int num_threads )
+{
+    if( data.size() > (size_t)std::numeric_limits<int32_t>::max() ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Too many rows for a k-d tree: " << data.size() << endl;
+        exit( -1 );
+    }
+
+    clearSearchers( );
+    _data = &data;
+    _size = data.size();
+    _trees.clear();
+    _trees.resize( std::max( num_trees, 1 ) );
+
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = std::min( num_threads, (int)_trees.size() );
+
+    /* thread t builds trees t, t + num_threads, ... */
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( [this, seed, t, num_threads]() {
+            for( size_t i=t; i<_trees.size(); i+=num_threads ) buildTree( _trees[i], seed + (unsigned)i );
+        } ) );
+    }
+    for( size_t i=0; i<_trees.size(); i+=num_threads ) buildTree( _trees[i], seed + (unsigned)i );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+}
+
+/*************************************************************
+ * search
+ *************************************************************/
+
+/* The state of one thread's searches. Rows are marked as compared
+ * with the number of the current search, so the marks need not be
+ * cleared between queries. */
+class KdForest::Searcher
+{
+public:
+    explicit Searcher( const KdForest& forest )
+        : _forest( forest )
+        , _mark( forest._size, 0 )
+        , _search( 0 )
+    { }
+
+    int search( const float* q, int k, int checks, int* index, float* dist );
+
+private:
+    struct Branch
+    {
+        float   bound; // lower bound of the distance to the rows below
+        int32_t tree;
+        int32_t node;
+
+        inline bool operator<( const Branch& o ) const { return bound > o.bound; }
+    };
+
+    void descend( const float* q, int tree, int node, float bound );
+
+    inline float worst( ) const {
+        return _count < _k ? FLT_MAX : _dist[_k-1];
+    }
+
+    const KdForest&  _forest;
+    vector<uint32_t> _mark;
+    uint32_t         _search;
+    vector<Branch>   _heap;    // min-heap on bound
+
+    int              _k;
+    int              _count;
+    int              _checked;
+    int*             _index;
+    float*           _dist;
+};
+
+void KdForest::Searcher::descend( const float* q, int tree, int node, float bound )
+{
+    const Tree&      t     = _forest._trees[tree];
+    const Node*      nodes = t.nodes.data();
+    const int        dim   = _forest._data->getDim();
+
+    while( nodes[node].dim >= 0 ) {
+        const Node& n    = nodes[node];
+        const float diff = q[n.dim] - n.value;
+        const int   near = diff < 0.0f ? n.first  : n.second;
+        const int   far  = diff < 0.0f ? n.second : n.first;
+
+        const float far_bound = bound + diff * diff;
+        if( far_bound < worst() ) {
+            Branch br = { far_bound, tree, far };
+            _heap.push_back( br );
+            std::push_heap( _heap.begin(), _heap.end() );
+        }
+        node = near;
+    }
+
+    const Node& leaf = nodes[node];
+#ifdef __GNUC__
+    /* the rows of a leaf are scattered over the matrix, request them
+     * all before the first is compared */
+    for( int i=leaf.first; i<leaf.second; i++ ) {
+        const char* row = (const char*)_forest._data->getRow( t.order[i] );
+        for( int b=0; b<dim*(int)sizeof(float); b+=64 ) __builtin_prefetch( row + b );
+    }
+#endif
+    for( int i=leaf.first; i<leaf.second; i++ ) {
+        const int32_t row = t.order[i];
+        if( _mark[row] == _search ) continue;
+        _mark[row] = _search;
+        _checked++;
+
+        const float d = l2sq( q, _forest._data->getRow( row ), dim );
+        if( d >= worst() ) continue;
+
+        /* insertion into the sorted result */
+        int j = std::min( _count, _k - 1 );
+        while( j > 0 && _dist[j-1] > d ) {
+            _dist[j]  = _dist[j-1];
+            _index[j] = _index[j-1];
+            j--;
+        }
+        _dist[j]  = d;
+        _index[j] = row;
+        if( _count < _k ) _count++;
+    }
+}
+
+int KdForest::Searcher::search( const float* q, int k, int checks, int* index, float* dist )
+{
+    if( k <= 0 ) return 0;
+
+    if( ++_search == 0 ) {
+        std::fill( _mark.begin(), _mark.end(), 0 );
+        _search = 1;
+    }
+    _k       = k;
+    _count   = 0;
+    _checked = 0;
+    _index   = index;
+    _dist    = dist;
+    _heap.clear();
+
+    for( int t=0; t<(int)_forest._trees.size(); t++ ) {
+        descend( q, t, 0, 0.0f );
+    }
+
+    while( not _heap.empty() && _checked < checks ) {
+        const Branch br = _heap.front();
+        std::pop_heap( _heap.begin(), _heap.end() );
+        _heap.pop_back();
+
+        /* all other branches are farther */
+        if( br.bound >= worst() ) break;
+
+        descend( q, br.tree, br.node, br.bound );
+    }
+    return _count;
+}
+
+KdForest::Searcher* KdForest::getSearcher( ) const
+{
+    {
+        std::lock_guard<std::mutex> lock( _searcher_mutex );
+        if( not _searchers.empty() ) {
+            Searcher* s = _searchers.back();
+            _searchers.pop_back();
+            return s;
+        }
+    }
+    return new Searcher( *this );
+}
+
+void KdForest::putSearcher( Searcher* searcher ) const
+{
+    std::lock_guard<std::mutex> lock( _searcher_mutex );
+    _searchers.push_back( searcher );
+}
+
+void KdForest::clearSearchers( )
+{
+    for( Searcher* s : _searchers ) delete s;
+    _searchers.clear();
+}
+
+int KdForest::knnSearch( const float* query, int k, int checks, int* index, float* dist ) const
+{
+    if( not isValid() ) return 0;
+    Searcher* searcher = getSearcher( );
+    const int count = searcher->search( query, k, checks, index, dist );
+    putSearcher( searcher );
+    return count;
+}
+
+void KdForest::searchRange( const DescriptorMatrix* query, int k, int checks,
+                            size_t q_begin, size_t q_end, int* index, float* dist, int* count ) const
+{
+    Searcher* searcher = getSearcher( );
+    for( size_t q=q_begin; q<q_end; q++ ) {
+        count[q] = searcher->search( query->getRow( q ), k, checks, &index[q * k], &dist[q * k] );
+    }
+    putSearcher( searcher );
+}
+
+void KdForest::knnSearch( const DescriptorMatrix& query, int k, int checks,
+                          NeighbourList& result, int num_threads ) const
+{
+    const size_t num_queries = query.size();
+    k = std::max( k, 0 );
+
+    result.offset.assign( num_queries + 1, 0 );
+    result.index.resize( num_queries * k );
+    result.dist.resize( num_queries * k );
+    if( num_queries == 0 || k == 0 || not isValid() ) {
+        result.index.clear();
+        result.dist.clear();
+        return;
+    }
+
+    vector<int> count( num_queries );
+    searchAll( query, k, checks, result.index.data(), result.dist.data(), count.data(), num_threads );
+
+    /* compact the rows of k slots, offset[q] <= q * k */
+    for( size_t q=0; q<num_queries; q++ ) {
+        const size_t o = result.offset[q];
+        for( int i=0; i<count[q]; i++ ) {
+            result.index[o+i] = result.index[q*k+i];
+            result.dist[o+i]  = result.dist[q*k+i];
+        }
+        result.offset[q+1] = o + count[q];
+    }
+    result.index.resize( result.offset[num_queries] );
+    result.dist.resize( result.offset[num_queries] );
+}
+
+void KdForest::matchNearest2( const DescriptorMatrix& query, int checks,
+                              int* nn, float* dist, int num_threads ) const
+{
+    const size_t num_queries = query.size();
+    if( num_queries == 0 ) return;
+
+    vector<int> count( num_queries, 0 );
+    if( isValid() ) {
+        searchAll( query, 2, checks, nn, dist, count.data(), num_threads );
+    }
+    for( size_t q=0; q<num_queries; q++ ) {
+        for( int i=count[q]; i<2; i++ ) {
+            nn[2*q+i]   = -1;
+            dist[2*q+i] = FLT_MAX;
+        }
+    }
+}
+
+void KdForest::searchAll( const DescriptorMatrix& query, int k, int checks,
+                          int* index, float* dist, int* count, int num_threads ) const
+{
+    const size_t num_queries = query.size();
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = (int)std::max( (size_t)1, std::min( (size_t)num_threads, num_queries / KD_MIN_QUERIES_PER_THREAD ) );
+
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( &KdForest::searchRange, this, &query, k, checks,
+                                              num_queries * t / num_threads,
+                                              num_queries * ( t + 1 ) / num_threads,
+                                              index, dist, count ) );
+    }
+    searchRange( &query, k, checks, 0, num_queries / num_threads, index, dist, count );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+}
+
+} // namespace popsift
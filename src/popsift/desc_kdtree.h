@@ -0,0 +1,114 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+namespace popsift {
+
+class DescriptorMatrix;
+struct NeighbourList;
+
+/* Approximate nearest-neighbour search with a forest of randomized k-d
+ * trees, as in FLANN's KDTreeIndex.
+ *
+ * Every tree splits the rows of a DescriptorMatrix recursively at the
+ * mean of a dimension that is drawn at random from the dimensions of
+ * highest variance, until a node holds a few rows. Because the trees
+ * split differently, a neighbour that one tree hides behind a split is
+ * often near the query in another.
+ *
+ * A search descends all trees to the leaves of the query and keeps the
+ * branches that it did not take in one priority queue for all trees,
+ * ordered by a lower bound of their distance. It continues with the
+ * best branch until checks rows were compared, so checks trades speed
+ * for recall. Rows that several trees lead to are compared once.
+ *
+ * The forest refers to the rows of the matrix that it was built over;
+ * the matrix must stay unchanged while the forest is used.
+ */
+class KdForest
+{
+public:
+    KdForest( );
+    ~KdForest( );
+
+    /** Build num_trees trees over the rows of data, one thread per tree
+     *  up to num_threads, 0 picks the number of cores. */
+    void build( const DescriptorMatrix& data, int num_trees = 4, unsigned seed = 1, int num_threads = 0 );
+
+    inline bool   isValid( ) const      { return _data != 0; }
+    inline int    getTreeCount( ) const { return (int)_trees.size(); }
+    inline size_t size( ) const         { return _size; }
+
+    /** The k nearest rows of one query of getDim() floats, comparing at
+     *  most checks rows; fewer than k if the search found fewer. Writes
+     *  the row indices and squared L2 distances, nearest first, and
+     *  returns their number. The search state is taken from a pool and
+     *  reused by later calls, so calling this per query costs no more
+     *  than the batch search. */
+    int knnSearch( const float* query, int k, int checks, int* index, float* dist ) const;
+
+    /** knnSearch for every row of query, split between num_threads
+     *  threads, 0 picks the number of cores */
+    void knnSearch( const DescriptorMatrix& query, int k, int checks,
+                    NeighbourList& result, int num_threads = 0 ) const;
+
+    /** The approximate counterpart of matchNearest2: 2 values per query
+     *  in nn and dist, -1 and FLT_MAX where the search found fewer than
+     *  two rows. The result can go to ratioTest and MatchList::assign. */
+    void matchNearest2( const DescriptorMatrix& query, int checks,
+                        int* nn, float* dist, int num_threads = 0 ) const;
+
+private:
+    /* Internal nodes split at value in dimension dim, their children
+     * are nodes first and second. Leaves have dim -1 and hold the rows
+     * order[first] .. order[second-1] of their tree. */
+    struct Node
+    {
+        int32_t dim;
+        float   value;
+        int32_t first;
+        int32_t second;
+    };
+
+    struct Tree
+    {
+        std::vector<Node>    nodes; // nodes[0] is the root
+        std::vector<int32_t> order;
+    };
+
+    class Builder;
+    class Searcher;
+
+    void buildTree( Tree& tree, unsigned seed ) const;
+
+    /* Searchers of earlier searches, for reuse */
+    Searcher* getSearcher( ) const;
+    void      putSearcher( Searcher* searcher ) const;
+    void      clearSearchers( );
+
+    /* Search k neighbours for every query into rows of k slots, with
+     * the number of neighbours found in count */
+    void searchAll( const DescriptorMatrix& query, int k, int checks,
+                    int* index, float* dist, int* count, int num_threads ) const;
+    void searchRange( const DescriptorMatrix* query, int k, int checks,
+                      size_t q_begin, size_t q_end, int* index, float* dist, int* count ) const;
+
+    const DescriptorMatrix* _data;
+    size_t                  _size;
+    std::vector<Tree>       _trees;
+
+    mutable std::mutex              _searcher_mutex;
+    mutable std::vector<Searcher*>  _searchers;
+};
+
+} // namespace popsift
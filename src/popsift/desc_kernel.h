@@ -0,0 +1,31 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+namespace popsift {
+
+/* The distance kernel of the host matchers, for indexes that keep
+ * their rows in the same packed form.
+ *
+ * Train rows are packed into panels of MATCH_PANEL rows, value k of row
+ * c of a panel at [k * MATCH_PANEL + c], so that the kernel reads one
+ * contiguous vector per dimension. The kernel compares MATCH_QUERIES
+ * queries with one panel. Rows that fill up the last panel must have
+ * infinite norms, so that their scores are infinite. */
+#define MATCH_PANEL   16
+#define MATCH_QUERIES 4
+
+/* Scores of MATCH_QUERIES queries against the rows of one panel,
+ *     s[r * MATCH_PANEL + c] = |t_c|^2 - 2 q_r.t_c
+ * which is the squared distance without |q_r|^2. */
+typedef void (*PanelKernel)( const float* const* q, const float* panel, const float* norms, int dim, float* s );
+
+/* The kernel for this CPU, with AVX2 and FMA if it has them */
+PanelKernel choosePanelKernel( );
+
+} // namespace popsift
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <string.h>
+#include <iso646.h>
+
+#include <cuda_runtime.h>
+
+#include "desc_kmeans.h"
+#include "desc_match.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Batches without a better smoothed mean distance before training stops */
+#define KMEANS_MAX_NO_IMPROVEMENT 10
+
+void assignClusters( const DescriptorMatrix& data,
+                     const DescriptorMatrix& centroids,
+                     int*                    cluster,
+                     float*                  dist,
+                     int                     num_threads )
+{
+    NeighbourList nearest;
+    matchKnn( data, centroids, 1, nearest, num_threads );
+
+    for( size_t i=0; i<data.size(); i++ ) {
+        const bool found = nearest.count( i ) > 0;
+        cluster[i] = found ? nearest.getIndices( i )[0] : -1;
+        if( dist ) dist[i] = found ? nearest.getDistances( i )[0] : 0.0f;
+    }
+}
+
+bool trainKMeans( const DescriptorMatrix& data,
+                  int                     k,
+                  DescriptorMatrix&       centroids,
+                  int                     iterations,
+                  size_t                  batch_size,
+                  unsigned                seed,
+                  int                     num_threads )
+{
+    const size_t n   = data.size();
+    const int    dim = data.getDim();
+    if( k < 1 || n < (size_t)k ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot train " << k
+             << " centroids from " << n << " descriptors" << endl;
+        return false;
+    }
+    const size_t batch = ( batch_size == 0 || batch_size > n ) ? n : batch_size;
+
+    std::mt19937_64 rng( seed );
+
+    /* distinct random rows */
+    vector<float>  centers( (size_t)k * dim );
+    vector<size_t> perm( n );
+    std::iota( perm.begin(), perm.end(), 0 );
+    for( int c=0; c<k; c++ ) {
+        std::uniform_int_distribution<size_t> pick( c, n - 1 );
+        std::swap( perm[c], perm[pick( rng )] );
+        memcpy( &centers[(size_t)c * dim], data.getRow( perm[c] ), dim * sizeof(float) );
+    }
+
+    vector<size_t>   seen( k, 0 );
+    vector<float>    rows( batch * dim );
+    vector<int>      cluster( batch );
+    vector<float>    dist( batch );
+    DescriptorMatrix batch_matrix;
+    std::uniform_int_distribution<size_t> draw( 0, n - 1 );
+
+    double       smoothed   = 0.0;
+    double       best       = 0.0;
+    int          no_improve = 0;
+    const double alpha      = std::min( 1.0, 2.0 * batch / ( n + 1.0 ) );
+
+    for( int it=0; it<iterations; it++ ) {
+        for( size_t i=0; i<batch; i++ ) {
+            memcpy( &rows[i * dim], data.getRow( batch == n ? i : draw( rng ) ), dim * sizeof(float) );
+        }
+        batch_matrix.assign( rows.data(), Config::FloatDesc, batch, dim * sizeof(float), dim );
+        centroids.assign( centers.data(), Config::FloatDesc, k, dim * sizeof(float), dim );
+        assignClusters( batch_matrix, centroids, cluster.data(), dist.data(), num_threads );
+
+        double sum = 0.0;
+        for( size_t i=0; i<batch; i++ ) {
+            const int    c   = cluster[i];
+            const float* x   = &rows[i * dim];
+            float*       ctr = &centers[(size_t)c * dim];
+            const float  eta = 1.0f / ++seen[c];
+            for( int j=0; j<dim; j++ ) ctr[j] += eta * ( x[j] - ctr[j] );
+            sum += dist[i];
+        }
+
+        std::uniform_int_distribution<size_t> in_batch( 0, batch - 1 );
+        for( int c=0; c<k; c++ ) {
+            if( seen[c] != 0 ) continue;
+            memcpy( &centers[(size_t)c * dim], &rows[in_batch( rng ) * dim], dim * sizeof(float) );
+        }
+
+        /* exponentially weighted mean distance of the batches */
+        const double mean = sum / batch;
+        smoothed = ( it == 0 ) ? mean : ( 1.0 - alpha ) * smoothed + alpha * mean;
+        if( it == 0 || smoothed < best ) {
+            best       = smoothed;
+            no_improve = 0;
+        } else if( ++no_improve >= KMEANS_MAX_NO_IMPROVEMENT ) {
+            break;
+        }
+    }
+
+    centroids.assign( centers.data(), Config::FloatDesc, k, dim * sizeof(float), dim );
+    return true;
+}
+
+} // namespace popsift
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+
+namespace popsift {
+
+class DescriptorMatrix;
+
+/* Mini-batch k-means (Sculley, "Web-scale k-means clustering"), for
+ * more centroids and samples than Lloyd's algorithm handles in
+ * reasonable time.
+ *
+ * Centroids start at k distinct random rows of data. Every iteration
+ * draws batch_size rows, assigns them to their nearest centroids with
+ * the kernels of matchNearest2, split between num_threads threads, and
+ * moves each centroid towards its rows with a step of 1 / (rows it has
+ * seen so far). A centroid that has not received a row yet takes the
+ * place of a random row of the batch. Training stops after iterations
+ * batches, or earlier if the mean distance of the batches has not
+ * improved for 10 batches.
+ *
+ * Returns false and explains why on cerr if data has fewer than k rows.
+ */
+bool trainKMeans( const DescriptorMatrix& data,
+                  int                     k,
+                  DescriptorMatrix&       centroids,
+                  int                     iterations  = 100,
+                  size_t                  batch_size  = 10000,
+                  unsigned                seed        = 1,
+                  int                     num_threads = 0 );
+
+/* The nearest centroid of every row of data and its squared distance;
+ * cluster and dist have room for data.size() values, dist may be 0 */
+void assignClusters( const DescriptorMatrix& data,
+                     const DescriptorMatrix& centroids,
+                     int*                    cluster,
+                     float*                  dist,
+                     int                     num_threads = 0 );
+
+} // namespace popsift
@@ -0,0 +1,794 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <string.h>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "desc_match.h"
+#include "desc_kernel.h"
+#include "desc_convert.h"
+#include "match_list.h"
+#include "features.h"
+#include "features_soa.h"
+
+/* The AVX2 kernel is compiled in with a target attribute and chosen at
+ * runtime, like the F16C conversion in desc_convert.cpp.
+ */
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define POPSIFT_AVX2_PATH 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace popsift {
+
+/* Panels that are compared with all queries of a thread before moving
+ * on, 256 rows of 128 floats are 128 KB and stay in L2 */
+#define MATCH_TILE_PANELS 16
+
+/* Query blocks below this count per thread are not worth a thread */
+#define MATCH_MIN_BLOCKS_PER_THREAD 16
+
+/*************************************************************
+ * DescriptorMatrix
+ *************************************************************/
+
+DescriptorMatrix::DescriptorMatrix( )
+    : _count( 0 )
+    , _dim( 0 )
+{ }
+
+DescriptorMatrix::DescriptorMatrix( const FeaturesHost& features )
+    : _count( 0 )
+    , _dim( 0 )
+{
+    assign( features );
+}
+
+DescriptorMatrix::DescriptorMatrix( const FeaturesSoA& features )
+    : _count( 0 )
+    , _dim( 0 )
+{
+    assign( features );
+}
+
+void DescriptorMatrix::assign( const void* desc, Config::DescType type, size_t count, size_t stride, int dim )
+{
+    _count = count;
+    _dim   = dim;
+    _data.resize( count * dim );
+    _norms.resize( count );
+
+    for( size_t i=0; i<count; i++ ) {
+        float* row = &_data[i * dim];
+        convertToFloat( (const char*)desc + i * stride, dim, type, row );
+        float n = 0.0f;
+        for( int k=0; k<dim; k++ ) n += row[k] * row[k];
+        _norms[i] = n;
+    }
+}
+
+void DescriptorMatrix::assign( const FeaturesHost& features )
+{
+    assign( features.getDescriptorData(), features.getDescType(),
+            features.getDescriptorCount(), features.getDescriptorStride(), 128 );
+}
+
+void DescriptorMatrix::assign( const FeaturesSoA& features )
+{
+    assign( features.getDescriptorData(), features.getDescType(),
+            features.getDescriptorCount(), features.getDescStride(), features.getDescDim() );
+}
+
+/*************************************************************
+ * Kernels
+ *************************************************************/
+
+static void panel_scores( const float* const* q, const float* panel, const float* norms, int dim, float* s )
+{
+    /* a local block, the compiler knows that it does not alias the
+     * panel and vectorizes the inner loop */
+    float acc[MATCH_QUERIES][MATCH_PANEL];
+    memset( acc, 0, sizeof(acc) );
+
+    for( int k=0; k<dim; k++ ) {
+        const float* __restrict__ b = &panel[k * MATCH_PANEL];
+        for( int r=0; r<MATCH_QUERIES; r++ ) {
+            const float x = q[r][k];
+            for( int c=0; c<MATCH_PANEL; c++ ) {
+                acc[r][c] += x * b[c];
+            }
+        }
+    }
+
+    for( int r=0; r<MATCH_QUERIES; r++ ) {
+        for( int c=0; c<MATCH_PANEL; c++ ) {
+            s[r * MATCH_PANEL + c] = norms[c] - 2.0f * acc[r][c];
+        }
+    }
+}
+
+#ifdef POPSIFT_AVX2_PATH
+static bool detect_avx2( )
+{
+    unsigned int a, b, c, d;
+    if( not __get_cpuid( 1, &a, &b, &c, &d ) ) return false;
+
+    const unsigned int need = bit_OSXSAVE | bit_AVX | bit_FMA;
+    if( ( c & need ) != need ) return false;
+
+    /* the OS must save the YMM registers */
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__( "xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0) );
+    if( ( xcr0_lo & 6 ) != 6 ) return false;
+
+    if( not __get_cpuid_count( 7, 0, &a, &b, &c, &d ) ) return false;
+    return ( b & bit_AVX2 ) != 0;
+}
+
+static bool have_avx2( )
+{
+    static const bool avx2 = detect_avx2( );
+    return avx2;
+}
+
+/* The 4 x 16 block of dot products lives in 8 registers */
+__attribute__((target("avx2,fma")))
+static void panel_scores_avx2( const float* const* q, const float* panel, const float* norms, int dim, float* s )
+{
+    __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps();
+    __m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+    __m256 a20 = _mm256_setzero_ps(), a21 = _mm256_setzero_ps();
+    __m256 a30 = _mm256_setzero_ps(), a31 = _mm256_setzero_ps();
+
+    const float* q0 = q[0];
+    const float* q1 = q[1];
+    const float* q2 = q[2];
+    const float* q3 = q[3];
+    for( int k=0; k<dim; k++ ) {
+        const __m256 b0 = _mm256_loadu_ps( &panel[k * MATCH_PANEL] );
+        const __m256 b1 = _mm256_loadu_ps( &panel[k * MATCH_PANEL + 8] );
+        __m256 x;
+        x   = _mm256_broadcast_ss( &q0[k] );
+        a00 = _mm256_fmadd_ps( x, b0, a00 );
+        a01 = _mm256_fmadd_ps( x, b1, a01 );
+        x   = _mm256_broadcast_ss( &q1[k] );
+        a10 = _mm256_fmadd_ps( x, b0, a10 );
+        a11 = _mm256_fmadd_ps( x, b1, a11 );
+        x   = _mm256_broadcast_ss( &q2[k] );
+        a20 = _mm256_fmadd_ps( x, b0, a20 );
+        a21 = _mm256_fmadd_ps( x, b1, a21 );
+        x   = _mm256_broadcast_ss( &q3[k] );
+        a30 = _mm256_fmadd_ps( x, b0, a30 );
+        a31 = _mm256_fmadd_ps( x, b1, a31 );
+    }
+
+    const __m256 m2 = _mm256_set1_ps( -2.0f );
+    const __m256 n0 = _mm256_loadu_ps( norms );
+    const __m256 n1 = _mm256_loadu_ps( norms + 8 );
+    _mm256_storeu_ps( s +  0, _mm256_fmadd_ps( a00, m2, n0 ) );
+    _mm256_storeu_ps( s +  8, _mm256_fmadd_ps( a01, m2, n1 ) );
+    _mm256_storeu_ps( s + 16, _mm256_fmadd_ps( a10, m2, n0 ) );
+    _mm256_storeu_ps( s + 24, _mm256_fmadd_ps( a11, m2, n1 ) );
+    _mm256_storeu_ps( s + 32, _mm256_fmadd_ps( a20, m2, n0 ) );
+    _mm256_storeu_ps( s + 40, _mm256_fmadd_ps( a21, m2, n1 ) );
+    _mm256_storeu_ps( s + 48, _mm256_fmadd_ps( a30, m2, n0 ) );
+    _mm256_storeu_ps( s + 56, _mm256_fmadd_ps( a31, m2, n1 ) );
+}
+#endif
+
+PanelKernel choosePanelKernel( )
+{
+#ifdef POPSIFT_AVX2_PATH
+    if( have_avx2() ) return panel_scores_avx2;
+#endif
+    return panel_scores;
+}
+
+/*************************************************************
+ * matchNearest2
+ *************************************************************/
+
+/* Train rows in panels, with the norms of the rows. Rows missing from
+ * the last panel are 0 with an infinite norm, so they never win. */
+struct PackedTrain
+{
+    int           num_panels;
+    vector<float> panels; // [num_panels][dim][MATCH_PANEL]
+    vector<float> norms;  // [num_panels][MATCH_PANEL]
+
+    PackedTrain( const DescriptorMatrix& train )
+    {
+        const int dim = train.getDim();
+        num_panels = (int)( ( train.size() + MATCH_PANEL - 1 ) / MATCH_PANEL );
+        panels.assign( (size_t)num_panels * dim * MATCH_PANEL, 0.0f );
+        norms.assign( (size_t)num_panels * MATCH_PANEL, std::numeric_limits<float>::infinity() );
+
+        for( size_t i=0; i<train.size(); i++ ) {
+            float*       panel = &panels[( i / MATCH_PANEL ) * dim * MATCH_PANEL];
+            const int    c     = i % MATCH_PANEL;
+            const float* row   = train.getRow( i );
+            for( int k=0; k<dim; k++ ) panel[k * MATCH_PANEL + c] = row[k];
+            norms[i] = train.getNorm( i );
+        }
+    }
+};
+
+/* The two best scores of one query, kept in locals while a query block
+ * runs over a tile */
+struct Nearest2
+{
+    float d1, d2;
+    int   i1, i2;
+
+    inline void reset( )
+    {
+        d1 = d2 = std::numeric_limits<float>::infinity();
+        i1 = i2 = -1;
+    }
+
+    inline void insert( float d, int i )
+    {
+        if( d < d1 ) {
+            d2 = d1;
+            i2 = i1;
+            d1 = d;
+            i1 = i;
+        } else if( d < d2 ) {
+            d2 = d;
+            i2 = i;
+        }
+    }
+
+    inline void update( const float* s, int base )
+    {
+        float m = s[0];
+        for( int c=1; c<MATCH_PANEL; c++ ) m = s[c] < m ? s[c] : m;
+        if( not ( m < d2 ) ) return;
+
+        for( int c=0; c<MATCH_PANEL; c++ ) {
+            if( s[c] < d2 ) insert( s[c], base + c );
+        }
+    }
+};
+
+/* 2-NN of the query rows [q_begin, q_end), scores are accumulated in
+ * nn and dist and turned into squared distances at the end. If cols is
+ * not 0, the same distances update the 2-NN among these queries of
+ * every train row in cols, one entry per panel row. */
+static void match_range( const DescriptorMatrix& query, const PackedTrain& train,
+                         PanelKernel kernel, size_t q_begin, size_t q_end,
+                         int* nn, float* dist, Nearest2* cols )
+{
+    const int    dim = query.getDim();
+    const size_t n   = q_end - q_begin;
+    const float  inf = std::numeric_limits<float>::infinity();
+
+    for( size_t q=q_begin; q<q_end; q++ ) {
+        nn[2*q]   = -1;
+        nn[2*q+1] = -1;
+        dist[2*q]   = inf;
+        dist[2*q+1] = inf;
+    }
+
+    float s[MATCH_QUERIES * MATCH_PANEL];
+
+    for( int p0=0; p0<train.num_panels; p0+=MATCH_TILE_PANELS ) {
+        const int p1 = std::min( train.num_panels, p0 + MATCH_TILE_PANELS );
+
+        for( size_t b=0; b<n; b+=MATCH_QUERIES ) {
+            const int    rows = (int)std::min( (size_t)MATCH_QUERIES, n - b );
+            const float* q[MATCH_QUERIES];
+            Nearest2     best[MATCH_QUERIES];
+            for( int r=0; r<MATCH_QUERIES; r++ ) {
+                /* a short last block repeats its last query */
+                const size_t row = q_begin + b + std::min( r, rows - 1 );
+                q[r]       = query.getRow( row );
+                best[r].d1 = dist[2*row];
+                best[r].d2 = dist[2*row+1];
+                best[r].i1 = nn[2*row];
+                best[r].i2 = nn[2*row+1];
+            }
+
+            for( int p=p0; p<p1; p++ ) {
+                kernel( q, &train.panels[(size_t)p * dim * MATCH_PANEL],
+                        &train.norms[(size_t)p * MATCH_PANEL], dim, s );
+                for( int r=0; r<MATCH_QUERIES; r++ ) {
+                    best[r].update( &s[r * MATCH_PANEL], p * MATCH_PANEL );
+                }
+                if( cols ) {
+                    /* the other direction needs the full distance, and
+                     * must not see the repeated query of a short block */
+                    Nearest2* col = &cols[p * MATCH_PANEL];
+                    for( int r=0; r<rows; r++ ) {
+                        const int   row = (int)( q_begin + b + r );
+                        const float qn  = query.getNorm( row );
+                        for( int c=0; c<MATCH_PANEL; c++ ) {
+                            const float d = s[r * MATCH_PANEL + c] + qn;
+                            if( d < col[c].d2 ) col[c].insert( d, row );
+                        }
+                    }
+                }
+            }
+
+            for( int r=0; r<rows; r++ ) {
+                const size_t row = q_begin + b + r;
+                dist[2*row]   = best[r].d1;
+                dist[2*row+1] = best[r].d2;
+                nn[2*row]     = best[r].i1;
+                nn[2*row+1]   = best[r].i2;
+            }
+        }
+    }
+
+    /* add |q|^2; rounding can make the distance of equal rows negative */
+    for( size_t q=q_begin; q<q_end; q++ ) {
+        for( int j=0; j<2; j++ ) {
+            if( nn[2*q+j] < 0 ) {
+                dist[2*q+j] = std::numeric_limits<float>::max();
+            } else {
+                dist[2*q+j] = std::max( 0.0f, dist[2*q+j] + query.getNorm( q ) );
+            }
+        }
+    }
+}
+
+/* Split the queries into ranges for at most num_threads threads, 0
+ * picks the number of cores. The ranges start at block boundaries.
+ * Returns the number of threads. */
+static int split_queries( size_t num_queries, int num_threads, vector<size_t>& begin )
+{
+    const size_t num_blocks = ( num_queries + MATCH_QUERIES - 1 ) / MATCH_QUERIES;
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = (int)std::max( (size_t)1, std::min( (size_t)num_threads, num_blocks / MATCH_MIN_BLOCKS_PER_THREAD ) );
+
+    begin.resize( num_threads + 1 );
+    for( int t=0; t<=num_threads; t++ ) {
+        begin[t] = std::min( num_queries, num_blocks * t / num_threads * MATCH_QUERIES );
+    }
+    return num_threads;
+}
+
+static void check_dims( const DescriptorMatrix& query, const DescriptorMatrix& train )
+{
+    if( query.getDim() != train.getDim() && query.size() > 0 && train.size() > 0 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot match " << query.getDim()
+             << "-dimensional descriptors with " << train.getDim() << "-dimensional descriptors" << endl;
+        exit( -1 );
+    }
+}
+
+/* Both matchers: the 2-NN of every query, and with train_nn also the
+ * 2-NN of every train row, which every thread collects for its own
+ * queries and which are merged at the end */
+static void match_both( const DescriptorMatrix& query,
+                        const DescriptorMatrix& train,
+                        int*                    nn,
+                        float*                  dist,
+                        int*                    train_nn,
+                        float*                  train_dist,
+                        int                     num_threads )
+{
+    const size_t num_queries = query.size();
+    const size_t num_train   = train.size();
+    check_dims( query, train );
+
+    const PackedTrain packed( train );
+    const PanelKernel kernel = choosePanelKernel( );
+
+    vector<size_t> begin;
+    num_threads = split_queries( num_queries, num_threads, begin );
+
+    vector<vector<Nearest2> > cols( train_nn ? num_threads : 0 );
+    for( vector<Nearest2>& c : cols ) {
+        c.resize( (size_t)packed.num_panels * MATCH_PANEL );
+        for( Nearest2& n : c ) n.reset();
+    }
+
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( match_range, boost::cref( query ), boost::cref( packed ),
+                                              kernel, begin[t], begin[t+1], nn, dist,
+                                              train_nn ? cols[t].data() : (Nearest2*)0 ) );
+    }
+    match_range( query, packed, kernel, begin[0], begin[1], nn, dist,
+                 train_nn ? cols[0].data() : (Nearest2*)0 );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+
+    if( not train_nn ) return;
+
+    for( size_t j=0; j<num_train; j++ ) {
+        Nearest2 n = cols[0][j];
+        for( int t=1; t<num_threads; t++ ) {
+            n.insert( cols[t][j].d1, cols[t][j].i1 );
+            n.insert( cols[t][j].d2, cols[t][j].i2 );
+        }
+        train_nn[2*j]     = n.i1;
+        train_nn[2*j+1]   = n.i2;
+        train_dist[2*j]   = n.i1 < 0 ? std::numeric_limits<float>::max() : std::max( 0.0f, n.d1 );
+        train_dist[2*j+1] = n.i2 < 0 ? std::numeric_limits<float>::max() : std::max( 0.0f, n.d2 );
+    }
+}
+
+void matchNearest2( const DescriptorMatrix& query,
+                    const DescriptorMatrix& train,
+                    int*                    nn,
+                    float*                  dist,
+                    int                     num_threads )
+{
+    match_both( query, train, nn, dist, 0, 0, num_threads );
+}
+
+void matchNearest2Symmetric( const DescriptorMatrix& query,
+                             const DescriptorMatrix& train,
+                             int*                    nn,
+                             float*                  dist,
+                             int*                    train_nn,
+                             float*                  train_dist,
+                             int                     num_threads )
+{
+    match_both( query, train, nn, dist, train_nn, train_dist, num_threads );
+}
+
+/*************************************************************
+ * matchKnn, matchRadius
+ *************************************************************/
+
+/* The tile loop of match_range for collectors with more state per
+ * query than fits in locals. For every query block and panel it calls
+ *     collector.update( first query, rows, scores, first train row )
+ * with the scores as computed by the kernel. */
+template<class Collector>
+static void scan_range( const DescriptorMatrix& query, const PackedTrain& train,
+                        PanelKernel kernel, size_t q_begin, size_t q_end,
+                        Collector& collector )
+{
+    const int    dim = query.getDim();
+    const size_t n   = q_end - q_begin;
+
+    float s[MATCH_QUERIES * MATCH_PANEL];
+
+    for( int p0=0; p0<train.num_panels; p0+=MATCH_TILE_PANELS ) {
+        const int p1 = std::min( train.num_panels, p0 + MATCH_TILE_PANELS );
+
+        for( size_t b=0; b<n; b+=MATCH_QUERIES ) {
+            const int    rows = (int)std::min( (size_t)MATCH_QUERIES, n - b );
+            const float* q[MATCH_QUERIES];
+            for( int r=0; r<MATCH_QUERIES; r++ ) {
+                q[r] = query.getRow( q_begin + b + std::min( r, rows - 1 ) );
+            }
+
+            for( int p=p0; p<p1; p++ ) {
+                kernel( q, &train.panels[(size_t)p * dim * MATCH_PANEL],
+                        &train.norms[(size_t)p * MATCH_PANEL], dim, s );
+                collector.update( q_begin + b, rows, s, p * MATCH_PANEL );
+            }
+        }
+    }
+}
+
+static inline float panel_min( const float* s )
+{
+    float m = s[0];
+    for( int c=1; c<MATCH_PANEL; c++ ) m = s[c] < m ? s[c] : m;
+    return m;
+}
+
+typedef std::pair<float,int> Scored;
+
+/* A max-heap of the k best scores for every query of a range */
+struct KnnCollector
+{
+    size_t         q_begin;
+    int            k;
+    vector<Scored> heap;  // [query][k]
+    vector<int>    count; // [query]
+
+    KnnCollector( size_t q_begin_, size_t n, int k_ )
+        : q_begin( q_begin_ ), k( k_ ), heap( n * k_ ), count( n, 0 )
+    { }
+
+    inline void update( size_t q0, int rows, const float* s, int base )
+    {
+        for( int r=0; r<rows; r++ ) {
+            const size_t  q  = q0 + r - q_begin;
+            Scored*       h  = &heap[q * k];
+            int&          n  = count[q];
+            const float*  sr = &s[r * MATCH_PANEL];
+            if( n == k && not ( panel_min( sr ) < h[0].first ) ) continue;
+
+            for( int c=0; c<MATCH_PANEL; c++ ) {
+                if( n < k ) {
+                    /* padding rows of the last panel have infinite scores */
+                    if( sr[c] == std::numeric_limits<float>::infinity() ) continue;
+                    h[n++] = Scored( sr[c], base + c );
+                    std::push_heap( h, h + n );
+                } else if( sr[c] < h[0].first ) {
+                    std::pop_heap( h, h + k );
+                    h[k-1] = Scored( sr[c], base + c );
+                    std::push_heap( h, h + k );
+                }
+            }
+        }
+    }
+};
+
+/* All (query, train, score) within the radius, in scan order */
+struct RadiusCollector
+{
+    struct Hit
+    {
+        int   query;
+        int   train;
+        float score;
+    };
+
+    const float*  limit; // [query] the squared radius minus |q|^2
+    vector<Hit>   hits;
+
+    inline void update( size_t q0, int rows, const float* s, int base )
+    {
+        for( int r=0; r<rows; r++ ) {
+            const int    q  = (int)( q0 + r );
+            const float  l  = limit[q];
+            const float* sr = &s[r * MATCH_PANEL];
+            if( not ( panel_min( sr ) <= l ) ) continue;
+
+            for( int c=0; c<MATCH_PANEL; c++ ) {
+                if( sr[c] <= l ) {
+                    Hit h = { q, base + c, sr[c] };
+                    hits.push_back( h );
+                }
+            }
+        }
+    }
+};
+
+static void knn_range( const DescriptorMatrix& query, const PackedTrain& packed, PanelKernel kernel,
+                       size_t q_begin, size_t q_end, int k, NeighbourList* result )
+{
+    KnnCollector collector( q_begin, q_end - q_begin, k );
+    scan_range( query, packed, kernel, q_begin, q_end, collector );
+
+    for( size_t q=q_begin; q<q_end; q++ ) {
+        Scored*   h = &collector.heap[( q - q_begin ) * k];
+        const int n = collector.count[q - q_begin];
+        std::sort_heap( h, h + n );
+
+        const size_t o = result->offset[q];
+        for( int i=0; i<n; i++ ) {
+            result->index[o+i] = h[i].second;
+            result->dist[o+i]  = std::max( 0.0f, h[i].first + query.getNorm( q ) );
+        }
+    }
+}
+
+void matchKnn( const DescriptorMatrix& query,
+               const DescriptorMatrix& train,
+               int                     k,
+               NeighbourList&          result,
+               int                     num_threads )
+{
+    check_dims( query, train );
+
+    const size_t num_queries = query.size();
+    const int    n           = (int)std::min( (size_t)std::max( k, 0 ), train.size() );
+
+    result.offset.resize( num_queries + 1 );
+    for( size_t q=0; q<=num_queries; q++ ) result.offset[q] = q * n;
+    result.index.resize( num_queries * n );
+    result.dist.resize( num_queries * n );
+    if( n == 0 || num_queries == 0 ) return;
+
+    const PackedTrain packed( train );
+    const PanelKernel kernel = choosePanelKernel( );
+
+    vector<size_t> begin;
+    num_threads = split_queries( num_queries, num_threads, begin );
+
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( knn_range, boost::cref( query ), boost::cref( packed ),
+                                              kernel, begin[t], begin[t+1], n, &result ) );
+    }
+    knn_range( query, packed, kernel, begin[0], begin[1], n, &result );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+}
+
+static void radius_range( const DescriptorMatrix& query, const PackedTrain& packed, PanelKernel kernel,
+                          size_t q_begin, size_t q_end, RadiusCollector* collector )
+{
+    scan_range( query, packed, kernel, q_begin, q_end, *collector );
+
+    /* group by query, nearest first */
+    std::sort( collector->hits.begin(), collector->hits.end(),
+               []( const RadiusCollector::Hit& a, const RadiusCollector::Hit& b ) {
+                   return a.query < b.query || ( a.query == b.query && a.score < b.score );
+               } );
+}
+
+void matchRadius( const DescriptorMatrix& query,
+                  const DescriptorMatrix& train,
+                  float                   radius,
+                  NeighbourList&          result,
+                  int                     max_count,
+                  int                     num_threads )
+{
+    check_dims( query, train );
+
+    const size_t num_queries = query.size();
+    result.offset.assign( num_queries + 1, 0 );
+    result.index.clear();
+    result.dist.clear();
+    if( num_queries == 0 || train.size() == 0 || not ( radius >= 0.0f ) ) return;
+
+    /* compare scores, which lack |q|^2, with the squared radius */
+    vector<float> limit( num_queries );
+    for( size_t q=0; q<num_queries; q++ ) limit[q] = radius * radius - query.getNorm( q );
+
+    const PackedTrain packed( train );
+    const PanelKernel kernel = choosePanelKernel( );
+
+    vector<size_t> begin;
+    num_threads = split_queries( num_queries, num_threads, begin );
+
+    vector<RadiusCollector> collectors( num_threads );
+    for( RadiusCollector& c : collectors ) c.limit = limit.data();
+
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( radius_range, boost::cref( query ), boost::cref( packed ),
+                                              kernel, begin[t], begin[t+1], &collectors[t] ) );
+    }
+    radius_range( query, packed, kernel, begin[0], begin[1], &collectors[0] );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+
+    /* the threads' hits are in query order, and the threads in order
+     * of their query ranges */
+    for( const RadiusCollector& c : collectors ) {
+        for( const RadiusCollector::Hit& h : c.hits ) result.offset[h.query + 1]++;
+    }
+    if( max_count > 0 ) {
+        for( size_t q=1; q<=num_queries; q++ ) {
+            result.offset[q] = std::min( result.offset[q], (size_t)max_count );
+        }
+    }
+    for( size_t q=0; q<num_queries; q++ ) result.offset[q+1] += result.offset[q];
+
+    result.index.resize( result.offset[num_queries] );
+    result.dist.resize( result.offset[num_queries] );
+    size_t o    = 0;
+    int    last = -1;
+    for( const RadiusCollector& c : collectors ) {
+        for( const RadiusCollector::Hit& h : c.hits ) {
+            if( h.query != last ) {
+                last = h.query;
+                o    = result.offset[h.query];
+            }
+            if( o == result.offset[h.query + 1] ) continue;
+            result.index[o] = h.train;
+            result.dist[o]  = std::max( 0.0f, h.score + query.getNorm( h.query ) );
+            o++;
+        }
+    }
+}
+
+size_t ratioTest( const int* nn, const float* dist, size_t num_queries, float ratio, char* accept )
+{
+    /* the distances are squared */
+    const float r2       = ratio * ratio;
+    size_t      accepted = 0;
+    for( size_t q=0; q<num_queries; q++ ) {
+        accept[q] = nn[2*q+1] >= 0 && dist[2*q] < r2 * dist[2*q+1];
+        accepted += accept[q];
+    }
+    return accepted;
+}
+
+void matchFeatures( const FeaturesHost&  query,
+                    const FeaturesHost&  train,
+                    std::vector<int>&    nn,
+                    std::vector<float>&  dist,
+                    std::vector<char>&   accept,
+                    float                ratio,
+                    int                  num_threads )
+{
+    const DescriptorMatrix q( query );
+    const DescriptorMatrix t( train );
+
+    nn.resize( 2 * q.size() );
+    dist.resize( 2 * q.size() );
+    accept.resize( q.size() );
+
+    matchNearest2( q, t, nn.data(), dist.data(), num_threads );
+    ratioTest( nn.data(), dist.data(), q.size(), ratio, accept.data() );
+}
+
+void matchFeatures( const FeaturesHost& query,
+                    const FeaturesHost& train,
+                    MatchList&          matches,
+                    float               ratio,
+                    int                 num_threads )
+{
+    vector<int> query_rev;
+    vector<int> train_rev;
+    query.getReverseMap( query_rev );
+    train.getReverseMap( train_rev );
+    matchDescriptors( DescriptorMatrix( query ), DescriptorMatrix( train ),
+                      query_rev.data(), train_rev.data(), matches, ratio, false, num_threads );
+}
+
+void matchFeaturesMutual( const FeaturesHost& query,
+                          const FeaturesHost& train,
+                          MatchList&          matches,
+                          float               ratio,
+                          int                 num_threads )
+{
+    vector<int> query_rev;
+    vector<int> train_rev;
+    query.getReverseMap( query_rev );
+    train.getReverseMap( train_rev );
+    matchDescriptors( DescriptorMatrix( query ), DescriptorMatrix( train ),
+                      query_rev.data(), train_rev.data(), matches, ratio, true, num_threads );
+}
+
+void matchDescriptors( const DescriptorMatrix& query,
+                       const DescriptorMatrix& train,
+                       const int*              query_rev,
+                       const int*              train_rev,
+                       MatchList&              matches,
+                       float                   ratio,
+                       bool                    mutual,
+                       int                     num_threads )
+{
+    vector<int>   nn( 2 * query.size() );
+    vector<float> dist( 2 * query.size() );
+    vector<char>  accept( query.size() );
+
+    if( not mutual ) {
+        matchNearest2( query, train, nn.data(), dist.data(), num_threads );
+        ratioTest( nn.data(), dist.data(), query.size(), ratio, accept.data() );
+        matches.assign( nn.data(), dist.data(), accept.data(), query.size(), train.size(), query_rev, train_rev );
+        return;
+    }
+
+    vector<int>   train_nn( 2 * train.size() );
+    vector<float> train_dist( 2 * train.size() );
+    vector<char>  train_accept( train.size() );
+
+    matchNearest2Symmetric( query, train, nn.data(), dist.data(), train_nn.data(), train_dist.data(), num_threads );
+    ratioTest( nn.data(), dist.data(), query.size(), ratio, accept.data() );
+    ratioTest( train_nn.data(), train_dist.data(), train.size(), ratio, train_accept.data() );
+
+    MatchList reverse;
+    matches.assign( nn.data(), dist.data(), accept.data(), query.size(), train.size(), query_rev, train_rev );
+    reverse.assign( train_nn.data(), train_dist.data(), train_accept.data(), train.size(), query.size(),
+                    train_rev, query_rev );
+    matches.keepMutual( reverse );
+}
+
+} // namespace popsift
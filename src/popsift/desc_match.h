@@ -0,0 +1,175 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+#include "sift_conf.h"
+
+namespace popsift {
+
+class FeaturesHost;
+class FeaturesSoA;
+class MatchList;
+
+/* The descriptors of one image as a contiguous float matrix with the
+ * squared norm of every row, the form in which the host matchers
+ * compare them. Half and uint8 descriptors are converted once when the
+ * matrix is filled, so that the matching loops only see floats.
+ */
+class DescriptorMatrix
+{
+public:
+    DescriptorMatrix( );
+    explicit DescriptorMatrix( const FeaturesHost& features );
+    explicit DescriptorMatrix( const FeaturesSoA& features );
+
+    /** Copy count rows of dim values of type, stride bytes apart */
+    void assign( const void* desc, Config::DescType type, size_t count, size_t stride, int dim );
+
+    void assign( const FeaturesHost& features );
+    void assign( const FeaturesSoA& features );
+
+    inline size_t size( ) const   { return _count; }
+    inline int    getDim( ) const { return _dim; }
+
+    inline const float* getRow( size_t i ) const  { return &_data[i * _dim]; }
+    inline float        getNorm( size_t i ) const { return _norms[i]; }
+    inline const float* getNorms( ) const         { return _norms.data(); }
+
+private:
+    size_t             _count;
+    int                _dim;
+    std::vector<float> _data;  // [count][dim]
+    std::vector<float> _norms; // squared L2 norms of the rows
+};
+
+/* For every row of query, the two rows of train with the smallest L2
+ * distance, by brute force. nn and dist have room for 2 * query.size()
+ * values; nn[2q] is the nearest train row of query row q and nn[2q+1]
+ * the second nearest, -1 if train has fewer rows. The distances are
+ * squared L2 distances, as in adcMatch.
+ *
+ * Distances are computed as |q|^2 + |t|^2 - 2 q.t, the dot products
+ * like a matrix product: tiles of train rows are packed for a small
+ * kernel that multiplies 4 queries with 16 train rows, using AVX2 and
+ * FMA if the CPU has them. Query rows are split between num_threads
+ * threads, 0 picks the number of cores.
+ */
+void matchNearest2( const DescriptorMatrix& query,
+                    const DescriptorMatrix& train,
+                    int*                    nn,
+                    float*                  dist,
+                    int                     num_threads = 0 );
+
+/* matchNearest2 in both directions in one pass over the distances:
+ * train_nn and train_dist receive the two nearest query rows of every
+ * train row, 2 * train.size() values, like nn and dist for the query
+ * rows. Costs little more than matchNearest2 because the distances
+ * are computed once. */
+void matchNearest2Symmetric( const DescriptorMatrix& query,
+                             const DescriptorMatrix& train,
+                             int*                    nn,
+                             float*                  dist,
+                             int*                    train_nn,
+                             float*                  train_dist,
+                             int                     num_threads = 0 );
+
+/* The neighbours of many queries in compressed sparse row form: the
+ * neighbours of query q are index[offset[q]] .. index[offset[q+1]-1],
+ * nearest first, with their squared L2 distances at the same positions
+ * in dist. All queries share three arrays, so that a search does not
+ * allocate per query.
+ */
+struct NeighbourList
+{
+    std::vector<size_t> offset; // size() + 1 entries
+    std::vector<int>    index;
+    std::vector<float>  dist;
+
+    inline size_t size( ) const             { return offset.empty() ? 0 : offset.size() - 1; }
+    inline size_t count( size_t q ) const   { return offset[q+1] - offset[q]; }
+    inline const int*   getIndices( size_t q ) const   { return &index[offset[q]]; }
+    inline const float* getDistances( size_t q ) const { return &dist[offset[q]]; }
+};
+
+/* The k nearest train rows of every query row, or all train rows if
+ * there are fewer than k, by brute force with the kernels of
+ * matchNearest2. Every query keeps a bounded heap of its k best rows;
+ * a panel is only inserted if its best distance beats the heap. */
+void matchKnn( const DescriptorMatrix& query,
+               const DescriptorMatrix& train,
+               int                     k,
+               NeighbourList&          result,
+               int                     num_threads = 0 );
+
+/* All train rows within L2 distance radius of every query row, nearest
+ * first. With max_count > 0, only the max_count nearest are kept for
+ * each query. The rows found by a thread are collected before they
+ * are sorted, so a radius that includes most of train needs memory
+ * for all pairs. */
+void matchRadius( const DescriptorMatrix& query,
+                  const DescriptorMatrix& train,
+                  float                   radius,
+                  NeighbourList&          result,
+                  int                     max_count   = 0,
+                  int                     num_threads = 0 );
+
+/* Lowe's ratio test on the result of matchNearest2: accept[q] is 1 if
+ * the L2 distance to the nearest train row is less than ratio times
+ * the distance to the second nearest, 0 otherwise or if there is no
+ * second nearest. Returns the number of accepted queries. */
+size_t ratioTest( const int* nn, const float* dist, size_t num_queries, float ratio, char* accept );
+
+/* Brute-force 2-NN matching of all descriptors of query against those
+ * of train on the host, followed by the ratio test. nn and dist
+ * receive 2 values per query descriptor, accept one; see
+ * matchNearest2 and ratioTest. Descriptors must have the same
+ * dimension, their types may differ.
+ */
+void matchFeatures( const FeaturesHost&  query,
+                    const FeaturesHost&  train,
+                    std::vector<int>&    nn,
+                    std::vector<float>&  dist,
+                    std::vector<char>&   accept,
+                    float                ratio       = 0.8f,
+                    int                  num_threads = 0 );
+
+/* The same, with the result as a MatchList that carries the feature
+ * indices of the descriptors as well */
+void matchFeatures( const FeaturesHost& query,
+                    const FeaturesHost& train,
+                    MatchList&          matches,
+                    float               ratio       = 0.8f,
+                    int                 num_threads = 0 );
+
+/* Symmetric matching: a match is accepted only if it passes the ratio
+ * test in both directions and query and train descriptor are each
+ * other's nearest neighbour, see MatchList::keepMutual. This removes
+ * many of the false matches that pass the one-sided test. */
+void matchFeaturesMutual( const FeaturesHost& query,
+                          const FeaturesHost& train,
+                          MatchList&          matches,
+                          float               ratio       = 0.8f,
+                          int                 num_threads = 0 );
+
+/* matchFeatures, or matchFeaturesMutual if mutual is true, for
+ * descriptors that are already in matrices. query_rev and train_rev
+ * map rows to features, see FeaturesHost::getReverseMap; they may be 0
+ * if the feature indices are not needed. */
+void matchDescriptors( const DescriptorMatrix& query,
+                       const DescriptorMatrix& train,
+                       const int*              query_rev,
+                       const int*              train_rev,
+                       MatchList&              matches,
+                       float                   ratio       = 0.8f,
+                       bool                    mutual      = false,
+                       int                     num_threads = 0 );
+
+} // namespace popsift
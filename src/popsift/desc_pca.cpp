@@ -0,0 +1,345 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+#include <iso646.h>
+
+#include <cuda_runtime.h>
+
+#include "desc_pca.h"
+#include "desc_convert.h"
+#include "features_soa.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(PcaBasisHeader) == 64, "PcaBasisHeader must be 64 bytes" );
+
+/* rows that are updated together with one row of the basis */
+#define PCA_ROW_BLOCK 8
+
+/* Eigen decomposition of the symmetric n x n matrix a (row-major) with
+ * the cyclic Jacobi method. a is destroyed, its diagonal holds the
+ * eigenvalues on return, and column i of v the eigenvector of a[i][i].
+ * Slow for big matrices, but exact enough and only run at training.
+ */
+static void jacobi_eigen( vector<double>& a, vector<double>& v, int n )
+{
+    v.assign( n * n, 0.0 );
+    for( int i=0; i<n; i++ ) v[i*n+i] = 1.0;
+
+    for( int sweep=0; sweep<100; sweep++ ) {
+        double off  = 0.0;
+        double diag = 0.0;
+        for( int p=0; p<n; p++ ) {
+            diag += a[p*n+p] * a[p*n+p];
+            for( int q=p+1; q<n; q++ ) off += a[p*n+q] * a[p*n+q];
+        }
+        if( off <= 1e-24 * diag ) break;
+
+        for( int p=0; p<n; p++ ) {
+            for( int q=p+1; q<n; q++ ) {
+                const double apq = a[p*n+q];
+                if( fabs( apq ) < 1e-300 ) continue;
+
+                /* rotation that zeroes a[p][q] */
+                const double theta = ( a[q*n+q] - a[p*n+p] ) / ( 2.0 * apq );
+                const double t     = ( theta >= 0.0 ? 1.0 : -1.0 ) / ( fabs( theta ) + sqrt( theta * theta + 1.0 ) );
+                const double c     = 1.0 / sqrt( t * t + 1.0 );
+                const double s     = t * c;
+
+                for( int k=0; k<n; k++ ) {
+                    const double akp = a[k*n+p];
+                    const double akq = a[k*n+q];
+                    a[k*n+p] = c * akp - s * akq;
+                    a[k*n+q] = s * akp + c * akq;
+                }
+                for( int k=0; k<n; k++ ) {
+                    const double apk = a[p*n+k];
+                    const double aqk = a[q*n+k];
+                    a[p*n+k] = c * apk - s * aqk;
+                    a[q*n+k] = s * apk + c * aqk;
+                }
+                for( int k=0; k<n; k++ ) {
+                    const double vkp = v[k*n+p];
+                    const double vkq = v[k*n+q];
+                    v[k*n+p] = c * vkp - s * vkq;
+                    v[k*n+q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+}
+
+/*************************************************************
+ * PcaBasis
+ *************************************************************/
+
+PcaBasis::PcaBasis( )
+    : _input_dim( 0 )
+    , _num_components( 0 )
+    , _num_samples( 0 )
+{ }
+
+bool PcaBasis::train( const float* desc, size_t count, size_t stride, int input_dim, int num_components )
+{
+    if( num_components <= 0 || num_components > input_dim ) num_components = input_dim;
+
+    if( count < 2 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot train a PCA basis from "
+             << count << " descriptors" << endl;
+        return false;
+    }
+
+    const int n = input_dim;
+
+    /* mean and covariance in double, the sums are long */
+    vector<double> mean( n, 0.0 );
+    for( size_t i=0; i<count; i++ ) {
+        const float* row = (const float*)( (const char*)desc + i * stride );
+        for( int k=0; k<n; k++ ) mean[k] += row[k];
+    }
+    for( int k=0; k<n; k++ ) mean[k] /= count;
+
+    vector<double> cov( n * n, 0.0 );
+    vector<double> d( n );
+    for( size_t i=0; i<count; i++ ) {
+        const float* row = (const float*)( (const char*)desc + i * stride );
+        for( int k=0; k<n; k++ ) d[k] = row[k] - mean[k];
+        for( int p=0; p<n; p++ ) {
+            const double dp  = d[p];
+            double*      out = &cov[p*n];
+            for( int q=p; q<n; q++ ) out[q] += dp * d[q];
+        }
+    }
+    for( int p=0; p<n; p++ ) {
+        for( int q=p; q<n; q++ ) {
+            cov[p*n+q] /= ( count - 1 );
+            cov[q*n+p]  = cov[p*n+q];
+        }
+    }
+
+    vector<double> vec;
+    jacobi_eigen( cov, vec, n );
+
+    vector<int> order( n );
+    for( int i=0; i<n; i++ ) order[i] = i;
+    sort( order.begin(), order.end(), [&]( int l, int r ) { return cov[l*n+l] > cov[r*n+r]; } );
+
+    _input_dim      = n;
+    _num_components = num_components;
+    _num_samples    = count;
+    _mean.resize( n );
+    _eigenvalues.resize( num_components );
+    _components.resize( num_components * n );
+
+    for( int k=0; k<n; k++ ) _mean[k] = (float)mean[k];
+
+    for( int c=0; c<num_components; c++ ) {
+        const int col = order[c];
+        _eigenvalues[c] = (float)std::max( cov[col*n+col], 0.0 );
+
+        /* make the largest entry positive, so that training on the same
+         * sample gives the same basis */
+        int big = 0;
+        for( int k=1; k<n; k++ ) {
+            if( fabs( vec[k*n+col] ) > fabs( vec[big*n+col] ) ) big = k;
+        }
+        const double sign = vec[big*n+col] < 0.0 ? -1.0 : 1.0;
+        for( int k=0; k<n; k++ ) {
+            _components[c*n+k] = (float)( sign * vec[k*n+col] );
+        }
+    }
+
+    prepare( );
+    return true;
+}
+
+void PcaBasis::prepare( )
+{
+    const int n  = _input_dim;
+    const int nc = _num_components;
+
+    _transposed.resize( n * nc );
+    for( int c=0; c<nc; c++ ) {
+        for( int k=0; k<n; k++ ) {
+            _transposed[k*nc+c] = _components[c*n+k];
+        }
+    }
+
+    /* subtracting the mean is folded into a constant per output */
+    _offset.resize( nc );
+    for( int c=0; c<nc; c++ ) {
+        double sum = 0.0;
+        for( int k=0; k<n; k++ ) sum += (double)_mean[k] * _components[c*n+k];
+        _offset[c] = (float)-sum;
+    }
+}
+
+bool PcaBasis::save( const std::string& filename ) const
+{
+    PcaBasisHeader hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_PCA_FILE_MAGIC, sizeof(hdr.magic) );
+    hdr.version         = POPSIFT_PCA_FILE_VERSION;
+    hdr.header_size     = sizeof(PcaBasisHeader);
+    hdr.byte_order_mark = 0x01020304;
+    hdr.input_dim       = _input_dim;
+    hdr.num_components  = _num_components;
+    hdr.num_samples     = _num_samples;
+
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+    of.write( (const char*)&hdr, sizeof(hdr) );
+    of.write( (const char*)_mean.data(),        _mean.size()        * sizeof(float) );
+    of.write( (const char*)_eigenvalues.data(), _eigenvalues.size() * sizeof(float) );
+    of.write( (const char*)_components.data(),  _components.size()  * sizeof(float) );
+    if( not of.good() ) {
+        cerr << "Failed to write PCA basis to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool PcaBasis::load( const std::string& filename )
+{
+    ifstream file( filename.c_str(), ios::binary );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return false;
+    }
+
+    PcaBasisHeader hdr;
+    if( not file.read( (char*)&hdr, sizeof(hdr) ) ||
+        memcmp( hdr.magic, POPSIFT_PCA_FILE_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << filename << " is not a PopSift PCA basis file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << filename << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_PCA_FILE_VERSION ) {
+        cerr << "File " << filename << " has PCA file version " << hdr.version
+             << ", this reader supports version " << POPSIFT_PCA_FILE_VERSION << endl;
+        return false;
+    }
+    if( hdr.header_size < sizeof(PcaBasisHeader) || hdr.input_dim == 0 || hdr.input_dim > 4096 ||
+        hdr.num_components == 0 || hdr.num_components > hdr.input_dim ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+
+    _input_dim      = hdr.input_dim;
+    _num_components = hdr.num_components;
+    _num_samples    = hdr.num_samples;
+    _mean.resize( _input_dim );
+    _eigenvalues.resize( _num_components );
+    _components.resize( _num_components * _input_dim );
+
+    file.seekg( hdr.header_size, ios::beg );
+    file.read( (char*)_mean.data(),        _mean.size()        * sizeof(float) );
+    file.read( (char*)_eigenvalues.data(), _eigenvalues.size() * sizeof(float) );
+    file.read( (char*)_components.data(),  _components.size()  * sizeof(float) );
+    if( not file.good() ) {
+        cerr << "File " << filename << " is truncated" << endl;
+        _num_components = 0;
+        return false;
+    }
+
+    prepare( );
+    return true;
+}
+
+void PcaBasis::project( const float* src, size_t count, size_t src_stride,
+                        float* dst, size_t dst_stride, int out_dim ) const
+{
+    const int    n  = _input_dim;
+    const int    nc = _num_components;
+    const float* bt = _transposed.data();
+
+    /* accumulate in a local tile, the compiler knows that it does not
+     * alias the basis and keeps it in L1 */
+    vector<float> tile( PCA_ROW_BLOCK * out_dim );
+    float*        acc = tile.data();
+
+    for( size_t i0=0; i0<count; i0+=PCA_ROW_BLOCK ) {
+        const int rows = (int)std::min( (size_t)PCA_ROW_BLOCK, count - i0 );
+
+        const float* in[PCA_ROW_BLOCK];
+        for( int r=0; r<rows; r++ ) {
+            in[r] = (const float*)( (const char*)src + ( i0 + r ) * src_stride );
+            memcpy( &acc[r * out_dim], _offset.data(), out_dim * sizeof(float) );
+        }
+
+        /* rank-1 updates of the row block, the inner loop vectorizes */
+        for( int k=0; k<n; k++ ) {
+            const float* __restrict__ b = &bt[k*nc];
+            for( int r=0; r<rows; r++ ) {
+                const float         x = in[r][k];
+                float* __restrict__ o = &acc[r * out_dim];
+                for( int c=0; c<out_dim; c++ ) {
+                    o[c] += x * b[c];
+                }
+            }
+        }
+
+        for( int r=0; r<rows; r++ ) {
+            memcpy( (char*)dst + ( i0 + r ) * dst_stride, &acc[r * out_dim], out_dim * sizeof(float) );
+        }
+    }
+}
+
+FeaturesSoA* PcaBasis::project( const FeaturesSoA& features, int out_dim ) const
+{
+    if( features.getDescDim() != _input_dim ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot project " << features.getDescDim()
+             << "-dimensional descriptors with a " << _input_dim << "-dimensional PCA basis" << endl;
+        return 0;
+    }
+    if( out_dim <= 0 || out_dim > _num_components ) {
+        cerr << __FILE__ << ":" << __LINE__ << " The PCA basis has " << _num_components
+             << " components, cannot project to " << out_dim << " dimensions" << endl;
+        return 0;
+    }
+
+    const int num_kpt  = features.getKeypointCount();
+    const int num_desc = features.getDescriptorCount();
+
+    FeaturesSoA* result = new FeaturesSoA( features.getFeatureCount(), num_kpt, num_desc,
+                                           Config::FloatDesc, out_dim );
+
+    result->copyKeypoints( features );
+
+    if( features.getDescType() == Config::FloatDesc ) {
+        project( (const float*)features.getDescriptorData(), num_desc, features.getDescStride(),
+                 (float*)result->getDescriptorData(), result->getDescStride(), out_dim );
+        return result;
+    }
+
+    /* compact types are expanded one row block at a time */
+    vector<float> block( PCA_ROW_BLOCK * _input_dim );
+    for( int i0=0; i0<num_desc; i0+=PCA_ROW_BLOCK ) {
+        const int rows = std::min( PCA_ROW_BLOCK, num_desc - i0 );
+        for( int r=0; r<rows; r++ ) {
+            features.getDescriptorAsFloat( i0 + r, &block[r * _input_dim] );
+        }
+        project( block.data(), rows, _input_dim * sizeof(float),
+                 (float*)result->getDescriptor( i0 ), result->getDescStride(), out_dim );
+    }
+    return result;
+}
+
+} // namespace popsift
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace popsift {
+
+class FeaturesSoA;
+
+#define POPSIFT_PCA_FILE_MAGIC   "PSPCA\r\n"
+#define POPSIFT_PCA_FILE_VERSION 1
+
+/* Header of a PCA basis file (host byte order, checked with
+ * byte_order_mark). It is followed by
+ *     float mean[input_dim]
+ *     float eigenvalues[num_components]
+ *     float components[num_components][input_dim]
+ * with the components sorted by decreasing eigenvalue.
+ */
+struct PcaBasisHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark; // 0x01020304
+    uint32_t input_dim;
+    uint32_t num_components;
+    uint32_t reserved0;
+    uint64_t num_samples;     // descriptors used for training
+    uint8_t  reserved[24];
+};
+
+/* A PCA basis for reducing descriptors from 128 to fewer dimensions,
+ * typically 32, 64 or 96. The basis is trained once over a sample of
+ * extracted (and normalized) descriptors, saved, and loaded by the
+ * programs that project.
+ *
+ * project() computes (x - mean) * C^T for a block of descriptor rows,
+ * where C holds the first out_dim components. It is a blocked SGEMM:
+ * a group of rows is multiplied with one row of the transposed basis
+ * at a time, so the basis row stays in L1 while the group is updated.
+ */
+class PcaBasis
+{
+public:
+    PcaBasis( );
+
+    /** Train over count descriptors of input_dim floats, stride bytes
+     *  apart. Keeps num_components components, all if 0.
+     *  Returns false if count is too small. */
+    bool train( const float* desc, size_t count, size_t stride,
+                int input_dim = 128, int num_components = 0 );
+
+    /** Returns false and explains why on cerr if the file cannot be
+     *  read or is not a PCA basis file. */
+    bool load( const std::string& filename );
+    bool save( const std::string& filename ) const;
+
+    inline bool   isValid( ) const           { return _num_components > 0; }
+    inline int    getInputDim( ) const       { return _input_dim; }
+    inline int    getComponentCount( ) const { return _num_components; }
+    inline size_t getSampleCount( ) const    { return _num_samples; }
+
+    inline const float* getMean( ) const               { return _mean.data(); }
+    inline const float* getEigenvalues( ) const        { return _eigenvalues.data(); }
+    inline const float* getComponent( int c ) const    { return &_components[c * _input_dim]; }
+
+    /** Project count rows of getInputDim() floats at src, src_stride
+     *  bytes apart, to out_dim floats at dst, dst_stride bytes apart.
+     *  out_dim must not exceed getComponentCount(). */
+    void project( const float* src, size_t count, size_t src_stride,
+                  float* dst, size_t dst_stride, int out_dim ) const;
+
+    /** A copy of features with out_dim-dimensional float descriptors.
+     *  Descriptors of other types are converted to float first.
+     *  The caller must delete the result. */
+    FeaturesSoA* project( const FeaturesSoA& features, int out_dim ) const;
+
+private:
+    void prepare( );
+
+    int                _input_dim;
+    int                _num_components;
+    size_t             _num_samples;
+    std::vector<float> _mean;
+    std::vector<float> _eigenvalues;
+    std::vector<float> _components;   // num_components x input_dim
+
+    /* derived by prepare() */
+    std::vector<float> _transposed;   // input_dim x num_components
+    std::vector<float> _offset;       // -mean * C^T
+};
+
+} // namespace popsift
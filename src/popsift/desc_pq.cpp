@@ -0,0 +1,428 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <limits>
+#include <string.h>
+#include <math.h>
+#include <iso646.h>
+
+#include <cuda_runtime.h>
+
+#include "desc_pq.h"
+#include "desc_convert.h"
+#include "features_soa.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(PqCodebookHeader) == 64, "PqCodebookHeader must be 64 bytes" );
+
+#define PQ_K POPSIFT_PQ_CENTROIDS
+
+/* rows converted to float at a time when encoding compact types */
+#define PQ_ROW_BLOCK 64
+
+/* codes scanned into a distance buffer at a time by adcMatch */
+#define PQ_SCAN_BLOCK 1024
+
+/* Index of the centroid nearest to x. ct holds the centroids of one
+ * subspace transposed (d x 256), norms their squared norms. The
+ * distance without |x|^2, which is the same for all centroids, is
+ * computed for 256 centroids at once so that the loop vectorizes.
+ */
+static inline int nearest_centroid( const float* x, const float* ct, const float* norms, int d, float* scratch )
+{
+    for( int c=0; c<PQ_K; c++ ) scratch[c] = norms[c];
+    for( int j=0; j<d; j++ ) {
+        const float  xj  = -2.0f * x[j];
+        const float* row = &ct[j * PQ_K];
+        for( int c=0; c<PQ_K; c++ ) scratch[c] += xj * row[c];
+    }
+
+    int best = 0;
+    for( int c=1; c<PQ_K; c++ ) {
+        if( scratch[c] < scratch[best] ) best = c;
+    }
+    return best;
+}
+
+static void transpose_centroids( const float* centroids, int d, float* ct, float* norms )
+{
+    for( int c=0; c<PQ_K; c++ ) {
+        float n = 0.0f;
+        for( int j=0; j<d; j++ ) {
+            const float v = centroids[c * d + j];
+            ct[j * PQ_K + c] = v;
+            n += v * v;
+        }
+        norms[c] = n;
+    }
+}
+
+/* Lloyd's k-means with 256 centers over n contiguous points of d
+ * values. Centers start at distinct random points; an empty cluster
+ * takes over half of the biggest one.
+ */
+static void kmeans( const float* data, size_t n, int d, int iterations, std::mt19937_64& rng, float* centroids )
+{
+    vector<size_t> perm( n );
+    std::iota( perm.begin(), perm.end(), 0 );
+    for( int c=0; c<PQ_K; c++ ) {
+        std::uniform_int_distribution<size_t> pick( c, n - 1 );
+        std::swap( perm[c], perm[pick( rng )] );
+        memcpy( &centroids[c * d], &data[perm[c] * d], d * sizeof(float) );
+    }
+
+    vector<float>  ct( d * PQ_K );
+    vector<float>  norms( PQ_K );
+    vector<float>  scratch( PQ_K );
+    vector<int>    assign( n );
+    vector<double> sums( PQ_K * d );
+    vector<size_t> counts( PQ_K );
+
+    for( int it=0; it<iterations; it++ ) {
+        transpose_centroids( centroids, d, ct.data(), norms.data() );
+
+        size_t changed = 0;
+        for( size_t i=0; i<n; i++ ) {
+            const int c = nearest_centroid( &data[i * d], ct.data(), norms.data(), d, scratch.data() );
+            if( it == 0 || c != assign[i] ) changed++;
+            assign[i] = c;
+        }
+        if( changed == 0 ) break;
+
+        std::fill( sums.begin(), sums.end(), 0.0 );
+        std::fill( counts.begin(), counts.end(), 0 );
+        for( size_t i=0; i<n; i++ ) {
+            const int c = assign[i];
+            counts[c]++;
+            for( int j=0; j<d; j++ ) sums[c * d + j] += data[i * d + j];
+        }
+        for( int c=0; c<PQ_K; c++ ) {
+            if( counts[c] == 0 ) continue;
+            for( int j=0; j<d; j++ ) centroids[c * d + j] = (float)( sums[c * d + j] / counts[c] );
+        }
+
+        for( int c=0; c<PQ_K; c++ ) {
+            if( counts[c] != 0 ) continue;
+
+            const int big = (int)( std::max_element( counts.begin(), counts.end() ) - counts.begin() );
+            std::uniform_real_distribution<float> jitter( -1e-4f, 1e-4f );
+            for( int j=0; j<d; j++ ) {
+                const float v  = centroids[big * d + j];
+                const float e  = jitter( rng ) * ( fabsf( v ) + 1e-6f );
+                centroids[c   * d + j] = v + e;
+                centroids[big * d + j] = v - e;
+            }
+            counts[c]    = counts[big] / 2;
+            counts[big] -= counts[c];
+        }
+    }
+}
+
+/*************************************************************
+ * PqCodebook
+ *************************************************************/
+
+PqCodebook::PqCodebook( )
+    : _dim( 0 )
+    , _num_subspaces( 0 )
+    , _sub_dim( 0 )
+    , _num_samples( 0 )
+{ }
+
+bool PqCodebook::train( const float* desc, size_t count, size_t stride,
+                        int dim, int num_subspaces, int iterations, unsigned seed )
+{
+    if( num_subspaces <= 0 || dim <= 0 || dim % num_subspaces != 0 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot split " << dim
+             << " dimensions into " << num_subspaces << " subspaces" << endl;
+        return false;
+    }
+    if( count < PQ_K ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot train " << PQ_K
+             << " centroids from " << count << " descriptors" << endl;
+        return false;
+    }
+
+    _dim           = dim;
+    _num_subspaces = num_subspaces;
+    _sub_dim       = dim / num_subspaces;
+    _num_samples   = count;
+    _centroids.resize( num_subspaces * PQ_K * _sub_dim );
+
+    std::mt19937_64 rng( seed );
+    vector<float>   sub( count * _sub_dim );
+    for( int m=0; m<num_subspaces; m++ ) {
+        for( size_t i=0; i<count; i++ ) {
+            const float* row = (const float*)( (const char*)desc + i * stride );
+            memcpy( &sub[i * _sub_dim], &row[m * _sub_dim], _sub_dim * sizeof(float) );
+        }
+        kmeans( sub.data(), count, _sub_dim, iterations, rng, &_centroids[m * PQ_K * _sub_dim] );
+    }
+
+    prepare( );
+    return true;
+}
+
+void PqCodebook::prepare( )
+{
+    _transposed.resize( _num_subspaces * _sub_dim * PQ_K );
+    _norms.resize( _num_subspaces * PQ_K );
+    for( int m=0; m<_num_subspaces; m++ ) {
+        transpose_centroids( &_centroids[m * PQ_K * _sub_dim], _sub_dim,
+                             &_transposed[m * _sub_dim * PQ_K], &_norms[m * PQ_K] );
+    }
+}
+
+unsigned long long PqCodebook::getFingerprint( ) const
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    auto mix = [&h]( const void* ptr, size_t len ) {
+        const unsigned char* p = (const unsigned char*)ptr;
+        for( size_t i=0; i<len; i++ ) {
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
+        }
+    };
+    mix( &_dim, sizeof(_dim) );
+    mix( &_num_subspaces, sizeof(_num_subspaces) );
+    mix( _centroids.data(), _centroids.size() * sizeof(float) );
+    return h;
+}
+
+bool PqCodebook::save( const std::string& filename ) const
+{
+    PqCodebookHeader hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_PQ_FILE_MAGIC, sizeof(hdr.magic) );
+    hdr.version         = POPSIFT_PQ_FILE_VERSION;
+    hdr.header_size     = sizeof(PqCodebookHeader);
+    hdr.byte_order_mark = 0x01020304;
+    hdr.dim             = _dim;
+    hdr.num_subspaces   = _num_subspaces;
+    hdr.num_samples     = _num_samples;
+
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+    of.write( (const char*)&hdr, sizeof(hdr) );
+    of.write( (const char*)_centroids.data(), _centroids.size() * sizeof(float) );
+    if( not of.good() ) {
+        cerr << "Failed to write PQ codebook to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool PqCodebook::load( const std::string& filename )
+{
+    ifstream file( filename.c_str(), ios::binary );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return false;
+    }
+
+    PqCodebookHeader hdr;
+    if( not file.read( (char*)&hdr, sizeof(hdr) ) ||
+        memcmp( hdr.magic, POPSIFT_PQ_FILE_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << filename << " is not a PopSift PQ codebook file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << filename << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_PQ_FILE_VERSION ) {
+        cerr << "File " << filename << " has PQ codebook version " << hdr.version
+             << ", this reader supports version " << POPSIFT_PQ_FILE_VERSION << endl;
+        return false;
+    }
+    if( hdr.header_size < sizeof(PqCodebookHeader) || hdr.dim == 0 || hdr.dim > 4096 ||
+        hdr.num_subspaces == 0 || hdr.dim % hdr.num_subspaces != 0 ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+
+    _dim           = hdr.dim;
+    _num_subspaces = hdr.num_subspaces;
+    _sub_dim       = hdr.dim / hdr.num_subspaces;
+    _num_samples   = hdr.num_samples;
+    _centroids.resize( _num_subspaces * PQ_K * _sub_dim );
+
+    file.seekg( hdr.header_size, ios::beg );
+    file.read( (char*)_centroids.data(), _centroids.size() * sizeof(float) );
+    if( not file.good() ) {
+        cerr << "File " << filename << " is truncated" << endl;
+        _num_subspaces = 0;
+        return false;
+    }
+
+    prepare( );
+    return true;
+}
+
+void PqCodebook::encode( const float* src, size_t count, size_t src_stride,
+                         uint8_t* codes, size_t code_stride ) const
+{
+    vector<float> scratch( PQ_K );
+    for( size_t i=0; i<count; i++ ) {
+        const float* row  = (const float*)( (const char*)src + i * src_stride );
+        uint8_t*     code = codes + i * code_stride;
+        for( int m=0; m<_num_subspaces; m++ ) {
+            code[m] = (uint8_t)nearest_centroid( &row[m * _sub_dim],
+                                                 &_transposed[m * _sub_dim * PQ_K],
+                                                 &_norms[m * PQ_K],
+                                                 _sub_dim, scratch.data() );
+        }
+    }
+}
+
+FeaturesSoA* PqCodebook::encode( const FeaturesSoA& features ) const
+{
+    if( features.getDescDim() != _dim ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot encode " << features.getDescDim()
+             << "-dimensional descriptors with a " << _dim << "-dimensional codebook" << endl;
+        return 0;
+    }
+
+    const int num_desc = features.getDescriptorCount();
+
+    FeaturesSoA* result = new FeaturesSoA( features.getFeatureCount(), features.getKeypointCount(), num_desc,
+                                           Config::UInt8Desc, getCodeSize() );
+    result->copyKeypoints( features );
+
+    if( features.getDescType() == Config::FloatDesc ) {
+        encode( (const float*)features.getDescriptorData(), num_desc, features.getDescStride(),
+                (uint8_t*)result->getDescriptorData(), result->getDescStride() );
+        return result;
+    }
+
+    vector<float> block( PQ_ROW_BLOCK * _dim );
+    for( int i0=0; i0<num_desc; i0+=PQ_ROW_BLOCK ) {
+        const int rows = std::min( PQ_ROW_BLOCK, num_desc - i0 );
+        for( int r=0; r<rows; r++ ) {
+            features.getDescriptorAsFloat( i0 + r, &block[r * _dim] );
+        }
+        encode( block.data(), rows, _dim * sizeof(float),
+                (uint8_t*)result->getDescriptor( i0 ), result->getDescStride() );
+    }
+    return result;
+}
+
+void PqCodebook::decode( const uint8_t* code, float* dst ) const
+{
+    for( int m=0; m<_num_subspaces; m++ ) {
+        memcpy( &dst[m * _sub_dim], getCentroid( m, code[m] ), _sub_dim * sizeof(float) );
+    }
+}
+
+void PqCodebook::computeDistanceTable( const float* query, float* table ) const
+{
+    for( int m=0; m<_num_subspaces; m++ ) {
+        const float* x  = &query[m * _sub_dim];
+        const float* ct = &_transposed[m * _sub_dim * PQ_K];
+        float*       t  = &table[m * PQ_K];
+
+        float xx = 0.0f;
+        for( int j=0; j<_sub_dim; j++ ) xx += x[j] * x[j];
+
+        /* |x-c|^2 = |x|^2 - 2 x.c + |c|^2, clamped against rounding */
+        for( int c=0; c<PQ_K; c++ ) t[c] = xx + _norms[m * PQ_K + c];
+        for( int j=0; j<_sub_dim; j++ ) {
+            const float  xj  = -2.0f * x[j];
+            const float* row = &ct[j * PQ_K];
+            for( int c=0; c<PQ_K; c++ ) t[c] += xj * row[c];
+        }
+        for( int c=0; c<PQ_K; c++ ) t[c] = std::max( t[c], 0.0f );
+    }
+}
+
+/*************************************************************
+ * ADC
+ *************************************************************/
+
+void adcScan( const float* table, int num_subspaces,
+              const uint8_t* codes, size_t count, size_t code_stride,
+              float* dist )
+{
+    /* four codes at a time, their table lookups are independent
+     * and overlap in the load units */
+    size_t i = 0;
+    for( ; i+4<=count; i+=4 ) {
+        const uint8_t* c0 = codes + ( i + 0 ) * code_stride;
+        const uint8_t* c1 = codes + ( i + 1 ) * code_stride;
+        const uint8_t* c2 = codes + ( i + 2 ) * code_stride;
+        const uint8_t* c3 = codes + ( i + 3 ) * code_stride;
+        float d0 = 0.0f, d1 = 0.0f, d2 = 0.0f, d3 = 0.0f;
+        for( int m=0; m<num_subspaces; m++ ) {
+            const float* t = &table[m * PQ_K];
+            d0 += t[c0[m]];
+            d1 += t[c1[m]];
+            d2 += t[c2[m]];
+            d3 += t[c3[m]];
+        }
+        dist[i+0] = d0;
+        dist[i+1] = d1;
+        dist[i+2] = d2;
+        dist[i+3] = d3;
+    }
+    for( ; i<count; i++ ) {
+        dist[i] = adcDistance( table, codes + i * code_stride, num_subspaces );
+    }
+}
+
+void adcMatch( const PqCodebook& codebook,
+               const float* queries, size_t num_queries, size_t query_stride,
+               const uint8_t* codes, size_t count, size_t code_stride,
+               int* nn, float* dist )
+{
+    const int     m = codebook.getSubspaceCount();
+    vector<float> table( m * PQ_K );
+    vector<float> d( PQ_SCAN_BLOCK );
+
+    for( size_t q=0; q<num_queries; q++ ) {
+        const float* query = (const float*)( (const char*)queries + q * query_stride );
+        codebook.computeDistanceTable( query, table.data() );
+
+        int   best1 = -1,                               best2 = -1;
+        float dist1 = std::numeric_limits<float>::max(), dist2 = std::numeric_limits<float>::max();
+
+        for( size_t i0=0; i0<count; i0+=PQ_SCAN_BLOCK ) {
+            const size_t n = std::min( (size_t)PQ_SCAN_BLOCK, count - i0 );
+            adcScan( table.data(), m, codes + i0 * code_stride, n, code_stride, d.data() );
+            for( size_t i=0; i<n; i++ ) {
+                if( d[i] < dist2 ) {
+                    if( d[i] < dist1 ) {
+                        best2 = best1;
+                        dist2 = dist1;
+                        best1 = (int)( i0 + i );
+                        dist1 = d[i];
+                    } else {
+                        best2 = (int)( i0 + i );
+                        dist2 = d[i];
+                    }
+                }
+            }
+        }
+
+        nn[2*q+0]   = best1;
+        nn[2*q+1]   = best2;
+        dist[2*q+0] = dist1;
+        dist[2*q+1] = dist2;
+    }
+}
+
+} // namespace popsift
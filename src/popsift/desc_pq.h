@@ -0,0 +1,149 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace popsift {
+
+class FeaturesSoA;
+
+#define POPSIFT_PQ_FILE_MAGIC   "PSPQ\r\n\0"
+#define POPSIFT_PQ_FILE_VERSION 1
+
+/* Number of centroids per subspace, codes are one byte per subspace */
+#define POPSIFT_PQ_CENTROIDS 256
+
+/* Header of a product quantization codebook file (host byte order,
+ * checked with byte_order_mark). It is followed by
+ *     float centroids[num_subspaces][256][dim / num_subspaces]
+ */
+struct PqCodebookHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark; // 0x01020304
+    uint32_t dim;
+    uint32_t num_subspaces;
+    uint32_t reserved0;
+    uint64_t num_samples;     // descriptors used for training
+    uint8_t  reserved[24];
+};
+
+/* Product quantization of descriptors.
+ *
+ * A descriptor of dim values is split into num_subspaces subvectors of
+ * dim / num_subspaces values, and each subvector is replaced by the
+ * index of the nearest of 256 centroids that were trained for its
+ * subspace. A code therefore has num_subspaces bytes: 16 or 32 bytes
+ * replace the 512 bytes of a float descriptor.
+ *
+ * Codes are compared to an uncompressed query with the asymmetric
+ * distance (ADC): the query's squared distances to all centroids are
+ * computed once into a table of num_subspaces x 256 floats, and the
+ * distance to a code is the sum of num_subspaces table entries.
+ */
+class PqCodebook
+{
+public:
+    PqCodebook( );
+
+    /** Train with k-means in every subspace over count descriptors of
+     *  dim floats, stride bytes apart. dim must be a multiple of
+     *  num_subspaces, and count at least 256.
+     *  Returns false if the parameters are not usable. */
+    bool train( const float* desc, size_t count, size_t stride,
+                int dim, int num_subspaces,
+                int iterations = 25, unsigned seed = 1 );
+
+    /** Returns false and explains why on cerr if the file cannot be
+     *  read or is not a codebook file. */
+    bool load( const std::string& filename );
+    bool save( const std::string& filename ) const;
+
+    inline bool   isValid( ) const          { return _num_subspaces > 0; }
+    inline int    getDim( ) const           { return _dim; }
+    inline int    getSubspaceCount( ) const { return _num_subspaces; }
+    inline int    getSubspaceDim( ) const   { return _sub_dim; }
+    inline int    getCodeSize( ) const      { return _num_subspaces; }
+    inline size_t getSampleCount( ) const   { return _num_samples; }
+
+    /** FNV-1a hash of the centroids, identifies the codebook that
+     *  encoded a feature file */
+    unsigned long long getFingerprint( ) const;
+
+    /** Centroid c of subspace m, getSubspaceDim() floats */
+    inline const float* getCentroid( int m, int c ) const {
+        return &_centroids[( m * POPSIFT_PQ_CENTROIDS + c ) * _sub_dim];
+    }
+
+    /** Encode count rows of getDim() floats at src, src_stride bytes
+     *  apart, into getCodeSize() bytes each at codes, code_stride bytes
+     *  apart. */
+    void encode( const float* src, size_t count, size_t src_stride,
+                 uint8_t* codes, size_t code_stride ) const;
+
+    /** A copy of features whose descriptor rows are the PQ codes, as
+     *  UInt8Desc rows of getCodeSize() values. Descriptors of other
+     *  types are converted to float first. The caller must delete
+     *  the result. */
+    FeaturesSoA* encode( const FeaturesSoA& features ) const;
+
+    /** Reconstruct the getDim() values of a code */
+    void decode( const uint8_t* code, float* dst ) const;
+
+    /** Squared distances from the subvectors of query to all centroids,
+     *  getSubspaceCount() x 256 floats */
+    void computeDistanceTable( const float* query, float* table ) const;
+
+private:
+    void prepare( );
+
+    int                _dim;
+    int                _num_subspaces;
+    int                _sub_dim;
+    size_t             _num_samples;
+    std::vector<float> _centroids;   // [m][c][sub_dim]
+
+    /* derived by prepare(): centroids transposed per subspace,
+     * [m][j][c], and their squared norms [m][c] */
+    std::vector<float> _transposed;
+    std::vector<float> _norms;
+};
+
+/* Asymmetric distance of one code, using a table from
+ * PqCodebook::computeDistanceTable */
+inline float adcDistance( const float* table, const uint8_t* code, int num_subspaces )
+{
+    float d = 0.0f;
+    for( int m=0; m<num_subspaces; m++ ) {
+        d += table[m * POPSIFT_PQ_CENTROIDS + code[m]];
+    }
+    return d;
+}
+
+/* Asymmetric distances of count codes, code_stride bytes apart */
+void adcScan( const float* table, int num_subspaces,
+              const uint8_t* codes, size_t count, size_t code_stride,
+              float* dist );
+
+/* For every query, the two codes with the smallest asymmetric
+ * distance. nn and dist have room for 2 * num_queries values; nn[2q]
+ * is the nearest code of query q and nn[2q+1] the second nearest, -1
+ * if there are fewer codes. The distances are squared L2 distances.
+ */
+void adcMatch( const PqCodebook& codebook,
+               const float* queries, size_t num_queries, size_t query_stride,
+               const uint8_t* codes, size_t count, size_t code_stride,
+               int* nn, float* dist );
+
+} // namespace popsift
@@ -13,6 +13,9 @@
 #include <math_constants.h>
 
 #include "features.h"
+#include "match_list.h"
+#include "desc_match.h"
+#include "desc_convert.h"
 #include "sift_extremum.h"
 #include "common/assist.h"
 #include "common/debug_macros.h"
@@ -40,25 +43,33 @@ FeaturesBase::~FeaturesBase( )
 FeaturesHost::FeaturesHost( )
     : _ext( 0 )
     , _ori( 0 )
+    , _desc_compact( 0 )
+    , _desc_type( Config::FloatDesc )
 { }
 
-FeaturesHost::FeaturesHost( int num_ext, int num_ori )
+FeaturesHost::FeaturesHost( int num_ext, int num_ori, Config::DescType type )
     : _ext( 0 )
     , _ori( 0 )
+    , _desc_compact( 0 )
+    , _desc_type( type )
 {
-    reset( num_ext, num_ori );
+    reset( num_ext, num_ori, type );
 }
 
 FeaturesHost::~FeaturesHost( )
 {
     free( _ext );
     free( _ori );
+    free( _desc_compact );
 }
 
-void FeaturesHost::reset( int num_ext, int num_ori )
+void FeaturesHost::reset( int num_ext, int num_ori, Config::DescType type )
 {
     if( _ext != 0 ) { free( _ext ); _ext = 0; }
     if( _ori != 0 ) { free( _ori ); _ori = 0; }
+    if( _desc_compact != 0 ) { free( _desc_compact ); _desc_compact = 0; }
+
+    _desc_type = type;
 
     _ext = (Feature*)memalign( getPageSize(), num_ext * sizeof(Feature) );
     if( _ext == 0 ) {
@@ -68,6 +79,21 @@ void FeaturesHost::reset( int num_ext, int num_ori )
         if( errno == ENOMEM ) cerr << "    Not enough memory." << endl;
         exit( -1 );
     }
+    if( type != Config::FloatDesc ) {
+        _desc_compact = memalign( getPageSize(), num_ori * getDescriptorStride() );
+        if( _desc_compact == 0 ) {
+            cerr << __FILE__ << ":" << __LINE__ << " Runtime error:" << endl
+                 << "    Failed to (re)allocate memory for downloading " << num_ori << " "
+                 << descTypeName( type ) << " descriptors" << endl;
+            if( errno == EINVAL ) cerr << "    Alignment is not a power of two." << endl;
+            if( errno == ENOMEM ) cerr << "    Not enough memory." << endl;
+            exit( -1 );
+        }
+        setFeatureCount( num_ext );
+        setDescriptorCount( num_ori );
+        return;
+    }
+
     _ori = (Descriptor*)memalign( getPageSize(), num_ori * sizeof(Descriptor) );
     if( _ori == 0 ) {
         cerr << __FILE__ << ":" << __LINE__ << " Runtime error:" << endl
@@ -92,12 +118,12 @@ void FeaturesHost::pin( )
              << "    Memory size requested: " << getFeatureCount() * sizeof(Feature) << endl
              << "    " << cudaGetErrorString(err) << endl;
     }
-    err = cudaHostRegister( _ori, getDescriptorCount() * sizeof(Descriptor), 0 );
+    err = cudaHostRegister( getDescriptorData(), getDescriptorCount() * getDescriptorStride(), 0 );
     if( err != cudaSuccess ) {
         cerr << __FILE__ << ":" << __LINE__ << " Runtime warning:" << endl
              << "    Failed to register descriptor memory in CUDA." << endl
              << "    Descriptors count: " << getDescriptorCount() << endl
-             << "    Memory size requested: " << getDescriptorCount() * sizeof(Descriptor) << endl
+             << "    Memory size requested: " << getDescriptorCount() * getDescriptorStride() << endl
              << "    " << cudaGetErrorString(err) << endl;
     }
 }
@@ -105,13 +131,51 @@ void FeaturesHost::pin( )
 void FeaturesHost::unpin( )
 {
     cudaHostUnregister( _ext );
-    cudaHostUnregister( _ori );
+    cudaHostUnregister( getDescriptorData() );
+}
+
+size_t FeaturesHost::getDescriptorStride( ) const
+{
+    return 128 * descTypeSize( _desc_type );
 }
 
+void FeaturesHost::getReverseMap( std::vector<int>& rev ) const
+{
+    rev.assign( getDescriptorCount(), -1 );
+
+    /* compact descriptors are stored in feature order, float
+     * descriptors are found through their pointers */
+    int d = 0;
+    for( int i=0; i<size(); i++ ) {
+        const Feature& f = _ext[i];
+        for( int o=0; o<f.num_ori; o++, d++ ) {
+            const int idx = ( _desc_type == Config::FloatDesc && f.desc[o] ) ? (int)( f.desc[o] - _ori ) : d;
+            if( idx >= 0 && idx < getDescriptorCount() ) rev[idx] = i;
+        }
+    }
+}
+
+static void print_keypoint( std::ostream& ostr, const Feature& f, const float* desc, bool write_as_uchar );
+
 void FeaturesHost::print( std::ostream& ostr, bool write_as_uchar ) const
 {
+    if( _desc_type == Config::FloatDesc ) {
+        for( int i=0; i<size(); i++ ) {
+            _ext[i].print( ostr, write_as_uchar );
+        }
+        return;
+    }
+
+    /* compact descriptors are found by position, not by pointer */
+    float        desc[128];
+    const char*  row    = (const char*)_desc_compact;
+    const size_t stride = getDescriptorStride();
     for( int i=0; i<size(); i++ ) {
-        _ext[i].print( ostr, write_as_uchar );
+        for( int ori=0; ori<_ext[i].num_ori; ori++ ) {
+            convertToFloat( row, 128, _desc_type, desc );
+            print_keypoint( ostr, _ext[i], desc, write_as_uchar );
+            row += stride;
+        }
     }
 }
 
@@ -182,7 +246,7 @@ l2_in_t0( const float4* lptr, const float4* rptr )
 }
 
 __global__ void
-compute_distance( int3* match_matrix, Descriptor* l, int l_len, Descriptor* r, int r_len )
+compute_distance( int2* match_matrix, float2* match_dist, Descriptor* l, int l_len, Descriptor* r, int r_len )
 {
     if( blockIdx.x >= l_len ) return;
     const int idx = blockIdx.x;
@@ -220,54 +284,21 @@ compute_distance( int3* match_matrix, Descriptor* l, int l_len, Descriptor* r, i
 
     if( threadIdx.x == 0 )
     {
-        bool accept = ( match_1st_val / match_2nd_val < 0.8f );
-        match_matrix[blockIdx.x] = make_int3( match_1st_idx, match_2nd_idx, accept );
+        match_matrix[blockIdx.x] = make_int2( match_1st_idx, match_2nd_idx );
+        match_dist[blockIdx.x]   = make_float2( match_1st_val, match_2nd_val );
     }
 }
 
-__global__ void
-show_distance( int3*       match_matrix,
-               Feature*    l_ext,
-               Descriptor* l_ori,
-               int*        l_fem,
-               int         l_len,
-               Feature*    r_ext,
-               Descriptor* r_ori,
-               int*        r_fem,
-               int         r_len )
-{
-    for( int i=0; i<l_len; i++ )
-    {
-        const float4* lptr  = (const float4*)( &l_ori[i] );
-        const float4* rptr1 = (const float4*)( &r_ori[match_matrix[i].x] );
-        const float4* rptr2 = (const float4*)( &r_ori[match_matrix[i].y] );
-	float d1 = l2_in_t0( lptr, rptr1 );
-	float d2 = l2_in_t0( lptr, rptr2 );
-	if( threadIdx.x == 0 )
-        {
-            if( match_matrix[i].z )
-                printf( "accept feat %4d [%4d] matches feat %4d [%4d] ( 2nd feat %4d [%4d] ) dist %.3f vs %.3f\n",
-                        l_fem[i], i,
-                        r_fem[match_matrix[i].x], match_matrix[i].x,
-                        r_fem[match_matrix[i].y], match_matrix[i].y,
-                        d1, d2 );
-	    else
-                printf( "reject feat %4d [%4d] matches feat %4d [%4d] ( 2nd feat %4d [%4d] ) dist %.3f vs %.3f\n",
-                        l_fem[i], i,
-                        r_fem[match_matrix[i].x], match_matrix[i].x,
-                        r_fem[match_matrix[i].y], match_matrix[i].y,
-                        d1, d2 );
-        }
-        __syncthreads();
-    }
-}
-
-void FeaturesDev::match( FeaturesDev* other )
+void FeaturesDev::match( FeaturesDev* other, MatchList& matches, float ratio )
 {
     int l_len = getDescriptorCount( );
     int r_len = other->getDescriptorCount( );
 
-    int3* match_matrix = popsift::cuda::malloc_devT<int3>( l_len, __FILE__, __LINE__ );
+    matches.clear( );
+    if( l_len == 0 ) return;
+
+    int2*   match_matrix = popsift::cuda::malloc_devT<int2>  ( l_len, __FILE__, __LINE__ );
+    float2* match_dist   = popsift::cuda::malloc_devT<float2>( l_len, __FILE__, __LINE__ );
 
     dim3 grid;
     grid.x = l_len;
@@ -280,50 +311,71 @@ void FeaturesDev::match( FeaturesDev* other )
 
     compute_distance
         <<<grid,block>>>
-        ( match_matrix, getDescriptors(), l_len, other->getDescriptors(), r_len );
+        ( match_matrix, match_dist, getDescriptors(), l_len, other->getDescriptors(), r_len );
 
     POP_SYNC_CHK;
 
-    show_distance
-        <<<1,32>>>
-        ( match_matrix,
-          getFeatures(),
-          getDescriptors(),
-          getReverseMap(),
-          l_len,
-          other->getFeatures(),
-          other->getDescriptors(),
-          other->getReverseMap(),
-          r_len );
-
-    POP_SYNC_CHK;
+    /* download the result and both reverse maps, and fill matches in
+     * the form of the host matcher */
+    vector<int2>   h_matrix( l_len );
+    vector<float2> h_dist( l_len );
+    vector<int>    l_rev( l_len );
+    vector<int>    r_rev( r_len );
+    popcuda_memcpy_sync( h_matrix.data(), match_matrix, l_len * sizeof(int2), cudaMemcpyDeviceToHost );
+    popcuda_memcpy_sync( h_dist.data(), match_dist, l_len * sizeof(float2), cudaMemcpyDeviceToHost );
+    popcuda_memcpy_sync( l_rev.data(), getReverseMap(), l_len * sizeof(int), cudaMemcpyDeviceToHost );
+    if( r_len > 0 ) {
+        popcuda_memcpy_sync( r_rev.data(), other->getReverseMap(), r_len * sizeof(int), cudaMemcpyDeviceToHost );
+    }
 
     cudaFree( match_matrix );
+    cudaFree( match_dist );
+
+    vector<int>   nn( 2 * l_len );
+    vector<float> dist( 2 * l_len );
+    vector<char>  accept( l_len );
+    for( int i=0; i<l_len; i++ ) {
+        /* the kernel leaves index 0 and an infinite distance where
+         * there is no neighbour */
+        nn[2*i]     = r_len > 0 ? h_matrix[i].x : -1;
+        nn[2*i+1]   = r_len > 1 ? h_matrix[i].y : -1;
+        dist[2*i]   = h_dist[i].x;
+        dist[2*i+1] = h_dist[i].y;
+    }
+    /* the same test as the host matchers, so that both accept the
+     * same matches */
+    ratioTest( nn.data(), dist.data(), l_len, ratio, accept.data() );
+    matches.assign( nn.data(), dist.data(), accept.data(), l_len, r_len, l_rev.data(), r_rev.data() );
 }
 
 /*************************************************************
  * Feature
  *************************************************************/
 
-void Feature::print( std::ostream& ostr, bool write_as_uchar ) const
+static void print_keypoint( std::ostream& ostr, const Feature& f, const float* desc, bool write_as_uchar )
 {
-    float sigval =  1.0f / ( sigma * sigma );
+    float sigval =  1.0f / ( f.sigma * f.sigma );
 
-    for( int ori=0; ori<num_ori; ori++ ) {
-        ostr << xpos << " " << ypos << " "
-             << sigval << " 0 " << sigval << " ";
-        if( write_as_uchar ) {
-            for( int i=0; i<128; i++ ) {
-                ostr << roundf(desc[ori]->features[i]) << " ";
-            }
-        } else {
-            ostr << std::setprecision(3);
-            for( int i=0; i<128; i++ ) {
-                ostr << desc[ori]->features[i] << " ";
-            }
-            ostr << std::setprecision(6);
+    ostr << f.xpos << " " << f.ypos << " "
+         << sigval << " 0 " << sigval << " ";
+    if( write_as_uchar ) {
+        for( int i=0; i<128; i++ ) {
+            ostr << roundf(desc[i]) << " ";
+        }
+    } else {
+        ostr << std::setprecision(3);
+        for( int i=0; i<128; i++ ) {
+            ostr << desc[i] << " ";
         }
-        ostr << std::endl;
+        ostr << std::setprecision(6);
+    }
+    ostr << std::endl;
+}
+
+void Feature::print( std::ostream& ostr, bool write_as_uchar ) const
+{
+    for( int ori=0; ori<num_ori; ori++ ) {
+        print_keypoint( ostr, *this, desc[ori]->features, write_as_uchar );
     }
 }
 
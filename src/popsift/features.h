@@ -11,10 +11,12 @@
 #include <vector>
 
 #include "sift_constants.h"
+#include "sift_conf.h"
 
 namespace popsift {
 
 struct Descriptor; // float features[128];
+class  MatchList;
 
 /* This is a data structure that is returned to a calling program.
  * The xpos/ypos information in feature is scale-adapted.
@@ -60,16 +62,24 @@ public:
  * Descriptors in the transparent array with their extrema except
  * for brute force.
  *
+ * With a compact descriptor type (see Config::setDescType), the
+ * descriptors are kept in _desc_compact instead of _ori, getDescriptors()
+ * returns 0 and the desc pointers in Feature are 0. The descriptors
+ * are stored in feature order, the descriptor of orientation o of
+ * feature f is preceded by those of all orientations of features 0..f-1.
+ *
  * Note: FeaturesHost is typedef'd to its older name Features
  */
 class FeaturesHost : public FeaturesBase
 {
-    Feature*     _ext;
-    Descriptor*  _ori;
+    Feature*         _ext;
+    Descriptor*      _ori;
+    void*            _desc_compact;
+    Config::DescType _desc_type;
 
 public:
     FeaturesHost( );
-    FeaturesHost( int num_ext, int num_ori );
+    FeaturesHost( int num_ext, int num_ori, Config::DescType type = Config::FloatDesc );
     virtual ~FeaturesHost( );
 
     typedef Feature*       F_iterator;
@@ -80,13 +90,38 @@ public:
     inline F_iterator       end()         { return &_ext[size()]; }
     inline F_const_iterator end() const   { return &_ext[size()]; }
 
-    void reset( int num_ext, int num_ori );
+    void reset( int num_ext, int num_ori, Config::DescType type = Config::FloatDesc );
     void pin( );
     void unpin( );
 
     inline Feature*    getFeatures()    { return _ext; }
     inline Descriptor* getDescriptors() { return _ori; }
 
+    inline Config::DescType getDescType() const { return _desc_type; }
+
+    /** Bytes from one descriptor to the next in getDescriptorData() */
+    size_t getDescriptorStride() const;
+
+    /** The descriptor array of any type, descriptor i is at
+     *  i * getDescriptorStride() */
+    inline void*       getDescriptorData()       { return _desc_type == Config::FloatDesc ? (void*)_ori : _desc_compact; }
+    inline const void* getDescriptorData() const { return _desc_type == Config::FloatDesc ? (const void*)_ori : _desc_compact; }
+
+    /** 0 unless the descriptor type is HalfDesc, values are IEEE fp16
+     *  bit patterns, see half_to_float in desc_convert.h */
+    inline unsigned short* getDescriptorsHalf() {
+        return _desc_type == Config::HalfDesc ? (unsigned short*)_desc_compact : 0;
+    }
+
+    /** 0 unless the descriptor type is UInt8Desc */
+    inline unsigned char* getDescriptorsUInt8() {
+        return _desc_type == Config::UInt8Desc ? (unsigned char*)_desc_compact : 0;
+    }
+
+    /** The index of the feature of every descriptor, like the reverse
+     *  map of FeaturesDev */
+    void getReverseMap( std::vector<int>& rev ) const;
+
     void print( std::ostream& ostr, bool write_as_uchar ) const;
 
 protected:
@@ -110,7 +145,10 @@ public:
 
     void reset( int num_ext, int num_ori );
 
-    void match( FeaturesDev* other );
+    /** Match all descriptors against those of other on the GPU. The
+     *  ratio test is ratioTest of desc_match.h, as in matchDescriptors:
+     *  queries without a second neighbour are rejected. */
+    void match( FeaturesDev* other, MatchList& matches, float ratio = 0.8f );
 
     inline Feature*    getFeatures()    { return _ext; }
     inline Descriptor* getDescriptors() { return _ori; }
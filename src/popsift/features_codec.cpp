@@ -0,0 +1,651 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <iso646.h>
+
+#include <cuda_runtime.h>
+
+#include "features_codec.h"
+#include "features_soa.h"
+#include "desc_convert.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(FeaturesCodecHeader) == 96, "FeaturesCodecHeader must be 96 bytes" );
+
+/* Descriptor values are coded with one of CODEC_CONTEXTS Huffman
+ * tables, chosen by the value before them in the row. Code lengths are
+ * limited so that one lookup in a table of CODEC_TABLE_SIZE entries
+ * decodes a value. */
+#define CODEC_CONTEXTS    4
+#define CODEC_SYMBOLS     256
+#define CODEC_MAX_BITS    12
+#define CODEC_TABLE_SIZE  ( 1 << CODEC_MAX_BITS )
+#define CODEC_LENGTH_BYTES ( CODEC_CONTEXTS * CODEC_SYMBOLS / 2 )
+
+/* Table entries carry the context for the next value in bits 12-13;
+ * bit 15 marks bit patterns that are not a code. */
+#define CODEC_CONTEXT_MASK ( ( CODEC_CONTEXTS - 1 ) << CODEC_MAX_BITS )
+#define CODEC_INVALID      0x8000
+
+/* Rows are distributed over CODEC_STREAMS bit streams, row k to
+ * stream k % CODEC_STREAMS, which are decoded in an interleaved loop to
+ * hide the latency of the table lookups. Every stream is followed by
+ * CODEC_STREAM_PAD zero bytes. */
+#define CODEC_STREAMS     4
+#define CODEC_STREAM_PAD  8
+
+FeaturesCodecInfo::FeaturesCodecInfo( )
+    : image_width( 0 )
+    , image_height( 0 )
+    , config_fingerprint( 0 )
+    , desc_codec( FF_CodecNone )
+    , codec_fingerprint( 0 )
+{ }
+
+/* Normalized SIFT histograms are dominated by zeros and small values,
+ * and a bin is usually small when its neighbour is. */
+static inline int context_of( int prev )
+{
+    return ( prev > 0 ) + ( prev >= 16 ) + ( prev >= 48 );
+}
+
+static inline uint32_t zigzag( int32_t v )
+{
+    return ( (uint32_t)v << 1 ) ^ (uint32_t)( v >> 31 );
+}
+
+static inline int32_t unzigzag( uint32_t v )
+{
+    return (int32_t)( v >> 1 ) ^ -(int32_t)( v & 1 );
+}
+
+static inline void put_varint( vector<char>& out, uint32_t v )
+{
+    while( v >= 0x80 ) {
+        out.push_back( (char)( v | 0x80 ) );
+        v >>= 7;
+    }
+    out.push_back( (char)v );
+}
+
+static inline bool get_varint( const uint8_t*& p, const uint8_t* end, uint32_t& v )
+{
+    v = 0;
+    for( int shift=0; shift<35; shift+=7 ) {
+        if( p == end ) return false;
+        const uint8_t b = *p++;
+        v |= (uint32_t)( b & 0x7f ) << shift;
+        if( not ( b & 0x80 ) ) return true;
+    }
+    return false;
+}
+
+static inline uint64_t load64( const uint8_t* p )
+{
+    uint64_t v;
+    memcpy( &v, p, sizeof(v) );
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64( v );
+#endif
+    return v;
+}
+
+/*************************************************************
+ * Huffman tables
+ *************************************************************/
+
+/* Huffman code lengths for freq, at most CODEC_MAX_BITS. If the
+ * optimal code is deeper, the frequencies are flattened and the code
+ * rebuilt. */
+static void huffman_lengths( const uint64_t* freq, uint8_t* len )
+{
+    vector<uint64_t> f( freq, freq + CODEC_SYMBOLS );
+
+    for( ;; ) {
+        memset( len, 0, CODEC_SYMBOLS );
+
+        typedef pair<uint64_t,int> Item;
+        priority_queue<Item, vector<Item>, greater<Item> > queue;
+        vector<int> parent;
+        int         leaf[CODEC_SYMBOLS];
+        int         last = 0;
+
+        for( int s=0; s<CODEC_SYMBOLS; s++ ) {
+            leaf[s] = -1;
+            if( f[s] == 0 ) continue;
+            leaf[s] = parent.size();
+            last    = s;
+            queue.push( Item( f[s], leaf[s] ) );
+            parent.push_back( -1 );
+        }
+        if( queue.empty() ) return;
+        if( queue.size() == 1 ) {
+            /* a single value still needs a code of one bit */
+            len[last] = 1;
+            return;
+        }
+
+        while( queue.size() > 1 ) {
+            const Item a = queue.top(); queue.pop();
+            const Item b = queue.top(); queue.pop();
+            const int  n = parent.size();
+            parent.push_back( -1 );
+            parent[a.second] = n;
+            parent[b.second] = n;
+            queue.push( Item( a.first + b.first, n ) );
+        }
+
+        int max_len = 0;
+        for( int s=0; s<CODEC_SYMBOLS; s++ ) {
+            if( leaf[s] < 0 ) continue;
+            int depth = 0;
+            for( int n=leaf[s]; parent[n] >= 0; n=parent[n] ) depth++;
+            len[s]  = depth;
+            max_len = max( max_len, depth );
+        }
+        if( max_len <= CODEC_MAX_BITS ) return;
+
+        for( int s=0; s<CODEC_SYMBOLS; s++ ) {
+            if( f[s] > 0 ) f[s] = ( f[s] + 1 ) / 2;
+        }
+    }
+}
+
+/* Canonical codes for the lengths, bit-reversed because the stream is
+ * written and read starting with the least significant bit */
+static void canonical_codes( const uint8_t* len, uint32_t* code )
+{
+    int bl_count[CODEC_MAX_BITS+1] = { 0 };
+    for( int s=0; s<CODEC_SYMBOLS; s++ ) {
+        if( len[s] ) bl_count[len[s]]++;
+    }
+
+    uint32_t next[CODEC_MAX_BITS+1];
+    uint32_t c = 0;
+    next[0] = 0;
+    for( int b=1; b<=CODEC_MAX_BITS; b++ ) {
+        c       = ( c + ( b > 1 ? bl_count[b-1] : 0 ) ) << 1;
+        next[b] = c;
+    }
+
+    for( int s=0; s<CODEC_SYMBOLS; s++ ) {
+        code[s] = 0;
+        if( len[s] == 0 ) continue;
+        const uint32_t v = next[len[s]]++;
+        uint32_t r = 0;
+        for( int i=0; i<len[s]; i++ ) r |= ( ( v >> i ) & 1 ) << ( len[s] - 1 - i );
+        code[s] = r;
+    }
+}
+
+/* Decoding table: entry i holds
+ *     ( next context << 12 ) | ( length << 8 ) | symbol
+ * for the code that is a prefix of the bits i, CODEC_INVALID where no
+ * code matches. Values are quantized by shift. Returns false if the lengths
+ * are not a prefix code. */
+static bool build_table( const uint8_t* len, int shift, uint16_t* table )
+{
+    uint32_t kraft = 0;
+    for( int s=0; s<CODEC_SYMBOLS; s++ ) {
+        if( len[s] > CODEC_MAX_BITS ) return false;
+        if( len[s] ) kraft += 1u << ( CODEC_MAX_BITS - len[s] );
+    }
+    if( kraft > CODEC_TABLE_SIZE ) return false;
+
+    uint32_t code[CODEC_SYMBOLS];
+    canonical_codes( len, code );
+
+    for( int i=0; i<CODEC_TABLE_SIZE; i++ ) table[i] = CODEC_INVALID;
+    for( int s=0; s<CODEC_SYMBOLS; s++ ) {
+        if( len[s] == 0 ) continue;
+        const uint16_t entry = ( context_of( s << shift ) << 12 ) | ( len[s] << 8 ) | s;
+        for( uint32_t r=code[s]; r<CODEC_TABLE_SIZE; r+=1u<<len[s] ) {
+            table[r] = entry;
+        }
+    }
+    return true;
+}
+
+/*************************************************************
+ * compressFeatures
+ *************************************************************/
+
+struct Extremum
+{
+    int32_t qx;
+    int32_t qy;
+    int     first;   // first keypoint
+    int     count;   // keypoints, one per orientation
+};
+
+void compressFeatures( const FeaturesSoA&       features,
+                       const FeaturesCodecInfo& info,
+                       std::vector<char>&       out,
+                       int                      desc_shift )
+{
+    const int num_kpt = features.getKeypointCount();
+    const int dim     = features.getDescDim();
+
+    /* codes are symbols, not magnitudes */
+    const int shift = info.desc_codec == FF_CodecNone ? max( 0, min( desc_shift, 7 ) ) : 0;
+
+    /* group the keypoints of every extremum and sort the extrema by
+     * position, so that position deltas are small */
+    const float* xpos  = features.getXPos();
+    const float* ypos  = features.getYPos();
+    const float* sigma = features.getSigma();
+    const float* ori   = features.getOrientation();
+    const int*   oct   = features.getOctave();
+    const int*   fidx  = features.getFeatureIndex();
+
+    vector<Extremum> ext;
+    for( int k=0; k<num_kpt; k++ ) {
+        if( k > 0 && fidx[k] == fidx[k-1] ) {
+            ext.back().count++;
+            continue;
+        }
+        Extremum e;
+        e.qx    = (int32_t)lrintf( xpos[k] * POPSIFT_CODEC_XY_SCALE );
+        e.qy    = (int32_t)lrintf( ypos[k] * POPSIFT_CODEC_XY_SCALE );
+        e.first = k;
+        e.count = 1;
+        ext.push_back( e );
+    }
+    std::stable_sort( ext.begin(), ext.end(), []( const Extremum& a, const Extremum& b ) {
+        return a.qy < b.qy || ( a.qy == b.qy && a.qx < b.qx );
+    } );
+
+    FeaturesCodecHeader hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_FEATURES_CODEC_MAGIC, sizeof(hdr.magic) );
+    hdr.version            = POPSIFT_FEATURES_CODEC_VERSION;
+    hdr.header_size        = sizeof(FeaturesCodecHeader);
+    hdr.byte_order_mark    = 0x01020304;
+    hdr.desc_dim           = dim;
+    hdr.num_features       = ext.size();
+    hdr.num_keypoints      = num_kpt;
+    hdr.image_width        = info.image_width;
+    hdr.image_height       = info.image_height;
+    hdr.config_fingerprint = info.config_fingerprint;
+    hdr.desc_codec         = info.desc_codec;
+    hdr.desc_shift         = shift;
+    hdr.codec_fingerprint  = info.codec_fingerprint;
+    hdr.xy_scale           = POPSIFT_CODEC_XY_SCALE;
+    hdr.sigma_scale        = POPSIFT_CODEC_SIGMA_SCALE;
+
+    out.assign( sizeof(hdr), 0 );
+    out.reserve( sizeof(hdr) + (size_t)num_kpt * ( 8 + dim ) );
+
+    /* keypoint stream */
+    int32_t prev_qx = 0;
+    int32_t prev_qy = 0;
+    for( const Extremum& e : ext ) {
+        const int k = e.first;
+        put_varint( out, (uint32_t)( e.qy - prev_qy ) );
+        put_varint( out, zigzag( e.qx - prev_qx ) );
+        prev_qx = e.qx;
+        prev_qy = e.qy;
+
+        put_varint( out, zigzag( (int32_t)lrintf( log2f( sigma[k] ) * POPSIFT_CODEC_SIGMA_SCALE ) ) );
+        put_varint( out, zigzag( oct[k] ) * 4 + min( e.count - 1, 3 ) );
+        if( e.count - 1 >= 3 ) put_varint( out, e.count - 4 );
+
+        for( int o=0; o<e.count; o++ ) {
+            const uint16_t q = (uint16_t)lrint( ori[k+o] * ( 65536.0 / ( 2.0 * M_PI ) ) );
+            out.push_back( (char)( q & 0xff ) );
+            out.push_back( (char)( q >> 8 ) );
+        }
+    }
+    hdr.keypoint_bytes = out.size() - sizeof(hdr);
+
+    /* descriptor rows as uint8 in the sorted keypoint order,
+     * quantized by desc_shift */
+    vector<uint8_t> rows( (size_t)num_kpt * dim );
+    {
+        uint8_t* dst = rows.data();
+        for( const Extremum& e : ext ) {
+            for( int k=e.first; k<e.first+e.count; k++ ) {
+                const void* src = features.getKeypointDescriptor( k );
+                if( features.getDescType() == Config::UInt8Desc ) {
+                    memcpy( dst, src, dim );
+                } else {
+                    convertDescriptor( src, features.getDescType(), dst, Config::UInt8Desc, dim );
+                }
+                if( shift > 0 ) {
+                    const int max_q = 255 >> shift;
+                    for( int i=0; i<dim; i++ ) {
+                        dst[i] = min( ( dst[i] + ( 1 << ( shift - 1 ) ) ) >> shift, max_q );
+                    }
+                }
+                dst += dim;
+            }
+        }
+    }
+
+    uint64_t freq[CODEC_CONTEXTS][CODEC_SYMBOLS];
+    memset( freq, 0, sizeof(freq) );
+    for( int k=0; k<num_kpt; k++ ) {
+        const uint8_t* row = &rows[(size_t)k * dim];
+        int            ctx = 0;
+        for( int i=0; i<dim; i++ ) {
+            freq[ctx][row[i]]++;
+            ctx = context_of( row[i] << shift );
+        }
+    }
+
+    uint8_t  len[CODEC_CONTEXTS][CODEC_SYMBOLS];
+    uint32_t code[CODEC_CONTEXTS][CODEC_SYMBOLS];
+    for( int c=0; c<CODEC_CONTEXTS; c++ ) {
+        huffman_lengths( freq[c], len[c] );
+        canonical_codes( len[c], code[c] );
+    }
+
+    /* bit streams, least significant bit first */
+    vector<vector<uint8_t> > streams( CODEC_STREAMS );
+    for( int st=0; st<CODEC_STREAMS; st++ ) {
+        const int      count = ( num_kpt - st + CODEC_STREAMS - 1 ) / CODEC_STREAMS;
+        vector<uint8_t>& buf = streams[st];
+        buf.resize( (size_t)count * dim * CODEC_MAX_BITS / 8 + 8 );
+
+        uint8_t* p     = buf.data();
+        uint64_t acc   = 0;
+        int      nbits = 0;
+        for( int k=st; k<num_kpt; k+=CODEC_STREAMS ) {
+            const uint8_t* row = &rows[(size_t)k * dim];
+            int            ctx = 0;
+            for( int i=0; i<dim; i++ ) {
+                acc   |= (uint64_t)code[ctx][row[i]] << nbits;
+                nbits += len[ctx][row[i]];
+                ctx    = context_of( row[i] << shift );
+                if( nbits >= 32 ) {
+                    for( int b=0; b<4; b++ ) *p++ = (uint8_t)( acc >> ( 8 * b ) );
+                    acc  >>= 32;
+                    nbits -= 32;
+                }
+            }
+        }
+        while( nbits > 0 ) {
+            *p++ = (uint8_t)acc;
+            acc  >>= 8;
+            nbits -= 8;
+        }
+        buf.resize( p - buf.data() );
+    }
+
+    const size_t desc_start = out.size();
+    for( int c=0; c<CODEC_CONTEXTS; c++ ) {
+        for( int sym=0; sym<CODEC_SYMBOLS; sym+=2 ) {
+            out.push_back( (char)( len[c][sym] | ( len[c][sym+1] << 4 ) ) );
+        }
+    }
+    for( int st=0; st<CODEC_STREAMS; st++ ) {
+        const uint64_t bytes = streams[st].size();
+        out.insert( out.end(), (const char*)&bytes, (const char*)&bytes + sizeof(bytes) );
+    }
+    for( int st=0; st<CODEC_STREAMS; st++ ) {
+        out.insert( out.end(), streams[st].begin(), streams[st].end() );
+        out.insert( out.end(), CODEC_STREAM_PAD, 0 );
+    }
+
+    hdr.desc_bytes = out.size() - desc_start;
+    memcpy( out.data(), &hdr, sizeof(hdr) );
+}
+
+void compressFeatures( const FeaturesFile& file, std::vector<char>& out, int desc_shift )
+{
+    FeaturesSoA       features( file );
+    FeaturesCodecInfo info;
+    info.image_width        = file.getImageWidth();
+    info.image_height       = file.getImageHeight();
+    info.config_fingerprint = file.getConfigFingerprint();
+    info.desc_codec         = file.getDescCodec();
+    info.codec_fingerprint  = file.getCodecFingerprint();
+    compressFeatures( features, info, out, desc_shift );
+}
+
+/*************************************************************
+ * decompressFeatures
+ *************************************************************/
+
+/* Decode the value at bit position pos of the streams starting at base,
+ * with the table chosen by the previous entry. The stream padding
+ * keeps the 8-byte load inside the block as long as pos is inside a
+ * stream. */
+static inline uint32_t decode_at( const uint8_t* base, uint64_t& pos, const uint16_t* tables, uint32_t prev )
+{
+    const uint64_t bits  = load64( base + ( pos >> 3 ) ) >> ( pos & 7 );
+    const uint32_t entry = tables[( prev & CODEC_CONTEXT_MASK ) | ( bits & ( CODEC_TABLE_SIZE - 1 ) )];
+    pos += ( entry >> 8 ) & 0xf;
+    return entry;
+}
+
+/* Decode count rows of dim values from CODEC_STREAMS streams into dst.
+ * Returns false if a stream contains a bit pattern that is not a code
+ * or runs past its end. */
+static bool decode_rows( const uint8_t* const* stream, const size_t* length,
+                         const uint16_t* tables, int count, int dim, int shift,
+                         uint8_t* dst, size_t dst_stride )
+{
+    /* Positions are kept in bits from the first stream, which is cheaper
+     * than one reader state per stream and leaves the interleaved loop
+     * enough registers. A group of rows is decoded without bounds checks
+     * if no stream can reach its end in it. */
+    const uint8_t* base     = stream[0];
+    const uint64_t row_bits = (uint64_t)dim * CODEC_MAX_BITS;
+    uint64_t       pos[CODEC_STREAMS];
+    uint64_t       end[CODEC_STREAMS];
+    for( int st=0; st<CODEC_STREAMS; st++ ) {
+        pos[st] = (uint64_t)( stream[st] - base ) * 8;
+        end[st] = pos[st] + (uint64_t)length[st] * 8;
+    }
+
+    uint32_t flags = 0;
+    int      k     = 0;
+    for( ; k + CODEC_STREAMS <= count; k += CODEC_STREAMS ) {
+        bool room = true;
+        for( int st=0; st<CODEC_STREAMS; st++ ) room = room && pos[st] + row_bits <= end[st];
+        if( not room ) break;
+
+        uint8_t* row = dst + (size_t)k * dst_stride;
+        uint64_t p0 = pos[0], p1 = pos[1], p2 = pos[2], p3 = pos[3];
+        uint32_t e0 = 0, e1 = 0, e2 = 0, e3 = 0;
+        for( int i=0; i<dim; i++ ) {
+            e0 = decode_at( base, p0, tables, e0 );
+            e1 = decode_at( base, p1, tables, e1 );
+            e2 = decode_at( base, p2, tables, e2 );
+            e3 = decode_at( base, p3, tables, e3 );
+            row[i]                  = (uint8_t)e0;
+            row[i +     dst_stride] = (uint8_t)e1;
+            row[i + 2 * dst_stride] = (uint8_t)e2;
+            row[i + 3 * dst_stride] = (uint8_t)e3;
+            flags |= e0 | e1 | e2 | e3;
+        }
+        pos[0] = p0; pos[1] = p1; pos[2] = p2; pos[3] = p3;
+    }
+
+    /* the last rows, checking every value */
+    for( ; k<count; k++ ) {
+        const int st  = k % CODEC_STREAMS;
+        uint8_t*  row = dst + (size_t)k * dst_stride;
+        uint32_t  e   = 0;
+        for( int i=0; i<dim; i++ ) {
+            if( pos[st] > end[st] ) return false;
+            e       = decode_at( base, pos[st], tables, e );
+            row[i]  = (uint8_t)e;
+            flags  |= e;
+        }
+    }
+    for( int st=0; st<CODEC_STREAMS; st++ ) {
+        if( pos[st] > end[st] ) return false;
+    }
+    if( flags & CODEC_INVALID ) return false;
+
+    if( shift > 0 ) {
+        for( int k=0; k<count; k++ ) {
+            uint8_t* row = dst + (size_t)k * dst_stride;
+            for( int i=0; i<dim; i++ ) row[i] <<= shift;
+        }
+    }
+    return true;
+}
+
+FeaturesSoA* decompressFeatures( const void*        data,
+                                 size_t             length,
+                                 FeaturesCodecInfo* info )
+{
+    const uint8_t*             base = (const uint8_t*)data;
+    const FeaturesCodecHeader& hdr  = *(const FeaturesCodecHeader*)data;
+
+    if( length < sizeof(FeaturesCodecHeader) ||
+        memcmp( hdr.magic, POPSIFT_FEATURES_CODEC_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "Data is not a compressed PopSift feature block" << endl;
+        return 0;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "Compressed feature block was written on a machine with different byte order" << endl;
+        return 0;
+    }
+    if( hdr.version != POPSIFT_FEATURES_CODEC_VERSION ) {
+        cerr << "Compressed feature block has version " << hdr.version
+             << ", this reader supports version " << POPSIFT_FEATURES_CODEC_VERSION << endl;
+        return 0;
+    }
+    if( hdr.header_size < sizeof(FeaturesCodecHeader) || hdr.desc_dim == 0 ||
+        hdr.xy_scale == 0 || hdr.sigma_scale == 0 ||
+        hdr.num_features > hdr.num_keypoints || hdr.desc_codec > FF_CodecPQ || hdr.desc_shift > 7 ||
+        hdr.desc_bytes < CODEC_LENGTH_BYTES + CODEC_STREAMS * ( sizeof(uint64_t) + CODEC_STREAM_PAD ) ||
+        hdr.header_size > length ||
+        hdr.keypoint_bytes > length - hdr.header_size ||
+        hdr.desc_bytes > length - hdr.header_size - hdr.keypoint_bytes ) {
+        cerr << "Compressed feature block has an invalid header or is truncated" << endl;
+        return 0;
+    }
+    /* every keypoint takes at least its 2 orientation bytes; checked
+     * before the counts are used as int and allocated */
+    if( hdr.num_keypoints > hdr.keypoint_bytes / 2 ||
+        hdr.num_keypoints > (uint32_t)INT_MAX ||
+        hdr.desc_dim > (uint32_t)INT_MAX / std::max( hdr.num_keypoints, 1u ) ) {
+        cerr << "Compressed feature block has implausible keypoint or descriptor counts" << endl;
+        return 0;
+    }
+
+    const int num_kpt = hdr.num_keypoints;
+    const int num_ext = hdr.num_features;
+    const int dim     = hdr.desc_dim;
+
+    FeaturesSoA* features = new FeaturesSoA( num_ext, num_kpt, num_kpt, Config::UInt8Desc, dim );
+    float* xpos  = features->getXPos();
+    float* ypos  = features->getYPos();
+    float* sigma = features->getSigma();
+    float* ori   = features->getOrientation();
+    int*   oct   = features->getOctave();
+    int*   fidx  = features->getFeatureIndex();
+    int*   didx  = features->getDescIndex();
+
+    /* keypoint stream */
+    const uint8_t* p       = base + hdr.header_size;
+    const uint8_t* kp_end  = p + hdr.keypoint_bytes;
+    const float    xy_inv  = 1.0f / hdr.xy_scale;
+    const float    sig_inv = 1.0f / hdr.sigma_scale;
+    int32_t        qx      = 0;
+    int32_t        qy      = 0;
+    int            k       = 0;
+    bool           ok      = true;
+    for( int f=0; f<num_ext && ok; f++ ) {
+        uint32_t dy, dx, qs, oc, extra = 0;
+        ok = get_varint( p, kp_end, dy ) && get_varint( p, kp_end, dx ) &&
+             get_varint( p, kp_end, qs ) && get_varint( p, kp_end, oc );
+        if( ok && ( oc & 3 ) == 3 ) ok = get_varint( p, kp_end, extra );
+        if( not ok ) break;
+
+        qy += dy;
+        qx += unzigzag( dx );
+        const int   count = ( oc & 3 ) + 1 + extra;
+        const float x     = qx * xy_inv;
+        const float y     = qy * xy_inv;
+        const float s     = exp2f( unzigzag( qs ) * sig_inv );
+        const int   o     = unzigzag( oc >> 2 );
+        if( count > num_kpt - k || kp_end - p < 2 * count ) {
+            ok = false;
+            break;
+        }
+        for( int i=0; i<count; i++, k++ ) {
+            const int16_t q = (int16_t)( p[0] | ( p[1] << 8 ) );
+            p += 2;
+            xpos[k]  = x;
+            ypos[k]  = y;
+            sigma[k] = s;
+            ori[k]   = (float)( q * ( 2.0 * M_PI / 65536.0 ) );
+            oct[k]   = o;
+            fidx[k]  = f;
+            didx[k]  = k;
+        }
+    }
+    if( not ok || k != num_kpt ) {
+        cerr << "Compressed feature block has a damaged keypoint stream" << endl;
+        delete features;
+        return 0;
+    }
+
+    /* descriptor streams */
+    const uint8_t*   desc     = base + hdr.header_size + hdr.keypoint_bytes;
+    const uint8_t*   desc_end = desc + hdr.desc_bytes;
+    vector<uint16_t> tables( CODEC_CONTEXTS * CODEC_TABLE_SIZE );
+    for( int c=0; c<CODEC_CONTEXTS; c++ ) {
+        uint8_t len[CODEC_SYMBOLS];
+        for( int sym=0; sym<CODEC_SYMBOLS; sym+=2 ) {
+            const uint8_t b = desc[c * CODEC_SYMBOLS / 2 + sym / 2];
+            len[sym]   = b & 0xf;
+            len[sym+1] = b >> 4;
+        }
+        ok = ok && build_table( len, hdr.desc_shift, &tables[c * CODEC_TABLE_SIZE] );
+    }
+
+    const uint8_t* stream[CODEC_STREAMS];
+    size_t         stream_bytes[CODEC_STREAMS];
+    const uint8_t* q = desc + CODEC_LENGTH_BYTES + CODEC_STREAMS * sizeof(uint64_t);
+    for( int st=0; st<CODEC_STREAMS && ok; st++ ) {
+        uint64_t bytes;
+        memcpy( &bytes, desc + CODEC_LENGTH_BYTES + st * sizeof(uint64_t), sizeof(bytes) );
+        if( bytes > (uint64_t)( desc_end - q ) || desc_end - q - bytes < CODEC_STREAM_PAD ) {
+            ok = false;
+            break;
+        }
+        stream[st]       = q;
+        stream_bytes[st] = bytes;
+        q += bytes + CODEC_STREAM_PAD;
+    }
+    ok = ok && decode_rows( stream, stream_bytes, tables.data(), num_kpt, dim, hdr.desc_shift,
+                            (uint8_t*)features->getDescriptorData(), features->getDescStride() );
+    if( not ok ) {
+        cerr << "Compressed feature block has a damaged descriptor stream" << endl;
+        delete features;
+        return 0;
+    }
+
+    if( info ) {
+        info->image_width        = hdr.image_width;
+        info->image_height       = hdr.image_height;
+        info->config_fingerprint = hdr.config_fingerprint;
+        info->desc_codec         = (FeaturesFileCodec)hdr.desc_codec;
+        info->codec_fingerprint  = hdr.codec_fingerprint;
+    }
+    return features;
+}
+
+} // namespace popsift
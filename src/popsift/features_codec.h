@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "features_file.h"
+
+namespace popsift {
+
+class FeaturesSoA;
+
+#define POPSIFT_FEATURES_CODEC_MAGIC   "PSFZ\r\n\0\0"
+#define POPSIFT_FEATURES_CODEC_VERSION 1
+
+/* Quantization of the keypoints: positions in 1/16 pixel, scales in
+ * 1/256 steps of log2(sigma), orientations in 1/65536 turns */
+#define POPSIFT_CODEC_XY_SCALE    16
+#define POPSIFT_CODEC_SIGMA_SCALE 256
+
+/* Compressed feature block, a self-contained alternative to the
+ * binary feature file for archival and transfer (host byte order,
+ * checked with byte_order_mark):
+ *
+ *   0                  FeaturesCodecHeader, 96 bytes
+ *   header_size        keypoint stream, keypoint_bytes: extrema sorted
+ *                      by y and x, every extremum as varints of its
+ *                      position deltas, log-scale, octave and number of
+ *                      orientations, followed by 16-bit orientations
+ *   + keypoint_bytes   descriptor streams, desc_bytes: code lengths of
+ *                      4 Huffman tables and the sizes of 4 bit streams,
+ *                      then the streams; the descriptor bytes of the
+ *                      keypoints, in the same order, alternate between
+ *                      the streams row by row. Every value is coded with
+ *                      the table chosen by the magnitude of the value
+ *                      before it in the row.
+ *
+ * Keypoints are quantized, see above. Descriptors are stored as uint8;
+ * float and half descriptors are rounded like Config::UInt8Desc, so
+ * only uint8 descriptors and PQ codes survive unchanged, unless
+ * desc_shift drops low bits as well. Extrema keep their orientations
+ * together but not their order.
+ */
+struct FeaturesCodecHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark;    // 0x01020304
+    uint32_t desc_dim;
+    uint32_t num_features;
+    uint32_t num_keypoints;
+    int32_t  image_width;
+    int32_t  image_height;
+    uint64_t config_fingerprint;
+    uint32_t desc_codec;         // FeaturesFileCodec of the descriptor rows
+    uint32_t desc_shift;         // descriptor values were divided by 2^desc_shift
+    uint64_t codec_fingerprint;
+    uint32_t xy_scale;           // POPSIFT_CODEC_XY_SCALE
+    uint32_t sigma_scale;        // POPSIFT_CODEC_SIGMA_SCALE
+    uint64_t keypoint_bytes;
+    uint64_t desc_bytes;
+    uint8_t  reserved[8];
+};
+
+/* What a compressed block records besides keypoints and descriptors,
+ * with the same meaning as in FeaturesFileHeader */
+struct FeaturesCodecInfo
+{
+    int                image_width;
+    int                image_height;
+    unsigned long long config_fingerprint;
+    FeaturesFileCodec  desc_codec;
+    unsigned long long codec_fingerprint;
+
+    FeaturesCodecInfo( );
+};
+
+/* Compress features into out, replacing its content. With desc_shift
+ * > 0, descriptor values are rounded to multiples of 2^desc_shift,
+ * which saves about one bit per value and shift; 0 keeps uint8 values
+ * exact. PQ codes are never shifted. */
+void compressFeatures( const FeaturesSoA&       features,
+                       const FeaturesCodecInfo& info,
+                       std::vector<char>&       out,
+                       int                      desc_shift = 0 );
+
+/* Compress the content of a mapped feature file */
+void compressFeatures( const FeaturesFile& file, std::vector<char>& out, int desc_shift = 0 );
+
+/* Decompress a block into a FeaturesSoA with UInt8Desc descriptors, one
+ * row per keypoint. If info is given, it receives the block's image
+ * size and fingerprints. Returns 0 and explains why on cerr if the
+ * block is damaged. The caller must delete the result. */
+FeaturesSoA* decompressFeatures( const void*        data,
+                                 size_t             length,
+                                 FeaturesCodecInfo* info = 0 );
+
+} // namespace popsift
@@ -0,0 +1,396 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string.h>
+#include <iso646.h>
+
+#include <cuda_runtime.h>
+
+#include "features_db.h"
+#include "features_soa.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(FeaturesDbHeader) == 64, "FeaturesDbHeader must be 64 bytes" );
+static_assert( sizeof(FeaturesDbEntry)  == 64, "FeaturesDbEntry must be 64 bytes" );
+
+/* feature blocks start on the alignment that FeaturesFile expects */
+#define FDB_BLOCK_ALIGN 4096
+
+static inline uint64_t align_up( uint64_t v, uint64_t a )
+{
+    return ( v + a - 1 ) / a * a;
+}
+
+static uint32_t name_hash( const char* name, size_t length )
+{
+    uint32_t h = 2166136261u;
+    for( size_t i=0; i<length; i++ ) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void initHeader( FeaturesDbHeader& hdr, FeaturesDbFileKind kind, uint64_t db_id )
+{
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_FEATURES_DB_MAGIC, sizeof(hdr.magic) );
+    hdr.version         = POPSIFT_FEATURES_DB_VERSION;
+    hdr.header_size     = sizeof(FeaturesDbHeader);
+    hdr.byte_order_mark = 0x01020304;
+    hdr.kind            = kind;
+    hdr.db_id           = db_id;
+    hdr.entry_size      = sizeof(FeaturesDbEntry);
+}
+
+static bool validateHeader( const FeaturesDbHeader& hdr, size_t length,
+                            FeaturesDbFileKind kind, const std::string& filename )
+{
+    if( length < sizeof(FeaturesDbHeader) ||
+        memcmp( hdr.magic, POPSIFT_FEATURES_DB_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << filename << " is not a PopSift feature database file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << filename << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_FEATURES_DB_VERSION ) {
+        cerr << "File " << filename << " has feature database version " << hdr.version
+             << ", this reader supports version " << POPSIFT_FEATURES_DB_VERSION << endl;
+        return false;
+    }
+    if( hdr.kind != (uint32_t)kind || hdr.header_size < sizeof(FeaturesDbHeader) ||
+        hdr.header_size > length || hdr.entry_size != sizeof(FeaturesDbEntry) ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+    return true;
+}
+
+/* true if length bytes at offset lie in a file of file_length bytes;
+ * compared term by term so that crafted entries cannot wrap */
+static inline bool inFile( uint64_t offset, uint64_t length, uint64_t file_length )
+{
+    return offset <= file_length && length <= file_length - offset;
+}
+
+/*************************************************************
+ * FeaturesDbWriter
+ *************************************************************/
+
+FeaturesDbWriter::FeaturesDbWriter( )
+    : _segment_end( 0 )
+    , _count( 0 )
+{ }
+
+FeaturesDbWriter::~FeaturesDbWriter( )
+{
+    close( );
+}
+
+bool FeaturesDbWriter::open( const std::string& path )
+{
+    close( );
+
+    const string index_path = path + ".idx";
+
+    ifstream probe( path.c_str(), ios::binary );
+    const bool exists = probe.is_open();
+    probe.close();
+
+    if( not exists ) {
+        /* create both files */
+        std::random_device seed;
+        std::mt19937_64    rng( seed() ^ (uint64_t)std::chrono::system_clock::now().time_since_epoch().count() );
+        const uint64_t db_id = rng();
+
+        FeaturesDbHeader seg_hdr;
+        FeaturesDbHeader idx_hdr;
+        initHeader( seg_hdr, FDB_Segment, db_id );
+        initHeader( idx_hdr, FDB_Index,   db_id );
+
+        ofstream seg( path.c_str(), ios::binary );
+        ofstream idx( index_path.c_str(), ios::binary );
+        if( not seg.is_open() || not idx.is_open() ) {
+            cerr << "Feature database " << path << " could not be created" << endl;
+            return false;
+        }
+        seg.write( (const char*)&seg_hdr, sizeof(seg_hdr) );
+        idx.write( (const char*)&idx_hdr, sizeof(idx_hdr) );
+        if( not seg.good() || not idx.good() ) {
+            cerr << "Feature database " << path << " could not be created" << endl;
+            return false;
+        }
+    }
+
+    _segment.open( path.c_str(),       ios::binary | ios::in | ios::out );
+    _index.open(   index_path.c_str(), ios::binary | ios::in | ios::out );
+    if( not _segment.is_open() || not _index.is_open() ) {
+        cerr << "Feature database " << path << " could not be opened for writing" << endl;
+        close( );
+        return false;
+    }
+
+    FeaturesDbHeader seg_hdr;
+    FeaturesDbHeader idx_hdr;
+    memset( &seg_hdr, 0, sizeof(seg_hdr) );
+    memset( &idx_hdr, 0, sizeof(idx_hdr) );
+    _segment.seekg( 0, ios::end );
+    const uint64_t seg_length = _segment.tellg();
+    _segment.seekg( 0, ios::beg );
+    _segment.read( (char*)&seg_hdr, sizeof(seg_hdr) );
+    _index.seekg( 0, ios::end );
+    const uint64_t idx_length = _index.tellg();
+    _index.seekg( 0, ios::beg );
+    _index.read( (char*)&idx_hdr, sizeof(idx_hdr) );
+    _segment.clear();
+    _index.clear();
+
+    if( not validateHeader( seg_hdr, seg_length, FDB_Segment, path ) ||
+        not validateHeader( idx_hdr, idx_length, FDB_Index, index_path ) ) {
+        close( );
+        return false;
+    }
+    if( seg_hdr.db_id != idx_hdr.db_id ) {
+        cerr << "Index " << index_path << " does not belong to feature database " << path << endl;
+        close( );
+        return false;
+    }
+
+    /* a partial entry at the end is the trace of an interrupted append */
+    _count       = ( idx_length - idx_hdr.header_size ) / sizeof(FeaturesDbEntry);
+    _segment_end = seg_hdr.header_size;
+    if( _count > 0 ) {
+        FeaturesDbEntry last;
+        _index.seekg( idx_hdr.header_size + ( _count - 1 ) * sizeof(FeaturesDbEntry) );
+        _index.read( (char*)&last, sizeof(last) );
+        if( not _index.good() || not inFile( last.offset, last.length, seg_length ) ) {
+            cerr << "Feature database " << path << " is truncated" << endl;
+            close( );
+            return false;
+        }
+        _segment_end = last.offset + last.length;
+    }
+    _index.seekp( idx_hdr.header_size + _count * sizeof(FeaturesDbEntry) );
+    _path = path;
+    return true;
+}
+
+void FeaturesDbWriter::close( )
+{
+    if( _segment.is_open() ) _segment.close();
+    if( _index.is_open() )   _index.close();
+    _segment.clear();
+    _index.clear();
+    _segment_end = 0;
+    _count       = 0;
+}
+
+template<typename WriteFn>
+long long FeaturesDbWriter::appendBlock( const std::string& name, WriteFn write )
+{
+    if( not isOpen() ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Feature database is not open" << endl;
+        return -1;
+    }
+
+    FeaturesDbEntry entry;
+    memset( &entry, 0, sizeof(entry) );
+    entry.name_offset = _segment_end;
+    entry.name_length = name.size();
+    entry.name_hash   = name_hash( name.data(), name.size() );
+    entry.offset      = align_up( _segment_end + name.size(), FDB_BLOCK_ALIGN );
+
+    const vector<char> zeros( FDB_BLOCK_ALIGN, 0 );
+    _segment.seekp( _segment_end );
+    _segment.write( name.data(), name.size() );
+    _segment.write( zeros.data(), entry.offset - _segment_end - name.size() );
+
+    FeaturesFileHeader hdr;
+    const bool ok = write( _segment, hdr );
+    _segment.flush();
+    if( not ok || not _segment.good() ) {
+        cerr << "Failed to append features of " << name << " to " << _path << endl;
+        _segment.clear();
+        return -1;
+    }
+
+    entry.length             = hdr.file_size;
+    entry.config_fingerprint = hdr.config_fingerprint;
+    entry.num_features       = hdr.num_features;
+    entry.num_descriptors    = hdr.num_descriptors;
+    entry.desc_type          = hdr.desc_type;
+    entry.image_width        = hdr.image_width;
+    entry.image_height       = hdr.image_height;
+    entry.desc_codec         = hdr.desc_codec;
+
+    /* the entry commits the block */
+    const std::streampos entry_pos = _index.tellp();
+    _index.write( (const char*)&entry, sizeof(entry) );
+    _index.flush();
+    if( not _index.good() ) {
+        cerr << "Failed to append index entry of " << name << " to " << _path << ".idx" << endl;
+        _index.clear();
+        _index.seekp( entry_pos );
+        return -1;
+    }
+
+    _segment_end = entry.offset + entry.length;
+    return (long long)_count++;
+}
+
+long long FeaturesDbWriter::append( const std::string&  name,
+                                    const FeaturesHost& features,
+                                    const Config&       config,
+                                    int                 image_width,
+                                    int                 image_height,
+                                    Config::DescType    type )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    return appendBlock( name, [&]( std::ostream& ostr, FeaturesFileHeader& hdr ) {
+        return writeFeaturesBlock( ostr, features, config, image_width, image_height, type, &hdr );
+    } );
+}
+
+long long FeaturesDbWriter::append( const std::string& name,
+                                    const FeaturesSoA& features,
+                                    const Config&      config,
+                                    int                image_width,
+                                    int                image_height,
+                                    FeaturesFileCodec  codec,
+                                    unsigned long long codec_fingerprint )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    return appendBlock( name, [&]( std::ostream& ostr, FeaturesFileHeader& hdr ) {
+        return writeFeaturesBlock( ostr, features, config, image_width, image_height,
+                                   codec, codec_fingerprint, &hdr );
+    } );
+}
+
+/*************************************************************
+ * FeaturesDb
+ *************************************************************/
+
+FeaturesDb::FeaturesDb( )
+    : _segment( 0 )
+    , _segment_length( 0 )
+    , _index( 0 )
+    , _index_length( 0 )
+    , _entries( 0 )
+    , _count( 0 )
+{ }
+
+FeaturesDb::~FeaturesDb( )
+{
+    close( );
+}
+
+bool FeaturesDb::open( const std::string& path )
+{
+    close( );
+
+    const string index_path = path + ".idx";
+
+    _segment = mapFile( path, _segment_length, sizeof(FeaturesDbHeader), "PopSift feature database file" );
+    if( _segment == 0 ) return false;
+    _index = mapFile( index_path, _index_length, sizeof(FeaturesDbHeader), "PopSift feature database file" );
+    if( _index == 0 ) {
+        close( );
+        return false;
+    }
+
+    const FeaturesDbHeader& seg_hdr = *(const FeaturesDbHeader*)_segment;
+    const FeaturesDbHeader& idx_hdr = *(const FeaturesDbHeader*)_index;
+    if( not validateHeader( seg_hdr, _segment_length, FDB_Segment, path ) ||
+        not validateHeader( idx_hdr, _index_length, FDB_Index, index_path ) ) {
+        close( );
+        return false;
+    }
+    if( seg_hdr.db_id != idx_hdr.db_id ) {
+        cerr << "Index " << index_path << " does not belong to feature database " << path << endl;
+        close( );
+        return false;
+    }
+
+    _entries = (const FeaturesDbEntry*)( _index + idx_hdr.header_size );
+    _count   = ( _index_length - idx_hdr.header_size ) / sizeof(FeaturesDbEntry);
+    _path    = path;
+    return true;
+}
+
+void FeaturesDb::close( )
+{
+    unmapFile( _segment, _segment_length );
+    unmapFile( _index, _index_length );
+    _segment        = 0;
+    _segment_length = 0;
+    _index          = 0;
+    _index_length   = 0;
+    _entries        = 0;
+    _count          = 0;
+    _names.clear();
+}
+
+std::string FeaturesDb::getImageName( size_t id ) const
+{
+    if( id >= _count ) return string();
+    const FeaturesDbEntry& e = _entries[id];
+    if( not inFile( e.name_offset, e.name_length, _segment_length ) ) return string();
+    return string( _segment + e.name_offset, e.name_length );
+}
+
+bool FeaturesDb::getFeatures( size_t id, FeaturesFile& view ) const
+{
+    if( id >= _count ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Image " << id << " is not in feature database "
+             << _path << " with " << _count << " images" << endl;
+        view.close( );
+        return false;
+    }
+    const FeaturesDbEntry& e = _entries[id];
+    if( not inFile( e.offset, e.length, _segment_length ) ) {
+        cerr << "Feature database " << _path << " is truncated at image " << id << endl;
+        view.close( );
+        return false;
+    }
+    return view.openBlock( _segment + e.offset, e.length, _path + ":" + getImageName( id ) );
+}
+
+long long FeaturesDb::findImage( const std::string& name ) const
+{
+    std::lock_guard<std::mutex> lock( _names_mutex );
+
+    if( _names.empty() && _count > 0 ) {
+        _names.reserve( _count );
+        for( size_t id=0; id<_count; id++ ) {
+            _names.insert( std::make_pair( _entries[id].name_hash, (uint64_t)id ) );
+        }
+    }
+
+    const uint32_t h = name_hash( name.data(), name.size() );
+    auto range = _names.equal_range( h );
+    for( auto it = range.first; it != range.second; ++it ) {
+        const FeaturesDbEntry& e = _entries[it->second];
+        if( e.name_length == name.size() &&
+            inFile( e.name_offset, e.name_length, _segment_length ) &&
+            memcmp( _segment + e.name_offset, name.data(), name.size() ) == 0 ) {
+            return (long long)it->second;
+        }
+    }
+    return -1;
+}
+
+} // namespace popsift
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+
+#include "features_file.h"
+
+namespace popsift {
+
+#define POPSIFT_FEATURES_DB_MAGIC   "PSFDB\r\n\0"
+#define POPSIFT_FEATURES_DB_VERSION 1
+
+/* A feature database holds the features of many images in two files
+ * instead of one file per image:
+ *
+ *   <path>      segment: a FeaturesDbHeader, followed for every image by
+ *               its name and, at the next 4096-byte boundary, a feature
+ *               block with the bytes of a binary feature file
+ *               (features_file.h)
+ *   <path>.idx  index: a FeaturesDbHeader, followed by one
+ *               FeaturesDbEntry per image; the image id is the position
+ *               of the entry
+ *
+ * Both files are append-only. The index entry of an image is written
+ * after its block, so an interrupted writer leaves at most a block
+ * without entry, which the next writer overwrites.
+ */
+struct FeaturesDbHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark; // 0x01020304
+    uint32_t kind;            // FeaturesDbFileKind
+    uint64_t db_id;           // random, identical in segment and index
+    uint32_t entry_size;      // sizeof(FeaturesDbEntry)
+    uint32_t reserved0;
+    uint8_t  reserved[24];
+};
+
+enum FeaturesDbFileKind
+{
+    FDB_Segment = 1,
+    FDB_Index   = 2
+};
+
+struct FeaturesDbEntry
+{
+    uint64_t offset;             // of the feature block in the segment
+    uint64_t length;             // of the feature block
+    uint64_t name_offset;        // of the image name in the segment
+    uint64_t config_fingerprint; // copied from the block header
+    uint32_t name_length;
+    uint32_t num_features;
+    uint32_t num_descriptors;
+    uint32_t desc_type;          // Config::DescType
+    int32_t  image_width;
+    int32_t  image_height;
+    uint32_t desc_codec;         // FeaturesFileCodec
+    uint32_t name_hash;          // FNV-1a of the name, for findImage
+};
+
+/* Appends images to a feature database, creating it if it does not
+ * exist. append() may be called from several threads.
+ */
+class FeaturesDbWriter
+{
+public:
+    FeaturesDbWriter( );
+    ~FeaturesDbWriter( );
+
+    /** Returns false and explains why on cerr if the files cannot be
+     *  created, or exist and are not a matching segment and index. */
+    bool open( const std::string& path );
+    void close( );
+
+    inline bool   isOpen( ) const        { return _segment.is_open(); }
+    inline size_t getImageCount( ) const { return _count; }
+
+    /** Append the features of one image like writeFeaturesFile.
+     *  Returns the id of the image, or -1 if writing failed. */
+    long long append( const std::string&  name,
+                      const FeaturesHost& features,
+                      const Config&       config,
+                      int                 image_width,
+                      int                 image_height,
+                      Config::DescType    type = Config::FloatDesc );
+
+    long long append( const std::string& name,
+                      const FeaturesSoA& features,
+                      const Config&      config,
+                      int                image_width,
+                      int                image_height,
+                      FeaturesFileCodec  codec = FF_CodecNone,
+                      unsigned long long codec_fingerprint = 0 );
+
+private:
+    /* write name and block, then the entry; called with _mutex held */
+    template<typename WriteFn>
+    long long appendBlock( const std::string& name, WriteFn write );
+
+    std::mutex   _mutex;
+    std::fstream _segment;
+    std::fstream _index;
+    std::string  _path;
+    uint64_t     _segment_end;
+    size_t       _count;
+};
+
+/* A read-only view of a feature database. Segment and index are mapped
+ * into memory when the database is opened; getFeatures() points a
+ * FeaturesFile at the block of an image without reading or copying.
+ * Images appended after open() are not visible.
+ */
+class FeaturesDb
+{
+public:
+    FeaturesDb( );
+    ~FeaturesDb( );
+
+    /** Returns false and explains why on cerr if the files are not a
+     *  matching feature database. */
+    bool open( const std::string& path );
+    void close( );
+
+    inline bool   isOpen( ) const        { return _segment != 0; }
+    inline size_t getImageCount( ) const { return _count; }
+
+    /** The random id of the database, to recognize files derived from it */
+    inline uint64_t getDbId( ) const { return ((const FeaturesDbHeader*)_segment)->db_id; }
+
+    inline const FeaturesDbEntry& getEntry( size_t id ) const { return _entries[id]; }
+
+    std::string getImageName( size_t id ) const;
+
+    /** Point view at the features of image id. The view is valid while
+     *  the database is open. Returns false if id is out of range or the
+     *  block is damaged. */
+    bool getFeatures( size_t id, FeaturesFile& view ) const;
+
+    /** Id of the image with this name, -1 if there is none. The first
+     *  call builds a hash table over all names. */
+    long long findImage( const std::string& name ) const;
+
+private:
+    const char*            _segment;
+    size_t                 _segment_length;
+    const char*            _index;
+    size_t                 _index_length;
+    const FeaturesDbEntry* _entries;
+    size_t                 _count;
+    std::string            _path;
+
+    mutable std::mutex                                  _names_mutex;
+    mutable std::unordered_multimap<uint32_t, uint64_t> _names;
+};
+
+} // namespace popsift
@@ -0,0 +1,409 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string.h>
+#include <iso646.h>
+
+#include <cuda_runtime.h>
+
+#include "features_file.h"
+#include "features_soa.h"
+#include "mapped_file.h"
+#include "desc_convert.h"
+#include "sift_extremum.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(FeaturesFileHeader) == 128, "FeaturesFileHeader must be 128 bytes" );
+
+/* The descriptor block starts on a 4K boundary independent of the
+ * page size of the writer, mapped descriptors are always aligned. */
+#define FF_DESC_ALIGN     4096
+#define FF_KEYPOINT_ALIGN 64
+#define FF_ROW_ALIGN      16
+
+static inline uint64_t align_up( uint64_t v, uint64_t a )
+{
+    return ( v + a - 1 ) / a * a;
+}
+
+/*************************************************************
+ * writeFeaturesFile
+ *************************************************************/
+
+static void initHeader( FeaturesFileHeader& hdr,
+                        const Config&       config,
+                        int                 image_width,
+                        int                 image_height,
+                        int                 num_features,
+                        int                 num_desc,
+                        Config::DescType    type,
+                        int                 dim )
+{
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_FEATURES_FILE_MAGIC, sizeof(hdr.magic) );
+    hdr.version            = POPSIFT_FEATURES_FILE_VERSION;
+    hdr.header_size        = sizeof(FeaturesFileHeader);
+    hdr.byte_order_mark    = 0x01020304;
+    hdr.desc_type          = type;
+    hdr.config_fingerprint = config.getFingerprint();
+    hdr.image_width        = image_width;
+    hdr.image_height       = image_height;
+    hdr.num_features       = num_features;
+    hdr.num_descriptors    = num_desc;
+    hdr.desc_dim           = dim;
+    hdr.desc_stride        = align_up( dim * descTypeSize( type ), FF_ROW_ALIGN );
+    hdr.keypoint_offset    = align_up( sizeof(FeaturesFileHeader), FF_KEYPOINT_ALIGN );
+    hdr.keypoint_stride    = align_up( num_desc * sizeof(float), FF_KEYPOINT_ALIGN );
+    hdr.desc_offset        = align_up( hdr.keypoint_offset + KP_NumArrays * hdr.keypoint_stride, FF_DESC_ALIGN );
+    hdr.file_size          = hdr.desc_offset + (uint64_t)num_desc * hdr.desc_stride;
+}
+
+static bool writeBlocks( std::ostream&             of,
+                         const FeaturesFileHeader& hdr,
+                         const vector<char>&       kp,
+                         const vector<char>&       desc )
+{
+    const vector<char> zeros( FF_DESC_ALIGN, 0 );
+    of.write( (const char*)&hdr, sizeof(hdr) );
+    of.write( zeros.data(), hdr.keypoint_offset - sizeof(hdr) );
+    of.write( kp.data(), kp.size() );
+    of.write( zeros.data(), hdr.desc_offset - hdr.keypoint_offset - kp.size() );
+    of.write( desc.data(), (size_t)hdr.num_descriptors * hdr.desc_stride );
+    return of.good();
+}
+
+/* Open filename and write a block into it with write( ostream& ) */
+template<typename WriteFn>
+static bool writeFile( const std::string& filename, WriteFn write )
+{
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+    if( not write( of ) ) {
+        cerr << "Failed to write features to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool writeFeaturesBlock( std::ostream&       ostr,
+                         const FeaturesHost& features,
+                         const Config&       config,
+                         int                 image_width,
+                         int                 image_height,
+                         Config::DescType    type,
+                         FeaturesFileHeader* header )
+{
+    const uint32_t num_desc = features.getDescriptorCount();
+    const uint32_t dim      = 128;
+
+    FeaturesFileHeader hdr;
+    initHeader( hdr, config, image_width, image_height,
+                features.getFeatureCount(), num_desc, type, dim );
+
+    /* transpose the Feature records into keypoint arrays */
+    vector<char>   kp( KP_NumArrays * hdr.keypoint_stride, 0 );
+    float*         xpos  = (float*)&kp[KP_XPos        * hdr.keypoint_stride];
+    float*         ypos  = (float*)&kp[KP_YPos        * hdr.keypoint_stride];
+    float*         sigma = (float*)&kp[KP_Sigma       * hdr.keypoint_stride];
+    float*         ori   = (float*)&kp[KP_Orientation * hdr.keypoint_stride];
+    int*           oct   = (int*)  &kp[KP_Octave      * hdr.keypoint_stride];
+    int*           fidx  = (int*)  &kp[KP_Feature     * hdr.keypoint_stride];
+
+    vector<char>   desc( (size_t)num_desc * hdr.desc_stride, 0 );
+
+    uint32_t k = 0;
+    int      f = 0;
+    for( const Feature& feat : features ) {
+        for( int o=0; o<feat.num_ori; o++ ) {
+            if( k == num_desc ) {
+                cerr << __FILE__ << ":" << __LINE__ << " Features reference more descriptors than "
+                     << num_desc << ", not writing them" << endl;
+                return false;
+            }
+            xpos[k]  = feat.xpos;
+            ypos[k]  = feat.ypos;
+            sigma[k] = feat.sigma;
+            ori[k]   = feat.orientation[o];
+            oct[k]   = feat.debug_octave;
+            fidx[k]  = f;
+            if( features.getDescType() == Config::FloatDesc ) {
+                convertFromFloat( feat.desc[o]->features, dim, type, &desc[(size_t)k * hdr.desc_stride] );
+            } else {
+                const char* src = (const char*)features.getDescriptorData() + k * features.getDescriptorStride();
+                convertDescriptor( src, features.getDescType(), &desc[(size_t)k * hdr.desc_stride], type, dim );
+            }
+            k++;
+        }
+        f++;
+    }
+    hdr.num_descriptors = k;
+    hdr.file_size       = hdr.desc_offset + (uint64_t)k * hdr.desc_stride;
+    if( header ) *header = hdr;
+
+    return writeBlocks( ostr, hdr, kp, desc );
+}
+
+bool writeFeaturesBlock( std::ostream&       ostr,
+                         const FeaturesSoA&  features,
+                         const Config&       config,
+                         int                 image_width,
+                         int                 image_height,
+                         FeaturesFileCodec   codec,
+                         unsigned long long  codec_fingerprint,
+                         FeaturesFileHeader* header )
+{
+    const int num_kpt = features.getKeypointCount();
+
+    FeaturesFileHeader hdr;
+    initHeader( hdr, config, image_width, image_height,
+                features.getFeatureCount(), num_kpt,
+                features.getDescType(), features.getDescDim() );
+    hdr.desc_codec        = codec;
+    hdr.codec_fingerprint = codec_fingerprint;
+
+    vector<char> kp( KP_NumArrays * hdr.keypoint_stride, 0 );
+    memcpy( &kp[KP_XPos        * hdr.keypoint_stride], features.getXPos(),         num_kpt * sizeof(float) );
+    memcpy( &kp[KP_YPos        * hdr.keypoint_stride], features.getYPos(),         num_kpt * sizeof(float) );
+    memcpy( &kp[KP_Sigma       * hdr.keypoint_stride], features.getSigma(),        num_kpt * sizeof(float) );
+    memcpy( &kp[KP_Orientation * hdr.keypoint_stride], features.getOrientation(),  num_kpt * sizeof(float) );
+    memcpy( &kp[KP_Octave      * hdr.keypoint_stride], features.getOctave(),       num_kpt * sizeof(int) );
+    memcpy( &kp[KP_Feature     * hdr.keypoint_stride], features.getFeatureIndex(), num_kpt * sizeof(int) );
+
+    /* the file has one descriptor per keypoint, in keypoint order */
+    vector<char> desc( (size_t)num_kpt * hdr.desc_stride, 0 );
+    const size_t row_bytes = features.getDescDim() * descTypeSize( features.getDescType() );
+    for( int k=0; k<num_kpt; k++ ) {
+        memcpy( &desc[(size_t)k * hdr.desc_stride], features.getKeypointDescriptor( k ), row_bytes );
+    }
+    if( header ) *header = hdr;
+
+    return writeBlocks( ostr, hdr, kp, desc );
+}
+
+bool writeFeaturesFile( const std::string&  filename,
+                        const FeaturesHost& features,
+                        const Config&       config,
+                        int                 image_width,
+                        int                 image_height,
+                        Config::DescType    type )
+{
+    return writeFile( filename, [&]( std::ostream& ostr ) {
+        return writeFeaturesBlock( ostr, features, config, image_width, image_height, type );
+    } );
+}
+
+bool writeFeaturesFile( const std::string& filename,
+                        const FeaturesSoA& features,
+                        const Config&      config,
+                        int                image_width,
+                        int                image_height,
+                        FeaturesFileCodec  codec,
+                        unsigned long long codec_fingerprint )
+{
+    return writeFile( filename, [&]( std::ostream& ostr ) {
+        return writeFeaturesBlock( ostr, features, config, image_width, image_height,
+                                   codec, codec_fingerprint );
+    } );
+}
+
+/*************************************************************
+ * FeaturesFile
+ *************************************************************/
+
+FeaturesFile::FeaturesFile( )
+    : _base( 0 )
+    , _header( 0 )
+    , _length( 0 )
+    , _owned( false )
+{ }
+
+FeaturesFile::~FeaturesFile( )
+{
+    close( );
+}
+
+bool FeaturesFile::open( const std::string& filename )
+{
+    close( );
+
+    _base = mapFile( filename, _length, sizeof(FeaturesFileHeader), "PopSift feature file" );
+    if( _base == 0 ) return false;
+    _owned  = true;
+    _header = (const FeaturesFileHeader*)_base;
+
+    if( not validate( filename ) ) {
+        close( );
+        return false;
+    }
+
+    setFeatureCount( _header->num_features );
+    setDescriptorCount( _header->num_descriptors );
+    return true;
+}
+
+bool FeaturesFile::openBlock( const void* data, size_t length, const std::string& name )
+{
+    close( );
+
+    if( length < sizeof(FeaturesFileHeader) ) {
+        cerr << "Block " << name << " is too short to be a PopSift feature block" << endl;
+        return false;
+    }
+    if( (uintptr_t)data % FF_DESC_ALIGN != 0 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Feature block " << name << " is not "
+             << FF_DESC_ALIGN << "-byte aligned" << endl;
+        return false;
+    }
+
+    _base   = (const char*)data;
+    _length = length;
+    _owned  = false;
+    _header = (const FeaturesFileHeader*)_base;
+
+    if( not validate( name ) ) {
+        close( );
+        return false;
+    }
+
+    setFeatureCount( _header->num_features );
+    setDescriptorCount( _header->num_descriptors );
+    return true;
+}
+
+void FeaturesFile::close( )
+{
+    if( _base == 0 ) return;
+
+    if( _owned ) {
+        unmapFile( _base, _length );
+    }
+    _base   = 0;
+    _header = 0;
+    _length = 0;
+    _owned  = false;
+    setFeatureCount( 0 );
+    setDescriptorCount( 0 );
+}
+
+bool FeaturesFile::validate( const std::string& filename ) const
+{
+    const FeaturesFileHeader& h = *_header;
+
+    if( _length < sizeof(FeaturesFileHeader) ||
+        memcmp( h.magic, POPSIFT_FEATURES_FILE_MAGIC, sizeof(h.magic) ) != 0 ) {
+        cerr << "File " << filename << " is not a PopSift feature file" << endl;
+        return false;
+    }
+    if( h.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << filename << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( h.version != POPSIFT_FEATURES_FILE_VERSION ) {
+        cerr << "File " << filename << " has feature file version " << h.version
+             << ", this reader supports version " << POPSIFT_FEATURES_FILE_VERSION << endl;
+        return false;
+    }
+    if( h.header_size < sizeof(FeaturesFileHeader) || h.desc_type > Config::UInt8Desc ||
+        h.desc_codec > FF_CodecPQ ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+
+    /* every term is bounded by the file length before the terms are
+     * added, so that a crafted offset or stride cannot wrap the sum */
+    const bool in_file =
+        h.keypoint_offset <= _length &&
+        h.keypoint_stride <= ( _length - h.keypoint_offset ) / KP_NumArrays &&
+        h.desc_offset     <= _length &&
+        (uint64_t)h.num_descriptors * h.desc_stride <= _length - h.desc_offset;
+    if( not in_file ||
+        h.keypoint_offset % FF_KEYPOINT_ALIGN != 0 ||
+        h.keypoint_stride < (uint64_t)h.num_descriptors * sizeof(float) ||
+        h.desc_offset % FF_DESC_ALIGN != 0 ||
+        h.desc_stride < h.desc_dim * descTypeSize( (Config::DescType)h.desc_type ) ||
+        h.keypoint_offset + KP_NumArrays * h.keypoint_stride > h.desc_offset ) {
+        cerr << "File " << filename << " is truncated or has inconsistent block offsets" << endl;
+        return false;
+    }
+    return true;
+}
+
+void FeaturesFile::getDescriptorAsFloat( int i, float* dst ) const
+{
+    convertToFloat( getDescriptor( i ), getDescDim(), getDescType(), dst );
+}
+
+FeaturesHost* FeaturesFile::toFeaturesHost( ) const
+{
+    if( getDescDim() != 128 || getDescCodec() != FF_CodecNone ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot create Feature records from "
+             << getDescDim() << "-dimensional " << ( getDescCodec() != FF_CodecNone ? "encoded " : "" )
+             << "descriptors" << endl;
+        return 0;
+    }
+
+    const int    num_desc = getDescriptorCount();
+    const float* xpos     = getXPos();
+    const float* ypos     = getYPos();
+    const float* sigma    = getSigma();
+    const float* ori      = getOrientation();
+    const int*   oct      = getOctave();
+    const int*   fidx     = getFeatureIndex();
+
+    const Config::DescType type = getDescType();
+
+    FeaturesHost* features = new FeaturesHost( getFeatureCount(), num_desc, type );
+    Feature*      ext      = features->getFeatures();
+    Descriptor*   desc     = features->getDescriptors();
+    char*         compact  = (char*)features->getDescriptorData();
+
+    int f = -1;
+    for( int k=0; k<num_desc; k++ ) {
+        if( f < 0 || fidx[k] != fidx[k-1] || ext[f].num_ori == ORIENTATION_MAX_COUNT ) {
+            f++;
+            if( f >= getFeatureCount() ) {
+                cerr << __FILE__ << ":" << __LINE__ << " Feature file references more than "
+                     << getFeatureCount() << " features" << endl;
+                delete features;
+                return 0;
+            }
+            Feature& feat = ext[f];
+            feat.debug_octave = oct[k];
+            feat.xpos         = xpos[k];
+            feat.ypos         = ypos[k];
+            feat.sigma        = sigma[k];
+            feat.num_ori      = 0;
+            for( int o=0; o<ORIENTATION_MAX_COUNT; o++ ) {
+                feat.orientation[o] = 0.0f;
+                feat.desc[o]        = 0;
+            }
+        }
+        Feature& feat = ext[f];
+        feat.orientation[feat.num_ori] = ori[k];
+        if( type == Config::FloatDesc ) {
+            feat.desc[feat.num_ori] = &desc[k];
+            getDescriptorAsFloat( k, desc[k].features );
+        } else {
+            memcpy( compact + k * features->getDescriptorStride(), getDescriptor( k ), features->getDescriptorStride() );
+        }
+        feat.num_ori++;
+    }
+    features->setFeatureCount( f + 1 );
+    return features;
+}
+
+} // namespace popsift
+
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <ostream>
+
+#include "features.h"
+#include "sift_conf.h"
+
+namespace popsift {
+
+class FeaturesSoA;
+
+#define POPSIFT_FEATURES_FILE_MAGIC   "PSFEAT\r\n"
+#define POPSIFT_FEATURES_FILE_VERSION 1
+
+/* Binary feature file, a replacement for the text output of
+ * FeaturesHost::print that can be mapped into memory and used
+ * without parsing.
+ *
+ * Layout (host byte order, checked with byte_order_mark):
+ *
+ *   0                  FeaturesFileHeader, 128 bytes
+ *   keypoint_offset    keypoint block: one keypoint per descriptor,
+ *                      6 arrays of num_descriptors 4-byte values,
+ *                      keypoint_stride bytes apart (64-byte aligned):
+ *                          float xpos[]
+ *                          float ypos[]
+ *                          float sigma[]
+ *                          float orientation[]
+ *                          int   octave[]
+ *                          int   feature[]   index of the extremum, keypoints
+ *                                            of one extremum are consecutive
+ *   desc_offset        descriptor block, page-aligned: num_descriptors rows
+ *                      of desc_dim values of type desc_type, desc_stride
+ *                      bytes apart (16-byte aligned)
+ *
+ * Readers must reject files with a different major version. Fields may
+ * be appended in the reserved area without changing the version.
+ */
+struct FeaturesFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark;    // 0x01020304
+    uint32_t desc_type;          // Config::DescType
+    uint64_t config_fingerprint; // Config::getFingerprint()
+    int32_t  image_width;
+    int32_t  image_height;
+    uint32_t num_features;       // extrema
+    uint32_t num_descriptors;    // keypoints, one per orientation
+    uint32_t desc_dim;           // values per descriptor
+    uint32_t desc_stride;        // bytes per descriptor row
+    uint64_t keypoint_offset;
+    uint64_t keypoint_stride;
+    uint64_t desc_offset;
+    uint64_t file_size;
+    uint32_t desc_codec;         // FeaturesFileCodec, 0 in files written before it existed
+    uint32_t reserved0;
+    uint64_t codec_fingerprint;  // identifies the codebook for FF_CodecPQ
+    uint8_t  reserved[24];
+};
+
+/* How the rows of the descriptor block are to be interpreted */
+enum FeaturesFileCodec
+{
+    FF_CodecNone = 0,  // descriptor values of desc_type
+    FF_CodecPQ   = 1   // product quantization codes, desc_dim bytes, see desc_pq.h
+};
+
+enum FeaturesFileArray
+{
+    KP_XPos = 0,
+    KP_YPos,
+    KP_Sigma,
+    KP_Orientation,
+    KP_Octave,
+    KP_Feature,
+    KP_NumArrays
+};
+
+/* Write features in the binary format. The descriptors are converted
+ * to type, see desc_convert.h. image_width and image_height are only
+ * stored for the reader's information.
+ * Returns false if the file could not be written.
+ */
+bool writeFeaturesFile( const std::string&  filename,
+                        const FeaturesHost& features,
+                        const Config&       config,
+                        int                 image_width,
+                        int                 image_height,
+                        Config::DescType    type = Config::FloatDesc );
+
+/* Write a FeaturesSoA, keeping its descriptor type and dimension.
+ * Descriptors are stored in keypoint order. codec and
+ * codec_fingerprint describe descriptor rows that are not plain values,
+ * e.g. the result of PqCodebook::encode.
+ */
+bool writeFeaturesFile( const std::string& filename,
+                        const FeaturesSoA& features,
+                        const Config&      config,
+                        int                image_width,
+                        int                image_height,
+                        FeaturesFileCodec  codec = FF_CodecNone,
+                        unsigned long long codec_fingerprint = 0 );
+
+/* Write the bytes of a feature file to a stream, e.g. into a segment
+ * of a FeaturesDb (features_db.h). Offsets in the header are relative
+ * to the start of the block, which the reader expects at a 4096-byte
+ * aligned address. If header is given, it receives the header that
+ * was written. Returns false if the stream failed.
+ */
+bool writeFeaturesBlock( std::ostream&       ostr,
+                         const FeaturesHost& features,
+                         const Config&       config,
+                         int                 image_width,
+                         int                 image_height,
+                         Config::DescType    type = Config::FloatDesc,
+                         FeaturesFileHeader* header = 0 );
+
+bool writeFeaturesBlock( std::ostream&       ostr,
+                         const FeaturesSoA&  features,
+                         const Config&       config,
+                         int                 image_width,
+                         int                 image_height,
+                         FeaturesFileCodec   codec = FF_CodecNone,
+                         unsigned long long  codec_fingerprint = 0,
+                         FeaturesFileHeader* header = 0 );
+
+/* A read-only view of a binary feature file. The file is memory-mapped,
+ * nothing is parsed or copied when it is opened. Feature and descriptor
+ * counts are available through the FeaturesBase interface like for
+ * FeaturesHost.
+ */
+class FeaturesFile : public FeaturesBase
+{
+public:
+    FeaturesFile( );
+    virtual ~FeaturesFile( );
+
+    /** Map the file. Returns false and explains why on cerr if
+     *  it is not a valid feature file. */
+    bool open( const std::string& filename );
+
+    /** View a feature block that is already in memory, e.g. inside a
+     *  mapped FeaturesDb segment. data must be 4096-byte aligned and
+     *  stay valid while the view is used; it is not released by
+     *  close(). name is only used in error messages. */
+    bool openBlock( const void* data, size_t length, const std::string& name );
+
+    void close( );
+
+    inline bool isOpen( ) const { return _base != 0; }
+
+    inline const FeaturesFileHeader& getHeader( ) const { return *_header; }
+
+    inline int                getImageWidth( ) const        { return _header->image_width; }
+    inline int                getImageHeight( ) const       { return _header->image_height; }
+    inline unsigned long long getConfigFingerprint( ) const { return _header->config_fingerprint; }
+    inline Config::DescType   getDescType( ) const          { return (Config::DescType)_header->desc_type; }
+    inline int                getDescDim( ) const           { return _header->desc_dim; }
+    inline size_t             getDescStride( ) const        { return _header->desc_stride; }
+    inline FeaturesFileCodec  getDescCodec( ) const         { return (FeaturesFileCodec)_header->desc_codec; }
+    inline unsigned long long getCodecFingerprint( ) const  { return _header->codec_fingerprint; }
+
+    /* keypoint arrays, getDescriptorCount() entries each */
+    inline const float* getXPos( ) const        { return (const float*)array( KP_XPos ); }
+    inline const float* getYPos( ) const        { return (const float*)array( KP_YPos ); }
+    inline const float* getSigma( ) const       { return (const float*)array( KP_Sigma ); }
+    inline const float* getOrientation( ) const { return (const float*)array( KP_Orientation ); }
+    inline const int*   getOctave( ) const      { return (const int*)array( KP_Octave ); }
+    inline const int*   getFeatureIndex( ) const { return (const int*)array( KP_Feature ); }
+
+    /** Start of the descriptor block, row i is at i * getDescStride() */
+    inline const void* getDescriptorData( ) const { return _base + _header->desc_offset; }
+
+    inline const void* getDescriptor( int i ) const {
+        return _base + _header->desc_offset + (size_t)i * _header->desc_stride;
+    }
+
+    /** Descriptor i converted to getDescDim() floats. For encoded
+     *  descriptors these are the code bytes. */
+    void getDescriptorAsFloat( int i, float* dst ) const;
+
+    /** Copy into a FeaturesHost, for code that needs the Feature
+     *  records (e.g. print). Requires 128-dimensional, not encoded
+     *  descriptors.
+     *  The descriptors keep their type. The caller must delete the result. */
+    FeaturesHost* toFeaturesHost( ) const;
+
+private:
+    inline const void* array( FeaturesFileArray a ) const {
+        return _base + _header->keypoint_offset + a * _header->keypoint_stride;
+    }
+
+    bool validate( const std::string& filename ) const;
+
+    const char*               _base;
+    const FeaturesFileHeader* _header;
+    size_t                    _length;
+    bool                      _owned;    // _base was mapped by open()
+};
+
+} // namespace popsift
+
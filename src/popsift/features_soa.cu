@@ -0,0 +1,263 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "features_soa.h"
+#include "features_file.h"
+#include "desc_convert.h"
+#include "sift_extremum.h"
+#include "common/assist.h"
+
+using namespace std;
+
+namespace popsift {
+
+#define SOA_ARRAY_ALIGN 64
+#define SOA_ROW_ALIGN   16
+
+static inline size_t align_up( size_t v, size_t a )
+{
+    return ( v + a - 1 ) / a * a;
+}
+
+static void* soa_alloc( size_t bytes, const char* what, int count )
+{
+    void* ptr = memalign( getPageSize(), bytes > 0 ? bytes : 1 );
+    if( ptr == 0 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Runtime error:" << endl
+             << "    Failed to (re)allocate memory for " << count << " " << what << endl;
+        if( errno == EINVAL ) cerr << "    Alignment is not a power of two." << endl;
+        if( errno == ENOMEM ) cerr << "    Not enough memory." << endl;
+        exit( -1 );
+    }
+    return ptr;
+}
+
+/*************************************************************
+ * FeaturesSoA
+ *************************************************************/
+
+FeaturesSoA::FeaturesSoA( )
+    : _num_kpt( 0 )
+    , _kpt_capacity( 0 )
+    , _xpos( 0 )
+    , _ypos( 0 )
+    , _sigma( 0 )
+    , _orientation( 0 )
+    , _octave( 0 )
+    , _feature( 0 )
+    , _desc_index( 0 )
+    , _desc( 0 )
+    , _desc_type( Config::FloatDesc )
+    , _desc_dim( 128 )
+    , _desc_stride( 128 * sizeof(float) )
+{ }
+
+FeaturesSoA::FeaturesSoA( int num_ext, int num_kpt, int num_desc, Config::DescType type, int desc_dim )
+    : _num_kpt( 0 )
+    , _kpt_capacity( 0 )
+    , _xpos( 0 )
+    , _desc( 0 )
+{
+    reset( num_ext, num_kpt, num_desc, type, desc_dim );
+}
+
+FeaturesSoA::FeaturesSoA( const FeaturesHost& features, Config::DescType type )
+    : _num_kpt( 0 )
+    , _kpt_capacity( 0 )
+    , _xpos( 0 )
+    , _desc( 0 )
+{
+    const int num_desc = features.getDescriptorCount();
+    reset( features.getFeatureCount(), num_desc, num_desc, type, 128 );
+
+    int k = 0;
+    int f = 0;
+    for( const Feature& feat : features ) {
+        for( int o=0; o<feat.num_ori && k<num_desc; o++ ) {
+            _xpos[k]        = feat.xpos;
+            _ypos[k]        = feat.ypos;
+            _sigma[k]       = feat.sigma;
+            _orientation[k] = feat.orientation[o];
+            _octave[k]      = feat.debug_octave;
+            _feature[k]     = f;
+            _desc_index[k]  = k;
+            if( features.getDescType() == Config::FloatDesc ) {
+                convertFromFloat( feat.desc[o]->features, _desc_dim, _desc_type, getDescriptor( k ) );
+            } else {
+                const char* src = (const char*)features.getDescriptorData() + k * features.getDescriptorStride();
+                convertDescriptor( src, features.getDescType(), getDescriptor( k ), _desc_type, _desc_dim );
+            }
+            k++;
+        }
+        f++;
+    }
+    _num_kpt = k;
+}
+
+FeaturesSoA::FeaturesSoA( const FeaturesFile& file )
+    : _num_kpt( 0 )
+    , _kpt_capacity( 0 )
+    , _xpos( 0 )
+    , _desc( 0 )
+{
+    const int num_desc = file.getDescriptorCount();
+    reset( file.getFeatureCount(), num_desc, num_desc, file.getDescType(), file.getDescDim() );
+
+    memcpy( _xpos,        file.getXPos(),        num_desc * sizeof(float) );
+    memcpy( _ypos,        file.getYPos(),        num_desc * sizeof(float) );
+    memcpy( _sigma,       file.getSigma(),       num_desc * sizeof(float) );
+    memcpy( _orientation, file.getOrientation(), num_desc * sizeof(float) );
+    memcpy( _octave,      file.getOctave(),      num_desc * sizeof(int) );
+    memcpy( _feature,     file.getFeatureIndex(), num_desc * sizeof(int) );
+    for( int k=0; k<num_desc; k++ ) {
+        _desc_index[k] = k;
+    }
+
+    const size_t row_bytes = _desc_dim * descTypeSize( _desc_type );
+    if( file.getDescStride() == _desc_stride ) {
+        memcpy( _desc, file.getDescriptorData(), num_desc * _desc_stride );
+    } else {
+        for( int k=0; k<num_desc; k++ ) {
+            memcpy( getDescriptor( k ), file.getDescriptor( k ), row_bytes );
+        }
+    }
+    _num_kpt = num_desc;
+}
+
+FeaturesSoA::FeaturesSoA( const FeaturesSoA& other )
+    : FeaturesBase( )
+    , _num_kpt( 0 )
+    , _kpt_capacity( 0 )
+    , _xpos( 0 )
+    , _desc( 0 )
+{
+    copyFrom( other );
+}
+
+FeaturesSoA& FeaturesSoA::operator=( const FeaturesSoA& other )
+{
+    if( this != &other ) {
+        copyFrom( other );
+    }
+    return *this;
+}
+
+FeaturesSoA::~FeaturesSoA( )
+{
+    release( );
+}
+
+void FeaturesSoA::copyFrom( const FeaturesSoA& other )
+{
+    reset( other.getFeatureCount(), other._kpt_capacity, other.getDescriptorCount(),
+           other._desc_type, other._desc_dim );
+    copyKeypoints( other );
+    _num_kpt = other._num_kpt;
+    memcpy( _desc, other._desc, other.getDescriptorCount() * _desc_stride );
+}
+
+void FeaturesSoA::release( )
+{
+    free( _xpos );
+    free( _desc );
+    _xpos = _ypos = _sigma = _orientation = 0;
+    _octave = _feature = _desc_index = 0;
+    _desc = 0;
+    _kpt_capacity = 0;
+}
+
+void FeaturesSoA::reset( int num_ext, int num_kpt, int num_desc, Config::DescType type, int desc_dim )
+{
+    release( );
+
+    _desc_type   = type;
+    _desc_dim    = desc_dim;
+    _desc_stride = align_up( desc_dim * descTypeSize( type ), SOA_ROW_ALIGN );
+
+    /* all keypoint arrays share one allocation, each starts on a cache line */
+    const size_t array_bytes = align_up( num_kpt * sizeof(float), SOA_ARRAY_ALIGN );
+    char* base = (char*)soa_alloc( 7 * array_bytes, "keypoints", num_kpt );
+    _xpos        = (float*)( base + 0 * array_bytes );
+    _ypos        = (float*)( base + 1 * array_bytes );
+    _sigma       = (float*)( base + 2 * array_bytes );
+    _orientation = (float*)( base + 3 * array_bytes );
+    _octave      = (int*)  ( base + 4 * array_bytes );
+    _feature     = (int*)  ( base + 5 * array_bytes );
+    _desc_index  = (int*)  ( base + 6 * array_bytes );
+    _kpt_capacity = num_kpt;
+    _num_kpt      = num_kpt;
+
+    _desc = soa_alloc( num_desc * _desc_stride, "descriptors", num_desc );
+    if( _desc_stride > _desc_dim * descTypeSize( type ) ) {
+        memset( _desc, 0, num_desc * _desc_stride );
+    }
+
+    setFeatureCount( num_ext );
+    setDescriptorCount( num_desc );
+}
+
+void FeaturesSoA::copyKeypoints( const FeaturesSoA& other )
+{
+    const int n = std::min( _num_kpt, other._num_kpt );
+    memcpy( _xpos,        other._xpos,        n * sizeof(float) );
+    memcpy( _ypos,        other._ypos,        n * sizeof(float) );
+    memcpy( _sigma,       other._sigma,       n * sizeof(float) );
+    memcpy( _orientation, other._orientation, n * sizeof(float) );
+    memcpy( _octave,      other._octave,      n * sizeof(int) );
+    memcpy( _feature,     other._feature,     n * sizeof(int) );
+    memcpy( _desc_index,  other._desc_index,  n * sizeof(int) );
+}
+
+void FeaturesSoA::getDescriptorAsFloat( int row, float* dst ) const
+{
+    convertToFloat( getDescriptor( row ), _desc_dim, _desc_type, dst );
+}
+
+void FeaturesSoA::print( std::ostream& ostr, bool write_as_uchar ) const
+{
+    vector<float> desc( _desc_dim );
+
+    for( int k=0; k<_num_kpt; k++ ) {
+        const float sigval = 1.0f / ( _sigma[k] * _sigma[k] );
+
+        getDescriptorAsFloat( _desc_index[k], desc.data() );
+
+        ostr << _xpos[k] << " " << _ypos[k] << " "
+             << sigval << " 0 " << sigval << " ";
+        if( write_as_uchar ) {
+            for( int i=0; i<_desc_dim; i++ ) {
+                ostr << roundf(desc[i]) << " ";
+            }
+        } else {
+            ostr << std::setprecision(3);
+            for( int i=0; i<_desc_dim; i++ ) {
+                ostr << desc[i] << " ";
+            }
+            ostr << std::setprecision(6);
+        }
+        ostr << std::endl;
+    }
+}
+
+std::ostream& operator<<( std::ostream& ostr, const FeaturesSoA& features )
+{
+    features.print( ostr, false );
+    return ostr;
+}
+
+} // namespace popsift
+
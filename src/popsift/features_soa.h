@@ -0,0 +1,127 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "features.h"
+#include "sift_conf.h"
+
+namespace popsift {
+
+class FeaturesFile;
+
+/* Structure-of-arrays alternative to FeaturesHost.
+ *
+ * There is one keypoint for every orientation of every extremum. Each
+ * keypoint property is a contiguous array, and keypoints refer to
+ * their descriptor by row index into a single descriptor matrix
+ * instead of by pointer. Copies are deep: they allocate their own
+ * arrays and copy keypoints and descriptors with a few memcpy calls,
+ * and the arrays can be written to disk as they are. Loops that touch only
+ * positions do not drag orientations and descriptor pointers through
+ * the cache.
+ *
+ * Keypoints of the same extremum are consecutive and share the value
+ * in getFeatureIndex(). getFeatureCount() is the number of extrema,
+ * getDescriptorCount() the number of rows in the descriptor matrix.
+ *
+ * All arrays start at 64-byte boundaries, and descriptor rows are
+ * padded to a multiple of 16 bytes.
+ */
+class FeaturesSoA : public FeaturesBase
+{
+    int     _num_kpt;
+    int     _kpt_capacity;
+
+    float*  _xpos;
+    float*  _ypos;
+    float*  _sigma;
+    float*  _orientation;
+    int*    _octave;
+    int*    _feature;
+    int*    _desc_index;
+
+    void*            _desc;
+    Config::DescType _desc_type;
+    int              _desc_dim;
+    size_t           _desc_stride;
+
+public:
+    FeaturesSoA( );
+    FeaturesSoA( int num_ext, int num_kpt, int num_desc,
+                 Config::DescType type = Config::FloatDesc, int desc_dim = 128 );
+    virtual ~FeaturesSoA( );
+
+    /** Transpose the Feature records of a FeaturesHost. The
+     *  descriptors are converted from the host's type to type. */
+    explicit FeaturesSoA( const FeaturesHost& features, Config::DescType type = Config::FloatDesc );
+
+    /** Copy the content of a mapped feature file */
+    explicit FeaturesSoA( const FeaturesFile& file );
+
+    /** Deep copies of keypoints and descriptors */
+    FeaturesSoA( const FeaturesSoA& other );
+    FeaturesSoA& operator=( const FeaturesSoA& other );
+
+    void reset( int num_ext, int num_kpt, int num_desc,
+                Config::DescType type = Config::FloatDesc, int desc_dim = 128 );
+
+    /** Copy the keypoint arrays and descriptor indices of other, for
+     *  containers that hold transformed descriptors of the same
+     *  keypoints. Both must have the same keypoint count. */
+    void copyKeypoints( const FeaturesSoA& other );
+
+    inline int     getKeypointCount( ) const    { return _num_kpt; }
+    inline void    setKeypointCount( int n )    { _num_kpt = n; }
+
+    inline float*       getXPos( )              { return _xpos; }
+    inline const float* getXPos( ) const        { return _xpos; }
+    inline float*       getYPos( )              { return _ypos; }
+    inline const float* getYPos( ) const        { return _ypos; }
+    inline float*       getSigma( )             { return _sigma; }
+    inline const float* getSigma( ) const       { return _sigma; }
+    inline float*       getOrientation( )       { return _orientation; }
+    inline const float* getOrientation( ) const { return _orientation; }
+    inline int*         getOctave( )            { return _octave; }
+    inline const int*   getOctave( ) const      { return _octave; }
+    inline int*         getFeatureIndex( )      { return _feature; }
+    inline const int*   getFeatureIndex( ) const { return _feature; }
+    inline int*         getDescIndex( )         { return _desc_index; }
+    inline const int*   getDescIndex( ) const   { return _desc_index; }
+
+    inline Config::DescType getDescType( ) const   { return _desc_type; }
+    inline int              getDescDim( ) const    { return _desc_dim; }
+    inline size_t           getDescStride( ) const { return _desc_stride; }
+
+    /** Row r of the descriptor matrix, raw values of getDescType() */
+    inline void*       getDescriptor( int row )       { return (char*)_desc + row * _desc_stride; }
+    inline const void* getDescriptor( int row ) const { return (const char*)_desc + row * _desc_stride; }
+
+    /** The descriptor of keypoint k */
+    inline const void* getKeypointDescriptor( int k ) const { return getDescriptor( _desc_index[k] ); }
+
+    /** Start of the descriptor matrix */
+    inline void*       getDescriptorData( )       { return _desc; }
+    inline const void* getDescriptorData( ) const { return _desc; }
+
+    /** Row r converted to getDescDim() floats */
+    void getDescriptorAsFloat( int row, float* dst ) const;
+
+    /** Same text format as FeaturesHost::print */
+    void print( std::ostream& ostr, bool write_as_uchar ) const;
+
+private:
+    void release( );
+    void copyFrom( const FeaturesSoA& other );
+};
+
+std::ostream& operator<<( std::ostream& ostr, const FeaturesSoA& features );
+
+} // namespace popsift
+
@@ -0,0 +1,300 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "features_text.h"
+#include "desc_convert.h"
+#include "sift_extremum.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Upper bound for one output line: 133 numbers of at most 12
+ * characters ("-1.23457e+38") and a separator each, plus " 0" and
+ * the newline. */
+#define TEXT_MAX_LINE ( 133 * 13 + 8 )
+
+/* Features below this count are formatted by a single thread */
+#define TEXT_MIN_PER_THREAD 1024
+
+static const uint64_t pow10_u64[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL
+};
+
+int formatFloatG( char* buf, float f, int precision )
+{
+    const double v = f;
+    const double a = fabs( v );
+
+    /* the range and precision for which the integers below fit in 64 bits */
+    if( not ( a >= 1e-5 && a < 1e15 ) || precision < 1 || precision > 6 ) {
+        if( v == 0.0 ) {
+            if( signbit( v ) ) {
+                buf[0] = '-';
+                buf[1] = '0';
+                return 2;
+            }
+            buf[0] = '0';
+            return 1;
+        }
+        char tmp[64];
+        const int len = snprintf( tmp, sizeof(tmp), "%.*g", precision, v );
+        memcpy( buf, tmp, len );
+        return len;
+    }
+
+    char* p = buf;
+    if( v < 0.0 ) *p++ = '-';
+
+    /* |f| = m * 2^ex exactly */
+    uint32_t bits;
+    memcpy( &bits, &f, sizeof(bits) );
+    const int biased = ( bits >> 23 ) & 0xff;
+    uint64_t  m      = bits & 0x7fffff;
+    int       ex;
+    if( biased == 0 ) {
+        ex = -149;
+    } else {
+        m |= 0x800000;
+        ex = biased - 150;
+    }
+
+    /* q = |f| * 10^(precision-1-e), rounded half to even, with
+     * 10^(precision-1) <= q < 10^precision */
+    int      e = (int)floor( log10( a ) );
+    uint64_t q;
+    for( ;; ) {
+        const int k = precision - 1 - e;
+        uint64_t  n = m;
+        uint64_t  d = 1;
+        if( k >= 0 ) n *= pow10_u64[k];
+        else         d *= pow10_u64[-k];
+        if( ex >= 0 ) n <<= ex;
+        else          d <<= -ex;
+
+        q = n / d;
+        const uint64_t r = n % d;
+        if( q < pow10_u64[precision-1] ) { e--; continue; }
+        if( q >= pow10_u64[precision] )  { e++; continue; }
+
+        if( 2 * r > d || ( 2 * r == d && ( q & 1 ) ) ) q++;
+        if( q == pow10_u64[precision] ) {
+            q = pow10_u64[precision-1];
+            e++;
+        }
+        break;
+    }
+
+    char digits[8];
+    for( int i=precision-1; i>=0; i-- ) {
+        digits[i] = '0' + ( q % 10 );
+        q /= 10;
+    }
+    int ndig = precision;
+    while( ndig > 1 && digits[ndig-1] == '0' ) ndig--;
+
+    if( e < -4 || e >= precision ) {
+        *p++ = digits[0];
+        if( ndig > 1 ) {
+            *p++ = '.';
+            for( int i=1; i<ndig; i++ ) *p++ = digits[i];
+        }
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        int x = e < 0 ? -e : e;
+        if( x >= 100 ) {
+            *p++ = '0' + x / 100;
+            x %= 100;
+        }
+        *p++ = '0' + x / 10;
+        *p++ = '0' + x % 10;
+    } else if( e >= 0 ) {
+        for( int i=0; i<=e; i++ ) *p++ = digits[i];
+        if( ndig > e + 1 ) {
+            *p++ = '.';
+            for( int i=e+1; i<ndig; i++ ) *p++ = digits[i];
+        }
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        for( int i=0; i<-e-1; i++ ) *p++ = '0';
+        for( int i=0; i<ndig; i++ ) *p++ = digits[i];
+    }
+    return (int)( p - buf );
+}
+
+/* Format one descriptor line like print_keypoint in features.cu */
+static char* format_line( char* p, const Feature& f, const float* desc, bool write_as_uchar )
+{
+    const float sigval = 1.0f / ( f.sigma * f.sigma );
+
+    p += formatFloatG( p, f.xpos, 6 );
+    *p++ = ' ';
+    p += formatFloatG( p, f.ypos, 6 );
+    *p++ = ' ';
+    p += formatFloatG( p, sigval, 6 );
+    *p++ = ' ';
+    *p++ = '0';
+    *p++ = ' ';
+    p += formatFloatG( p, sigval, 6 );
+    *p++ = ' ';
+    if( write_as_uchar ) {
+        for( int i=0; i<128; i++ ) {
+            p += formatFloatG( p, roundf( desc[i] ), 6 );
+            *p++ = ' ';
+        }
+    } else {
+        for( int i=0; i<128; i++ ) {
+            p += formatFloatG( p, desc[i], 3 );
+            *p++ = ' ';
+        }
+    }
+    *p++ = '\n';
+    return p;
+}
+
+/* Features [begin,end), whose first descriptor has index first_desc
+ * in the compact descriptor array */
+static void format_chunk( const FeaturesHost& features,
+                          int                 begin,
+                          int                 end,
+                          int                 first_desc,
+                          bool                write_as_uchar,
+                          vector<char>&       out )
+{
+    const Feature*         ext    = features.begin();
+    const Config::DescType type   = features.getDescType();
+    const char*            row    = (const char*)features.getDescriptorData() + first_desc * features.getDescriptorStride();
+    const size_t           stride = features.getDescriptorStride();
+
+    size_t lines = 0;
+    for( int i=begin; i<end; i++ ) lines += ext[i].num_ori;
+    out.resize( lines * TEXT_MAX_LINE );
+
+    float desc[128];
+    char* p = out.data();
+    for( int i=begin; i<end; i++ ) {
+        const Feature& f = ext[i];
+        for( int ori=0; ori<f.num_ori; ori++ ) {
+            const float* values;
+            if( type == Config::FloatDesc ) {
+                values = f.desc[ori]->features;
+            } else {
+                convertToFloat( row, 128, type, desc );
+                values = desc;
+                row   += stride;
+            }
+            p = format_line( p, f, values, write_as_uchar );
+        }
+    }
+    out.resize( p - out.data() );
+}
+
+void formatFeaturesText( const FeaturesHost& features,
+                         bool                write_as_uchar,
+                         std::vector<char>&  out,
+                         int                 num_threads )
+{
+    const int num_ext = features.size();
+
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = std::max( 1, std::min( num_threads, num_ext / TEXT_MIN_PER_THREAD ) );
+
+    if( num_threads == 1 ) {
+        format_chunk( features, 0, num_ext, 0, write_as_uchar, out );
+        return;
+    }
+
+    /* chunk boundaries and the index of their first compact descriptor */
+    vector<int> begin( num_threads + 1 );
+    vector<int> first_desc( num_threads );
+    int desc = 0;
+    for( int t=0; t<num_threads; t++ ) {
+        begin[t]      = (int)( (long long)num_ext * t / num_threads );
+        begin[t+1]    = (int)( (long long)num_ext * ( t + 1 ) / num_threads );
+        first_desc[t] = desc;
+        for( int i=begin[t]; i<begin[t+1]; i++ ) desc += features.begin()[i].num_ori;
+    }
+
+    vector<vector<char> > parts( num_threads );
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( format_chunk, boost::cref( features ),
+                                              begin[t], begin[t+1], first_desc[t],
+                                              write_as_uchar, boost::ref( parts[t] ) ) );
+    }
+    format_chunk( features, begin[0], begin[1], first_desc[0], write_as_uchar, parts[0] );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+
+    size_t total = 0;
+    for( const vector<char>& part : parts ) total += part.size();
+    out.resize( total );
+    char* p = out.data();
+    for( const vector<char>& part : parts ) {
+        memcpy( p, part.data(), part.size() );
+        p += part.size();
+    }
+}
+
+bool writeFeaturesText( const std::string&  filename,
+                        const FeaturesHost& features,
+                        bool                write_as_uchar,
+                        int                 num_threads )
+{
+    vector<char> text;
+    formatFeaturesText( features, write_as_uchar, text, num_threads );
+
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+    of.write( text.data(), text.size() );
+    if( not of.good() ) {
+        cerr << "Failed to write features to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+} // namespace popsift
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "features.h"
+
+namespace popsift {
+
+/* A fast replacement for FeaturesHost::print that produces the same
+ * bytes: one line per descriptor with
+ *     x y 1/sigma^2 0 1/sigma^2 d0 d1 ... d127
+ * where positions and scales are printed like printf's %g and the
+ * descriptor values like %.3g, or rounded and printed like %g with
+ * write_as_uchar.
+ *
+ * The features are split into chunks that are formatted by num_threads
+ * threads (0 picks the number of cores) into separate buffers, and the
+ * file is written with a single write.
+ */
+void formatFeaturesText( const FeaturesHost& features,
+                         bool                write_as_uchar,
+                         std::vector<char>&  out,
+                         int                 num_threads = 0 );
+
+/* Returns false if the file could not be written */
+bool writeFeaturesText( const std::string&  filename,
+                        const FeaturesHost& features,
+                        bool                write_as_uchar,
+                        int                 num_threads = 0 );
+
+/* Write v like printf( "%.*g", precision, (double)v ) into buf, which
+ * must have room for 32 characters. No terminating 0 is written.
+ * Returns the number of characters. Values between 1e-5 and 1e15 with
+ * precision up to 6 use exact integer arithmetic, others use snprintf.
+ */
+int formatFloatG( char* buf, float v, int precision );
+
+} // namespace popsift
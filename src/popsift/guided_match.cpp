@@ -0,0 +1,190 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <stdlib.h>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "guided_match.h"
+#include "desc_match.h"
+#include "match_geometry.h"
+#include "match_list.h"
+#include "point_grid.h"
+#include "features.h"
+#include "sift_extremum.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Queries per thread before another thread is worth it */
+#define GUIDED_MIN_QUERIES_PER_THREAD 256
+
+/* The arguments that every thread shares */
+struct Guided
+{
+    const DescriptorMatrix& query;
+    const DescriptorMatrix& train;
+    const float*            query_x;
+    const float*            query_y;
+    const PointGrid&        grid;
+    const GeometryResult&   prior;
+    float                   radius;
+    int*                    nn;
+    float*                  dist;
+};
+
+/* The train rows that the prior allows for a query keypoint */
+static void candidates( const Guided& g, float x, float y, vector<int>& result )
+{
+    const double* M = g.prior.matrix;
+    if( g.prior.model == GeometryHomography ) {
+        const double w = M[6] * x + M[7] * y + M[8];
+        if( w <= 0.0 ) return; // behind the camera, H is scaled to H[8] >= 0
+        g.grid.findInCircle( (float)( ( M[0] * x + M[1] * y + M[2] ) / w ),
+                             (float)( ( M[3] * x + M[4] * y + M[5] ) / w ),
+                             g.radius, result );
+    } else {
+        g.grid.findNearLine( (float)( M[0] * x + M[1] * y + M[2] ),
+                             (float)( M[3] * x + M[4] * y + M[5] ),
+                             (float)( M[6] * x + M[7] * y + M[8] ),
+                             g.radius, result );
+    }
+}
+
+static void guided_range( const Guided& g, size_t begin, size_t end )
+{
+    const int   dim = g.query.getDim();
+    vector<int> cand;
+    for( size_t q=begin; q<end; q++ ) {
+        cand.clear();
+        candidates( g, g.query_x[q], g.query_y[q], cand );
+
+        const float* qrow = g.query.getRow( q );
+        float        d1   = std::numeric_limits<float>::max();
+        float        d2   = std::numeric_limits<float>::max();
+        int          i1   = -1;
+        int          i2   = -1;
+        for( int t : cand ) {
+            const float* trow = g.train.getRow( t );
+            float        dot  = 0.0f;
+            for( int k=0; k<dim; k++ ) dot += qrow[k] * trow[k];
+            const float d = std::max( 0.0f, g.query.getNorm( q ) + g.train.getNorm( t ) - 2.0f * dot );
+            if( d < d1 ) {
+                d2 = d1;
+                i2 = i1;
+                d1 = d;
+                i1 = t;
+            } else if( d < d2 ) {
+                d2 = d;
+                i2 = t;
+            }
+        }
+        g.nn[2*q]     = i1;
+        g.nn[2*q+1]   = i2;
+        g.dist[2*q]   = d1;
+        g.dist[2*q+1] = d2;
+    }
+}
+
+void matchGuided( const DescriptorMatrix& query,
+                  const DescriptorMatrix& train,
+                  const float*            query_x,
+                  const float*            query_y,
+                  const PointGrid&        train_grid,
+                  const GeometryResult&   prior,
+                  float                   radius,
+                  const int*              query_rev,
+                  const int*              train_rev,
+                  MatchList&              matches,
+                  float                   ratio,
+                  int                     num_threads )
+{
+    if( not prior.valid ) {
+        matchDescriptors( query, train, query_rev, train_rev, matches, ratio, false, num_threads );
+        return;
+    }
+    if( query.getDim() != train.getDim() && query.size() > 0 && train.size() > 0 ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot match " << query.getDim()
+             << "-dimensional descriptors with " << train.getDim() << "-dimensional descriptors" << endl;
+        exit( -1 );
+    }
+    if( train_grid.size() != train.size() ) {
+        cerr << __FILE__ << ":" << __LINE__ << " The grid holds " << train_grid.size()
+             << " points for " << train.size() << " train descriptors" << endl;
+        exit( -1 );
+    }
+
+    /* H and -H are the same homography; with H[8] >= 0, w > 0 for
+     * the keypoints in front of the camera */
+    GeometryResult model = prior;
+    if( model.model == GeometryHomography && model.matrix[8] < 0.0 ) {
+        for( int i=0; i<9; i++ ) model.matrix[i] = -model.matrix[i];
+    }
+
+    const size_t  num_queries = query.size();
+    vector<int>   nn( 2 * num_queries );
+    vector<float> dist( 2 * num_queries );
+    vector<char>  accept( num_queries );
+    const Guided  g = { query, train, query_x, query_y, train_grid, model, radius, nn.data(), dist.data() };
+
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = (int)std::max( (size_t)1, std::min( (size_t)num_threads, num_queries / GUIDED_MIN_QUERIES_PER_THREAD ) );
+
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( guided_range, boost::cref( g ),
+                                              num_queries * t / num_threads,
+                                              num_queries * ( t + 1 ) / num_threads ) );
+    }
+    guided_range( g, 0, num_queries / num_threads );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+
+    ratioTest( nn.data(), dist.data(), num_queries, ratio, accept.data() );
+    matches.assign( nn.data(), dist.data(), accept.data(), num_queries, train.size(), query_rev, train_rev );
+}
+
+void matchGuided( const FeaturesHost&   query,
+                  const FeaturesHost&   train,
+                  const GeometryResult& prior,
+                  float                 radius,
+                  MatchList&            matches,
+                  float                 ratio,
+                  int                   num_threads )
+{
+    vector<int> query_rev;
+    vector<int> train_rev;
+    query.getReverseMap( query_rev );
+    train.getReverseMap( train_rev );
+
+    vector<float> query_x( query_rev.size() );
+    vector<float> query_y( query_rev.size() );
+    for( size_t i=0; i<query_rev.size(); i++ ) {
+        const Feature& f = query.begin()[query_rev[i]];
+        query_x[i] = f.xpos;
+        query_y[i] = f.ypos;
+    }
+
+    PointGrid grid;
+    grid.build( train );
+    matchGuided( DescriptorMatrix( query ), DescriptorMatrix( train ), query_x.data(), query_y.data(),
+                 grid, prior, radius, query_rev.data(), train_rev.data(), matches, ratio, num_threads );
+}
+
+} // namespace popsift
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+
+namespace popsift {
+
+class DescriptorMatrix;
+class FeaturesHost;
+class MatchList;
+class PointGrid;
+struct GeometryResult;
+
+/* Guided matching: when the geometry between two images is already
+ * known, from verifyMatches or from the previous frame of a video,
+ * every query descriptor is only compared with the train descriptors
+ * whose keypoints lie where the geometry predicts them:
+ *
+ * - for a homography, within radius pixels of H applied to the query
+ *   keypoint; H may have any scale and sign,
+ * - for a fundamental matrix, within radius pixels of the epipolar
+ *   line F applied to the query keypoint.
+ *
+ * The candidates are found with a PointGrid over the train keypoints,
+ * so a query costs a few cells and a few descriptors instead of all of
+ * train. The two nearest candidates pass through the ratio test and
+ * the result is a MatchList as from matchDescriptors; a query with
+ * fewer than two candidates is rejected. If prior.valid is false, all
+ * train descriptors are candidates and this is matchDescriptors.
+ *
+ * Queries are split between num_threads threads, 0 picks the number
+ * of cores.
+ */
+
+/* query_x and query_y hold the keypoint position of every query row,
+ * and point i of train_grid is the keypoint of train row i, see
+ * PointGrid::build( const FeaturesHost& ). query_rev and train_rev map
+ * rows to features as in matchDescriptors; they may be 0. */
+void matchGuided( const DescriptorMatrix& query,
+                  const DescriptorMatrix& train,
+                  const float*            query_x,
+                  const float*            query_y,
+                  const PointGrid&        train_grid,
+                  const GeometryResult&   prior,
+                  float                   radius,
+                  const int*              query_rev,
+                  const int*              train_rev,
+                  MatchList&              matches,
+                  float                   ratio       = 0.8f,
+                  int                     num_threads = 0 );
+
+/* The same for two sets of features, with the keypoint positions of
+ * their Feature records */
+void matchGuided( const FeaturesHost&   query,
+                  const FeaturesHost&   train,
+                  const GeometryResult& prior,
+                  float                 radius,
+                  MatchList&            matches,
+                  float                 ratio       = 0.8f,
+                  int                   num_threads = 0 );
+
+} // namespace popsift
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <string.h>
+#include <errno.h>
+#include <iso646.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Alignment of files that are read instead of mapped, the largest
+ * that any of the formats asks for */
+#define MAPPED_FILE_ALIGN 4096
+
+const char* mapFile( const std::string& filename, size_t& length, size_t min_length, const char* what )
+{
+    length = 0;
+#ifdef _WIN32
+    /* no mmap, read into aligned memory instead */
+    ifstream file( filename.c_str(), ios::binary | ios::ate );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return 0;
+    }
+    const size_t size = (size_t)file.tellg();
+    if( size < min_length ) {
+        cerr << "File " << filename << " is too short to be a " << what << endl;
+        return 0;
+    }
+    file.seekg( 0, ios::beg );
+    char* buffer = (char*)_aligned_malloc( size > 0 ? size : 1, MAPPED_FILE_ALIGN );
+    if( buffer == 0 || not file.read( buffer, size ) ) {
+        cerr << "File " << filename << " could not be read" << endl;
+        _aligned_free( buffer );
+        return 0;
+    }
+    length = size;
+    return buffer;
+#else
+    int fd = ::open( filename.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+        cerr << "File " << filename << " could not be opened for reading: " << strerror(errno) << endl;
+        return 0;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 ) {
+        cerr << "File " << filename << " could not be inspected: " << strerror(errno) << endl;
+        ::close( fd );
+        return 0;
+    }
+    const size_t size = st.st_size;
+    if( size < min_length || size == 0 ) {
+        cerr << "File " << filename << " is too short to be a " << what << endl;
+        ::close( fd );
+        return 0;
+    }
+    void* ptr = mmap( 0, size, PROT_READ, MAP_SHARED, fd, 0 );
+    ::close( fd );
+    if( ptr == MAP_FAILED ) {
+        cerr << "File " << filename << " could not be mapped: " << strerror(errno) << endl;
+        return 0;
+    }
+    length = size;
+    return (const char*)ptr;
+#endif
+}
+
+void unmapFile( const char* base, size_t length )
+{
+    if( base == 0 ) return;
+#ifdef _WIN32
+    _aligned_free( (void*)base );
+#else
+    munmap( (void*)base, length );
+#endif
+}
+
+} // namespace popsift
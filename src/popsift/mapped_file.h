@@ -0,0 +1,30 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+namespace popsift {
+
+/* Map a whole file read-only, for the binary formats that are used in
+ * place: feature files, feature databases and HNSW indices. Without
+ * mmap (Windows), the file is read into memory aligned to
+ * MAPPED_FILE_ALIGN bytes instead, the page alignment that the formats
+ * assume.
+ *
+ * Files shorter than min_length are rejected as too short to be what.
+ * Returns 0 and explains why on cerr if the file cannot be mapped,
+ * otherwise the start of the file, with its size in length. Release
+ * it with unmapFile.
+ */
+const char* mapFile( const std::string& filename, size_t& length, size_t min_length, const char* what );
+
+void unmapFile( const char* base, size_t length );
+
+} // namespace popsift
@@ -0,0 +1,325 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string.h>
+#include <iso646.h>
+
+#include "match_db.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(MatchDbHeader) == 64, "MatchDbHeader must be 64 bytes" );
+static_assert( sizeof(MatchDbEntry)  == 32, "MatchDbEntry must be 32 bytes" );
+
+static inline uint64_t pair_key( uint32_t query_image, uint32_t train_image )
+{
+    return ( (uint64_t)query_image << 32 ) | train_image;
+}
+
+static void initHeader( MatchDbHeader& hdr, MatchDbFileKind kind, uint64_t db_id, uint64_t features_db_id )
+{
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_MATCH_DB_MAGIC, sizeof(hdr.magic) );
+    hdr.version         = POPSIFT_MATCH_DB_VERSION;
+    hdr.header_size     = sizeof(MatchDbHeader);
+    hdr.byte_order_mark = 0x01020304;
+    hdr.kind            = kind;
+    hdr.db_id           = db_id;
+    hdr.features_db_id  = features_db_id;
+    hdr.entry_size      = sizeof(MatchDbEntry);
+}
+
+static bool validateHeader( const MatchDbHeader& hdr, size_t length,
+                            MatchDbFileKind kind, const std::string& filename )
+{
+    if( length < sizeof(MatchDbHeader) ||
+        memcmp( hdr.magic, POPSIFT_MATCH_DB_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << filename << " is not a PopSift match database file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << filename << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_MATCH_DB_VERSION ) {
+        cerr << "File " << filename << " has match database version " << hdr.version
+             << ", this reader supports version " << POPSIFT_MATCH_DB_VERSION << endl;
+        return false;
+    }
+    if( hdr.kind != (uint32_t)kind || hdr.header_size < sizeof(MatchDbHeader) ||
+        hdr.header_size > length || hdr.entry_size != sizeof(MatchDbEntry) ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+    return true;
+}
+
+/* Read and check both headers and all complete index entries; a
+ * partial entry at the end is the trace of an interrupted append */
+template<class Stream>
+static bool readDb( Stream& segment, Stream& index, const std::string& path,
+                    MatchDbHeader& seg_hdr, MatchDbHeader& idx_hdr, vector<MatchDbEntry>& entries )
+{
+    const string index_path = path + ".idx";
+
+    memset( &seg_hdr, 0, sizeof(seg_hdr) );
+    memset( &idx_hdr, 0, sizeof(idx_hdr) );
+    segment.seekg( 0, ios::end );
+    const uint64_t seg_length = segment.tellg();
+    segment.seekg( 0, ios::beg );
+    segment.read( (char*)&seg_hdr, sizeof(seg_hdr) );
+    index.seekg( 0, ios::end );
+    const uint64_t idx_length = index.tellg();
+    index.seekg( 0, ios::beg );
+    index.read( (char*)&idx_hdr, sizeof(idx_hdr) );
+    segment.clear();
+    index.clear();
+
+    if( not validateHeader( seg_hdr, seg_length, MDB_Segment, path ) ||
+        not validateHeader( idx_hdr, idx_length, MDB_Index, index_path ) ) {
+        return false;
+    }
+    if( seg_hdr.db_id != idx_hdr.db_id ) {
+        cerr << "Index " << index_path << " does not belong to match database " << path << endl;
+        return false;
+    }
+
+    entries.resize( ( idx_length - idx_hdr.header_size ) / sizeof(MatchDbEntry) );
+    index.seekg( idx_hdr.header_size );
+    index.read( (char*)entries.data(), entries.size() * sizeof(MatchDbEntry) );
+    if( not index.good() ) {
+        cerr << "Match database " << path << " could not be read" << endl;
+        return false;
+    }
+    index.clear();
+    /* term by term, so that a crafted entry cannot wrap */
+    if( not entries.empty() && ( entries.back().offset > seg_length ||
+                                 entries.back().length > seg_length - entries.back().offset ) ) {
+        cerr << "Match database " << path << " is truncated" << endl;
+        return false;
+    }
+    return true;
+}
+
+/*************************************************************
+ * MatchDbWriter
+ *************************************************************/
+
+MatchDbWriter::MatchDbWriter( )
+    : _segment_end( 0 )
+    , _count( 0 )
+{ }
+
+MatchDbWriter::~MatchDbWriter( )
+{
+    close( );
+}
+
+bool MatchDbWriter::open( const std::string& path, uint64_t features_db_id )
+{
+    close( );
+
+    const string index_path = path + ".idx";
+
+    ifstream probe( path.c_str(), ios::binary );
+    const bool exists = probe.is_open();
+    probe.close();
+
+    if( not exists ) {
+        /* create both files */
+        std::random_device seed;
+        std::mt19937_64    rng( seed() ^ (uint64_t)std::chrono::system_clock::now().time_since_epoch().count() );
+        const uint64_t db_id = rng();
+
+        MatchDbHeader seg_hdr;
+        MatchDbHeader idx_hdr;
+        initHeader( seg_hdr, MDB_Segment, db_id, features_db_id );
+        initHeader( idx_hdr, MDB_Index,   db_id, features_db_id );
+
+        ofstream seg( path.c_str(), ios::binary );
+        ofstream idx( index_path.c_str(), ios::binary );
+        if( not seg.is_open() || not idx.is_open() ) {
+            cerr << "Match database " << path << " could not be created" << endl;
+            return false;
+        }
+        seg.write( (const char*)&seg_hdr, sizeof(seg_hdr) );
+        idx.write( (const char*)&idx_hdr, sizeof(idx_hdr) );
+        if( not seg.good() || not idx.good() ) {
+            cerr << "Match database " << path << " could not be created" << endl;
+            return false;
+        }
+    }
+
+    _segment.open( path.c_str(),       ios::binary | ios::in | ios::out );
+    _index.open(   index_path.c_str(), ios::binary | ios::in | ios::out );
+    if( not _segment.is_open() || not _index.is_open() ) {
+        cerr << "Match database " << path << " could not be opened for writing" << endl;
+        close( );
+        return false;
+    }
+
+    MatchDbHeader        seg_hdr;
+    MatchDbHeader        idx_hdr;
+    vector<MatchDbEntry> entries;
+    if( not readDb( _segment, _index, path, seg_hdr, idx_hdr, entries ) ) {
+        close( );
+        return false;
+    }
+    if( seg_hdr.features_db_id != features_db_id ) {
+        cerr << "Match database " << path << " belongs to a different feature database" << endl;
+        close( );
+        return false;
+    }
+
+    _segment_end = entries.empty() ? seg_hdr.header_size : entries.back().offset + entries.back().length;
+    for( size_t n=0; n<entries.size(); n++ ) {
+        _pairs[pair_key( entries[n].query_image, entries[n].train_image )] = n;
+    }
+    _count = entries.size();
+    _index.seekp( idx_hdr.header_size + _count * sizeof(MatchDbEntry) );
+    _path = path;
+    return true;
+}
+
+void MatchDbWriter::close( )
+{
+    if( _segment.is_open() ) _segment.close();
+    if( _index.is_open() )   _index.close();
+    _segment.clear();
+    _index.clear();
+    _segment_end = 0;
+    _count       = 0;
+    _pairs.clear();
+}
+
+size_t MatchDbWriter::getPairCount( ) const
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    return _pairs.size();
+}
+
+bool MatchDbWriter::contains( uint32_t query_image, uint32_t train_image ) const
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    return _pairs.count( pair_key( query_image, train_image ) ) > 0;
+}
+
+bool MatchDbWriter::append( uint32_t query_image, uint32_t train_image, const MatchList& matches )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    if( not isOpen() ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Match database is not open" << endl;
+        return false;
+    }
+
+    MatchDbEntry entry;
+    memset( &entry, 0, sizeof(entry) );
+    entry.offset       = _segment_end;
+    entry.query_image  = query_image;
+    entry.train_image  = train_image;
+    entry.num_matches  = (uint32_t)matches.size();
+    entry.num_accepted = (uint32_t)matches.getAcceptedCount();
+
+    _segment.seekp( _segment_end );
+    const bool ok = matches.write( _segment );
+    _segment.flush();
+    if( not ok || not _segment.good() ) {
+        cerr << "Failed to append matches of images " << query_image << " and " << train_image
+             << " to " << _path << endl;
+        _segment.clear();
+        return false;
+    }
+    entry.length = (uint64_t)_segment.tellp() - _segment_end;
+
+    /* the entry commits the matches */
+    const std::streampos entry_pos = _index.tellp();
+    _index.write( (const char*)&entry, sizeof(entry) );
+    _index.flush();
+    if( not _index.good() ) {
+        cerr << "Failed to append index entry of images " << query_image << " and " << train_image
+             << " to " << _path << ".idx" << endl;
+        _index.clear();
+        _index.seekp( entry_pos );
+        return false;
+    }
+
+    _segment_end += entry.length;
+    _pairs[pair_key( query_image, train_image )] = _count++;
+    return true;
+}
+
+/*************************************************************
+ * MatchDb
+ *************************************************************/
+
+MatchDb::MatchDb( )
+    : _features_db_id( 0 )
+{ }
+
+bool MatchDb::open( const std::string& path )
+{
+    close( );
+
+    ifstream index( ( path + ".idx" ).c_str(), ios::binary );
+    _segment.open( path.c_str(), ios::binary );
+    if( not _segment.is_open() || not index.is_open() ) {
+        cerr << "Match database " << path << " could not be opened for reading" << endl;
+        close( );
+        return false;
+    }
+
+    MatchDbHeader seg_hdr;
+    MatchDbHeader idx_hdr;
+    if( not readDb( _segment, index, path, seg_hdr, idx_hdr, _entries ) ) {
+        close( );
+        return false;
+    }
+    for( size_t n=0; n<_entries.size(); n++ ) {
+        _pairs[pair_key( _entries[n].query_image, _entries[n].train_image )] = n;
+    }
+    _features_db_id = seg_hdr.features_db_id;
+    _path           = path;
+    return true;
+}
+
+void MatchDb::close( )
+{
+    if( _segment.is_open() ) _segment.close();
+    _segment.clear();
+    _entries.clear();
+    _pairs.clear();
+    _features_db_id = 0;
+}
+
+long long MatchDb::findPair( uint32_t query_image, uint32_t train_image ) const
+{
+    auto it = _pairs.find( pair_key( query_image, train_image ) );
+    return it == _pairs.end() ? -1 : (long long)it->second;
+}
+
+bool MatchDb::getMatches( size_t n, MatchList& matches ) const
+{
+    if( n >= _entries.size() ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Pair " << n << " is not in match database "
+             << _path << " with " << _entries.size() << " pairs" << endl;
+        matches.clear( );
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock( _mutex );
+    _segment.clear();
+    _segment.seekg( _entries[n].offset );
+    return matches.read( _segment, _path );
+}
+
+} // namespace popsift
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+#include "match_list.h"
+
+namespace popsift {
+
+#define POPSIFT_MATCH_DB_MAGIC   "PSMDB\r\n\0"
+#define POPSIFT_MATCH_DB_VERSION 1
+
+/* A match database holds the MatchLists of many image pairs of one
+ * feature database in two files, like the feature database itself:
+ *
+ *   <path>      segment: a MatchDbHeader, followed for every pair by
+ *               its MatchList as written by MatchList::write
+ *   <path>.idx  index: a MatchDbHeader, followed by one MatchDbEntry
+ *               per pair
+ *
+ * Both files are append-only, and the index entry of a pair is written
+ * after its MatchList. The index is therefore also the checkpoint of a
+ * long matching run: a writer that is interrupted leaves at most a
+ * MatchList without entry, which the next writer overwrites, and the
+ * pairs with entries need not be matched again.
+ */
+struct MatchDbHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark; // 0x01020304
+    uint32_t kind;            // MatchDbFileKind
+    uint64_t db_id;           // random, identical in segment and index
+    uint64_t features_db_id;  // FeaturesDb::getDbId of the matched images
+    uint32_t entry_size;      // sizeof(MatchDbEntry)
+    uint32_t reserved0;
+    uint8_t  reserved[16];
+};
+
+enum MatchDbFileKind
+{
+    MDB_Segment = 1,
+    MDB_Index   = 2
+};
+
+struct MatchDbEntry
+{
+    uint64_t offset;       // of the MatchList in the segment
+    uint64_t length;       // of the MatchList
+    uint32_t query_image;  // image ids in the feature database
+    uint32_t train_image;
+    uint32_t num_matches;
+    uint32_t num_accepted;
+};
+
+/* Appends the matches of image pairs to a match database, creating it
+ * if it does not exist. append() may be called from several threads.
+ */
+class MatchDbWriter
+{
+public:
+    MatchDbWriter( );
+    ~MatchDbWriter( );
+
+    /** Returns false and explains why on cerr if the files cannot be
+     *  created, or exist and are not a matching segment and index of
+     *  the feature database features_db_id. */
+    bool open( const std::string& path, uint64_t features_db_id );
+    void close( );
+
+    inline bool isOpen( ) const { return _segment.is_open(); }
+
+    /** Number of distinct pairs */
+    size_t getPairCount( ) const;
+
+    /** True if the database holds the matches of this pair */
+    bool contains( uint32_t query_image, uint32_t train_image ) const;
+
+    /** Append the matches of one pair. Returns false if writing
+     *  failed. */
+    bool append( uint32_t query_image, uint32_t train_image, const MatchList& matches );
+
+private:
+    mutable std::mutex _mutex;
+    std::fstream       _segment;
+    std::fstream       _index;
+    std::string        _path;
+    uint64_t           _segment_end;
+    size_t             _count;
+    std::unordered_map<uint64_t, size_t> _pairs; // image pair to entry number
+};
+
+/* A read-only view of a match database */
+class MatchDb
+{
+public:
+    MatchDb( );
+
+    /** Returns false and explains why on cerr if the files are not a
+     *  matching match database. */
+    bool open( const std::string& path );
+    void close( );
+
+    inline bool     isOpen( ) const           { return _segment.is_open(); }
+    inline size_t   getPairCount( ) const     { return _entries.size(); }
+    inline uint64_t getFeaturesDbId( ) const  { return _features_db_id; }
+
+    inline const MatchDbEntry& getEntry( size_t n ) const { return _entries[n]; }
+
+    /** Entry number of a pair, -1 if the database does not hold it */
+    long long findPair( uint32_t query_image, uint32_t train_image ) const;
+
+    /** Read the matches of entry n. Returns false and explains why on
+     *  cerr if n is out of range or the MatchList is damaged. */
+    bool getMatches( size_t n, MatchList& matches ) const;
+
+private:
+    mutable std::mutex        _mutex;   // guards reads of the segment
+    mutable std::ifstream     _segment;
+    std::vector<MatchDbEntry> _entries;
+    std::unordered_map<uint64_t, size_t> _pairs;
+    uint64_t                  _features_db_id;
+    std::string               _path;
+};
+
+} // namespace popsift
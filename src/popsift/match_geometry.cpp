@@ -0,0 +1,798 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <string.h>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+#include <cuda_runtime.h>
+
+#include "match_geometry.h"
+#include "match_list.h"
+#include "features.h"
+#include "sift_extremum.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Samples that are drawn before their hypotheses are evaluated */
+#define RANSAC_BATCH 32
+
+/* Matches to evaluate per thread before another thread is worth it */
+#define RANSAC_MIN_POINTS_PER_THREAD 256
+
+/* Rounds of least-squares refinement on the inliers */
+#define RANSAC_REFINE_STEPS 3
+
+RansacOptions::RansacOptions( GeometryModel m )
+    : model( m )
+    , threshold( m == GeometryHomography ? 4.0f : 2.0f )
+    , confidence( 0.999 )
+    , max_iterations( 10000 )
+    , prosac( true )
+    , seed( 1 )
+    , num_threads( 0 )
+{ }
+
+/*************************************************************
+ * Small dense linear algebra
+ *************************************************************/
+
+/* c = a b for 3x3 matrices */
+static void mul3( const double* a, const double* b, double* c )
+{
+    for( int i=0; i<3; i++ ) {
+        for( int j=0; j<3; j++ ) {
+            c[i*3+j] = a[i*3] * b[j] + a[i*3+1] * b[3+j] + a[i*3+2] * b[6+j];
+        }
+    }
+}
+
+static double det3( const double* m )
+{
+    return m[0] * ( m[4] * m[8] - m[5] * m[7] )
+         - m[1] * ( m[3] * m[8] - m[5] * m[6] )
+         + m[2] * ( m[3] * m[7] - m[4] * m[6] );
+}
+
+/* Solve the n x n system A x = b in place by Gaussian elimination with
+ * partial pivoting, x replaces b. Returns false if A is singular. */
+static bool solve_linear( double* A, double* b, int n )
+{
+    for( int c=0; c<n; c++ ) {
+        int p = c;
+        for( int r=c+1; r<n; r++ ) {
+            if( fabs( A[r*n+c] ) > fabs( A[p*n+c] ) ) p = r;
+        }
+        if( fabs( A[p*n+c] ) < 1e-12 ) return false;
+        if( p != c ) {
+            for( int j=0; j<n; j++ ) std::swap( A[p*n+j], A[c*n+j] );
+            std::swap( b[p], b[c] );
+        }
+        for( int r=c+1; r<n; r++ ) {
+            const double f = A[r*n+c] / A[c*n+c];
+            if( f == 0.0 ) continue;
+            for( int j=c; j<n; j++ ) A[r*n+j] -= f * A[c*n+j];
+            b[r] -= f * b[c];
+        }
+    }
+    for( int r=n-1; r>=0; r-- ) {
+        double s = b[r];
+        for( int j=r+1; j<n; j++ ) s -= A[r*n+j] * b[j];
+        b[r] = s / A[r*n+r];
+    }
+    return true;
+}
+
+/* A basis of the null space of a rows x 9 matrix, by Gauss-Jordan
+ * elimination in place; one vector of 9 values per free column.
+ * Returns the number of vectors. */
+static int null_space( double* A, int rows, double* basis )
+{
+    int  pivot_col[9];
+    bool is_pivot[9] = { false };
+    int  rank = 0;
+    for( int c=0; c<9 && rank<rows; c++ ) {
+        int p = rank;
+        for( int r=rank+1; r<rows; r++ ) {
+            if( fabs( A[r*9+c] ) > fabs( A[p*9+c] ) ) p = r;
+        }
+        if( fabs( A[p*9+c] ) < 1e-12 ) continue;
+        if( p != rank ) {
+            for( int j=0; j<9; j++ ) std::swap( A[p*9+j], A[rank*9+j] );
+        }
+        const double inv = 1.0 / A[rank*9+c];
+        for( int j=0; j<9; j++ ) A[rank*9+j] *= inv;
+        for( int r=0; r<rows; r++ ) {
+            const double f = A[r*9+c];
+            if( r == rank || f == 0.0 ) continue;
+            for( int j=0; j<9; j++ ) A[r*9+j] -= f * A[rank*9+j];
+        }
+        pivot_col[rank] = c;
+        is_pivot[c]     = true;
+        rank++;
+    }
+
+    int n = 0;
+    for( int f=0; f<9; f++ ) {
+        if( is_pivot[f] ) continue;
+        double* v = &basis[n * 9];
+        for( int j=0; j<9; j++ ) v[j] = 0.0;
+        v[f] = 1.0;
+        for( int r=0; r<rank; r++ ) v[pivot_col[r]] = -A[r*9+f];
+        n++;
+    }
+    return n;
+}
+
+/* The eigenvector of the smallest eigenvalue of a symmetric n x n
+ * matrix, n <= 9, by cyclic Jacobi rotations */
+static void smallest_eigenvector( const double* S, int n, double* v )
+{
+    double a[81];
+    double V[81];
+    for( int i=0; i<n*n; i++ ) a[i] = S[i];
+    for( int i=0; i<n; i++ ) {
+        for( int j=0; j<n; j++ ) V[i*n+j] = ( i == j ) ? 1.0 : 0.0;
+    }
+
+    for( int sweep=0; sweep<60; sweep++ ) {
+        double off  = 0.0;
+        double diag = 0.0;
+        for( int p=0; p<n; p++ ) {
+            diag += a[p*n+p] * a[p*n+p];
+            for( int q=p+1; q<n; q++ ) off += a[p*n+q] * a[p*n+q];
+        }
+        if( off <= 1e-30 * diag ) break;
+
+        for( int p=0; p<n; p++ ) {
+            for( int q=p+1; q<n; q++ ) {
+                const double apq = a[p*n+q];
+                if( fabs( apq ) < 1e-300 ) continue;
+                const double theta = ( a[q*n+q] - a[p*n+p] ) / ( 2.0 * apq );
+                const double t     = ( theta >= 0.0 ? 1.0 : -1.0 ) / ( fabs( theta ) + sqrt( theta * theta + 1.0 ) );
+                const double c     = 1.0 / sqrt( t * t + 1.0 );
+                const double s     = t * c;
+                for( int k=0; k<n; k++ ) {
+                    const double akp = a[k*n+p];
+                    const double akq = a[k*n+q];
+                    a[k*n+p] = c * akp - s * akq;
+                    a[k*n+q] = s * akp + c * akq;
+                }
+                for( int k=0; k<n; k++ ) {
+                    const double apk = a[p*n+k];
+                    const double aqk = a[q*n+k];
+                    a[p*n+k] = c * apk - s * aqk;
+                    a[q*n+k] = s * apk + c * aqk;
+                }
+                for( int k=0; k<n; k++ ) {
+                    const double vkp = V[k*n+p];
+                    const double vkq = V[k*n+q];
+                    V[k*n+p] = c * vkp - s * vkq;
+                    V[k*n+q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    int m = 0;
+    for( int i=1; i<n; i++ ) {
+        if( a[i*n+i] < a[m*n+m] ) m = i;
+    }
+    for( int k=0; k<n; k++ ) v[k] = V[k*n+m];
+}
+
+/* Real roots of c3 x^3 + c2 x^2 + c1 x + c0 */
+static int solve_cubic( double c3, double c2, double c1, double c0, double* roots )
+{
+    const double scale = fabs( c2 ) + fabs( c1 ) + fabs( c0 );
+    if( fabs( c3 ) <= 1e-12 * scale ) {
+        if( fabs( c2 ) <= 1e-12 * scale ) {
+            if( c1 == 0.0 ) return 0;
+            roots[0] = -c0 / c1;
+            return 1;
+        }
+        const double disc = c1 * c1 - 4.0 * c2 * c0;
+        if( disc < 0.0 ) return 0;
+        roots[0] = ( -c1 + sqrt( disc ) ) / ( 2.0 * c2 );
+        roots[1] = ( -c1 - sqrt( disc ) ) / ( 2.0 * c2 );
+        return 2;
+    }
+
+    const double a = c2 / c3;
+    const double b = c1 / c3;
+    const double c = c0 / c3;
+    const double q = ( a * a - 3.0 * b ) / 9.0;
+    const double r = ( 2.0 * a * a * a - 9.0 * a * b + 27.0 * c ) / 54.0;
+    if( r * r < q * q * q ) {
+        const double t = acos( r / sqrt( q * q * q ) );
+        const double m = -2.0 * sqrt( q );
+        roots[0] = m * cos( t / 3.0 ) - a / 3.0;
+        roots[1] = m * cos( ( t + 2.0 * M_PI ) / 3.0 ) - a / 3.0;
+        roots[2] = m * cos( ( t - 2.0 * M_PI ) / 3.0 ) - a / 3.0;
+        return 3;
+    }
+    const double A = ( r > 0.0 ? -1.0 : 1.0 ) * cbrt( fabs( r ) + sqrt( r * r - q * q * q ) );
+    const double B = ( A != 0.0 ) ? q / A : 0.0;
+    roots[0] = A + B - a / 3.0;
+    return 1;
+}
+
+/*************************************************************
+ * Correspondences and models
+ *************************************************************/
+
+/* The keypoint positions of the accepted matches, in pixels for the
+ * evaluation and normalized (centroid at 0, mean distance sqrt(2),
+ * Hartley) for the solvers. T1 and T2 normalize, T2inv undoes T2. */
+struct Correspondences
+{
+    vector<float>  x1, y1, x2, y2;
+    vector<double> u1, v1, u2, v2;
+    vector<size_t> match;
+    double         T1[9];
+    double         T2[9];
+    double         T2inv[9];
+
+    inline size_t size( ) const { return x1.size(); }
+};
+
+static void normalization( const vector<float>& x, const vector<float>& y,
+                           vector<double>& u, vector<double>& v, double* T, double* Tinv )
+{
+    const size_t n  = x.size();
+    double       cx = 0.0;
+    double       cy = 0.0;
+    for( size_t i=0; i<n; i++ ) {
+        cx += x[i];
+        cy += y[i];
+    }
+    cx /= n;
+    cy /= n;
+    double d = 0.0;
+    for( size_t i=0; i<n; i++ ) d += sqrt( ( x[i] - cx ) * ( x[i] - cx ) + ( y[i] - cy ) * ( y[i] - cy ) );
+    const double s = ( d > 0.0 ) ? sqrt( 2.0 ) * n / d : 1.0;
+
+    u.resize( n );
+    v.resize( n );
+    for( size_t i=0; i<n; i++ ) {
+        u[i] = s * ( x[i] - cx );
+        v[i] = s * ( y[i] - cy );
+    }
+    const double t[9]  = { s, 0.0, -s * cx, 0.0, s, -s * cy, 0.0, 0.0, 1.0 };
+    const double ti[9] = { 1.0 / s, 0.0, cx, 0.0, 1.0 / s, cy, 0.0, 0.0, 1.0 };
+    memcpy( T, t, sizeof(t) );
+    if( Tinv ) memcpy( Tinv, ti, sizeof(ti) );
+}
+
+static inline int sample_size( GeometryModel model )
+{
+    return model == GeometryHomography ? 4 : 7;
+}
+
+/* H = T2inv Hn T1, scaled to H[8] = 1 */
+static void denormalize_homography( const Correspondences& c, const double* Hn, double* H )
+{
+    double tmp[9];
+    mul3( Hn, c.T1, tmp );
+    mul3( c.T2inv, tmp, H );
+    if( fabs( H[8] ) > 1e-12 ) {
+        const double inv = 1.0 / H[8];
+        for( int i=0; i<9; i++ ) H[i] *= inv;
+    }
+}
+
+/* F = T2^T Fn T1, scaled to a Frobenius norm of 1 */
+static void denormalize_fundamental( const Correspondences& c, const double* Fn, double* F )
+{
+    const double T2t[9] = { c.T2[0], c.T2[3], c.T2[6], c.T2[1], c.T2[4], c.T2[7], c.T2[2], c.T2[5], c.T2[8] };
+    double tmp[9];
+    mul3( Fn, c.T1, tmp );
+    mul3( T2t, tmp, F );
+    double norm = 0.0;
+    for( int i=0; i<9; i++ ) norm += F[i] * F[i];
+    if( norm > 0.0 ) {
+        const double inv = 1.0 / sqrt( norm );
+        for( int i=0; i<9; i++ ) F[i] *= inv;
+    }
+}
+
+/* Twice the signed area of the triangle a, b, c of normalized points */
+static inline double area( const vector<double>& u, const vector<double>& v, int a, int b, int c )
+{
+    return ( u[b] - u[a] ) * ( v[c] - v[a] ) - ( v[b] - v[a] ) * ( u[c] - u[a] );
+}
+
+/* The hypotheses of a minimal sample, at most 3 models of 9 values.
+ * Returns their number. */
+static int solve_minimal( GeometryModel model, const Correspondences& c, const int* sample, double* models )
+{
+    if( model == GeometryHomography ) {
+        /* three collinear points in either image make H degenerate */
+        static const int triples[4][3] = { { 0, 1, 2 }, { 0, 1, 3 }, { 0, 2, 3 }, { 1, 2, 3 } };
+        for( int t=0; t<4; t++ ) {
+            const int a = sample[triples[t][0]];
+            const int b = sample[triples[t][1]];
+            const int d = sample[triples[t][2]];
+            if( fabs( area( c.u1, c.v1, a, b, d ) ) < 1e-4 || fabs( area( c.u2, c.v2, a, b, d ) ) < 1e-4 ) return 0;
+        }
+
+        /* h8 = 1, two equations per correspondence */
+        double A[64];
+        double h[9];
+        for( int k=0; k<4; k++ ) {
+            const int    i = sample[k];
+            const double x = c.u1[i];
+            const double y = c.v1[i];
+            const double u = c.u2[i];
+            const double v = c.v2[i];
+            const double r0[8] = { x, y, 1.0, 0.0, 0.0, 0.0, -u * x, -u * y };
+            const double r1[8] = { 0.0, 0.0, 0.0, x, y, 1.0, -v * x, -v * y };
+            memcpy( &A[(2*k)   * 8], r0, sizeof(r0) );
+            memcpy( &A[(2*k+1) * 8], r1, sizeof(r1) );
+            h[2*k]   = u;
+            h[2*k+1] = v;
+        }
+        if( not solve_linear( A, h, 8 ) ) return 0;
+        h[8] = 1.0;
+        denormalize_homography( c, h, models );
+        return 1;
+    }
+
+    /* seven-point algorithm: F = a F1 + ( 1 - a ) F2 from the null
+     * space of the epipolar constraints, with det F = 0 */
+    double A[63];
+    for( int k=0; k<7; k++ ) {
+        const int    i  = sample[k];
+        const double u1 = c.u1[i];
+        const double v1 = c.v1[i];
+        const double u2 = c.u2[i];
+        const double v2 = c.v2[i];
+        const double r[9] = { u2 * u1, u2 * v1, u2, v2 * u1, v2 * v1, v2, u1, v1, 1.0 };
+        memcpy( &A[k * 9], r, sizeof(r) );
+    }
+    double basis[18];
+    if( null_space( A, 7, basis ) != 2 ) return 0;
+    const double* F1 = &basis[0];
+    const double* F2 = &basis[9];
+
+    /* det( F2 + a ( F1 - F2 ) ) at a = 0, 1, -1, 2 gives the cubic */
+    double p[4];
+    const double at[4] = { 0.0, 1.0, -1.0, 2.0 };
+    for( int k=0; k<4; k++ ) {
+        double F[9];
+        for( int j=0; j<9; j++ ) F[j] = F2[j] + at[k] * ( F1[j] - F2[j] );
+        p[k] = det3( F );
+    }
+    const double c0 = p[0];
+    const double c2 = ( p[1] + p[2] ) / 2.0 - c0;
+    const double s  = ( p[1] - p[2] ) / 2.0;
+    const double c3 = ( p[3] - 4.0 * c2 - c0 - 2.0 * s ) / 6.0;
+    const double c1 = s - c3;
+
+    double roots[3];
+    const int num_roots = solve_cubic( c3, c2, c1, c0, roots );
+    for( int k=0; k<num_roots; k++ ) {
+        double Fn[9];
+        for( int j=0; j<9; j++ ) Fn[j] = roots[k] * F1[j] + ( 1.0 - roots[k] ) * F2[j];
+        denormalize_fundamental( c, Fn, &models[k * 9] );
+    }
+    return num_roots;
+}
+
+/* The number of correspondences whose error under M is below thr2,
+ * squared pixels: the transfer error of H into the train image, or the
+ * Sampson distance of F. With Mask, mask[i] is set to 1 for inliers
+ * and 0 otherwise. The loops run over float arrays without branches,
+ * so that the compiler can vectorize them. */
+template<bool Mask>
+static size_t count_inliers( GeometryModel model, const double* M, const Correspondences& c,
+                             float thr2, char* mask )
+{
+    const float  h0 = (float)M[0], h1 = (float)M[1], h2 = (float)M[2];
+    const float  h3 = (float)M[3], h4 = (float)M[4], h5 = (float)M[5];
+    const float  h6 = (float)M[6], h7 = (float)M[7], h8 = (float)M[8];
+    const float* x1 = c.x1.data();
+    const float* y1 = c.y1.data();
+    const float* x2 = c.x2.data();
+    const float* y2 = c.y2.data();
+    const size_t n  = c.size();
+
+    size_t count = 0;
+    if( model == GeometryHomography ) {
+        for( size_t i=0; i<n; i++ ) {
+            const float w  = h6 * x1[i] + h7 * y1[i] + h8;
+            const float dx = ( h0 * x1[i] + h1 * y1[i] + h2 ) / w - x2[i];
+            const float dy = ( h3 * x1[i] + h4 * y1[i] + h5 ) / w - y2[i];
+            const int   in = ( dx * dx + dy * dy < thr2 );
+            count += in;
+            if( Mask ) mask[i] = (char)in;
+        }
+    } else {
+        for( size_t i=0; i<n; i++ ) {
+            const float fx  = h0 * x1[i] + h1 * y1[i] + h2;
+            const float fy  = h3 * x1[i] + h4 * y1[i] + h5;
+            const float fz  = h6 * x1[i] + h7 * y1[i] + h8;
+            const float gx  = h0 * x2[i] + h3 * y2[i] + h6;
+            const float gy  = h1 * x2[i] + h4 * y2[i] + h7;
+            const float num = x2[i] * fx + y2[i] * fy + fz;
+            const int   in  = ( num * num < thr2 * ( fx * fx + fy * fy + gx * gx + gy * gy ) );
+            count += in;
+            if( Mask ) mask[i] = (char)in;
+        }
+    }
+    return count;
+}
+
+/* Least-squares model of the correspondences with mask[i] set: the
+ * normalized DLT for H, the normalized eight-point algorithm with
+ * rank 2 enforced for F. Returns false if there are too few. */
+static bool fit_least_squares( GeometryModel model, const Correspondences& c, const char* mask, double* M )
+{
+    double S[81] = { 0.0 };
+    size_t used  = 0;
+    auto add = [&S]( const double* r ) {
+        for( int i=0; i<9; i++ ) {
+            for( int j=i; j<9; j++ ) S[i*9+j] += r[i] * r[j];
+        }
+    };
+
+    for( size_t i=0; i<c.size(); i++ ) {
+        if( not mask[i] ) continue;
+        used++;
+        const double u1 = c.u1[i];
+        const double v1 = c.v1[i];
+        const double u2 = c.u2[i];
+        const double v2 = c.v2[i];
+        if( model == GeometryHomography ) {
+            const double r0[9] = { u1, v1, 1.0, 0.0, 0.0, 0.0, -u2 * u1, -u2 * v1, -u2 };
+            const double r1[9] = { 0.0, 0.0, 0.0, u1, v1, 1.0, -v2 * u1, -v2 * v1, -v2 };
+            add( r0 );
+            add( r1 );
+        } else {
+            const double r[9] = { u2 * u1, u2 * v1, u2, v2 * u1, v2 * v1, v2, u1, v1, 1.0 };
+            add( r );
+        }
+    }
+    if( used < ( model == GeometryHomography ? 4u : 8u ) ) return false;
+    for( int i=0; i<9; i++ ) {
+        for( int j=0; j<i; j++ ) S[i*9+j] = S[j*9+i];
+    }
+
+    double m[9];
+    smallest_eigenvector( S, 9, m );
+    if( model == GeometryHomography ) {
+        denormalize_homography( c, m, M );
+        return true;
+    }
+
+    /* F ( I - v v^T ) with v the right singular vector of the smallest
+     * singular value removes it */
+    double FtF[9];
+    for( int i=0; i<3; i++ ) {
+        for( int j=0; j<3; j++ ) {
+            FtF[i*3+j] = m[i] * m[j] + m[3+i] * m[3+j] + m[6+i] * m[6+j];
+        }
+    }
+    double v[3];
+    smallest_eigenvector( FtF, 3, v );
+    double Fn[9];
+    for( int i=0; i<3; i++ ) {
+        const double fv = m[i*3] * v[0] + m[i*3+1] * v[1] + m[i*3+2] * v[2];
+        for( int j=0; j<3; j++ ) Fn[i*3+j] = m[i*3+j] - fv * v[j];
+    }
+    denormalize_fundamental( c, Fn, M );
+    return true;
+}
+
+/*************************************************************
+ * RANSAC / PROSAC
+ *************************************************************/
+
+class Ransac
+{
+public:
+    Ransac( const Correspondences& c, const RansacOptions& options );
+
+    /** The model with the most inliers; false if none has more
+     *  inliers than a minimal sample */
+    bool run( double* model, int& iterations );
+
+private:
+    void drawSample( int* sample );
+    void evaluate( int first );
+    void worker( int first );
+
+    const Correspondences& _c;
+    const RansacOptions&   _options;
+    const int              _m;
+    const size_t           _n;
+    const float            _thr2;
+    int                    _num_threads;
+    std::mt19937           _rng;
+
+    /* PROSAC: samples come from the first _subset correspondences;
+     * the subset grows when _t reaches _Tn_prime */
+    double                 _Tn;
+    double                 _Tn_prime;
+    size_t                 _subset;
+    size_t                 _t;
+
+    /* the current batch */
+    int                    _batch;
+    vector<int>            _samples;    // [RANSAC_BATCH][m]
+    vector<double>         _models;     // [RANSAC_BATCH][3][9]
+    vector<int>            _num_models; // [RANSAC_BATCH]
+    vector<size_t>         _inliers;    // [RANSAC_BATCH][3]
+
+    boost::barrier*        _barrier;
+    bool                   _done;
+};
+
+Ransac::Ransac( const Correspondences& c, const RansacOptions& options )
+    : _c( c )
+    , _options( options )
+    , _m( sample_size( options.model ) )
+    , _n( c.size() )
+    , _thr2( options.threshold * options.threshold )
+    , _rng( options.seed )
+    , _Tn( options.max_iterations )
+    , _Tn_prime( 1.0 )
+    , _subset( sample_size( options.model ) )
+    , _t( 0 )
+    , _batch( 0 )
+    , _samples( RANSAC_BATCH * sample_size( options.model ) )
+    , _models( RANSAC_BATCH * 27 )
+    , _num_models( RANSAC_BATCH )
+    , _inliers( RANSAC_BATCH * 3 )
+    , _barrier( 0 )
+    , _done( false )
+{
+    /* expected number of samples from the first m correspondences
+     * among max_iterations uniform samples */
+    for( int i=0; i<_m; i++ ) {
+        _Tn *= (double)( _m - i ) / ( _n - i );
+    }
+
+    _num_threads = options.num_threads;
+    if( _num_threads <= 0 ) {
+        _num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    _num_threads = (int)std::max( (size_t)1, std::min( (size_t)_num_threads, _n / RANSAC_MIN_POINTS_PER_THREAD ) );
+    _num_threads = std::min( _num_threads, RANSAC_BATCH );
+}
+
+void Ransac::drawSample( int* sample )
+{
+    _t++;
+    size_t range = _n;
+    int    k     = 0;
+    if( _options.prosac ) {
+        while( _t >= _Tn_prime && _subset < _n ) {
+            const double Tn1 = _Tn * ( _subset + 1 ) / ( _subset + 1 - _m );
+            _Tn_prime += ceil( Tn1 - _Tn );
+            _Tn        = Tn1;
+            _subset++;
+        }
+        range = _subset;
+        if( _Tn_prime >= _t ) {
+            /* the newest correspondence and m - 1 better ones */
+            sample[k++] = (int)( _subset - 1 );
+            range       = _subset - 1;
+        }
+    }
+
+    std::uniform_int_distribution<int> pick( 0, (int)range - 1 );
+    while( k < _m ) {
+        const int i = pick( _rng );
+        if( std::find( sample, sample + k, i ) == sample + k ) sample[k++] = i;
+    }
+}
+
+void Ransac::evaluate( int first )
+{
+    for( int b=first; b<_batch; b+=_num_threads ) {
+        double* models = &_models[b * 27];
+        _num_models[b] = solve_minimal( _options.model, _c, &_samples[b * _m], models );
+        for( int k=0; k<_num_models[b]; k++ ) {
+            _inliers[b * 3 + k] = count_inliers<false>( _options.model, &models[k * 9], _c, _thr2, 0 );
+        }
+    }
+}
+
+void Ransac::worker( int first )
+{
+    for( ;; ) {
+        _barrier->wait();
+        if( _done ) break;
+        evaluate( first );
+        _barrier->wait();
+    }
+}
+
+bool Ransac::run( double* model, int& iterations )
+{
+    vector<boost::thread*> threads;
+    if( _num_threads > 1 ) {
+        _barrier = new boost::barrier( _num_threads );
+        for( int t=1; t<_num_threads; t++ ) {
+            threads.push_back( new boost::thread( &Ransac::worker, this, t ) );
+        }
+    }
+
+    const double log_miss = log( 1.0 - std::min( _options.confidence, 1.0 - 1e-12 ) );
+    size_t       best     = 0;
+    int          limit    = _options.max_iterations;
+    iterations = 0;
+    while( iterations < limit ) {
+        _batch = std::min( RANSAC_BATCH, limit - iterations );
+        for( int b=0; b<_batch; b++ ) drawSample( &_samples[b * _m] );
+
+        if( _barrier ) {
+            _barrier->wait();
+            evaluate( 0 );
+            _barrier->wait();
+        } else {
+            evaluate( 0 );
+        }
+
+        /* in sample order, so that the result does not depend on the
+         * number of threads */
+        for( int b=0; b<_batch; b++ ) {
+            for( int k=0; k<_num_models[b]; k++ ) {
+                if( _inliers[b * 3 + k] <= best ) continue;
+                best = _inliers[b * 3 + k];
+                memcpy( model, &_models[b * 27 + k * 9], 9 * sizeof(double) );
+            }
+        }
+        iterations += _batch;
+
+        /* samples needed to draw one without outliers with the given
+         * confidence */
+        if( best > 0 ) {
+            const double all_inliers = pow( (double)best / _n, _m );
+            const double needed = ( all_inliers >= 1.0 ) ? 0.0 : log_miss / log( 1.0 - all_inliers );
+            if( needed < limit ) limit = std::max( (int)ceil( needed ), 1 );
+        }
+    }
+
+    if( _barrier ) {
+        _done = true;
+        _barrier->wait();
+        for( boost::thread* th : threads ) {
+            th->join();
+            delete th;
+        }
+        delete _barrier;
+        _barrier = 0;
+    }
+    return best > (size_t)_m;
+}
+
+/*************************************************************
+ * verifyMatches
+ *************************************************************/
+
+/* The accepted matches of which position() finds both keypoints, best
+ * distance ratio first if sorted */
+template<class Position>
+static void collect( const MatchList& matches, bool sorted, Position position, Correspondences& c )
+{
+    vector<std::pair<float,size_t>> order;
+    for( size_t i=0; i<matches.size(); i++ ) {
+        const Match& m = matches[i];
+        if( not m.isAccepted() || m.train < 0 ) continue;
+        order.push_back( std::make_pair( m.dist2 > 0.0f ? m.dist1 / m.dist2 : 1.0f, i ) );
+    }
+    if( sorted ) std::stable_sort( order.begin(), order.end() );
+
+    for( const std::pair<float,size_t>& o : order ) {
+        float x1, y1, x2, y2;
+        if( not position( matches[o.second], x1, y1, x2, y2 ) ) continue;
+        c.x1.push_back( x1 );
+        c.y1.push_back( y1 );
+        c.x2.push_back( x2 );
+        c.y2.push_back( y2 );
+        c.match.push_back( o.second );
+    }
+}
+
+static size_t verify( MatchList& matches, Correspondences& c, const RansacOptions& options, GeometryResult* result )
+{
+    for( size_t i=0; i<matches.size(); i++ ) matches[i].flags &= ~MatchInlier;
+    if( result ) {
+        memset( result, 0, sizeof(*result) );
+        result->model = options.model;
+    }
+    if( c.size() <= (size_t)sample_size( options.model ) ) return 0;
+
+    normalization( c.x1, c.y1, c.u1, c.v1, c.T1, 0 );
+    normalization( c.x2, c.y2, c.u2, c.v2, c.T2, c.T2inv );
+
+    double M[9];
+    int    iterations = 0;
+    Ransac ransac( c, options );
+    if( not ransac.run( M, iterations ) ) return 0;
+
+    const float  thr2 = options.threshold * options.threshold;
+    vector<char> mask( c.size() );
+    vector<char> refined_mask( c.size() );
+    size_t       inliers = count_inliers<true>( options.model, M, c, thr2, mask.data() );
+    for( int step=0; step<RANSAC_REFINE_STEPS; step++ ) {
+        double R[9];
+        if( not fit_least_squares( options.model, c, mask.data(), R ) ) break;
+        const size_t refined = count_inliers<true>( options.model, R, c, thr2, refined_mask.data() );
+        if( refined < inliers ) break;
+        memcpy( M, R, sizeof(M) );
+        mask.swap( refined_mask );
+        if( refined == inliers ) break;
+        inliers = refined;
+    }
+
+    for( size_t i=0; i<c.size(); i++ ) {
+        if( mask[i] ) matches[c.match[i]].flags |= MatchInlier;
+    }
+    if( result ) {
+        memcpy( result->matrix, M, sizeof(M) );
+        result->num_inliers = inliers;
+        result->iterations  = iterations;
+        result->valid       = true;
+    }
+    return inliers;
+}
+
+size_t verifyMatches( MatchList&           matches,
+                      const float*         query_x,
+                      const float*         query_y,
+                      const float*         train_x,
+                      const float*         train_y,
+                      const RansacOptions& options,
+                      GeometryResult*      result )
+{
+    Correspondences c;
+    collect( matches, options.prosac,
+             [&]( const Match& m, float& x1, float& y1, float& x2, float& y2 ) {
+                 x1 = query_x[m.query];
+                 y1 = query_y[m.query];
+                 x2 = train_x[m.train];
+                 y2 = train_y[m.train];
+                 return true;
+             }, c );
+    return verify( matches, c, options, result );
+}
+
+size_t verifyMatches( MatchList&           matches,
+                      const FeaturesHost&  query,
+                      const FeaturesHost&  train,
+                      const RansacOptions& options,
+                      GeometryResult*      result )
+{
+    Correspondences c;
+    collect( matches, options.prosac,
+             [&]( const Match& m, float& x1, float& y1, float& x2, float& y2 ) {
+                 if( m.query_feature < 0 || m.query_feature >= query.size() ||
+                     m.train_feature < 0 || m.train_feature >= train.size() ) return false;
+                 const Feature& q = query.begin()[m.query_feature];
+                 const Feature& t = train.begin()[m.train_feature];
+                 x1 = q.xpos;
+                 y1 = q.ypos;
+                 x2 = t.xpos;
+                 y2 = t.ypos;
+                 return true;
+             }, c );
+    return verify( matches, c, options, result );
+}
+
+} // namespace popsift
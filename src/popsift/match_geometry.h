@@ -0,0 +1,91 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+
+namespace popsift {
+
+class FeaturesHost;
+class MatchList;
+
+enum GeometryModel
+{
+    GeometryHomography,  // plane or pure rotation: train ~ H query
+    GeometryFundamental  // general scene: train^T F query = 0
+};
+
+/* Parameters of verifyMatches */
+struct RansacOptions
+{
+    GeometryModel model;
+    float         threshold;      // in pixels of the train image: transfer
+                                  // error of H, Sampson distance of F
+    double        confidence;     // that no better model was missed
+    int           max_iterations;
+    bool          prosac;         // sample matches with a lower distance
+                                  // ratio first
+    unsigned      seed;
+    int           num_threads;    // 0 picks the number of cores
+
+    RansacOptions( GeometryModel m = GeometryHomography );
+};
+
+/* A model found by verifyMatches. The matrix is row-major and maps
+ * keypoints of the query image to the train image. */
+struct GeometryResult
+{
+    GeometryModel model;
+    double        matrix[9];
+    size_t        num_inliers;
+    int           iterations;
+    bool          valid;
+};
+
+/* Geometric verification of the accepted matches of a MatchList with
+ * RANSAC: hypotheses are computed from minimal samples of matches, 4
+ * for a homography, 7 for a fundamental matrix (up to 3 hypotheses
+ * per sample), and the one that agrees with the most matches wins.
+ * It is refined by least squares on its inliers.
+ *
+ * With options.prosac, samples are drawn as in PROSAC (Chum and Matas):
+ * matches are sorted by the ratio of their two nearest distances and
+ * samples come from a growing set of the best ones, which finds a good
+ * model after a few iterations when the best matches are mostly
+ * correct. Sampling stops when a model with inlier ratio w has been
+ * found and no better model would be missed with probability
+ * options.confidence, after log( 1 - confidence ) / log( 1 - w^s )
+ * samples of size s.
+ *
+ * Samples are drawn in batches, and the hypotheses of a batch are solved
+ * and evaluated against all matches by options.num_threads threads. The
+ * result does not depend on the number of threads.
+ *
+ * Sets MatchInlier on the accepted matches that agree with the model
+ * and clears it on all others. Returns the number of inliers, 0 if no
+ * model was found.
+ */
+
+/* Keypoint positions by descriptor index, e.g. FeaturesFile::getXPos */
+size_t verifyMatches( MatchList&           matches,
+                      const float*         query_x,
+                      const float*         query_y,
+                      const float*         train_x,
+                      const float*         train_y,
+                      const RansacOptions& options,
+                      GeometryResult*      result = 0 );
+
+/* Keypoint positions from the Feature records, by the feature indices
+ * of the matches */
+size_t verifyMatches( MatchList&           matches,
+                      const FeaturesHost&  query,
+                      const FeaturesHost&  train,
+                      const RansacOptions& options,
+                      GeometryResult*      result = 0 );
+
+} // namespace popsift
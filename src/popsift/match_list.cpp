@@ -0,0 +1,197 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <stdio.h>
+#include <string.h>
+#include <iso646.h>
+
+#include "match_list.h"
+
+using namespace std;
+
+namespace popsift {
+
+static_assert( sizeof(Match) == 40, "Match must be 40 bytes" );
+static_assert( sizeof(MatchFileHeader) == 64, "MatchFileHeader must be 64 bytes" );
+
+MatchList::MatchList( )
+    : _num_queries( 0 )
+    , _num_train( 0 )
+{ }
+
+void MatchList::clear( )
+{
+    _matches.clear();
+    _num_queries = 0;
+    _num_train   = 0;
+}
+
+void MatchList::assign( const int* nn, const float* dist, const char* accept,
+                        int num_queries, int num_train,
+                        const int* query_rev, const int* train_rev )
+{
+    _num_queries = num_queries;
+    _num_train   = num_train;
+    _matches.resize( num_queries );
+
+    for( int q=0; q<num_queries; q++ ) {
+        Match& m = _matches[q];
+        m.query          = q;
+        m.train          = nn[2*q];
+        m.train2         = nn[2*q+1];
+        m.query_feature  = query_rev ? query_rev[q] : -1;
+        m.train_feature  = ( train_rev && m.train  >= 0 ) ? train_rev[m.train]  : -1;
+        m.train2_feature = ( train_rev && m.train2 >= 0 ) ? train_rev[m.train2] : -1;
+        m.dist1          = dist[2*q];
+        m.dist2          = dist[2*q+1];
+        m.flags          = accept[q] ? MatchAccepted : 0;
+        m.reserved       = 0;
+    }
+}
+
+size_t MatchList::getAcceptedCount( ) const
+{
+    size_t count = 0;
+    for( const Match& m : _matches ) count += m.isAccepted();
+    return count;
+}
+
+void MatchList::removeRejected( )
+{
+    _matches.erase( std::remove_if( _matches.begin(), _matches.end(),
+                                    []( const Match& m ) { return not m.isAccepted(); } ),
+                    _matches.end() );
+}
+
+size_t MatchList::keepMutual( const MatchList& reverse )
+{
+    size_t accepted = 0;
+    for( Match& m : _matches ) {
+        const bool mutual = m.train >= 0 && (size_t)m.train < reverse.size() &&
+                            reverse[m.train].query == m.train &&
+                            reverse[m.train].train == m.query;
+        m.flags &= ~MatchMutual;
+        if( mutual ) {
+            m.flags |= MatchMutual;
+            if( not reverse[m.train].isAccepted() ) m.flags &= ~MatchAccepted;
+        } else {
+            m.flags &= ~MatchAccepted;
+        }
+        accepted += m.isAccepted();
+    }
+    return accepted;
+}
+
+void MatchList::print( std::ostream& ostr, bool accepted_only ) const
+{
+    char line[200];
+    for( const Match& m : _matches ) {
+        if( accepted_only and not m.isAccepted() ) continue;
+        snprintf( line, sizeof(line),
+                  "%s feat %4d [%4d] matches feat %4d [%4d] ( 2nd feat %4d [%4d] ) dist %.3f vs %.3f\n",
+                  m.isAccepted() ? "accept" : "reject",
+                  m.query_feature, m.query,
+                  m.train_feature, m.train,
+                  m.train2_feature, m.train2,
+                  m.dist1, m.dist2 );
+        ostr << line;
+    }
+}
+
+std::ostream& operator<<( std::ostream& ostr, const MatchList& matches )
+{
+    matches.print( ostr );
+    return ostr;
+}
+
+bool MatchList::write( std::ostream& ostr ) const
+{
+    MatchFileHeader hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_MATCH_FILE_MAGIC, sizeof(hdr.magic) );
+    hdr.version         = POPSIFT_MATCH_FILE_VERSION;
+    hdr.header_size     = sizeof(MatchFileHeader);
+    hdr.byte_order_mark = 0x01020304;
+    hdr.match_size      = sizeof(Match);
+    hdr.num_queries     = _num_queries;
+    hdr.num_train       = _num_train;
+    hdr.num_matches     = _matches.size();
+
+    ostr.write( (const char*)&hdr, sizeof(hdr) );
+    ostr.write( (const char*)_matches.data(), _matches.size() * sizeof(Match) );
+    return ostr.good();
+}
+
+bool MatchList::read( std::istream& istr, const std::string& name )
+{
+    clear( );
+
+    MatchFileHeader hdr;
+    if( not istr.read( (char*)&hdr, sizeof(hdr) ) ||
+        memcmp( hdr.magic, POPSIFT_MATCH_FILE_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << name << " is not a PopSift match file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << name << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_MATCH_FILE_VERSION ) {
+        cerr << "File " << name << " has match file version " << hdr.version
+             << ", this reader supports version " << POPSIFT_MATCH_FILE_VERSION << endl;
+        return false;
+    }
+    if( hdr.header_size < sizeof(MatchFileHeader) || hdr.match_size != sizeof(Match) ||
+        hdr.num_matches > (uint64_t)std::numeric_limits<int>::max() ) {
+        cerr << "File " << name << " has an invalid header" << endl;
+        return false;
+    }
+
+    /* skip header fields of later versions */
+    istr.ignore( hdr.header_size - sizeof(hdr) );
+
+    _matches.resize( hdr.num_matches );
+    istr.read( (char*)_matches.data(), _matches.size() * sizeof(Match) );
+    if( not istr.good() ) {
+        cerr << "File " << name << " is truncated" << endl;
+        clear( );
+        return false;
+    }
+    _num_queries = hdr.num_queries;
+    _num_train   = hdr.num_train;
+    return true;
+}
+
+bool MatchList::save( const std::string& filename ) const
+{
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+    if( not write( of ) ) {
+        cerr << "Failed to write matches to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool MatchList::load( const std::string& filename )
+{
+    ifstream file( filename.c_str(), ios::binary );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return false;
+    }
+    return read( file, filename );
+}
+
+} // namespace popsift
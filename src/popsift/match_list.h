@@ -0,0 +1,136 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace popsift {
+
+#define POPSIFT_MATCH_FILE_MAGIC   "PSML\r\n\0"
+#define POPSIFT_MATCH_FILE_VERSION 1
+
+enum MatchFlags
+{
+    MatchAccepted = 1, // passed the ratio test
+    MatchMutual   = 2, // query and train are each other's nearest neighbour
+    MatchInlier   = 4  // consistent with the geometry found by verifyMatches
+};
+
+/* One query descriptor and its two nearest train descriptors.
+ * Descriptor indices are rows of the descriptor arrays, feature
+ * indices are the extrema that the descriptors belong to.
+ */
+struct Match
+{
+    int32_t  query;          // query descriptor
+    int32_t  train;          // nearest train descriptor, -1 if none
+    int32_t  train2;         // second nearest train descriptor, -1 if none
+    int32_t  query_feature;  // feature of query
+    int32_t  train_feature;  // feature of train, -1 if none
+    int32_t  train2_feature; // feature of train2, -1 if none
+    float    dist1;          // distance to train, squared L2
+    float    dist2;          // distance to train2, squared L2
+    uint32_t flags;          // MatchFlags
+    uint32_t reserved;
+
+    inline bool isAccepted( ) const { return flags & MatchAccepted; }
+    inline bool isInlier( ) const   { return flags & MatchInlier; }
+};
+
+/* Header of a binary match file (host byte order, checked with
+ * byte_order_mark). It is followed by num_matches Match records of
+ * match_size bytes.
+ */
+struct MatchFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark; // 0x01020304
+    uint32_t match_size;      // sizeof(Match)
+    uint32_t num_queries;     // descriptors of the query set
+    uint32_t num_train;       // descriptors of the train set
+    uint64_t num_matches;
+    uint8_t  reserved[24];
+};
+
+/* The result of matching a query set of descriptors against a train
+ * set, one Match per query descriptor unless rejected matches were
+ * removed.
+ */
+class MatchList
+{
+public:
+    MatchList( );
+
+    void clear( );
+
+    /** Fill from 2-NN results as written by matchNearest2: nn and dist
+     *  hold 2 values per query, accept one. query_rev and train_rev map
+     *  descriptors to features, see FeaturesHost::getReverseMap; they
+     *  may be 0 if the feature indices are not needed. */
+    void assign( const int* nn, const float* dist, const char* accept,
+                 int num_queries, int num_train,
+                 const int* query_rev, const int* train_rev );
+
+    inline size_t size( ) const                        { return _matches.size(); }
+    inline const Match& operator[]( size_t i ) const   { return _matches[i]; }
+    inline Match&       operator[]( size_t i )         { return _matches[i]; }
+    inline void         push_back( const Match& m )    { _matches.push_back( m ); }
+
+    typedef std::vector<Match>::const_iterator const_iterator;
+    inline const_iterator begin( ) const { return _matches.begin(); }
+    inline const_iterator end( ) const   { return _matches.end(); }
+
+    /** Descriptor counts of the query and train sets */
+    inline int  getQueryCount( ) const  { return _num_queries; }
+    inline int  getTrainCount( ) const  { return _num_train; }
+    inline void setCounts( int num_queries, int num_train ) {
+        _num_queries = num_queries;
+        _num_train   = num_train;
+    }
+
+    size_t getAcceptedCount( ) const;
+
+    /** Remove the matches that did not pass the ratio test */
+    void removeRejected( );
+
+    /** Compare with the matches of the other direction, in which train
+     *  was the query set; reverse must hold one match per train
+     *  descriptor, as filled by the matchers. Sets MatchMutual where
+     *  query and train are each other's nearest neighbour, and keeps
+     *  MatchAccepted only where the match is mutual and accepted in
+     *  both directions. Returns the number of accepted matches. */
+    size_t keepMutual( const MatchList& reverse );
+
+    /** One line per match, the format of the old device printf:
+     *      accept feat   12 [  13] matches feat   40 [  41] ( 2nd feat    7 [   7] ) dist 0.120 vs 0.310
+     *  with feature indices and descriptor indices in brackets. */
+    void print( std::ostream& ostr, bool accepted_only = false ) const;
+
+    /** Binary serialization, see MatchFileHeader. read() returns false
+     *  and explains why on cerr, naming the source as name. */
+    bool write( std::ostream& ostr ) const;
+    bool read( std::istream& istr, const std::string& name );
+
+    bool save( const std::string& filename ) const;
+    bool load( const std::string& filename );
+
+private:
+    std::vector<Match> _matches;
+    int                _num_queries;
+    int                _num_train;
+};
+
+std::ostream& operator<<( std::ostream& ostr, const MatchList& matches );
+
+} // namespace popsift
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <algorithm>
+#include <cmath>
+#include <iso646.h>
+
+#include <cuda_runtime.h>
+
+#include "point_grid.h"
+#include "features.h"
+#include "sift_extremum.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Points per cell that build() aims for by default */
+#define GRID_POINTS_PER_CELL 4
+
+/* Upper bound for the number of cells; a smaller cell size is raised */
+#define GRID_MAX_CELLS ( 1 << 22 )
+
+PointGrid::PointGrid( )
+    : _x0( 0.0f )
+    , _y0( 0.0f )
+    , _cell_size( 1.0f )
+    , _cols( 0 )
+    , _rows( 0 )
+{ }
+
+void PointGrid::build( const float* x, const float* y, size_t count, float cell_size )
+{
+    _x.assign( x, x + count );
+    _y.assign( y, y + count );
+    _cell_start.clear();
+    _points.clear();
+    _cols = 0;
+    _rows = 0;
+    if( count == 0 ) return;
+
+    float x1 = x[0];
+    float y1 = y[0];
+    _x0 = x[0];
+    _y0 = y[0];
+    for( size_t i=1; i<count; i++ ) {
+        _x0 = std::min( _x0, x[i] );
+        _y0 = std::min( _y0, y[i] );
+        x1  = std::max( x1, x[i] );
+        y1  = std::max( y1, y[i] );
+    }
+    const double w = x1 - _x0;
+    const double h = y1 - _y0;
+
+    if( cell_size <= 0.0f ) {
+        cell_size = (float)sqrt( w * h * GRID_POINTS_PER_CELL / count );
+        if( cell_size <= 0.0f ) {
+            /* all points on a horizontal or vertical line */
+            cell_size = (float)( std::max( w, h ) * GRID_POINTS_PER_CELL / count );
+        }
+        if( cell_size <= 0.0f ) cell_size = 1.0f;
+    }
+    while( ( w / cell_size + 1.0 ) * ( h / cell_size + 1.0 ) > GRID_MAX_CELLS ) {
+        cell_size *= 2.0f;
+    }
+    _cell_size = cell_size;
+    _cols      = (int)( w / cell_size ) + 1;
+    _rows      = (int)( h / cell_size ) + 1;
+
+    /* counting sort of the points by cell */
+    vector<int> cell( count );
+    _cell_start.assign( (size_t)_cols * _rows + 1, 0 );
+    for( size_t i=0; i<count; i++ ) {
+        cell[i] = row( y[i] ) * _cols + col( x[i] );
+        _cell_start[cell[i] + 1]++;
+    }
+    for( size_t c=1; c<_cell_start.size(); c++ ) {
+        _cell_start[c] += _cell_start[c-1];
+    }
+    vector<int> fill( _cell_start.begin(), _cell_start.end() - 1 );
+    _points.resize( count );
+    for( size_t i=0; i<count; i++ ) {
+        _points[fill[cell[i]]++] = (int)i;
+    }
+}
+
+void PointGrid::build( const FeaturesHost& features, float cell_size )
+{
+    vector<int> rev;
+    features.getReverseMap( rev );
+
+    vector<float> x( rev.size() );
+    vector<float> y( rev.size() );
+    for( size_t i=0; i<rev.size(); i++ ) {
+        const Feature& f = features.begin()[rev[i]];
+        x[i] = f.xpos;
+        y[i] = f.ypos;
+    }
+    build( x.data(), y.data(), rev.size(), cell_size );
+}
+
+inline int PointGrid::col( float x ) const
+{
+    return std::min( _cols - 1, std::max( 0, (int)floor( ( x - _x0 ) / _cell_size ) ) );
+}
+
+inline int PointGrid::row( float y ) const
+{
+    return std::min( _rows - 1, std::max( 0, (int)floor( ( y - _y0 ) / _cell_size ) ) );
+}
+
+template<class Pred>
+void PointGrid::scanRow( int r, int c0, int c1, Pred pred, std::vector<int>& result ) const
+{
+    const int end = _cell_start[r * _cols + c1 + 1];
+    for( int k=_cell_start[r * _cols + c0]; k<end; k++ ) {
+        const int i = _points[k];
+        if( pred( _x[i], _y[i] ) ) result.push_back( i );
+    }
+}
+
+void PointGrid::findInCircle( float x, float y, float radius, std::vector<int>& result ) const
+{
+    if( _cols == 0 ) return;
+    if( x + radius < _x0 || y + radius < _y0 ||
+        x - radius > _x0 + _cols * _cell_size || y - radius > _y0 + _rows * _cell_size ) return;
+
+    const float r2 = radius * radius;
+    const int   c0 = col( x - radius );
+    const int   c1 = col( x + radius );
+    const int   r1 = row( y + radius );
+    for( int r=row( y - radius ); r<=r1; r++ ) {
+        scanRow( r, c0, c1, [x,y,r2]( float px, float py ) {
+                     return ( px - x ) * ( px - x ) + ( py - y ) * ( py - y ) <= r2;
+                 }, result );
+    }
+}
+
+void PointGrid::findNearLine( float a, float b, float c, float width, std::vector<int>& result ) const
+{
+    if( _cols == 0 ) return;
+    const float n = sqrt( a * a + b * b );
+    if( n == 0.0f ) return;
+    a /= n;
+    b /= n;
+    c /= n;
+
+    auto near = [a,b,c,width]( float px, float py ) {
+        return fabs( a * px + b * py + c ) <= width;
+    };
+
+    if( fabs( b ) >= fabs( a ) ) {
+        /* rather horizontal: the band covers a range of rows in every
+         * column, at most width / |b| away from the line */
+        const float half = width / fabs( b );
+        for( int cc=0; cc<_cols; cc++ ) {
+            const float xa = _x0 + cc * _cell_size;
+            const float xb = xa + _cell_size;
+            const float ya = -( a * xa + c ) / b;
+            const float yb = -( a * xb + c ) / b;
+            const float lo = std::min( ya, yb ) - half;
+            const float hi = std::max( ya, yb ) + half;
+            if( hi < _y0 || lo > _y0 + _rows * _cell_size ) continue;
+            const int r1 = row( hi );
+            for( int r=row( lo ); r<=r1; r++ ) scanRow( r, cc, cc, near, result );
+        }
+    } else {
+        /* rather vertical: a range of columns in every row */
+        const float half = width / fabs( a );
+        for( int r=0; r<_rows; r++ ) {
+            const float ya = _y0 + r * _cell_size;
+            const float yb = ya + _cell_size;
+            const float xa = -( b * ya + c ) / a;
+            const float xb = -( b * yb + c ) / a;
+            const float lo = std::min( xa, xb ) - half;
+            const float hi = std::max( xa, xb ) + half;
+            if( hi < _x0 || lo > _x0 + _cols * _cell_size ) continue;
+            scanRow( r, col( lo ), col( hi ), near, result );
+        }
+    }
+}
+
+} // namespace popsift
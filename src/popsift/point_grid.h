@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+namespace popsift {
+
+class FeaturesHost;
+
+/* A uniform grid over the keypoint positions of an image, for finding
+ * the keypoints in a region without looking at all of them.
+ *
+ * The bounding box of the points is cut into square cells. The point
+ * numbers are sorted by cell, so that the points of a cell are
+ * consecutive, and cell_start holds where every cell begins (compressed
+ * sparse rows, like NeighbourList). Every point keeps its number, the
+ * searches return point numbers, not positions in the grid.
+ */
+class PointGrid
+{
+public:
+    PointGrid( );
+
+    /** Index count points. With cell_size <= 0, cells are sized for
+     *  about 4 points per cell if the points were spread evenly. */
+    void build( const float* x, const float* y, size_t count, float cell_size = 0.0f );
+
+    /** Index the keypoint of every descriptor of features, so that
+     *  point numbers are descriptor indices as in DescriptorMatrix:
+     *  all orientations of a feature share its position. */
+    void build( const FeaturesHost& features, float cell_size = 0.0f );
+
+    inline size_t size( ) const         { return _x.size(); }
+    inline float  getCellSize( ) const  { return _cell_size; }
+    inline int    getColumns( ) const   { return _cols; }
+    inline int    getRows( ) const      { return _rows; }
+    inline float  getX( size_t i ) const { return _x[i]; }
+    inline float  getY( size_t i ) const { return _y[i]; }
+
+    /** Append the points within distance radius of x, y to result */
+    void findInCircle( float x, float y, float radius, std::vector<int>& result ) const;
+
+    /** Append the points within distance width of the line
+     *  a x + b y + c = 0 to result, for an epipolar line. Only the
+     *  cells that the band crosses are visited. */
+    void findNearLine( float a, float b, float c, float width, std::vector<int>& result ) const;
+
+private:
+    /* cell of a coordinate, clamped to the grid */
+    inline int col( float x ) const;
+    inline int row( float y ) const;
+
+    /* the points of cells c0..c1 of row r with pred true */
+    template<class Pred>
+    void scanRow( int r, int c0, int c1, Pred pred, std::vector<int>& result ) const;
+
+    std::vector<float> _x;
+    std::vector<float> _y;
+    float              _x0;
+    float              _y0;
+    float              _cell_size;
+    int                _cols;
+    int                _rows;
+    std::vector<int>   _cell_start; // _cols * _rows + 1 entries
+    std::vector<int>   _points;     // point numbers, sorted by cell
+};
+
+} // namespace popsift
@@ -21,6 +21,11 @@ PopSift::PopSift( const popsift::Config& config, popsift::Config::ProcessingMode
         _pipe._unused.push( new popsift::Image);
         _pipe._unused.push( new popsift::Image);
     }
+    else if( imode == ShortImages )
+    {
+        _pipe._unused.push( new popsift::Image16 );
+        _pipe._unused.push( new popsift::Image16 );
+    }
     else
     {
         _pipe._unused.push( new popsift::ImageFloat );
@@ -45,6 +50,11 @@ PopSift::PopSift( ImageMode imode )
         _pipe._unused.push( new popsift::Image);
         _pipe._unused.push( new popsift::Image);
     }
+    else if( imode == ShortImages )
+    {
+        _pipe._unused.push( new popsift::Image16 );
+        _pipe._unused.push( new popsift::Image16 );
+    }
     else
     {
         _pipe._unused.push( new popsift::ImageFloat );
@@ -143,7 +153,7 @@ SiftJob* PopSift::enqueue( int                  w,
     if( _image_mode != ByteImages )
     {
         cerr << __FILE__ << ":" << __LINE__ << " Image mode error" << endl
-             << "E    Cannot load byte images into a PopSift pipeline configured for float images" << endl;
+             << "E    Cannot load byte images into a PopSift pipeline configured for float or 16-bit images" << endl;
         exit( -1 );
     }
 
@@ -159,7 +169,23 @@ SiftJob* PopSift::enqueue( int          w,
     if( _image_mode != FloatImages )
     {
         cerr << __FILE__ << ":" << __LINE__ << " Image mode error" << endl
-             << "E    Cannot load float images into a PopSift pipeline configured for byte images" << endl;
+             << "E    Cannot load float images into a PopSift pipeline configured for byte or 16-bit images" << endl;
+        exit( -1 );
+    }
+
+    SiftJob* job = new SiftJob( w, h, imageData );
+    _pipe._queue_stage1.push( job );
+    return job;
+}
+
+SiftJob* PopSift::enqueue( int                   w,
+                           int                   h,
+                           const unsigned short* imageData )
+{
+    if( _image_mode != ShortImages )
+    {
+        cerr << __FILE__ << ":" << __LINE__ << " Image mode error" << endl
+             << "E    Cannot load 16-bit images into a PopSift pipeline configured for byte or float images" << endl;
         exit( -1 );
     }
 
@@ -269,6 +295,23 @@ SiftJob::SiftJob( int w, int h, const float* imageData )
     }
 }
 
+SiftJob::SiftJob( int w, int h, const unsigned short* imageData )
+    : _w(w)
+    , _h(h)
+    , _img(0)
+{
+    _f = _p.get_future();
+
+    _imageData = (unsigned char*)malloc( w*h*sizeof(unsigned short) );
+    if( _imageData != 0 ) {
+        memcpy( _imageData, imageData, w*h*sizeof(unsigned short) );
+    } else {
+        cerr << __FILE__ << ":" << __LINE__ << " Memory limitation" << endl
+             << "E    Failed to allocate memory for SiftJob" << endl;
+        exit( -1 );
+    }
+}
+
 SiftJob::~SiftJob( )
 {
     delete [] _imageData;
@@ -56,8 +56,14 @@ public:
     /** Constructor for float images, value range [0..1[ */
     SiftJob( int w, int h, const float* imageData );
 
+    /** Constructor for 16-bit images, value range 0..65535 */
+    SiftJob( int w, int h, const unsigned short* imageData );
+
     ~SiftJob( );
 
+    inline int getWidth( ) const  { return _w; }
+    inline int getHeight( ) const { return _h; }
+
     popsift::FeaturesHost* get();    // should be deprecated, same as getHost()
     popsift::FeaturesBase* getBase();
     popsift::FeaturesHost* getHost();
@@ -88,7 +94,8 @@ public:
     enum ImageMode
     {
         ByteImages,
-        FloatImages
+        FloatImages,
+        ShortImages
     };
 
 public:
@@ -118,6 +125,13 @@ public:
                        int          h,
                        const float* imageData );
 
+    /** Enqueue a 16-bit image,  value range 0..65535.
+     *  Data with fewer significant bits (e.g. 12-bit sensors) should
+     *  be stretched to the full range by the caller. */
+    SiftJob*  enqueue( int                   w,
+                       int                   h,
+                       const unsigned short* imageData );
+
     /** deprecated */
     inline void uninit( int /*pipe*/ ) { uninit(); }
 
@@ -143,4 +143,46 @@ private:
     Plane2D_float _input_image_d;
 };
 
+/*************************************************************
+ * Image16
+ * Unsigned 16-bit input, e.g. 12-16 bit sensor data. The device
+ * plane keeps the integer samples; the conversion to float in
+ * the range [0..1] is done by the texture unit when the first
+ * blur/upscale pass reads the input image.
+ *************************************************************/
+
+struct Image16 : public ImageBase
+{
+    Image16( );
+
+    /** Create a device-sided buffer of the given dimensions */
+    Image16( int w, int h );
+
+    virtual ~Image16( );
+
+    /** Reallocation that takes care of pitch/step when new dimensions
+     *  are smaller and actually reallocation when they are bigger.
+     */
+    virtual void resetDimensions( int w, int h );
+
+    /* This loading function copies all image data to a local
+     * buffer that is pinned in memory. The input is expected
+     * to hold w*h unsigned 16-bit values.
+     */
+    virtual void load( void* input );
+
+private:
+    void allocate( int w, int h );
+    void createTexture( );
+    void destroyTexture( );
+
+private:
+    /* 2D plane holding input image on host for uploading
+     * to device. */
+    Plane2D_uint16 _input_image_h;
+
+    /* 2D plane holding input image on device for upscaling */
+    Plane2D_uint16 _input_image_d;
+};
+
 } // namespace popsift
@@ -36,6 +36,7 @@ Config::Config( )
     , _initial_blur( 0.5f )
     , _normalization_mode( getNormModeDefault() )
     , _normalization_multiplier( 0 )
+    , _desc_type( Config::FloatDesc )
     , _print_gauss_tables( false )
 {
     int            currentDev;
@@ -231,6 +232,38 @@ int Config::getNormalizationMultiplier( ) const
     return _normalization_multiplier;
 }
 
+void Config::setDescType( Config::DescType t )
+{
+    _desc_type = t;
+}
+
+void Config::setDescType( const std::string& t )
+{
+    if( t == "float" )
+        setDescType( Config::FloatDesc );
+    else if( t == "half" )
+        setDescType( Config::HalfDesc );
+    else if( t == "uint8" )
+        setDescType( Config::UInt8Desc );
+    else
+        POP_FATAL( string("Bad descriptor type.\n") + getDescTypeUsage() );
+}
+
+Config::DescType Config::getDescType( ) const
+{
+    return _desc_type;
+}
+
+const char* Config::getDescTypeUsage( )
+{
+    return
+        "Storage type of downloaded descriptors. "
+        "Options are: "
+        "float (default), "
+        "half (fp16, rounded to nearest even), "
+        "uint8 (rounded and saturated, combine with --norm-multi)";
+}
+
 void Config::setDownsampling( float v ) { _upscale_factor = -v; }
 void Config::setOctaves( int v ) { octaves = v; }
 void Config::setLevels( int v ) { levels = v; }
@@ -298,9 +331,44 @@ bool Config::equal( const Config& other ) const
         COMPARE( _assume_initial_blur ) ||
         COMPARE( _initial_blur ) ||
         COMPARE( _normalization_mode ) ||
-        COMPARE( _normalization_multiplier ) ) return false;
+        COMPARE( _normalization_multiplier ) ||
+        COMPARE( _desc_type ) ) return false;
     return true;
 }
 
+/* FNV-1a over the bytes of every member that is compared in equal() */
+static inline void fingerprint_add( unsigned long long& hash, const void* data, size_t len )
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for( size_t i=0; i<len; i++ ) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+}
+
+unsigned long long Config::getFingerprint( ) const
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    #define FINGERPRINT(a) fingerprint_add( hash, &this->a, sizeof(this->a) )
+    FINGERPRINT( octaves );
+    FINGERPRINT( levels );
+    FINGERPRINT( sigma );
+    FINGERPRINT( _edge_limit );
+    FINGERPRINT( _threshold );
+    FINGERPRINT( _upscale_factor );
+    FINGERPRINT( _scaling_mode );
+    FINGERPRINT( _max_extrema );
+    FINGERPRINT( _gauss_mode );
+    FINGERPRINT( _sift_mode );
+    FINGERPRINT( _assume_initial_blur );
+    FINGERPRINT( _initial_blur );
+    FINGERPRINT( _normalization_mode );
+    FINGERPRINT( _normalization_multiplier );
+    FINGERPRINT( _desc_mode );
+    FINGERPRINT( _desc_type );
+    #undef FINGERPRINT
+    return hash;
+}
+
 }; // namespace popsift
 
@@ -80,6 +80,16 @@ struct Config
         SmallestScaleFirst
     };
 
+    /* Storage type of descriptor values in memory and in files.
+     * Half and UInt8 are compact types for storage and matching,
+     * values are converted from the float result of extraction.
+     */
+    enum DescType {
+        FloatDesc,
+        HalfDesc,
+        UInt8Desc
+    };
+
     /* A parameter for the PopSift constructor. Determines which data is kept in
      * the Job data structure after processing, which is downloaded to the host,
      * which is invalidated.
@@ -176,6 +186,17 @@ struct Config
     int  getNormalizationMultiplier( ) const;
     void setNormalizationMultiplier( int mul );
 
+    /** Functions related to the storage type of downloaded descriptors.
+     *  UInt8Desc descriptors are rounded and saturated on the GPU after
+     *  normalization, combine with setNormalizationMultiplier to use the
+     *  value range, e.g. 2^9 for L2 normalization.
+     *  HalfDesc descriptors are rounded to nearest even fp16 on the GPU.
+     */
+    void               setDescType( DescType t );
+    void               setDescType( const std::string& t );
+    DescType           getDescType( ) const;
+    static const char* getDescTypeUsage( ); // Helper function for the main program's usage string.
+
     /* The input image is stretched by 2^upscale_factor
      * before processing. The factor 1 is default.
      */
@@ -228,6 +249,12 @@ struct Config
 
     bool equal( const Config& other ) const;
 
+    /* A hash of all parameters that influence the extracted features:
+     * those compared in equal() and the descriptor mode. Stored in feature files to
+     * detect features that were extracted with different settings.
+     */
+    unsigned long long getFingerprint( ) const;
+
 private:
     // default threshold 0.0 default of vlFeat
     // default threshold 5.0 / 256.0
@@ -303,6 +330,11 @@ private:
      */
     int _normalization_multiplier;
 
+    /* Descriptors are computed as floats. They can be downloaded
+     * in a compact type instead.
+     */
+    DescType _desc_type;
+
     /* Call the debug functions in gauss_filter.cu to print Gauss
      * filter width and Gauss tables in use.
      */
@@ -11,6 +11,7 @@
 #include <vector>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <cuda_fp16.h>
 #ifdef _WIN32
 #include <direct.h>
 #define stat _stat
@@ -19,6 +20,7 @@
 
 #include "sift_pyramid.h"
 #include "sift_extremum.h"
+#include "desc_convert.h"
 #include "common/debug_macros.h"
 #include "common/assist.h"
 
@@ -112,6 +114,8 @@ Pyramid::Pyramid( const Config& config,
     , _levels( config.levels + 3 )
     , _assume_initial_blur( config.hasInitialBlur() )
     , _initial_blur( config.getInitialBlur() )
+    , _desc_compact( 0 )
+    , _desc_compact_bytes( 0 )
 {
     _octaves = new Octave[_num_octaves];
 
@@ -212,6 +216,7 @@ Pyramid::~Pyramid()
 {
     cudaStreamDestroy( _download_stream );
 
+    cudaFree(     _desc_compact );
     cudaFree(     dobuf_shadow.i_ext_dat[0] );
     cudaFree(     dobuf_shadow.i_ext_off[0] );
     cudaFree(     dobuf_shadow.features );
@@ -245,6 +250,8 @@ void Pyramid::step2( const Config& conf )
  * cases.
  * This is possible because pointer arithmetic between Intel hosts and NVidia
  * GPUs are compatible.
+ * If descriptor_base is 0, the descriptors are not downloaded as Descriptor
+ * structures and the desc pointers remain 0.
  */
 __global__
 void prep_features( Descriptor* descriptor_base, int up_fac )
@@ -269,7 +276,7 @@ void prep_features( Descriptor* descriptor_base, int up_fac )
 
     int ori;
     for( ori = 0; ori<num_ori; ori++ ) {
-        fet.desc[ori]        = descriptor_base + ( ext.idx_ori + ori );
+        fet.desc[ori]        = descriptor_base ? descriptor_base + ( ext.idx_ori + ori ) : 0;
         fet.orientation[ori] = ext.orientation[ori];
     }
     for( ; ori<ORIENTATION_MAX_COUNT; ori++ ) {
@@ -278,14 +285,76 @@ void prep_features( Descriptor* descriptor_base, int up_fac )
     }
 }
 
+/* Round and saturate normalized descriptors to bytes.
+ * One warp per descriptor, 4 values per thread.
+ */
+__global__
+void convert_descriptors_uint8( const Descriptor* src, uchar4* dst, int num_ori )
+{
+    const int desc = blockIdx.x * blockDim.y + threadIdx.y;
+    if( desc >= num_ori ) return;
+
+    const float4 v = ( (const float4*)src[desc].features )[threadIdx.x];
+    uchar4 o;
+    o.x = (unsigned char)fminf( fmaxf( roundf( v.x ), 0.0f ), 255.0f );
+    o.y = (unsigned char)fminf( fmaxf( roundf( v.y ), 0.0f ), 255.0f );
+    o.z = (unsigned char)fminf( fmaxf( roundf( v.z ), 0.0f ), 255.0f );
+    o.w = (unsigned char)fminf( fmaxf( roundf( v.w ), 0.0f ), 255.0f );
+    dst[desc * 32 + threadIdx.x] = o;
+}
+
+/* Round normalized descriptors to fp16, nearest even.
+ * One warp per descriptor, 4 values per thread.
+ */
+__global__
+void convert_descriptors_half( const Descriptor* src, __half2* dst, int num_ori )
+{
+    const int desc = blockIdx.x * blockDim.y + threadIdx.y;
+    if( desc >= num_ori ) return;
+
+    const float4 v = ( (const float4*)src[desc].features )[threadIdx.x];
+    dst[desc * 64 + threadIdx.x * 2 + 0] = __floats2half2_rn( v.x, v.y );
+    dst[desc * 64 + threadIdx.x * 2 + 1] = __floats2half2_rn( v.z, v.w );
+}
+
+void* Pyramid::convert_descriptors( Config::DescType type )
+{
+    const size_t bytes = hct.ori_total * 128 * descTypeSize( type );
+    if( bytes > _desc_compact_bytes ) {
+        cudaFree( _desc_compact );
+        _desc_compact       = popsift::cuda::malloc_devT<unsigned char>( bytes, __FILE__, __LINE__ );
+        _desc_compact_bytes = bytes;
+    }
+
+    dim3 block( 32, 8 );
+    dim3 grid( grid_divide( hct.ori_total, 8 ) );
+    switch( type )
+    {
+    case Config::HalfDesc :
+        convert_descriptors_half
+            <<<grid,block,0,_download_stream>>>
+            ( dbuf_shadow.desc, (__half2*)_desc_compact, hct.ori_total );
+        break;
+    default :
+        convert_descriptors_uint8
+            <<<grid,block,0,_download_stream>>>
+            ( dbuf_shadow.desc, (uchar4*)_desc_compact, hct.ori_total );
+        break;
+    }
+    POP_SYNC_CHK;
+
+    return _desc_compact;
+}
+
 FeaturesHost* Pyramid::get_descriptors( const Config& conf )
 {
-    const float up_fac = conf.getUpscaleFactor();
+    const float            up_fac = conf.getUpscaleFactor();
+    const Config::DescType type   = conf.getDescType();
 
     readDescCountersFromDevice();
 
     nvtxRangePushA( "download descriptors" );
-    FeaturesHost* features = new FeaturesHost( hct.ext_total, hct.ori_total );
+    FeaturesHost* features = new FeaturesHost( hct.ext_total, hct.ori_total, type );
 
     if( hct.ext_total == 0 )
     {
@@ -293,6 +362,13 @@ FeaturesHost* Pyramid::get_descriptors( const Config& conf )
         return features;
     }
 
+    /* compact descriptors are converted on the device,
+     * only the converted array is downloaded */
+    const void* desc_src = dbuf_shadow.desc;
+    if( type != Config::FloatDesc ) {
+        desc_src = convert_descriptors( type );
+    }
+
     dim3 grid( grid_divide( hct.ext_total, 32 ) );
     prep_features<<<grid,32,0,_download_stream>>>( features->getDescriptors(), up_fac );
     POP_SYNC_CHK;
@@ -306,9 +382,9 @@ FeaturesHost* Pyramid::get_descriptors( const Config& conf )
                           cudaMemcpyDeviceToHost,
                           _download_stream );
 
-    popcuda_memcpy_async( features->getDescriptors(),
-                          dbuf_shadow.desc,
-                          hct.ori_total * sizeof(Descriptor),
+    popcuda_memcpy_async( features->getDescriptorData(),
+                          desc_src,
+                          hct.ori_total * features->getDescriptorStride(),
                           cudaMemcpyDeviceToHost,
                           _download_stream );
     cudaStreamSynchronize( _download_stream );
@@ -416,7 +492,7 @@ void Pyramid::writeDescriptor( const Config& conf, ostream& ostr, FeaturesHost*
             dom_ori = dom_ori / M_PI2 * 360;
             if (dom_ori < 0) dom_ori += 360;
 
-            const Descriptor& desc  = *ext.desc[ori]; // hbuf.desc[ori_idx];
+            const Descriptor* desc  = ext.desc[ori]; // hbuf.desc[ori_idx], 0 for compact types
 
             if( with_orientation )
                 ostr << setprecision(5)
@@ -431,9 +507,9 @@ void Pyramid::writeDescriptor( const Config& conf, ostream& ostr, FeaturesHost*
                      << " 0 "
                      << 1.0f / (sigma * sigma) << " ";
 
-            if (really) {
+            if (really && desc) {
                 for (int i = 0; i<128; i++) {
-                    ostr << desc.features[i] << " ";
+                    ostr << desc->features[i] << " ";
                 }
             }
             ostr << endl;
@@ -77,6 +77,11 @@ class Pyramid
     /* the download of converted descriptors should be asynchronous */
     cudaStream_t _download_stream;
 
+    /* device buffer for descriptors converted to a compact type before
+     * download, allocated on first use */
+    void*        _desc_compact;
+    size_t       _desc_compact_bytes;
+
 public:
     enum GaussTableChoice {
         Interpolated_FromPrevious,
@@ -152,6 +157,10 @@ private:
 
     void descriptors( const Config& conf );
 
+    /* convert the normalized descriptors on the device, returns the
+     * device pointer of the converted array */
+    void* convert_descriptors( Config::DescType type );
+
     void debug_out_floats  ( float* data, uint32_t pitch, uint32_t height );
     void debug_out_floats_t( float* data, uint32_t pitch, uint32_t height );
 
@@ -0,0 +1,356 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <string.h>
+#include <iso646.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <cuda_runtime.h>
+
+#include "vocab_tree.h"
+#include "desc_kmeans.h"
+#include "desc_match.h"
+
+using namespace std;
+
+namespace popsift {
+
+/* Descriptors to quantize per thread before another thread is worth it */
+#define VOCAB_MIN_ROWS_PER_THREAD 256
+
+static_assert( sizeof(VocabTreeHeader) == 64, "VocabTreeHeader must be 64 bytes" );
+static_assert( sizeof(VocabTreeNode) == 12, "VocabTreeNode must be 12 bytes" );
+
+/* The nodes of one level of the tree during training: the sample rows
+ * that reached every node, and for every node that was split the
+ * centroids of its children and the child of each of its rows */
+struct VocabTree::Level
+{
+    const DescriptorMatrix*  sample;
+    size_t                   begin;            // node number of rows[0]
+    vector<vector<uint32_t>> rows;
+    int                      iterations;
+    size_t                   batch_size;
+    unsigned                 seed;
+    int                      threads_per_node;
+    vector<vector<float>>    centers;          // empty if the node is not split
+    vector<vector<int>>      cluster;
+};
+
+VocabTree::VocabTree( )
+    : _dim( 0 )
+    , _branching( 0 )
+    , _depth( 0 )
+    , _num_words( 0 )
+    , _num_samples( 0 )
+{ }
+
+void VocabTree::trainNodes( Level* level, size_t first, size_t step ) const
+{
+    const DescriptorMatrix& sample = *level->sample;
+    vector<float>           data;
+    DescriptorMatrix        rows;
+    DescriptorMatrix        centers;
+
+    for( size_t i=first; i<level->rows.size(); i+=step ) {
+        const vector<uint32_t>& r = level->rows[i];
+        if( r.size() < (size_t)_branching ) continue;
+
+        data.resize( r.size() * _dim );
+        for( size_t j=0; j<r.size(); j++ ) {
+            memcpy( &data[j * _dim], sample.getRow( r[j] ), _dim * sizeof(float) );
+        }
+        rows.assign( data.data(), Config::FloatDesc, r.size(), _dim * sizeof(float), _dim );
+
+        if( not trainKMeans( rows, _branching, centers, level->iterations, level->batch_size,
+                             level->seed + (unsigned)( level->begin + i ), level->threads_per_node ) ) {
+            continue;
+        }
+        level->centers[i].assign( centers.getRow( 0 ), centers.getRow( 0 ) + _branching * _dim );
+        level->cluster[i].resize( r.size() );
+        assignClusters( rows, centers, level->cluster[i].data(), 0, level->threads_per_node );
+    }
+}
+
+bool VocabTree::train( const DescriptorMatrix& sample,
+                       int                     branching,
+                       int                     depth,
+                       int                     iterations,
+                       size_t                  batch_size,
+                       unsigned                seed,
+                       int                     num_threads )
+{
+    if( branching < 2 || depth < 1 || sample.size() < (size_t)branching ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot train a vocabulary tree with branching factor "
+             << branching << " and depth " << depth << " from " << sample.size() << " descriptors" << endl;
+        return false;
+    }
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+
+    _dim         = sample.getDim();
+    _branching   = branching;
+    _depth       = depth;
+    _num_words   = 0;
+    _num_samples = sample.size();
+    _nodes.clear();
+    _centroids.clear();
+
+    const VocabTreeNode leaf = { -1, 0, -1 };
+    _nodes.push_back( leaf );
+    _centroids.assign( _dim, 0.0f );
+
+    Level level;
+    level.sample     = &sample;
+    level.begin      = 0;
+    level.iterations = iterations;
+    level.batch_size = batch_size;
+    level.seed       = seed;
+    level.rows.resize( 1 );
+    level.rows[0].resize( sample.size() );
+    for( size_t i=0; i<sample.size(); i++ ) level.rows[0][i] = (uint32_t)i;
+
+    for( int d=0; d<depth && not level.rows.empty(); d++ ) {
+        const size_t count = level.rows.size();
+        level.centers.assign( count, vector<float>() );
+        level.cluster.assign( count, vector<int>() );
+
+        /* one node uses all threads, many nodes are split between them */
+        const int node_threads = (int)std::min( (size_t)num_threads, count );
+        level.threads_per_node = ( node_threads == 1 ) ? num_threads : 1;
+
+        vector<boost::thread*> threads;
+        for( int t=1; t<node_threads; t++ ) {
+            threads.push_back( new boost::thread( &VocabTree::trainNodes, this, &level, (size_t)t, (size_t)node_threads ) );
+        }
+        trainNodes( &level, 0, node_threads );
+        for( boost::thread* th : threads ) {
+            th->join();
+            delete th;
+        }
+
+        /* the children of the split nodes are the next level */
+        vector<vector<uint32_t>> next;
+        const size_t             next_begin = _nodes.size();
+        for( size_t i=0; i<count; i++ ) {
+            if( level.centers[i].empty() ) continue;
+
+            VocabTreeNode& node = _nodes[level.begin + i];
+            node.first_child  = (int32_t)_nodes.size();
+            node.num_children = _branching;
+            _nodes.insert( _nodes.end(), _branching, leaf );
+            _centroids.insert( _centroids.end(), level.centers[i].begin(), level.centers[i].end() );
+
+            const size_t base = next.size();
+            next.resize( base + _branching );
+            const vector<uint32_t>& rows = level.rows[i];
+            for( size_t r=0; r<rows.size(); r++ ) {
+                next[base + level.cluster[i][r]].push_back( rows[r] );
+            }
+        }
+        level.begin = next_begin;
+        level.rows.swap( next );
+    }
+
+    for( VocabTreeNode& node : _nodes ) {
+        if( node.num_children == 0 ) node.word = _num_words++;
+    }
+    prepare( );
+    return true;
+}
+
+void VocabTree::prepare( )
+{
+    _norms.resize( _nodes.size() );
+    for( size_t n=0; n<_nodes.size(); n++ ) {
+        const float* c = &_centroids[n * _dim];
+        float        s = 0.0f;
+        for( int j=0; j<_dim; j++ ) s += c[j] * c[j];
+        _norms[n] = s;
+    }
+}
+
+int VocabTree::quantize( const float* desc ) const
+{
+    int node = 0;
+    while( _nodes[node].num_children > 0 ) {
+        const int first = _nodes[node].first_child;
+        const int last  = first + _nodes[node].num_children;
+        float     best  = std::numeric_limits<float>::infinity();
+        int       child = first;
+        for( int c=first; c<last; c++ ) {
+            /* |x - c|^2 without the constant |x|^2 */
+            const float* ctr = &_centroids[(size_t)c * _dim];
+            float        dot = 0.0f;
+            for( int j=0; j<_dim; j++ ) dot += desc[j] * ctr[j];
+            const float d = _norms[c] - 2.0f * dot;
+            if( d < best ) {
+                best  = d;
+                child = c;
+            }
+        }
+        node = child;
+    }
+    return _nodes[node].word;
+}
+
+void VocabTree::quantizeRange( const DescriptorMatrix* desc, size_t begin, size_t end, int* words ) const
+{
+    for( size_t i=begin; i<end; i++ ) {
+        words[i] = quantize( desc->getRow( i ) );
+    }
+}
+
+void VocabTree::quantize( const DescriptorMatrix& desc, int* words, int num_threads ) const
+{
+    const size_t n = desc.size();
+    if( n == 0 ) return;
+    if( desc.getDim() != _dim ) {
+        cerr << __FILE__ << ":" << __LINE__ << " Cannot quantize " << desc.getDim()
+             << "-dimensional descriptors with a vocabulary of " << _dim << "-dimensional descriptors" << endl;
+        exit( -1 );
+    }
+
+    if( num_threads <= 0 ) {
+        num_threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    }
+    num_threads = (int)std::max( (size_t)1, std::min( (size_t)num_threads, n / VOCAB_MIN_ROWS_PER_THREAD ) );
+
+    vector<boost::thread*> threads;
+    for( int t=1; t<num_threads; t++ ) {
+        threads.push_back( new boost::thread( &VocabTree::quantizeRange, this, &desc,
+                                              n * t / num_threads, n * ( t + 1 ) / num_threads, words ) );
+    }
+    quantizeRange( &desc, 0, n / num_threads, words );
+    for( boost::thread* th : threads ) {
+        th->join();
+        delete th;
+    }
+}
+
+unsigned long long VocabTree::getFingerprint( ) const
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    auto mix = [&h]( const void* ptr, size_t len ) {
+        const unsigned char* p = (const unsigned char*)ptr;
+        for( size_t i=0; i<len; i++ ) {
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
+        }
+    };
+    mix( &_dim, sizeof(_dim) );
+    mix( &_branching, sizeof(_branching) );
+    mix( _nodes.data(), _nodes.size() * sizeof(VocabTreeNode) );
+    mix( _centroids.data(), _centroids.size() * sizeof(float) );
+    return h;
+}
+
+bool VocabTree::save( const std::string& filename ) const
+{
+    VocabTreeHeader hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, POPSIFT_VOCAB_FILE_MAGIC, sizeof(hdr.magic) );
+    hdr.version         = POPSIFT_VOCAB_FILE_VERSION;
+    hdr.header_size     = sizeof(VocabTreeHeader);
+    hdr.byte_order_mark = 0x01020304;
+    hdr.dim             = _dim;
+    hdr.branching       = _branching;
+    hdr.depth           = _depth;
+    hdr.num_nodes       = (uint32_t)_nodes.size();
+    hdr.num_words       = _num_words;
+    hdr.num_samples     = _num_samples;
+
+    ofstream of( filename.c_str(), ios::binary );
+    if( not of.is_open() ) {
+        cerr << "File " << filename << " could not be opened for writing" << endl;
+        return false;
+    }
+    of.write( (const char*)&hdr, sizeof(hdr) );
+    of.write( (const char*)_nodes.data(), _nodes.size() * sizeof(VocabTreeNode) );
+    of.write( (const char*)_centroids.data(), _centroids.size() * sizeof(float) );
+    if( not of.good() ) {
+        cerr << "Failed to write vocabulary tree to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+bool VocabTree::load( const std::string& filename )
+{
+    ifstream file( filename.c_str(), ios::binary );
+    if( not file.is_open() ) {
+        cerr << "File " << filename << " could not be opened for reading" << endl;
+        return false;
+    }
+
+    VocabTreeHeader hdr;
+    if( not file.read( (char*)&hdr, sizeof(hdr) ) ||
+        memcmp( hdr.magic, POPSIFT_VOCAB_FILE_MAGIC, sizeof(hdr.magic) ) != 0 ) {
+        cerr << "File " << filename << " is not a PopSift vocabulary tree file" << endl;
+        return false;
+    }
+    if( hdr.byte_order_mark != 0x01020304 ) {
+        cerr << "File " << filename << " was written on a machine with different byte order" << endl;
+        return false;
+    }
+    if( hdr.version != POPSIFT_VOCAB_FILE_VERSION ) {
+        cerr << "File " << filename << " has vocabulary tree version " << hdr.version
+             << ", this reader supports version " << POPSIFT_VOCAB_FILE_VERSION << endl;
+        return false;
+    }
+    if( hdr.header_size < sizeof(VocabTreeHeader) || hdr.dim == 0 || hdr.dim > 4096 ||
+        hdr.branching < 2 || hdr.num_nodes == 0 || hdr.num_nodes > (uint32_t)std::numeric_limits<int32_t>::max() ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+
+    vector<VocabTreeNode> nodes( hdr.num_nodes );
+    vector<float>         centroids( (size_t)hdr.num_nodes * hdr.dim );
+    file.seekg( hdr.header_size, ios::beg );
+    file.read( (char*)nodes.data(), nodes.size() * sizeof(VocabTreeNode) );
+    file.read( (char*)centroids.data(), centroids.size() * sizeof(float) );
+    if( not file.good() ) {
+        cerr << "File " << filename << " is truncated" << endl;
+        return false;
+    }
+
+    /* children come after their parent, so descending always ends */
+    uint32_t words = 0;
+    for( uint32_t n=0; n<hdr.num_nodes; n++ ) {
+        const VocabTreeNode& node = nodes[n];
+        const bool valid = ( node.num_children == 0 )
+                         ? ( node.word == (int32_t)words++ )
+                         : ( node.num_children > 0 && node.first_child > (int32_t)n &&
+                             (int64_t)node.first_child + node.num_children <= (int64_t)hdr.num_nodes );
+        if( not valid ) {
+            cerr << "File " << filename << " has an invalid node " << n << endl;
+            return false;
+        }
+    }
+    if( words != hdr.num_words ) {
+        cerr << "File " << filename << " has an invalid header" << endl;
+        return false;
+    }
+
+    _dim         = hdr.dim;
+    _branching   = hdr.branching;
+    _depth       = hdr.depth;
+    _num_words   = hdr.num_words;
+    _num_samples = hdr.num_samples;
+    _nodes.swap( nodes );
+    _centroids.swap( centroids );
+    prepare( );
+    return true;
+}
+
+} // namespace popsift
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2017, Simula Research Laboratory
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace popsift {
+
+class DescriptorMatrix;
+
+#define POPSIFT_VOCAB_FILE_MAGIC   "PSVT\r\n\0"
+#define POPSIFT_VOCAB_FILE_VERSION 1
+
+/* Header of a vocabulary tree file (host byte order, checked with
+ * byte_order_mark). It is followed by num_nodes VocabTreeNode records
+ * and the centroids of all nodes, num_nodes rows of dim floats.
+ */
+struct VocabTreeHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order_mark; // 0x01020304
+    uint32_t dim;
+    uint32_t branching;
+    uint32_t depth;
+    uint32_t num_nodes;
+    uint32_t num_words;
+    uint64_t num_samples;     // descriptors used for training
+    uint8_t  reserved[16];
+};
+
+/* A node of a vocabulary tree: its children are the nodes first_child ..
+ * first_child + num_children - 1, a node without children is the word
+ * word */
+struct VocabTreeNode
+{
+    int32_t first_child;
+    int32_t num_children;
+    int32_t word;
+};
+
+/* A vocabulary tree (Nister and Stewenius, "Scalable recognition with a
+ * vocabulary tree"): hierarchical k-means splits the descriptor space
+ * into branching cells, every cell again into branching cells, down to
+ * depth levels. The leaves are the visual words. A descriptor is
+ * quantized by descending to the nearest of the children of a node on
+ * every level, which costs branching * depth distances instead of one
+ * per word.
+ *
+ * Node 0 is the root; the children of a node are stored next to each
+ * other, and a level is stored after the level above it.
+ */
+class VocabTree
+{
+public:
+    VocabTree( );
+
+    /** Train the tree on the rows of sample with trainKMeans. A node is
+     *  split if it received at least branching rows, otherwise it stays
+     *  a word, so the tree may have fewer than branching^depth words.
+     *  The root is split with num_threads threads, the nodes of the
+     *  levels below are split between the threads. Returns false if
+     *  sample has fewer than branching rows. */
+    bool train( const DescriptorMatrix& sample,
+                int                     branching   = 10,
+                int                     depth       = 6,
+                int                     iterations  = 100,
+                size_t                  batch_size  = 10000,
+                unsigned                seed        = 1,
+                int                     num_threads = 0 );
+
+    inline bool   isValid( ) const       { return not _nodes.empty(); }
+    inline int    getDim( ) const        { return _dim; }
+    inline int    getBranching( ) const  { return _branching; }
+    inline int    getDepth( ) const      { return _depth; }
+    inline size_t getNodeCount( ) const  { return _nodes.size(); }
+    inline int    getWordCount( ) const  { return _num_words; }
+    inline size_t getNumSamples( ) const { return _num_samples; }
+
+    /** Hash of the tree, to check that a BoW index was built with it */
+    unsigned long long getFingerprint( ) const;
+
+    /** The word of one descriptor of getDim() floats */
+    int quantize( const float* desc ) const;
+
+    /** The words of all rows of desc, split between num_threads
+     *  threads, 0 picks the number of cores. words has room for
+     *  desc.size() values. */
+    void quantize( const DescriptorMatrix& desc, int* words, int num_threads = 0 ) const;
+
+    /** Returns false and explains why on cerr */
+    bool save( const std::string& filename ) const;
+    bool load( const std::string& filename );
+
+private:
+    struct Level;
+
+    void trainNodes( Level* level, size_t first, size_t step ) const;
+    void quantizeRange( const DescriptorMatrix* desc, size_t begin, size_t end, int* words ) const;
+    void prepare( );
+
+    int                        _dim;
+    int                        _branching;
+    int                        _depth;
+    int                        _num_words;
+    size_t                     _num_samples;
+    std::vector<VocabTreeNode> _nodes;
+    std::vector<float>         _centroids; // [node][dim], zero for the root
+    std::vector<float>         _norms;     // squared norms of the centroids
+};
+
+} // namespace popsift